@@ -24,7 +24,10 @@
 #include "http/function_handlers.hh"
 #include "http/file_handler.hh"
 #include "apps/httpd/demo.json.hh"
+#include "apps/httpd/memory.json.hh"
 #include "http/api_docs.hh"
+#include "core/memory.hh"
+#include <boost/range/irange.hpp>
 
 namespace bpo = boost::program_options;
 
@@ -60,6 +63,47 @@ void set_routes(routes& r) {
         obj.enum_var = v;
         return obj;
     });
+    memory_json::get_memory_stats.set(r, [] (std::unique_ptr<request> req) {
+        struct shard_stats {
+            memory::statistics stats = memory::stats();
+            memory::detailed_statistics detailed = memory::detailed_stats();
+            size_t huge_page_memory = memory::huge_page_memory();
+        };
+        return do_with(std::vector<std::unique_ptr<shard_stats>>(smp::count), [] (auto& all) {
+            return parallel_for_each(boost::irange(0u, smp::count), [&all] (unsigned shard) {
+                return smp::submit_to(shard, [] {
+                    return std::make_unique<shard_stats>();
+                }).then([&all, shard] (std::unique_ptr<shard_stats> s) {
+                    all[shard] = std::move(s);
+                });
+            }).then([&all] {
+                std::vector<memory_json::shard_memory_stats> res;
+                for (unsigned shard = 0; shard < all.size(); ++shard) {
+                    auto& s = *all[shard];
+                    memory_json::shard_memory_stats obj;
+                    obj.shard = shard;
+                    obj.total_memory = s.stats.total_memory();
+                    obj.free_memory = s.stats.free_memory();
+                    for (auto&& p : s.detailed.small_pools) {
+                        memory_json::small_pool_stats pool;
+                        pool.object_size = p.object_size;
+                        pool.span_size = p.span_size;
+                        pool.use_count = p.use_count;
+                        pool.free_count = p.free_count;
+                        pool.spans_in_use = p.spans_in_use;
+                        pool.waste = p.waste;
+                        obj.small_pools.push(pool);
+                    }
+                    obj.free_spans = s.detailed.free_spans;
+                    obj.largest_free_span = s.detailed.largest_free_span;
+                    obj.free_huge_pages = s.detailed.free_huge_pages;
+                    obj.huge_page_memory = s.huge_page_memory;
+                    res.push_back(std::move(obj));
+                }
+                return make_ready_future<json::json_return_type>(res);
+            });
+        });
+    });
 }
 
 int main(int ac, char** av) {
@@ -77,6 +121,8 @@ int main(int ac, char** av) {
             return server->set_routes([rb](routes& r){rb->set_api_doc(r);});
         }).then([server, rb]{
             return server->set_routes([rb](routes& r) {rb->register_function(r, "demo", "hello world application");});
+        }).then([server, rb]{
+            return server->set_routes([rb](routes& r) {rb->register_function(r, "memory", "allocator statistics");});
         }).then([server, port] {
             return server->listen(port);
         }).then([server, port] {
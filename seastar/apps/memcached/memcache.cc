@@ -28,7 +28,7 @@
 #include <sstream>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
-#include "core/timer-set.hh"
+#include "core/timer-wheel.hh"
 #include "core/shared_ptr.hh"
 #include "core/stream.hh"
 #include "core/memory.hh"
@@ -224,7 +224,7 @@ class item : public slab_item_base {
         }
     }
 
-    // needed by timer_set
+    // needed by timer_wheel
     bool cancel() {
         return false;
     }
@@ -371,7 +371,7 @@ class cache {
     size_t _resize_up_threshold = load_factor * initial_bucket_count;
     cache_type::bucket_type* _buckets;
     cache_type _cache;
-    seastar::timer_set<item, &item::_timer_link> _alive;
+    seastar::timer_wheel<item, &item::_timer_link> _alive;
     timer<clock_type> _timer;
     // delta in seconds between the current values of a wall clock and a clock_type clock
     clock_type::duration _wc_to_clock_type_delta;
@@ -172,11 +172,13 @@ tests = [
     'tests/l3_test',
     'tests/ip_test',
     'tests/timertest',
+    'tests/timer_wheel_test',
     'tests/tcp_test',
     'tests/futures_test',
     'tests/alloc_test',
     'tests/foreign_ptr_test',
     'tests/smp_test',
+    'tests/stall_detector_test',
     'tests/thread_test',
     'tests/thread_context_switch',
     'tests/udp_server',
@@ -197,9 +199,18 @@ tests = [
     'tests/rpc',
     'tests/semaphore_test',
     'tests/packet_test',
+    'tests/posix_zerocopy_test',
+    'tests/posix_data_source_test',
+    'tests/posix_udp_test',
+    'tests/arp_test',
+    'tests/flow_steering_test',
     'tests/tls_test',
     'tests/fair_queue_test',
     'tests/rpc_test',
+    'tests/futures_perf',
+    'tests/heap_profiler_perf',
+    'tests/timer_set_perf',
+    'tests/connection_table_perf',
     ]
 
 apps = [
@@ -243,6 +254,7 @@ args = arg_parser.parse_args()
 libnet = [
     'net/proxy.cc',
     'net/virtio.cc',
+    'net/loopback.cc',
     'net/dpdk.cc',
     'net/ip.cc',
     'net/ethernet.cc',
@@ -272,6 +284,8 @@ core = [
     'net/net.cc',
     'net/stack.cc',
     'rpc/rpc.cc',
+    'rpc/lz4_compressor.cc',
+    'rpc/rpc_stream.cc',
     ]
 
 http = ['http/transformers.cc',
@@ -284,6 +298,7 @@ http = ['http/transformers.cc',
         'http/matcher.cc',
         'http/mime_types.cc',
         'http/httpd.cc',
+        'http/content_stream.cc',
         'http/reply.cc',
         'http/request_parser.rl',
         'http/api_docs.cc',
@@ -295,7 +310,7 @@ boost_test_lib = [
 ]
 
 defines = []
-libs = '-laio -lboost_program_options -lboost_system -lboost_filesystem -lstdc++ -lm -lboost_unit_test_framework -lboost_thread -lcryptopp -lrt -lgnutls -lgnutlsxx'
+libs = '-laio -lboost_program_options -lboost_system -lboost_filesystem -lstdc++ -lm -lboost_unit_test_framework -lboost_thread -lcryptopp -lrt -lgnutls -lgnutlsxx -llz4'
 hwloc_libs = '-lhwloc -lnuma -lpciaccess -lxml2 -lz'
 xen_used = False
 def have_xen():
@@ -331,7 +346,7 @@ memcache_base = [
 deps = {
     'libseastar.a' : core + libnet + http,
     'seastar.pc': [],
-    'apps/httpd/httpd': ['apps/httpd/demo.json', 'apps/httpd/main.cc'] + http + libnet + core,
+    'apps/httpd/httpd': ['apps/httpd/demo.json', 'apps/httpd/memory.json', 'apps/httpd/main.cc'] + http + libnet + core,
     'apps/memcached/memcached': ['apps/memcached/memcache.cc'] + memcache_base,
     'tests/memcached/test_ascii_parser': ['tests/memcached/test_ascii_parser.cc'] + memcache_base + boost_test_lib,
     'tests/fileiotest': ['tests/fileiotest.cc'] + core + boost_test_lib,
@@ -342,13 +357,19 @@ deps = {
     'tests/ip_test': ['tests/ip_test.cc'] + core + libnet,
     'tests/tcp_test': ['tests/tcp_test.cc'] + core + libnet,
     'tests/timertest': ['tests/timertest.cc'] + core,
+    'tests/timer_wheel_test': ['tests/timer_wheel_test.cc'],
     'tests/futures_test': ['tests/futures_test.cc'] + core + boost_test_lib,
     'tests/alloc_test': ['tests/alloc_test.cc'] + core + boost_test_lib,
     'tests/foreign_ptr_test': ['tests/foreign_ptr_test.cc'] + core + boost_test_lib,
     'tests/semaphore_test': ['tests/semaphore_test.cc'] + core + boost_test_lib,
     'tests/smp_test': ['tests/smp_test.cc'] + core,
+    'tests/stall_detector_test': ['tests/stall_detector_test.cc'] + core,
     'tests/thread_test': ['tests/thread_test.cc'] + core + boost_test_lib,
     'tests/thread_context_switch': ['tests/thread_context_switch.cc'] + core,
+    'tests/futures_perf': ['tests/futures_perf.cc'] + core,
+    'tests/heap_profiler_perf': ['tests/heap_profiler_perf.cc'] + core,
+    'tests/timer_set_perf': ['tests/timer_set_perf.cc'],
+    'tests/connection_table_perf': ['tests/connection_table_perf.cc'] + core + libnet,
     'tests/udp_server': ['tests/udp_server.cc'] + core + libnet,
     'tests/udp_client': ['tests/udp_client.cc'] + core + libnet,
     'tests/tcp_server': ['tests/tcp_server.cc'] + core + libnet,
@@ -371,6 +392,11 @@ deps = {
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
     'tests/rpc_test': ['tests/rpc_test.cc'] + core + libnet + boost_test_lib,
     'tests/packet_test': ['tests/packet_test.cc'] + core + libnet,
+    'tests/posix_zerocopy_test': ['tests/posix_zerocopy_test.cc'] + core + libnet,
+    'tests/posix_data_source_test': ['tests/posix_data_source_test.cc'] + core + libnet,
+    'tests/posix_udp_test': ['tests/posix_udp_test.cc'] + core + libnet,
+    'tests/arp_test': ['tests/arp_test.cc'] + core + libnet,
+    'tests/flow_steering_test': ['tests/flow_steering_test.cc'] + core + libnet,
 }
 
 warnings = [
@@ -59,7 +59,7 @@ class circular_buffer {
     circular_buffer(const circular_buffer& X) = delete;
     ~circular_buffer();
     circular_buffer& operator=(const circular_buffer&) = delete;
-    circular_buffer& operator=(circular_buffer&&) = delete;
+    circular_buffer& operator=(circular_buffer&& X);
     void push_front(const T& data);
     void push_front(T&& data);
     template <typename... A>
@@ -72,6 +72,9 @@ class circular_buffer {
     T& back();
     void pop_front();
     void pop_back();
+    // Destroys all items, but keeps the storage; assign an empty
+    // circular_buffer to free it as well.
+    void clear();
     bool empty() const;
     size_t size() const;
     size_t capacity() const;
@@ -216,6 +219,17 @@ circular_buffer<T, Alloc>::circular_buffer(circular_buffer&& x)
     x._impl = {};
 }
 
+template <typename T, typename Alloc>
+inline
+circular_buffer<T, Alloc>&
+circular_buffer<T, Alloc>::operator=(circular_buffer&& x) {
+    if (this != &x) {
+        this->~circular_buffer();
+        new (this) circular_buffer(std::move(x));
+    }
+    return *this;
+}
+
 template <typename T, typename Alloc>
 template <typename Func>
 inline
@@ -367,6 +381,16 @@ circular_buffer<T, Alloc>::pop_back() {
     --_impl.end;
 }
 
+template <typename T, typename Alloc>
+inline
+void
+circular_buffer<T, Alloc>::clear() {
+    for_each([this] (T& obj) {
+        _impl.destroy(&obj);
+    });
+    _impl.begin = _impl.end = 0;
+}
+
 template <typename T, typename Alloc>
 inline
 T&
@@ -73,6 +73,9 @@ class deleter final {
     ///
     /// \return a deleter with the same encapsulated action as this one.
     deleter share();
+    /// Checks whether no other deleter shares this one's action, so that
+    /// the owner of the buffer can reuse it.
+    bool is_unique() const;
     /// Checks whether the deleter has an associated action.
     explicit operator bool() const { return bool(_impl); }
     /// \cond internal
@@ -114,6 +117,11 @@ struct deleter::impl {
 };
 /// \endcond
 
+inline
+bool deleter::is_unique() const {
+    return !_impl || is_raw_object() || _impl->refs == 1;
+}
+
 inline
 deleter::~deleter() {
     if (is_raw_object()) {
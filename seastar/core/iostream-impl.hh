@@ -57,6 +57,10 @@ future<> output_stream<CharType>::write(net::packet p) {
         return make_ready_future<>();
     }
 
+    if (queue_zero_copy_writes()) {
+        return queue_zero_copy(std::move(p));
+    }
+
     assert(!_end && "Mixing buffered writes and zero-copy writes not supported yet");
 
     if (!_trim_to_size || p.len() <= _size) {
@@ -77,6 +81,9 @@ future<> output_stream<CharType>::write(temporary_buffer<CharType> p) {
     if (p.empty()) {
         return make_ready_future<>();
     }
+    if (queue_zero_copy_writes()) {
+        return queue_zero_copy(net::packet(net::fragment{p.get_write(), p.size()}, p.release()));
+    }
     assert(!_end && "Mixing buffered writes and zero-copy writes not supported yet");
     if (!_trim_to_size || p.size() <= _size) {
         // TODO: aggregate buffers for later coalescing.
@@ -89,6 +96,49 @@ future<> output_stream<CharType>::write(temporary_buffer<CharType> p) {
     });
 }
 
+template <typename CharType>
+future<>
+output_stream<CharType>::queue_zero_copy(net::packet p) {
+    if (_end) {
+        // buffered data was written first, so it goes first
+        auto buf = std::move(_buf);
+        buf.trim(_end);
+        _end = 0;
+        net::packet head(net::fragment{buf.get_write(), buf.size()}, buf.release());
+        head.append(std::move(p));
+        p = std::move(head);
+    }
+    if (_zc_bufs) {
+        _zc_bufs->append(std::move(p));
+    } else {
+        _zc_bufs = std::move(p);
+    }
+    if (_zc_bufs->len() < _size) {
+        return make_ready_future<>();
+    }
+    auto pending = std::move(*_zc_bufs);
+    _zc_bufs = std::experimental::nullopt;
+    return put(std::move(pending));
+}
+
+// Returns the queued zero-copy data followed by the buffered data
+template <typename CharType>
+net::packet
+output_stream<CharType>::take_pending() {
+    net::packet p;
+    if (_zc_bufs) {
+        p = std::move(*_zc_bufs);
+        _zc_bufs = std::experimental::nullopt;
+    }
+    if (_end) {
+        auto buf = std::move(_buf);
+        buf.trim(_end);
+        _end = 0;
+        p = net::packet(std::move(p), std::move(buf));
+    }
+    return p;
+}
+
 template <typename CharType>
 future<temporary_buffer<CharType>>
 input_stream<CharType>::read_exactly_part(size_t n, tmp_buf out, size_t completed) {
@@ -102,7 +152,9 @@ input_stream<CharType>::read_exactly_part(size_t n, tmp_buf out, size_t complete
         return make_ready_future<tmp_buf>(std::move(out));
     }
 
-    // _buf is now empty
+    // _buf is now empty; drop it, so that the source can reuse the
+    // memory it refers to
+    _buf = tmp_buf();
     return _fd.get().then([this, n, out = std::move(out), completed] (auto buf) mutable {
         if (buf.size() == 0) {
             _eof = true;
@@ -126,6 +178,7 @@ input_stream<CharType>::read_exactly(size_t n) {
         return make_ready_future<tmp_buf>(std::move(front));
     } else if (_buf.size() == 0) {
         // buffer is empty: grab one and retry
+        _buf = tmp_buf();
         return _fd.get().then([this, n] (auto buf) mutable {
             if (buf.size() == 0) {
                 _eof = true;
@@ -147,6 +200,7 @@ future<>
 input_stream<CharType>::consume(Consumer& consumer) {
     for (;;) {
         if (_buf.empty() && !_eof) {
+            _buf = tmp_buf();
             return _fd.get().then([this, &consumer] (tmp_buf buf) {
                 _buf = std::move(buf);
                 _eof = _buf.empty();
@@ -194,6 +248,7 @@ input_stream<CharType>::read() {
         return make_ready_future<tmp_buf>();
     }
     if (_buf.empty()) {
+        _buf = tmp_buf();
         return _fd.get().then([this] (tmp_buf buf) {
             _eof = buf.empty();
             return make_ready_future<tmp_buf>(std::move(buf));
@@ -203,6 +258,29 @@ input_stream<CharType>::read() {
     }
 }
 
+template <typename CharType>
+future<temporary_buffer<CharType>>
+input_stream<CharType>::read_up_to(size_t n) {
+    using tmp_buf = temporary_buffer<CharType>;
+    if (_buf.empty()) {
+        if (_eof) {
+            return make_ready_future<tmp_buf>();
+        }
+        _buf = tmp_buf();
+        return _fd.get().then([this, n] (tmp_buf buf) {
+            _eof = buf.empty();
+            _buf = std::move(buf);
+            return read_up_to(n);
+        });
+    } else if (_buf.size() <= n) {
+        return make_ready_future<tmp_buf>(std::move(_buf));
+    } else {
+        auto front = _buf.share(0, n);
+        _buf.trim_front(n);
+        return make_ready_future<tmp_buf>(std::move(front));
+    }
+}
+
 // Writes @buf in chunks of _size length. The last chunk is buffered if smaller.
 template <typename CharType>
 future<>
@@ -305,6 +383,12 @@ void add_to_flush_poller(output_stream<char>* x);
 template <typename CharType>
 future<>
 output_stream<CharType>::put(temporary_buffer<CharType> buf) {
+    if (_zc_bufs) {
+        // queued zero-copy data was written before buf
+        auto p = std::move(*_zc_bufs);
+        _zc_bufs = std::experimental::nullopt;
+        return put(net::packet(std::move(p), std::move(buf)));
+    }
     // if flush is scheduled, disable it, so it will not try to write in parallel
     _flush = false;
     if (_flushing) {
@@ -317,6 +401,21 @@ output_stream<CharType>::put(temporary_buffer<CharType> buf) {
     }
 }
 
+template <typename CharType>
+future<>
+output_stream<CharType>::put(net::packet p) {
+    // if flush is scheduled, disable it, so it will not try to write in parallel
+    _flush = false;
+    if (_flushing) {
+        // flush in progress, wait for it to end before continuing
+        return _in_batch.value().get_future().then([this, p = std::move(p)] () mutable {
+            return _fd.put(std::move(p));
+        });
+    } else {
+        return _fd.put(std::move(p));
+    }
+}
+
 template <typename CharType>
 void
 output_stream<CharType>::poll_flush() {
@@ -332,11 +431,9 @@ output_stream<CharType>::poll_flush() {
     _flush = false;
     _flushing = true; // make whoever wants to write into the fd to wait for flush to complete
 
-    if (_end) {
+    if (_end || _zc_bufs) {
         // send whatever is in the buffer right now
-        _buf.trim(_end);
-        _end = 0;
-        f = _fd.put(std::move(_buf));
+        f = _fd.put(take_pending());
     }
 
     f.then([this] {
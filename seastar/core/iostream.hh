@@ -146,6 +146,10 @@ class input_stream final {
     /// Returns some data from the stream, or an empty buffer on end of
     /// stream.
     future<tmp_buf> read();
+    /// Returns between 1 and \c n bytes from the stream, or an empty buffer
+    /// on end of stream.  Unlike read_exactly(), never copies: the data is
+    /// shared with the buffer it was received in.
+    future<tmp_buf> read_up_to(size_t n);
     /// Detaches the \c input_stream from the underlying data source.
     ///
     /// Waits for any background operations (for example, read-ahead) to
@@ -170,6 +174,11 @@ class input_stream final {
 //
 // The data sink will not receive empty chunks.
 //
+// When batch_flushes is true (and trim_to_size is not), zero-copy writes are
+// not handed to the data sink immediately; they are queued, together with any
+// buffered data written before them, and handed over as a single packet by the
+// next (batched) flush, or as soon as the queue holds at least size bytes.
+//
 template <typename CharType>
 class output_stream final {
     static_assert(sizeof(CharType) == 1, "must buffer stream of bytes");
@@ -184,11 +193,17 @@ class output_stream final {
     bool _flush = false;
     bool _flushing = false;
     std::exception_ptr _ex;
+    // zero-copy writes waiting for a batched flush; precede the data in _buf
+    std::experimental::optional<net::packet> _zc_bufs;
 private:
     size_t available() const { return _end - _begin; }
     size_t possibly_available() const { return _size - _begin; }
+    bool queue_zero_copy_writes() const { return _batch_flushes && !_trim_to_size; }
+    future<> queue_zero_copy(net::packet p);
+    net::packet take_pending();
     future<> split_and_put(temporary_buffer<CharType> buf);
     future<> put(temporary_buffer<CharType> buf);
+    future<> put(net::packet p);
     void poll_flush();
 public:
     using char_type = CharType;
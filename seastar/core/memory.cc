@@ -68,6 +68,12 @@
 #include <experimental/optional>
 #include <functional>
 #include <cstring>
+#include <map>
+#include <unordered_map>
+#include <cmath>
+#include <execinfo.h>
+#include <fstream>
+#include <sstream>
 #include <boost/intrusive/list.hpp>
 #include <sys/mman.h>
 #ifdef HAVE_NUMA
@@ -79,14 +85,16 @@ namespace memory {
 static constexpr unsigned cpu_id_shift = 36; // FIXME: make dynamic
 static constexpr unsigned max_cpus = 256;
 static constexpr size_t cache_line_size = 64;
+static constexpr unsigned huge_page_pages = huge_page_size / page_size;
+// Large allocations of at least this many pages start on a huge page
+// boundary; smaller spans are kept out of free huge pages if possible.
+static constexpr unsigned huge_alloc_threshold_pages = huge_page_pages;
 
 using pageidx = uint32_t;
 
 struct page;
 class page_list;
 
-static std::atomic<bool> live_cpus[max_cpus];
-
 static thread_local uint64_t g_allocs;
 static thread_local uint64_t g_frees;
 static thread_local uint64_t g_cross_cpu_frees;
@@ -138,7 +146,8 @@ struct free_object {
 };
 
 struct page {
-    bool free;
+    bool free : 1;
+    bool sampled : 1; // holds (the start of) an object sampled by the heap profiler
     uint8_t offset_in_span;
     uint16_t nr_small_alloc;
     uint32_t span_size; // in pages, if we're the head or the tail
@@ -185,6 +194,12 @@ class page_list {
         }
         _front = ary[_front].link._next;
     }
+    template <typename Func>
+    void for_each(page* ary, Func func) {
+        for (auto n = _front; n; n = ary[n].link._next) {
+            func(ary[n]);
+        }
+    }
     page* find(uint32_t n_pages, page* ary) {
         auto n = _front;
         while (n && ary[n].span_size < n_pages) {
@@ -217,10 +232,11 @@ class small_pool {
     unsigned object_size() const { return _object_size; }
     static constexpr unsigned size_to_idx(unsigned size);
     static constexpr unsigned idx_to_size(unsigned idx);
+    small_pool_stats stats();
 private:
     void add_more_objects();
     void trim_free_list();
-    float waste();
+    float waste() const;
 };
 
 // index 0b0001'1100 -> size (1 << 4) + 0b11 << (4 - 2)
@@ -273,6 +289,75 @@ struct cross_cpu_free_item {
     cross_cpu_free_item* next;
 };
 
+// Objects freed by other cpus, waiting for their owner to free them.  Kept
+// outside the thread-local cpu_pages, so that other cpus can still push to
+// the list of a cpu whose thread exited.
+struct alignas(cache_line_size) xcpu_freelist {
+    std::atomic<cross_cpu_free_item*> head = { nullptr };
+};
+
+static xcpu_freelist xcpu_freelists[max_cpus];
+
+// Objects freed on behalf of another cpu are collected in a chain per
+// destination, and pushed onto its xcpu_freelists with a single CAS when
+// the chain is full or the freeing cpu polls.
+struct cross_cpu_free_batch {
+    static constexpr unsigned max_size = 32;
+    cross_cpu_free_item* head = nullptr;
+    cross_cpu_free_item* tail = nullptr;
+    unsigned size = 0;
+    bool pending = false; // listed in cpu_pages::pending_batches
+};
+
+// Heap profiler
+//
+// When enabled, about one allocation in every sample_period bytes is
+// recorded with its backtrace, until it is freed.  The distance between
+// samples is drawn from an exponential distribution (as in tcmalloc), so
+// that periodic allocation patterns do not bias the profile.  Pages that
+// hold a sampled object are marked, and only frees of objects on marked
+// pages look up the sample table.
+
+static constexpr unsigned max_backtrace_frames = 32;
+
+struct alloc_sample {
+    size_t size;
+    unsigned nr_frames;
+    void* frames[max_backtrace_frames];
+};
+
+struct heap_profiler {
+    size_t sample_period;
+    uint64_t rng_state;
+    std::unordered_map<void*, alloc_sample> samples;
+    std::unordered_map<pageidx, unsigned> sampled_pages; // samples per page
+    explicit heap_profiler(size_t period)
+        : sample_period(period)
+        , rng_state(reinterpret_cast<uintptr_t>(this) | 1) {
+    }
+    int64_t next_sample_distance() {
+        // xorshift64*; we cannot use <random> engines, which may allocate
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        auto r = rng_state * 2685821657736338717ULL;
+        double u = (r >> 11) * (1.0 / (uint64_t(1) << 53));
+        return int64_t(-std::log1p(-u) * sample_period) + 1;
+    }
+};
+
+// Bytes left to allocate until the next sample; never runs out while the
+// profiler is disabled, so allocate() only pays for a subtraction.
+static thread_local int64_t g_bytes_until_sample = std::numeric_limits<int64_t>::max();
+// Set while the profiler itself allocates and frees memory
+static thread_local bool g_in_profiler;
+
+struct profiler_guard {
+    bool _prev = g_in_profiler;
+    profiler_guard() { g_in_profiler = true; }
+    ~profiler_guard() { g_in_profiler = _prev; }
+};
+
 struct cpu_pages {
     static constexpr unsigned min_free_pages = 20000000 / page_size;
     char* memory;
@@ -281,6 +366,7 @@ struct cpu_pages {
     uint32_t nr_free_pages;
     uint32_t current_min_free_pages = 0;
     unsigned cpu_id = -1U;
+    bool hugetlbfs_backed = false;
     std::function<void (std::function<void ()>)> reclaim_hook;
     std::vector<reclaimer*> reclaimers;
     static constexpr unsigned nr_span_lists = 32;
@@ -296,7 +382,14 @@ struct cpu_pages {
         page_list free_spans[nr_span_lists];  // contains spans with span_size >= 2^idx
     } fsu;
     small_pool_array small_pools;
-    alignas(cache_line_size) std::atomic<cross_cpu_free_item*> xcpu_freelist;
+    heap_profiler* profiler = nullptr; // while heap profiling is enabled
+    // Only threads that poll drain_cross_cpu_freelist() batch their remote
+    // frees; other threads (e.g. the syscall thread) have nothing flushing
+    // their batches.
+    bool batch_cross_cpu_frees = false;
+    unsigned nr_pending_batches = 0;
+    uint8_t pending_batches[max_cpus];
+    cross_cpu_free_batch xcpu_batches[max_cpus];
     alignas(cache_line_size) std::vector<physical_address> virt_to_phys_map;
     static std::atomic<unsigned> cpu_id_gen;
     static cpu_pages* all_cpus[max_cpus];
@@ -309,7 +402,7 @@ struct cpu_pages {
         unsigned nr_pages;
     };
     template <typename Trimmer>
-    void* allocate_large_and_trim(unsigned nr_pages, Trimmer trimmer);
+    void* allocate_large_and_trim(unsigned nr_pages, Trimmer trimmer, bool reclaim = true);
     void* allocate_large(unsigned nr_pages);
     void* allocate_large_aligned(unsigned align_pages, unsigned nr_pages);
     page* find_and_unlink_span(unsigned nr_pages);
@@ -322,8 +415,14 @@ struct cpu_pages {
     void free(void* ptr, size_t size);
     void shrink(void* ptr, size_t new_size);
     void free_cross_cpu(unsigned cpu_id, void* ptr);
+    void push_cross_cpu(unsigned cpu_id, cross_cpu_free_item* head, cross_cpu_free_item* tail);
+    bool flush_cross_cpu_batches();
     bool drain_cross_cpu_freelist();
     size_t object_size(void* ptr);
+    void sample_allocation(void* ptr, size_t size);
+    void forget_sample(void* ptr);
+    void set_heap_profiling_sample_period(size_t period);
+    void dump_heap_profile(const std::string& path);
     page* to_page(void* p) {
         return &pages[(reinterpret_cast<char*>(p) - mem()) / page_size];
     }
@@ -339,6 +438,8 @@ struct cpu_pages {
     void init_virt_to_phys_map();
     memory::memory_layout memory_layout();
     translation translate(const void* addr, size_t size);
+    detailed_statistics detailed_stats();
+    size_t huge_page_memory();
     ~cpu_pages();
 };
 
@@ -448,15 +549,15 @@ cpu_pages::find_and_unlink_span_reclaiming(unsigned n_pages) {
 
 template <typename Trimmer>
 void*
-cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
-    page* span = find_and_unlink_span_reclaiming(n_pages);
+cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer, bool reclaim) {
+    page* span = reclaim ? find_and_unlink_span_reclaiming(n_pages) : find_and_unlink_span(n_pages);
     if (!span) {
         return nullptr;
     }
     auto span_size = span->span_size;
     auto span_idx = span - pages;
     nr_free_pages -= span->span_size;
-    trim t = trimmer(span_idx, nr_pages);
+    trim t = trimmer(span_idx, span_size);
     if (t.offset) {
         free_span_no_merge(span_idx, t.offset);
         span_idx += t.offset;
@@ -482,10 +583,36 @@ cpu_pages::allocate_large_and_trim(unsigned n_pages, Trimmer trimmer) {
     return mem() + span_idx * page_size;
 }
 
+// Transparent huge pages can only back 2MB-aligned ranges that are
+// entirely in use, so large buffers start on a huge page boundary, and
+// smaller spans are carved out of the parts of a free span that do not
+// cover a whole huge page, when those parts are big enough.
 void*
 cpu_pages::allocate_large(unsigned n_pages) {
+    if (n_pages >= huge_alloc_threshold_pages) {
+        // without reclaiming: we can fall back to an unaligned span
+        auto ptr = allocate_large_and_trim(n_pages + huge_page_pages - 1, [=] (unsigned idx, unsigned n) {
+            return trim{align_up(idx, huge_page_pages) - idx, n_pages};
+        }, false);
+        if (ptr) {
+            return ptr;
+        }
+        return allocate_large_and_trim(n_pages, [n_pages] (unsigned idx, unsigned n) {
+            return trim{0, n_pages};
+        });
+    }
     return allocate_large_and_trim(n_pages, [n_pages] (unsigned idx, unsigned n) {
-        return trim{0, std::min(n, n_pages)};
+        auto first_huge = align_up(idx, huge_page_pages);
+        auto end_huge = align_down(idx + n, huge_page_pages);
+        if (first_huge >= end_huge) {
+            // no whole huge page to protect
+            return trim{0, n_pages};
+        } else if (first_huge - idx >= n_pages) {
+            return trim{0, n_pages};
+        } else if (idx + n - end_huge >= n_pages) {
+            return trim{n - n_pages, n_pages};
+        }
+        return trim{0, n_pages};
     });
 }
 
@@ -521,25 +648,61 @@ size_t cpu_pages::object_size(void* ptr) {
 }
 
 void cpu_pages::free_cross_cpu(unsigned cpu_id, void* ptr) {
-    if (!live_cpus[cpu_id].load(std::memory_order_relaxed)) {
-        // Thread was destroyed; leak object
-        // should only happen for boost unit-tests.
+    auto p = reinterpret_cast<cross_cpu_free_item*>(ptr);
+    ++g_cross_cpu_frees;
+    if (!batch_cross_cpu_frees) {
+        push_cross_cpu(cpu_id, p, p);
         return;
     }
-    auto p = reinterpret_cast<cross_cpu_free_item*>(ptr);
-    auto& list = all_cpus[cpu_id]->xcpu_freelist;
+    auto& batch = xcpu_batches[cpu_id];
+    p->next = batch.head;
+    batch.head = p;
+    if (!batch.size++) {
+        batch.tail = p;
+    }
+    if (!batch.pending) {
+        batch.pending = true;
+        pending_batches[nr_pending_batches++] = cpu_id;
+    }
+    if (batch.size == cross_cpu_free_batch::max_size) {
+        push_cross_cpu(cpu_id, batch.head, batch.tail);
+        batch.head = batch.tail = nullptr;
+        batch.size = 0;
+    }
+}
+
+void cpu_pages::push_cross_cpu(unsigned cpu_id, cross_cpu_free_item* head, cross_cpu_free_item* tail) {
+    auto& list = xcpu_freelists[cpu_id].head;
     auto old = list.load(std::memory_order_relaxed);
     do {
-        p->next = old;
-    } while (!list.compare_exchange_weak(old, p, std::memory_order_release, std::memory_order_relaxed));
-    ++g_cross_cpu_frees;
+        tail->next = old;
+    } while (!list.compare_exchange_weak(old, head, std::memory_order_release, std::memory_order_relaxed));
 }
 
-bool cpu_pages::drain_cross_cpu_freelist() {
-    if (!xcpu_freelist.load(std::memory_order_relaxed)) {
+bool cpu_pages::flush_cross_cpu_batches() {
+    if (!nr_pending_batches) {
         return false;
     }
-    auto p = xcpu_freelist.exchange(nullptr, std::memory_order_acquire);
+    for (unsigned i = 0; i < nr_pending_batches; ++i) {
+        auto cpu_id = pending_batches[i];
+        auto& batch = xcpu_batches[cpu_id];
+        if (batch.size) {
+            push_cross_cpu(cpu_id, batch.head, batch.tail);
+        }
+        batch = cross_cpu_free_batch();
+    }
+    nr_pending_batches = 0;
+    return true;
+}
+
+bool cpu_pages::drain_cross_cpu_freelist() {
+    batch_cross_cpu_frees = true;
+    auto flushed = flush_cross_cpu_batches();
+    auto& list = xcpu_freelists[cpu_id].head;
+    if (!list.load(std::memory_order_relaxed)) {
+        return flushed;
+    }
+    auto p = list.exchange(nullptr, std::memory_order_acquire);
     while (p) {
         auto n = p->next;
         free(p);
@@ -554,6 +717,9 @@ void cpu_pages::free(void* ptr) {
         return free_cross_cpu(obj_cpu, ptr);
     }
     page* span = to_page(ptr);
+    if (__builtin_expect(span->sampled, false)) {
+        forget_sample(ptr);
+    }
     if (span->pool) {
         span->pool->deallocate(ptr);
     } else {
@@ -570,6 +736,9 @@ void cpu_pages::free(void* ptr, size_t size) {
     if (obj_cpu != cpu_id) {
         return free_cross_cpu(obj_cpu, ptr);
     }
+    if (__builtin_expect(profiler != nullptr, false) && to_page(ptr)->sampled) {
+        forget_sample(ptr);
+    }
     if (size <= max_small_allocation) {
         auto pool = &small_pools[small_pool::size_to_idx(size)];
         pool->deallocate(ptr);
@@ -591,6 +760,12 @@ void cpu_pages::shrink(void* ptr, size_t new_size) {
     if (new_size_pages == old_size_pages) {
         return;
     }
+    if (span->sampled && profiler && !g_in_profiler) {
+        auto i = profiler->samples.find(ptr);
+        if (i != profiler->samples.end()) {
+            i->second.size = std::min(i->second.size, new_size);
+        }
+    }
     span->span_size = new_size_pages;
     span[new_size_pages - 1].free = false;
     span[new_size_pages - 1].span_size = new_size_pages;
@@ -598,8 +773,193 @@ void cpu_pages::shrink(void* ptr, size_t new_size) {
     free_span(idx + new_size_pages, old_size_pages - new_size_pages);
 }
 
+detailed_statistics cpu_pages::detailed_stats() {
+    detailed_statistics ret;
+    // allocate up front, so that the lists do not change while we walk them
+    ret.small_pools.reserve(small_pool_array::nr_small_pools);
+    ret.free_spans.resize(nr_span_lists);
+    for (unsigned i = 0; i < small_pool_array::nr_small_pools; ++i) {
+        ret.small_pools.push_back(small_pools[i].stats());
+    }
+    uint32_t largest = 0;
+    for (unsigned i = 0; i < nr_span_lists; ++i) {
+        fsu.free_spans[i].for_each(pages, [&] (page& span) {
+            ++ret.free_spans[i];
+            largest = std::max(largest, span.span_size);
+            pageidx idx = &span - pages;
+            auto first_huge = align_up(idx, huge_page_pages);
+            auto end_huge = align_down(idx + span.span_size, huge_page_pages);
+            if (first_huge < end_huge) {
+                ret.free_huge_pages += (end_huge - first_huge) / huge_page_pages;
+            }
+        });
+    }
+    ret.largest_free_span = size_t(largest) * page_size;
+    return ret;
+}
+
+// Sums the transparent huge pages the kernel reports for the mappings of
+// this cpu's memory.
+size_t cpu_pages::huge_page_memory() {
+    if (hugetlbfs_backed) {
+        return size_t(nr_pages) * page_size;
+    }
+    auto start = reinterpret_cast<uintptr_t>(memory);
+    auto end = start + size_t(nr_pages) * page_size;
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    // bytes of the current mapping within [start, end)
+    size_t overlap = 0;
+    size_t ret = 0;
+    while (std::getline(smaps, line)) {
+        uintptr_t vma_start, vma_end;
+        char dash;
+        std::istringstream is(line);
+        if (is >> std::hex >> vma_start >> dash >> vma_end && dash == '-') {
+            auto b = std::max(vma_start, start);
+            auto e = std::min(vma_end, end);
+            overlap = b < e ? e - b : 0;
+        } else if (overlap && line.compare(0, 14, "AnonHugePages:") == 0) {
+            size_t kb = 0;
+            std::istringstream(line.substr(14)) >> kb;
+            // The kernel may have merged our memory with adjacent anonymous
+            // mappings; smaps does not say where in the mapping its huge
+            // pages are, so count at most the part that is ours.
+            ret += std::min(kb * 1024, overlap);
+        }
+    }
+    return ret;
+}
+
+[[gnu::noinline]]
+void cpu_pages::sample_allocation(void* ptr, size_t size) {
+    if (!profiler) {
+        // disabled on this shard after the countdown was armed
+        g_bytes_until_sample = std::numeric_limits<int64_t>::max();
+        return;
+    }
+    g_bytes_until_sample = profiler->next_sample_distance();
+    if (!ptr || g_in_profiler) {
+        return;
+    }
+    profiler_guard guard;
+    alloc_sample sample;
+    sample.size = size;
+    sample.nr_frames = ::backtrace(sample.frames, max_backtrace_frames);
+    try {
+        profiler->samples.emplace(ptr, sample);
+        ++profiler->sampled_pages[to_page(ptr) - pages];
+        to_page(ptr)->sampled = true;
+    } catch (...) {
+        // no memory for the sample; the profile will miss it
+        profiler->samples.erase(ptr);
+    }
+}
+
+void cpu_pages::forget_sample(void* ptr) {
+    // objects freed by the profiler itself are never sampled, and the
+    // tables may be in the middle of an update; without a profiler there
+    // is nothing to forget
+    if (g_in_profiler || !profiler) {
+        return;
+    }
+    profiler_guard guard;
+    if (!profiler->samples.erase(ptr)) {
+        return;
+    }
+    auto idx = to_page(ptr) - pages;
+    auto i = profiler->sampled_pages.find(idx);
+    if (!--i->second) {
+        profiler->sampled_pages.erase(i);
+        pages[idx].sampled = false;
+    }
+}
+
+void cpu_pages::set_heap_profiling_sample_period(size_t period) {
+    profiler_guard guard;
+    if (profiler) {
+        for (auto&& e : profiler->sampled_pages) {
+            pages[e.first].sampled = false;
+        }
+        delete profiler;
+        profiler = nullptr;
+    }
+    g_bytes_until_sample = std::numeric_limits<int64_t>::max();
+    if (period) {
+        profiler = new heap_profiler(period);
+        g_bytes_until_sample = profiler->next_sample_distance();
+    }
+}
+
+// Writes the profile in the legacy text format of gperftools' heap
+// profiler, which pprof reads.  Only allocations that are still live are
+// tracked, so in-use and allocated totals are the same.
+void cpu_pages::dump_heap_profile(const std::string& path) {
+    profiler_guard guard;
+    struct stack_totals {
+        size_t count = 0;
+        size_t bytes = 0;
+    };
+    std::map<std::vector<void*>, stack_totals> stacks;
+    stack_totals total;
+    size_t period = 0;
+    if (profiler) {
+        period = profiler->sample_period;
+        for (auto&& e : profiler->samples) {
+            auto& sample = e.second;
+            // skip sample_allocation() itself
+            auto first = sample.frames + std::min(sample.nr_frames, 1u);
+            auto& t = stacks[std::vector<void*>(first, sample.frames + sample.nr_frames)];
+            ++t.count;
+            t.bytes += sample.size;
+            ++total.count;
+            total.bytes += sample.size;
+        }
+    }
+    std::string out;
+    char line[64];
+    auto counts = [&] (const stack_totals& t) {
+        snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @", t.count, t.bytes, t.count, t.bytes);
+        out += line;
+    };
+    out += "heap profile: ";
+    counts(total);
+    snprintf(line, sizeof(line), " heap_v2/%zu\n", period);
+    out += line;
+    for (auto&& e : stacks) {
+        counts(e.second);
+        for (auto frame : e.first) {
+            snprintf(line, sizeof(line), " %p", frame);
+            out += line;
+        }
+        out += "\n";
+    }
+    out += "\nMAPPED_LIBRARIES:\n";
+    auto maps = file_desc::open("/proc/self/maps", O_RDONLY);
+    char buf[4096];
+    while (auto r = maps.read(buf, sizeof(buf))) {
+        if (!*r) {
+            break;
+        }
+        out.append(buf, *r);
+    }
+    auto fd = file_desc::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t written = 0;
+    while (written < out.size()) {
+        written += fd.write(out.data() + written, out.size() - written).value_or(0);
+    }
+}
+
+// A cpu's memory is never reused once its thread exits, so objects that
+// other cpus free to it after that just stay on its xcpu_freelists; the
+// ones freed before are released here.
 cpu_pages::~cpu_pages() {
-    live_cpus[cpu_id].store(false, std::memory_order_relaxed);
+    if (!is_initialized()) {
+        return;
+    }
+    drain_cross_cpu_freelist();
+    // Nothing would flush what later thread-local destructors free
+    batch_cross_cpu_frees = false;
 }
 
 bool cpu_pages::is_initialized() const {
@@ -634,7 +994,6 @@ bool cpu_pages::initialize() {
     }
     pages[nr_pages].free = false;
     free_span_no_merge(reserved, nr_pages - reserved);
-    live_cpus[cpu_id].store(true, std::memory_order_relaxed);
     return true;
 }
 
@@ -903,7 +1262,25 @@ small_pool::trim_free_list() {
     }
 }
 
-float small_pool::waste() {
+small_pool_stats small_pool::stats() {
+    small_pool_stats ret;
+    ret.object_size = _object_size;
+    ret.span_size = span_bytes();
+    ret.spans_in_use = _spans_in_use;
+    ret.waste = waste();
+    // Objects are either in use, in the pool's free list, or in the free
+    // list of a partially used span that is not feeding the pool.
+    auto in_spans = _spans_in_use * (span_bytes() / _object_size);
+    size_t in_span_freelists = 0;
+    _span_list.for_each(cpu_mem.pages, [&] (page& span) {
+        in_span_freelists += span_bytes() / _object_size - span.nr_small_alloc;
+    });
+    ret.free_count = _free_count + in_span_freelists;
+    ret.use_count = in_spans - ret.free_count;
+    return ret;
+}
+
+float small_pool::waste() const {
     return (span_bytes() % _object_size) / (1.0 * span_bytes());
 }
 
@@ -938,20 +1315,30 @@ size_t object_size(void* ptr) {
     return cpu_pages::all_cpus[object_cpu_id(ptr)]->object_size(ptr);
 }
 
+static inline
+void* maybe_sample(void* ptr, size_t size) {
+    if (__builtin_expect((g_bytes_until_sample -= size) < 0, false)) {
+        cpu_mem.sample_allocation(ptr, size);
+    }
+    return ptr;
+}
+
 void* allocate(size_t size) {
     ++g_allocs;
+    auto requested = size;
     if (size <= sizeof(free_object)) {
         size = sizeof(free_object);
     }
     if (size <= max_small_allocation) {
-        return cpu_mem.allocate_small(size);
+        return maybe_sample(cpu_mem.allocate_small(size), requested);
     } else {
-        return allocate_large(size);
+        return maybe_sample(allocate_large(size), requested);
     }
 }
 
 void* allocate_aligned(size_t align, size_t size) {
     ++g_allocs;
+    auto requested = size;
     size = std::max(size, align);
     if (size <= sizeof(free_object)) {
         size = sizeof(free_object);
@@ -960,9 +1347,9 @@ void* allocate_aligned(size_t align, size_t size) {
         // Our small allocator only guarantees alignment for power-of-two
         // allocations which are not larger than a page.
         size = 1 << log2ceil(size);
-        return cpu_mem.allocate_small(size);
+        return maybe_sample(cpu_mem.allocate_small(size), requested);
     } else {
-        return allocate_large_aligned(align, size);
+        return maybe_sample(allocate_large_aligned(align, size), requested);
     }
 }
 
@@ -997,6 +1384,70 @@ reclaimer::~reclaimer() {
     r.erase(std::find(r.begin(), r.end(), this));
 }
 
+#ifdef HAVE_NUMA
+
+// A set of NUMA nodes, as mbind() and get_mempolicy() take it.  Sized for
+// the largest number of nodes Linux supports, rather than one word, so
+// that node ids of 64 and more work.
+class numa_nodemask {
+public:
+    static constexpr unsigned max_nodes = 1024;
+private:
+    static constexpr unsigned bits_per_word = std::numeric_limits<unsigned long>::digits;
+    unsigned long _words[max_nodes / bits_per_word] = {};
+public:
+    void set(unsigned node) {
+        _words[node / bits_per_word] |= 1UL << (node % bits_per_word);
+    }
+    bool test(unsigned node) const {
+        return _words[node / bits_per_word] & (1UL << (node % bits_per_word));
+    }
+    unsigned long* get() {
+        return _words;
+    }
+};
+
+// Checks that mbind() took effect on [start, start + size), and that the
+// pages of that range which are already resident are on node \c nodeid.
+static void verify_numa_placement(char* start, size_t size, unsigned nodeid) {
+    int mode = -1;
+    numa_nodemask nodemask;
+    auto r = ::get_mempolicy(&mode, nodemask.get(), numa_nodemask::max_nodes,
+            start, MPOL_F_ADDR);
+    if (r == -1 || mode != MPOL_PREFERRED || !nodemask.test(nodeid)) {
+        std::cerr << "WARNING: shard memory is not bound to NUMA node " << nodeid
+                << "; performance may suffer" << std::endl;
+        return;
+    }
+    // sample one page per huge page; move_pages() without target nodes
+    // only reports where each page is
+    static constexpr size_t max_samples = 1024;
+    void* addrs[max_samples];
+    int status[max_samples];
+    auto step = std::max(huge_page_size, align_up(size / max_samples, page_size));
+    unsigned n = 0;
+    for (size_t off = 0; off < size && n < max_samples; off += step) {
+        addrs[n++] = start + off;
+    }
+    if (::move_pages(0, n, addrs, nullptr, status, 0) == -1) {
+        return;
+    }
+    unsigned resident = 0, remote = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        if (status[i] >= 0) {
+            ++resident;
+            remote += unsigned(status[i]) != nodeid;
+        }
+    }
+    if (remote) {
+        std::cerr << "WARNING: " << remote << " of " << resident
+                << " sampled resident pages of shard memory are not on NUMA node " << nodeid
+                << "; performance may suffer" << std::endl;
+    }
+}
+
+#endif
+
 void configure(std::vector<resource::memory> m,
         optional<std::string> hugetlbfs_path) {
     size_t total = 0;
@@ -1012,15 +1463,24 @@ void configure(std::vector<resource::memory> m,
             return allocate_hugetlbfs_memory(*fdp, where, how_much);
         };
         cpu_mem.replace_memory_backing(sys_alloc);
+        cpu_mem.hugetlbfs_backed = true;
     }
     cpu_mem.resize(total, sys_alloc);
     size_t pos = 0;
     for (auto&& x : m) {
 #ifdef HAVE_NUMA
-        unsigned long nodemask = 1UL << x.nodeid;
+        if (x.nodeid >= numa_nodemask::max_nodes) {
+            std::cerr << "WARNING: NUMA node " << x.nodeid
+                    << " is out of range; not binding shard memory to it" << std::endl;
+            pos += x.bytes;
+            continue;
+        }
+        numa_nodemask nodemask;
+        nodemask.set(x.nodeid);
+        // mbind() ignores the last bit of maxnode
         auto r = ::mbind(cpu_mem.mem() + pos, x.bytes,
                         MPOL_PREFERRED,
-                        &nodemask, std::numeric_limits<unsigned long>::digits,
+                        nodemask.get(), numa_nodemask::max_nodes + 1,
                         MPOL_MF_MOVE);
 
         if (r == -1) {
@@ -1028,6 +1488,8 @@ void configure(std::vector<resource::memory> m,
             strerror_r(errno, err, sizeof(err));
             std::cerr << "WARNING: unable to mbind shard memory; performance may suffer: "
                     << err << std::endl;
+        } else {
+            verify_numa_placement(cpu_mem.mem() + pos, x.bytes, x.nodeid);
         }
 #endif
         pos += x.bytes;
@@ -1063,6 +1525,22 @@ memory_layout get_memory_layout() {
     return cpu_mem.memory_layout();
 }
 
+detailed_statistics detailed_stats() {
+    return cpu_mem.detailed_stats();
+}
+
+size_t huge_page_memory() {
+    return cpu_mem.huge_page_memory();
+}
+
+void set_heap_profiling_sample_period(size_t period) {
+    cpu_mem.set_heap_profiling_sample_period(period);
+}
+
+void dump_heap_profile(const std::string& path) {
+    cpu_mem.dump_heap_profile(path);
+}
+
 }
 
 using namespace memory;
@@ -1359,6 +1837,14 @@ statistics stats() {
     return statistics{0, 0, 0, 1 << 30, 0, 0};
 }
 
+detailed_statistics detailed_stats() {
+    return {};
+}
+
+size_t huge_page_memory() {
+    return 0;
+}
+
 bool drain_cross_cpu_freelist() {
     return false;
 }
@@ -1372,6 +1858,13 @@ memory_layout get_memory_layout() {
     throw std::runtime_error("get_memory_layout() not supported");
 }
 
+void set_heap_profiling_sample_period(size_t period) {
+}
+
+void dump_heap_profile(const std::string& path) {
+    throw std::runtime_error("dump_heap_profile() not supported");
+}
+
 }
 
 void* operator new(size_t size, with_alignment wa) {
@@ -26,6 +26,7 @@
 #include <new>
 #include <functional>
 #include <vector>
+#include <string>
 
 
 /// \defgroup memory-module Memory management
@@ -102,7 +103,10 @@ class reclaimer {
 };
 
 // Call periodically to recycle objects that were freed
-// on cpu other than the one they were allocated on.
+// on cpu other than the one they were allocated on, and to
+// hand over objects this cpu freed for other cpus.  Once a
+// thread calls this, its frees of other cpus' objects are
+// batched until the next call.
 //
 // Returns @true if any work was actually performed.
 bool drain_cross_cpu_freelist();
@@ -174,6 +178,51 @@ class statistics {
     friend statistics stats();
 };
 
+/// Statistics of one of the small object pools of an lcore.
+struct small_pool_stats {
+    /// Size of the pool's objects (allocations are rounded up to it)
+    size_t object_size = 0;
+    /// Size of the spans of pages the pool carves objects from
+    size_t span_size = 0;
+    /// Number of objects currently allocated
+    size_t use_count = 0;
+    /// Number of free objects held by the pool, available for reuse by
+    /// allocations of this size only
+    size_t free_count = 0;
+    /// Number of spans held by the pool
+    size_t spans_in_use = 0;
+    /// Fraction of each span that is too small to hold an object
+    float waste = 0;
+};
+
+/// Allocator statistics for diagnosing fragmentation on this lcore.
+struct detailed_statistics {
+    /// One entry per small object pool, by increasing object size
+    std::vector<small_pool_stats> small_pools;
+    /// free_spans[i] is the number of free spans of at least 2^i pages,
+    /// and less than 2^(i+1)
+    std::vector<size_t> free_spans;
+    /// Size of the largest free span, in bytes; larger allocations
+    /// require reclaiming memory
+    size_t largest_free_span = 0;
+    /// Number of free, huge page aligned, huge page sized regions
+    size_t free_huge_pages = 0;
+};
+
+/// Capture a snapshot of per-size-class allocator statistics for this
+/// lcore.  Unlike stats(), this walks the allocator's free lists, so it
+/// should not be called too often.
+detailed_statistics detailed_stats();
+
+/// Returns how much of this lcore's memory is backed by huge pages, in
+/// bytes: all of it with --hugepages, otherwise the transparent huge pages
+/// the kernel reports in /proc/self/smaps (which is slow to read).
+///
+/// Allocations of a huge page or more start on a huge page boundary, and
+/// smaller spans are kept out of free huge pages when possible, so that
+/// transparent huge pages are not broken up.
+size_t huge_page_memory();
+
 struct memory_layout {
     uintptr_t start;
     uintptr_t end;
@@ -183,6 +232,24 @@ struct memory_layout {
 // Supported only when seastar allocator is enabled.
 memory::memory_layout get_memory_layout();
 
+/// Enables the sampling heap profiler on the current shard.
+///
+/// About one allocation in every \c period bytes allocated is recorded,
+/// with its backtrace, until it is freed.  A period of 0 disables the
+/// profiler and drops the samples.  With the default seastar allocator
+/// only; a no-op otherwise.
+///
+/// \param period average number of bytes allocated between samples
+///        (512k is a reasonable compromise between accuracy and overhead)
+void set_heap_profiling_sample_period(size_t period);
+
+/// Writes the sampled allocations of the current shard that are still
+/// live to the file \c path, in the heap profile format of gperftools,
+/// which \c pprof reads.  Blocks the shard while writing.
+///
+/// Throws std::system_error if the file cannot be written.
+void dump_heap_profile(const std::string& path);
+
 }
 
 class with_alignment {
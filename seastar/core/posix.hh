@@ -204,6 +204,14 @@ class file_desc {
         throw_system_error_on(r == -1, "recvmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> recvmmsg(mmsghdr* msgs, size_t vlen, int flags) {
+        auto r = ::recvmmsg(_fd, msgs, vlen, flags, nullptr);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "recvmmsg");
+        return { size_t(r) };
+    }
     boost::optional<size_t> send(const void* buffer, size_t len, int flags) {
         auto r = ::send(_fd, buffer, len, flags);
         if (r == -1 && errno == EAGAIN) {
@@ -228,6 +236,14 @@ class file_desc {
         throw_system_error_on(r == -1, "sendmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> sendmmsg(mmsghdr* msgs, size_t vlen, int flags) {
+        auto r = ::sendmmsg(_fd, msgs, vlen, flags);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "sendmmsg");
+        return { size_t(r) };
+    }
     void bind(sockaddr& sa, socklen_t sl) {
         auto r = ::bind(_fd, &sa, sl);
         throw_system_error_on(r == -1, "bind");
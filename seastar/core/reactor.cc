@@ -47,6 +47,7 @@
 #include <boost/algorithm/string/split.hpp>
 #include <boost/iterator/counting_iterator.hpp>
 #include <boost/range/numeric.hpp>
+#include <cmath>
 #include <boost/range/adaptor/transformed.hpp>
 #include <atomic>
 #include <dirent.h>
@@ -68,6 +69,7 @@
 #include <iostream>
 #include <system_error>
 #include <cxxabi.h>
+#include <execinfo.h>
 #endif
 
 #include <linux/falloc.h>
@@ -85,6 +87,8 @@ using namespace net;
 
 std::atomic<lowres_clock::rep> lowres_clock::_now;
 constexpr std::chrono::milliseconds lowres_clock::_granularity;
+constexpr std::chrono::nanoseconds reactor::expensive_poll_cost;
+constexpr std::chrono::nanoseconds reactor::min_adaptive_poll_delay;
 
 timespec to_timespec(steady_clock_type::time_point t) {
     using ns = std::chrono::nanoseconds;
@@ -211,6 +215,10 @@ inline int task_quota_signal() {
     return SIGRTMIN + 1;
 }
 
+inline int stall_detector_signal() {
+    return SIGRTMIN + 2;
+}
+
 reactor::reactor()
     : _backend()
 #ifdef HAVE_OSV
@@ -243,8 +251,12 @@ reactor::reactor()
     sev.sigev_signo = task_quota_signal();
     r = timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &_task_quota_timer);
     assert(r >= 0);
+    sev.sigev_signo = stall_detector_signal();
+    r = timer_create(CLOCK_MONOTONIC, &sev, &_stall_detector_timer);
+    assert(r >= 0);
     sigemptyset(&mask);
     sigaddset(&mask, task_quota_signal());
+    sigaddset(&mask, stall_detector_signal());
     r = ::pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
     assert(r == 0);
 #endif
@@ -256,6 +268,7 @@ reactor::reactor()
 }
 
 reactor::~reactor() {
+    timer_delete(_stall_detector_timer);
     timer_delete(_task_quota_timer);
     timer_delete(_steady_clock_timer);
     auto eraser = [](auto& list) {
@@ -266,12 +279,157 @@ reactor::~reactor() {
     };
     eraser(_expired_timers);
     eraser(_expired_lowres_timers);
+    for (auto tasks : { &_pending_tasks, &_at_destroy_tasks }) {
+        while (!tasks->empty()) {
+            // Off the queue before it is destroyed, in case its
+            // destructor queues another task
+            auto t = tasks->front();
+            tasks->pop_front();
+            delete t;
+        }
+    }
 }
 
 void
 reactor::clear_task_quota(int) {
     future_avail_count = max_inlined_continuations - 1;
-    local_engine->_task_quota_finished = true;
+    auto& r = *local_engine;
+    r._task_quota_finished = true;
+    // If nothing completed since the previous signal, a single task (or
+    // poll) has been running for at least a whole quota.
+    auto progress = r._tasks_processed + r._polls;
+    if (progress != r._quota_progress) {
+        r._quota_progress = progress;
+        r._quota_violation_counted = false;
+    } else if (!r._quota_violation_counted) {
+        r._quota_violation_counted = true;
+        ++r._task_quota_violations;
+    }
+}
+
+namespace {
+
+// Formats a message into a fixed buffer, for writing it out from a signal
+// handler, where neither allocating nor stdio is safe.
+class signal_safe_message {
+    char _buf[1024];
+    size_t _len = 0;
+public:
+    signal_safe_message& operator<<(const char* s) {
+        while (*s && _len < sizeof(_buf)) {
+            _buf[_len++] = *s++;
+        }
+        return *this;
+    }
+    signal_safe_message& operator<<(uint64_t v) {
+        char digits[20];
+        unsigned n = 0;
+        do {
+            digits[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        while (n && _len < sizeof(_buf)) {
+            _buf[_len++] = digits[--n];
+        }
+        return *this;
+    }
+    signal_safe_message& operator<<(const void* p) {
+        auto v = reinterpret_cast<uintptr_t>(p);
+        *this << "0x";
+        unsigned shift = 60;
+        while (shift && !(v >> shift)) {
+            shift -= 4;
+        }
+        for (;; shift -= 4) {
+            if (_len < sizeof(_buf)) {
+                _buf[_len++] = "0123456789abcdef"[(v >> shift) & 15];
+            }
+            if (!shift) {
+                break;
+            }
+        }
+        return *this;
+    }
+    void write(int fd) {
+        auto r = ::write(fd, _buf, _len);
+        (void)r;
+    }
+};
+
+constexpr unsigned max_stall_backtrace_frames = 32;
+constexpr auto min_stall_report_interval = std::chrono::seconds(1);
+
+}
+
+void
+reactor::stall_detector_tick(int) {
+    local_engine->check_for_stall();
+}
+
+void reactor::check_for_stall() {
+    auto progress = _tasks_processed + _polls;
+    if (progress != _stall_progress) {
+        _stall_progress = progress;
+        _stall_ticks = 0;
+        _stall_reported = false;
+        return;
+    }
+    // The last progress was made before the previous tick, so this is a
+    // lower bound on how long the current task has been running.
+    auto stalled = ++_stall_ticks * _stall_detector_period;
+    if (_stall_reported || stalled < _stall_threshold) {
+        return;
+    }
+    _stall_reported = true;
+    ++_stalls;
+    auto now = steady_clock_type::now();
+    if (now < _next_stall_report) {
+        ++_suppressed_stall_reports;
+        return;
+    }
+    _next_stall_report = now + min_stall_report_interval;
+    report_stall(stalled);
+}
+
+// Runs in the signal handler, on top of the stalled task, so the backtrace
+// shows what the task is doing.  The addresses can be resolved with
+// addr2line.
+void reactor::report_stall(std::chrono::milliseconds stalled) {
+    void* frames[max_stall_backtrace_frames];
+    auto nr_frames = ::backtrace(frames, max_stall_backtrace_frames);
+    signal_safe_message msg;
+    msg << "Reactor stalled for " << uint64_t(stalled.count()) << " ms on shard " << uint64_t(_id);
+    if (_suppressed_stall_reports) {
+        msg << " (" << _suppressed_stall_reports << " earlier stalls not reported)";
+        _suppressed_stall_reports = 0;
+    }
+    msg << ", backtrace:";
+    for (int i = 0; i < nr_frames; ++i) {
+        msg << " " << static_cast<const void*>(frames[i]);
+    }
+    msg << "\n";
+    msg.write(STDERR_FILENO);
+}
+
+void reactor::arm_stall_detector() {
+    if (!_stall_threshold.count()) {
+        return;
+    }
+    _stall_ticks = 0;
+    itimerspec its;
+    its.it_value = to_timespec(steady_clock_type::time_point(_stall_detector_period));
+    its.it_interval = its.it_value;
+    auto r = timer_settime(_stall_detector_timer, 0, &its, nullptr);
+    assert(r == 0);
+}
+
+void reactor::disarm_stall_detector() {
+    if (!_stall_threshold.count()) {
+        return;
+    }
+    itimerspec its = {};
+    auto r = timer_settime(_stall_detector_timer, 0, &its, nullptr);
+    assert(r == 0);
 }
 
 template <typename T, typename E, typename EnableFunc>
@@ -312,13 +470,15 @@ void reactor::timer_thread_func() {
                 if (tmr.expired()) {
                     _timer_due = 0;
                     _engine_thread->unsafe_stop();
-                    _pending_tasks.push_front(make_task([this] {
+                    auto t = make_task([this] {
                         complete_timers(_timers, _expired_timers, [this] {
                             if (!_timers.empty()) {
                                 enable_timer(_timers.get_next_timeout());
                             }
                         });
-                    }));
+                    });
+                    _pending_tasks.push_front(t.get());
+                    t.release();
                     _engine_thread->wake();
                 } else {
                     tmr.cancel();
@@ -375,10 +535,19 @@ void reactor::configure(boost::program_options::variables_map vm) {
 
     _handle_sigint = !vm.count("no-handle-interrupt");
     _task_quota = vm["task-quota-ms"].as<double>() * 1ms;
+    _stall_threshold = std::chrono::milliseconds(vm["stall-threshold-ms"].as<unsigned>());
+    // Check a few times per threshold, so that stalls are reported soon
+    // after they cross it.
+    _stall_detector_period = std::max(_stall_threshold / 4, std::chrono::milliseconds(1));
+    if (vm.count("idle-poll-time-us")) {
+        _max_poll_time = vm["idle-poll-time-us"].as<unsigned>() * 1us;
+    }
     if (vm.count("poll-mode")) {
         _max_poll_time = std::chrono::nanoseconds::max();
     }
+    _adaptive_poll_max_delay = vm["adaptive-poll-max-delay-us"].as<unsigned>() * 1us;
     set_strict_dma(!vm.count("relaxed-dma"));
+    memory::set_heap_profiling_sample_period(vm["heap-profiling-sample-period"].as<size_t>());
 }
 
 future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
@@ -436,6 +605,12 @@ void reactor_backend_epoll::abort_writer(pollable_fd_state& fd, std::exception_p
     abort_fd(fd, std::move(ex), &pollable_fd_state::pollout, EPOLLOUT);
 }
 
+// epoll always reports EPOLLERR, but we only look at it, and keep the fd
+// registered for it, while someone waits.
+future<> reactor_backend_epoll::error_queue_readable(pollable_fd_state& fd) {
+    return get_epoll_future(fd, &pollable_fd_state::pollerr, EPOLLERR);
+}
+
 void reactor_backend_epoll::forget(pollable_fd_state& fd) {
     if (fd.events_epoll) {
         ::epoll_ctl(_epollfd.get(), EPOLL_CTL_DEL, fd.fd.get(), nullptr);
@@ -1218,6 +1393,12 @@ void reactor::del_timer(timer<steady_clock_type>* tmr) {
     }
 }
 
+void reactor::rearm_timer(timer<steady_clock_type>* tmr, steady_clock_type::time_point old_timeout) {
+    if (_timers.update(*tmr, old_timeout)) {
+        enable_timer(_timers.get_next_timeout());
+    }
+}
+
 void reactor::add_timer(timer<lowres_clock>* tmr) {
     if (queue_timer(tmr)) {
         _lowres_next_timeout = _lowres_timers.get_next_timeout();
@@ -1237,6 +1418,12 @@ void reactor::del_timer(timer<lowres_clock>* tmr) {
     }
 }
 
+void reactor::rearm_timer(timer<lowres_clock>* tmr, lowres_clock::time_point old_timeout) {
+    if (_lowres_timers.update(*tmr, old_timeout)) {
+        _lowres_next_timeout = _lowres_timers.get_next_timeout();
+    }
+}
+
 void reactor::at_exit(std::function<future<> ()> func) {
     assert(!_stopping);
     _exit_funcs.push_back(std::move(func));
@@ -1277,9 +1464,79 @@ struct reactor::collectd_registrations {
     scollectd::registrations regs;
 };
 
+// memory::detailed_stats() walks the allocator's lists, so compute it once
+// per collection round rather than once per metric.
+static const memory::detailed_statistics& detailed_memory_stats() {
+    static thread_local memory::detailed_statistics stats;
+    static thread_local lowres_clock::time_point taken;
+    auto now = lowres_clock::now();
+    if (now != taken || stats.small_pools.empty()) {
+        stats = memory::detailed_stats();
+        taken = now;
+    }
+    return stats;
+}
+
+static void register_detailed_memory_metrics(scollectd::registrations& regs) {
+    auto initial = memory::detailed_stats();
+    for (size_t i = 0; i < initial.small_pools.size(); ++i) {
+        auto size = initial.small_pools[i].object_size;
+        auto pool = [i] { return detailed_memory_stats().small_pools[i]; };
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("small_pool-%d-used", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [pool] { return pool().use_count; })));
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("small_pool-%d-free", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [pool] { return pool().free_count; })));
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("small_pool-%d-spans", size)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [pool] { return pool().spans_in_use; })));
+    }
+    regs.push_back(scollectd::add_polled_metric(
+            scollectd::type_instance_id("memory",
+                scollectd::per_cpu_plugin_instance,
+                "bytes", "small_pool_waste"),
+            scollectd::make_typed(scollectd::data_type::GAUGE, [] {
+                uint64_t waste = 0;
+                for (auto&& p : detailed_memory_stats().small_pools) {
+                    waste += p.spans_in_use * p.span_size * p.waste;
+                }
+                return waste;
+            })));
+    for (size_t i = 0; i < initial.free_spans.size(); ++i) {
+        regs.push_back(scollectd::add_polled_metric(
+                scollectd::type_instance_id("memory",
+                    scollectd::per_cpu_plugin_instance,
+                    "objects", sprint("free_spans-%d", uint64_t(1) << i)),
+                scollectd::make_typed(scollectd::data_type::GAUGE,
+                        [i] { return detailed_memory_stats().free_spans[i]; })));
+    }
+    regs.push_back(scollectd::add_polled_metric(
+            scollectd::type_instance_id("memory",
+                scollectd::per_cpu_plugin_instance,
+                "bytes", "largest_free_span"),
+            scollectd::make_typed(scollectd::data_type::GAUGE,
+                    [] { return detailed_memory_stats().largest_free_span; })));
+    regs.push_back(scollectd::add_polled_metric(
+            scollectd::type_instance_id("memory",
+                scollectd::per_cpu_plugin_instance,
+                "objects", "free_huge_pages"),
+            scollectd::make_typed(scollectd::data_type::GAUGE,
+                    [] { return detailed_memory_stats().free_huge_pages; })));
+}
+
 reactor::collectd_registrations
 reactor::register_collectd_metrics() {
-    return collectd_registrations{ {
+    auto ret = collectd_registrations{ {
             // queue_length     value:GAUGE:0:U
             // Absolute value of num tasks in queue.
             scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
@@ -1405,17 +1662,50 @@ reactor::register_collectd_metrics() {
                 scollectd::make_typed(scollectd::data_type::DERIVE,
                         [] { return memory::stats().reclaims(); })
             ),
+            // total_operations value:DERIVE:0:U
+            // Times the reactor went to sleep after idling for --idle-poll-time-us
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "sleeps")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _sleeps)
+            ),
+            // total_operations value:DERIVE:0:U
+            // Tasks (or polls) that ran for longer than the task quota
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "task-quota-violations")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _task_quota_violations)
+            ),
+            // total_operations value:DERIVE:0:U
+            // Tasks (or polls) that ran for longer than --stall-threshold-ms
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "stalls")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, _stalls)
+            ),
     } };
+    register_detailed_memory_metrics(ret.regs);
+    for (auto h : { std::make_pair(&_task_runtimes, "task-runtime"), std::make_pair(&_poll_cycles, "poll-cycle") }) {
+        auto regs = h.first->register_collectd_metrics("reactor", scollectd::per_cpu_plugin_instance, h.second);
+        std::move(regs.begin(), regs.end(), std::back_inserter(ret.regs));
+    }
+    return ret;
 }
 
-void reactor::run_tasks(circular_buffer<std::unique_ptr<task>>& tasks) {
+void reactor::run_tasks(circular_buffer<task*>& tasks) {
     _task_quota_finished = false;
     future_avail_count = 0;
     while (!tasks.empty() && !_task_quota_finished) {
-        auto tsk = std::move(tasks.front());
+        auto tsk = tasks.front();
         tasks.pop_front();
-        tsk->run();
-        tsk.reset();
+        if (__builtin_expect(_tasks_processed % task_runtime_sample_period == 0, false)) {
+            auto start = steady_clock_type::now();
+            tsk->run();
+            _task_runtimes.add(steady_clock_type::now() - start);
+        } else {
+            tsk->run();
+        }
+        delete tsk;
         ++_tasks_processed;
         std::atomic_signal_fence(std::memory_order_relaxed); // for _task_quota_finished flag
     }
@@ -1464,6 +1754,9 @@ class reactor::io_pollfn final : public reactor::pollfn {
     virtual bool poll() override {
         return _r.process_io();
     }
+    virtual const char* name() const override {
+        return "io";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // aio cannot generate events if there are no inflight aios
         return _r._io_context_available.current() == reactor::max_aio;
@@ -1482,6 +1775,9 @@ class reactor::signal_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return _r._signals.poll_signal();
     }
+    virtual const char* name() const override {
+        return "signal";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // Signals will interrupt our epoll_pwait() call, but
         // disable them now to avoid a signal between this point
@@ -1508,6 +1804,9 @@ class reactor::batch_flush_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return _r.flush_tcp_batches();
     }
+    virtual const char* name() const override {
+        return "batch-flush";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // This is a passive poller, so if a previous poll
         // returned false (idle), there's no more work to do.
@@ -1524,6 +1823,9 @@ class reactor::aio_batch_submit_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return _r.flush_pending_aio();
     }
+    virtual const char* name() const override {
+        return "aio-batch-submit";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // This is a passive poller, so if a previous poll
         // returned false (idle), there's no more work to do.
@@ -1538,12 +1840,18 @@ class reactor::drain_cross_cpu_freelist_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return memory::drain_cross_cpu_freelist();
     }
+    virtual const char* name() const override {
+        return "drain-cross-cpu-freelist";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // Other cpus can queue items for us to free; and they won't notify
         // us about them.  But it's okay to ignore those items, freeing them
         // doesn't have any side effects.
         //
         // We'll take care of those items when we wake up for another reason.
+        // Our own batched frees for other cpus are handed over now, so
+        // that they are not held while we sleep.
+        memory::drain_cross_cpu_freelist();
         return true;
     }
     virtual void exit_interrupt_mode() override final {
@@ -1562,6 +1870,9 @@ class reactor::lowres_timer_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return _r.do_expire_lowres_timers();
     }
+    virtual const char* name() const override {
+        return "lowres-timers";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // arm our highres timer so a signal will wake us up
         auto next = _r._lowres_next_timeout;
@@ -1593,6 +1904,9 @@ class reactor::smp_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return smp::poll_queues();
     }
+    virtual const char* name() const override {
+        return "smp";
+    }
     virtual bool try_enter_interrupt_mode() override {
         _r._sleeping.store(true, std::memory_order_relaxed);
         systemwide_memory_barrier();
@@ -1615,6 +1929,9 @@ class reactor::epoll_pollfn final : public reactor::pollfn {
     virtual bool poll() final override {
         return _r.wait_and_process();
     }
+    virtual const char* name() const override {
+        return "epoll";
+    }
     virtual bool try_enter_interrupt_mode() override {
         // Since we'll be sleeping in epoll, no need to do anything
         // for interrupt mode.
@@ -1715,12 +2032,28 @@ int reactor::run() {
     r = sigaction(task_quota_signal(), &sa_task_quota, nullptr);
     assert(r == 0);
 
+    if (_stall_threshold.count()) {
+        // The first call to backtrace() loads libgcc, which must not
+        // happen in a signal handler.
+        void* frame;
+        ::backtrace(&frame, 1);
+        struct sigaction sa_stall_detector = {};
+        sa_stall_detector.sa_handler = &reactor::stall_detector_tick;
+        sa_stall_detector.sa_flags = SA_RESTART;
+        r = sigaction(stall_detector_signal(), &sa_stall_detector, nullptr);
+        assert(r == 0);
+        arm_stall_detector();
+    }
+
     bool idle = false;
+    auto poll_cycle_start = steady_clock_type::now();
 
     while (true) {
         run_tasks(_pending_tasks);
         if (_stopped) {
             load_timer.cancel();
+            // Shutting down waits for the other shards, which is not a stall
+            disarm_stall_detector();
             // Final tasks may include sending the last response to cpu 0, so run them
             while (!_pending_tasks.empty()) {
                 run_tasks(_pending_tasks);
@@ -1735,7 +2068,11 @@ int reactor::run() {
             break;
         }
 
-        if (!poll_once() && _pending_tasks.empty()) {
+        ++_polls;
+        auto now = steady_clock_type::now();
+        _poll_cycles.add(now - poll_cycle_start);
+        poll_cycle_start = now;
+        if (!poll_once(now) && _pending_tasks.empty()) {
             idle_end = steady_clock_type::now();
             if (!idle) {
                 idle_start = idle_end;
@@ -1743,9 +2080,20 @@ int reactor::run() {
             }
             _mm_pause();
             if (idle_end - idle_start > _max_poll_time) {
+                // Pollers skipped by adaptive polling may have work by now,
+                // and not all of them look for it when entering interrupt
+                // mode, so poll all of them once more before sleeping.
+                if (_adaptive_poll_max_delay.count()
+                        && (poll_once(idle_end, false) || !_pending_tasks.empty())) {
+                    idle_count += (idle_end - idle_start).count();
+                    idle_start = idle_end;
+                    idle = false;
+                    continue;
+                }
                 sleep();
                 // We may have slept for a while, so freshen idle_end
                 idle_end = steady_clock_type::now();
+                poll_cycle_start = idle_end;
             }
         } else {
             if (idle) {
@@ -1760,23 +2108,28 @@ int reactor::run() {
     // the I/O queue happens to use any other infrastructure that is also kept this way (for
     // instance, collectd), we will not have any way to guarantee who is destroyed first.
     my_io_queue.reset(nullptr);
+    _poller_collectd_regs.clear();
     return _return;
 }
 
 void
 reactor::sleep() {
     for (auto i = _pollers.begin(); i != _pollers.end(); ++i) {
-        auto ok = (*i)->try_enter_interrupt_mode();
+        auto ok = i->fn->try_enter_interrupt_mode();
         if (!ok) {
             while (i != _pollers.begin()) {
-                (*--i)->exit_interrupt_mode();
+                (--i)->fn->exit_interrupt_mode();
             }
             return;
         }
     }
+    ++_sleeps;
+    // Sleeping makes no progress, but is not a stall
+    disarm_stall_detector();
     wait_and_process(-1, &_active_sigmask);
+    arm_stall_detector();
     for (auto i = _pollers.rbegin(); i != _pollers.rend(); ++i) {
-        (*i)->exit_interrupt_mode();
+        i->fn->exit_interrupt_mode();
     }
 }
 
@@ -1788,10 +2141,37 @@ reactor::start_epoll() {
 }
 
 bool
-reactor::poll_once() {
+reactor::poll_once(steady_clock_type::time_point now, bool skip_idle) {
     bool work = false;
-    for (auto c : _pollers) {
-        work |= c->poll();
+    bool adaptive = skip_idle && _adaptive_poll_max_delay.count();
+    // Reading the clock after every poller would cost as much as the cheap
+    // pollers themselves, so only some iterations are timed.
+    bool timed = _polls % poll_timing_sample_period == 0;
+    auto start = now;
+    for (auto& p : _pollers) {
+        auto& stats = *p.stats;
+        if (adaptive && p.delay.count() && now < p.next_poll) {
+            ++stats.skipped;
+            continue;
+        }
+        bool found = p.fn->poll();
+        work |= found;
+        ++stats.polls;
+        stats.work += found;
+        if (timed) {
+            auto end = steady_clock_type::now();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+            start = end;
+            stats.timed += elapsed;
+            ++stats.timed_polls;
+            p.cost = (p.cost * 7 + elapsed) / 8;
+        }
+        if (found || p.cost < expensive_poll_cost) {
+            p.delay = {};
+        } else if (adaptive) {
+            p.delay = std::min(std::max(p.delay * 2, min_adaptive_poll_delay), _adaptive_poll_max_delay);
+            p.next_poll = now + p.delay;
+        }
     }
 
     return work;
@@ -1827,15 +2207,63 @@ class reactor::poller::deregistration_task : public task {
 };
 
 void reactor::register_poller(pollfn* p) {
-    _pollers.push_back(p);
+    auto i = _poller_stats.find(p->name());
+    if (i == _poller_stats.end()) {
+        i = _poller_stats.emplace(p->name(), poller_stats()).first;
+        register_poller_metrics(i->first, i->second);
+    }
+    _pollers.push_back(registered_poller{p, &i->second});
 }
 
 void reactor::unregister_poller(pollfn* p) {
-    _pollers.erase(std::find(_pollers.begin(), _pollers.end(), p));
+    _pollers.erase(std::find_if(_pollers.begin(), _pollers.end(), [p] (const registered_poller& rp) {
+        return rp.fn == p;
+    }));
 }
 
 void reactor::replace_poller(pollfn* old, pollfn* neww) {
-    std::replace(_pollers.begin(), _pollers.end(), old, neww);
+    for (auto& rp : _pollers) {
+        if (rp.fn == old) {
+            rp.fn = neww;
+        }
+    }
+}
+
+void reactor::register_poller_metrics(const sstring& name, poller_stats& stats) {
+    auto prefix = "poller-" + name;
+    auto regs = {
+            // total_operations value:DERIVE:0:U
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", prefix + "-polls")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.polls)
+            ),
+            // total_operations value:DERIVE:0:U
+            // Polls that found work
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", prefix + "-work")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.work)
+            ),
+            // total_operations value:DERIVE:0:U
+            // Polls skipped by adaptive polling
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", prefix + "-skipped")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, stats.skipped)
+            ),
+            // Nanoseconds spent polling, estimated from sampled polls
+            scollectd::add_polled_metric(scollectd::type_instance_id("reactor"
+                    , scollectd::per_cpu_plugin_instance
+                    , "derive", prefix + "-ns")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, [&stats] {
+                        return stats.estimated_time().count();
+                    })
+            ),
+    };
+    for (auto&& id : regs) {
+        _poller_collectd_regs.emplace_back(id);
+    }
 }
 
 reactor::poller::poller(poller&& x)
@@ -1880,7 +2308,7 @@ reactor::poller::~poller() {
             // not added yet, so don't do it at all.
             _registration_task->cancel();
         } else {
-            auto dummy = make_pollfn([] { return false; });
+            auto dummy = make_pollfn("other", [] { return false; });
             auto dummy_p = dummy.get();
             auto task = std::make_unique<deregistration_task>(std::move(dummy));
             engine().add_task(std::move(task));
@@ -1900,10 +2328,11 @@ reactor_backend_epoll::wait_and_process(int timeout, const sigset_t* active_sigm
     for (int i = 0; i < nr; ++i) {
         auto& evt = eevt[i];
         auto pfd = reinterpret_cast<pollable_fd_state*>(evt.data.ptr);
-        auto events = evt.events & (EPOLLIN | EPOLLOUT);
-        auto events_to_remove = events & ~pfd->events_requested;
+        auto events = evt.events & (EPOLLIN | EPOLLOUT | EPOLLERR);
+        auto events_to_remove = events & ~pfd->events_requested & pfd->events_epoll;
         complete_epoll_event(*pfd, &pollable_fd_state::pollin, events, EPOLLIN);
         complete_epoll_event(*pfd, &pollable_fd_state::pollout, events, EPOLLOUT);
+        complete_epoll_event(*pfd, &pollable_fd_state::pollerr, events, EPOLLERR);
         if (events_to_remove) {
             pfd->events_epoll &= ~events_to_remove;
             evt.events = pfd->events_epoll;
@@ -1958,14 +2387,37 @@ void smp_message_queue::move_pending() {
 }
 
 void smp_message_queue::submit_item(smp_message_queue::work_item* item) {
+    if (!_until_latency_sample--) {
+        _until_latency_sample = latency_sample_period - 1;
+        item->submitted = steady_clock_type::now();
+    }
     _tx.a.pending_fifo.push_back(item);
-    if (_tx.a.pending_fifo.size() >= batch_size) {
+    ++_submitted_since_poll;
+    if (_tx.a.pending_fifo.size() >= _batch_size) {
         move_pending();
     }
 }
 
+// Called once per poll.  When the remote core has drained (nearly) all we
+// sent it, it is polling with nothing to do, and holding requests back to
+// form a batch only adds latency.  When it is lagging behind, new requests
+// will not be looked at before the backlog is processed anyway, so we let
+// batches grow towards the number of requests submitted per poll, which
+// saves cache line transfers and wakeup checks per request.
+void smp_message_queue::adjust_batch_size() {
+    _submit_rate = (_submit_rate * 7 + _submitted_since_poll * 16) / 8;
+    _submitted_since_poll = 0;
+    if (_current_queue_length < batching_threshold) {
+        _batch_size = 1;
+    } else {
+        _batch_size = std::max<size_t>(1, std::min(_submit_rate / 16, max_batch_size));
+    }
+}
+
 void smp_message_queue::respond(work_item* item) {
     _completed_fifo.push_back(item);
+    // answer in batches about as large as the requests arrive in
+    auto batch_size = std::max<size_t>(1, std::min(_last_rcv_batch, max_batch_size));
     if (_completed_fifo.size() >= batch_size || engine()._stopped) {
         flush_response_batch();
     }
@@ -2019,10 +2471,25 @@ size_t smp_message_queue::process_queue(lf_queue& q, Func process) {
     return nr + 1;
 }
 
+void smp_message_queue::free_item(work_item* wi) {
+    auto size = wi->size();
+    wi->~work_item();
+    _work_item_pool.free(wi, size);
+}
+
 size_t smp_message_queue::process_completions() {
-    auto nr = process_queue<prefetch_cnt*2>(_completed, [] (work_item* wi) {
+    // read the clock only for a batch that has a sampled call, so that
+    // polling an idle queue costs none
+    steady_clock_type::time_point now;
+    auto nr = process_queue<prefetch_cnt*2>(_completed, [this, &now] (work_item* wi) {
+        if (wi->submitted != steady_clock_type::time_point()) {
+            if (now == steady_clock_type::time_point()) {
+                now = steady_clock_type::now();
+            }
+            _latency.add(now - wi->submitted);
+        }
         wi->complete();
-        delete wi;
+        free_item(wi);
     });
     _current_queue_length -= nr;
     _compl += nr;
@@ -2032,6 +2499,7 @@ size_t smp_message_queue::process_completions() {
 }
 
 void smp_message_queue::flush_request_batch() {
+    adjust_batch_size();
     move_pending();
 }
 
@@ -2046,6 +2514,61 @@ size_t smp_message_queue::process_incoming() {
     return nr;
 }
 
+uint64_t latency_histogram::count() const {
+    return boost::accumulate(buckets, uint64_t(0));
+}
+
+std::chrono::nanoseconds latency_histogram::percentile(double p) const {
+    auto total = count();
+    if (!total) {
+        return std::chrono::nanoseconds(0);
+    }
+    auto target = std::max<uint64_t>(1, std::ceil(total * p / 100));
+    uint64_t seen = 0;
+    unsigned b = 0;
+    for (; b < nr_buckets - 1; ++b) {
+        seen += buckets[b];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return std::chrono::nanoseconds(uint64_t(2) << b);
+}
+
+latency_histogram latency_histogram::operator-(const latency_histogram& x) const {
+    latency_histogram ret;
+    for (unsigned b = 0; b < nr_buckets; ++b) {
+        ret.buckets[b] = buckets[b] - x.buckets[b];
+    }
+    return ret;
+}
+
+const latency_histogram& windowed_latency_histogram::window() {
+    auto now = lowres_clock::now();
+    if (now != _window_taken) {
+        _window_taken = now;
+        _window = _total - _reported;
+        _reported = _total;
+    }
+    return _window;
+}
+
+std::vector<scollectd::registration>
+windowed_latency_histogram::register_collectd_metrics(const sstring& plugin,
+        const sstring& instance, const sstring& name) {
+    std::vector<scollectd::registration> regs;
+    for (auto p : { std::make_pair("p50", 50.0), std::make_pair("p99", 99.0), std::make_pair("max", 100.0) }) {
+        // latency value:GAUGE:0:U
+        regs.push_back(scollectd::add_polled_metric(scollectd::type_instance_id(plugin
+                , instance
+                , "latency", name + "-" + p.first)
+                , scollectd::make_typed(scollectd::data_type::GAUGE, [this, percentile = p.second] {
+                    return window().percentile(percentile).count();
+                })));
+    }
+    return regs;
+}
+
 void smp_message_queue::start(unsigned cpuid) {
     _tx.init();
     char instance[10];
@@ -2091,7 +2614,14 @@ void smp_message_queue::start(unsigned cpuid) {
                     , "total_operations", "completed-messages")
             , scollectd::make_typed(scollectd::data_type::DERIVE, _compl)
             ),
+            scollectd::add_polled_metric(scollectd::type_instance_id("smp"
+                    , instance
+                    , "queue_length", "batch-size")
+            , scollectd::make_typed(scollectd::data_type::GAUGE, _batch_size)
+            ),
     });
+    auto latency_regs = _latency.register_collectd_metrics("smp", instance, "round-trip");
+    std::move(latency_regs.begin(), latency_regs.end(), std::back_inserter(_collectd_regs));
 }
 
 /* not yet implemented for OSv. TODO: do the notification like we do class smp. */
@@ -2221,8 +2751,17 @@ reactor::get_options_description() {
                         format_separated(net_stack_names.begin(), net_stack_names.end(), ", ")).c_str())
         ("no-handle-interrupt", "ignore SIGINT (for gdb)")
         ("poll-mode", "poll continuously (100% cpu use)")
+        ("idle-poll-time-us", bpo::value<unsigned>(),
+                "time to keep polling an idle reactor before going to sleep (default: 200, or 2000 when virtualized)")
+        ("adaptive-poll-max-delay-us", bpo::value<unsigned>()->default_value(0),
+                "poll expensive pollers that keep finding no work less often, delaying the work they find "
+                "by at most this many microseconds (0: poll every poller on every iteration)")
         ("task-quota-ms", bpo::value<double>()->default_value(2.0), "Max time (ms) between polls")
-        ("relaxed-dma", "allow using buffered I/O if DMA is not available (reduces performance)");
+        ("stall-threshold-ms", bpo::value<unsigned>()->default_value(200),
+                "log a backtrace when a task runs for longer than this many milliseconds (0: disabled)")
+        ("relaxed-dma", "allow using buffered I/O if DMA is not available (reduces performance)")
+        ("heap-profiling-sample-period", bpo::value<size_t>()->default_value(0),
+                "sample an allocation every this many bytes allocated, on average, for heap profiling (0: disabled)");
         ;
     opts.add(network_stack_registry::options_description());
     return opts;
@@ -2841,7 +3380,8 @@ future<connected_socket> connect(socket_address sa, socket_address local) {
 }
 
 void reactor::add_high_priority_task(std::unique_ptr<task>&& t) {
-    _pending_tasks.push_front(std::move(t));
+    _pending_tasks.push_front(t.get());
+    t.release();
     // break .then() chains
     future_avail_count = max_inlined_continuations - 1;
 }
@@ -2878,7 +3418,7 @@ void add_to_flush_poller(output_stream<char>* os) {
 }
 
 network_stack_registrator nsr_posix{"posix",
-    boost::program_options::options_description(),
+    posix_net_options(),
     [](boost::program_options::variables_map ops) {
         return smp::main_thread() ? posix_network_stack::create(ops) : posix_ap_network_stack::create(ops);
     },
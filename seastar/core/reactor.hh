@@ -45,12 +45,14 @@
 #include <chrono>
 #include <ratio>
 #include <atomic>
+#include <array>
 #include <experimental/optional>
 #include <boost/lockfree/spsc_queue.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread/barrier.hpp>
 #include <set>
+#include <map>
 #include "util/eclipse.hh"
 #include "future.hh"
 #include "posix.hh"
@@ -65,6 +67,7 @@
 #include "fair_queue.hh"
 #include "core/scattered_message.hh"
 #include "core/enum.hh"
+#include "core/bitops.hh"
 #include <boost/range/irange.hpp>
 #include "timer.hh"
 
@@ -140,6 +143,7 @@ class pollable_fd_state {
     int events_known = 0;     // returned from epoll
     promise<> pollin;
     promise<> pollout;
+    promise<> pollerr;
     friend class reactor;
     friend class pollable_fd;
 };
@@ -167,15 +171,18 @@ class pollable_fd {
     future<size_t> read_some(const std::vector<iovec>& iov);
     future<> write_all(const char* buffer, size_t size);
     future<> write_all(const uint8_t* buffer, size_t size);
-    future<size_t> write_some(net::packet& p);
+    future<size_t> write_some(net::packet& p, int flags = 0);
     future<> write_all(net::packet& p);
     future<> readable();
     future<> writeable();
+    // Resolves when the socket error queue has something to read
+    future<> error_queue_readable();
     void abort_reader(std::exception_ptr ex);
     void abort_writer(std::exception_ptr ex);
     future<pollable_fd, socket_address> accept();
     future<size_t> sendmsg(struct msghdr *msg);
     future<size_t> recvmsg(struct msghdr *msg);
+    future<size_t> recvmmsg(struct mmsghdr *msgs, size_t vlen);
     future<size_t> sendto(socket_address addr, const void* buf, size_t len);
     file_desc& get_file_desc() const { return _s->fd; }
     void shutdown(int how) { _s->fd.shutdown(how); }
@@ -300,9 +307,53 @@ class syscall_work_queue {
     friend class thread_pool;
 };
 
+/// Latencies (of cross-core calls, task runs, poll cycles) counted in
+/// power-of-two nanosecond buckets.
+struct latency_histogram {
+    static constexpr unsigned nr_buckets = 32;
+    // buckets[i] counts samples that took less than 2^(i+1) ns
+    std::array<uint64_t, nr_buckets> buckets = {};
+    void add(std::chrono::nanoseconds latency) {
+        auto ns = std::max<int64_t>(latency.count(), 1);
+        auto b = std::min<unsigned>(63 - count_leading_zeros(uint64_t(ns)), nr_buckets - 1);
+        ++buckets[b];
+    }
+    uint64_t count() const;
+    /// Returns the upper bound of the bucket holding the given percentile
+    /// (0-100) of samples, or zero if no samples were recorded.
+    std::chrono::nanoseconds percentile(double p) const;
+    latency_histogram operator-(const latency_histogram& x) const;
+};
+
+/// A latency_histogram that is also reported through collectd gauges,
+/// which show the samples recorded since they were last read.  All the
+/// gauges of one histogram are read together, so the window is cut once
+/// per lowres clock tick and shared by the gauges read in that tick.
+class windowed_latency_histogram {
+    latency_histogram _total;
+    latency_histogram _reported;
+    latency_histogram _window;
+    lowres_clock::time_point _window_taken;
+public:
+    void add(std::chrono::nanoseconds latency) {
+        _total.add(latency);
+    }
+    /// Samples recorded since startup
+    const latency_histogram& total() const { return _total; }
+    /// Samples recorded since the previous window was cut
+    const latency_histogram& window();
+    /// Registers "latency" gauges named <name>-p50, <name>-p99 and
+    /// <name>-max, in nanoseconds, that report the current window.
+    std::vector<scollectd::registration> register_collectd_metrics(const sstring& plugin,
+            const sstring& instance, const sstring& name);
+};
+
 class smp_message_queue {
     static constexpr size_t queue_length = 128;
-    static constexpr size_t batch_size = 16;
+    static constexpr size_t max_batch_size = 32;
+    // below this many unprocessed requests in the queue the remote core is
+    // considered idle, and requests are sent without batching
+    static constexpr size_t batching_threshold = 8;
     static constexpr size_t prefetch_cnt = 2;
     struct work_item;
     struct lf_queue_remote {
@@ -323,6 +374,12 @@ class smp_message_queue {
         size_t _last_snt_batch = 0;
         size_t _last_cmpl_batch = 0;
         size_t _current_queue_length = 0;
+        size_t _batch_size = 1;
+        size_t _submitted_since_poll = 0;
+        // average number of requests submitted between two polls, times 16
+        size_t _submit_rate = 0;
+        // submissions left until the next one whose latency is measured
+        unsigned _until_latency_sample = 0;
     };
     // keep this between two structures with statistics
     // this makes sure that they have at least one cache line
@@ -333,10 +390,16 @@ class smp_message_queue {
         size_t _received = 0;
         size_t _last_rcv_batch = 0;
     };
+    // Only one call in latency_sample_period is timed, to keep clock
+    // reads off the submission path
+    static constexpr unsigned latency_sample_period = 16;
     struct work_item {
+        // zero unless the call's latency is measured
+        steady_clock_type::time_point submitted;
         virtual ~work_item() {}
         virtual future<> process() = 0;
         virtual void complete() = 0;
+        virtual size_t size() const = 0;
     };
     template <typename Func>
     struct async_work_item : work_item {
@@ -371,6 +434,7 @@ class smp_message_queue {
             }
         }
         future_type get_future() { return _promise.get_future(); }
+        virtual size_t size() const override { return sizeof(*this); }
     };
     union tx_side {
         tx_side() {}
@@ -381,15 +445,25 @@ class smp_message_queue {
         } a;
     } _tx;
     std::vector<work_item*> _completed_fifo;
+    // Work items are allocated and freed on the submitting core, so they
+    // are recycled through the same kind of size-bucketed free lists as
+    // tasks, but private to the queue.
+    alignas(64) task_arena _work_item_pool;
+    // Round trip latency of a sample of the calls made with
+    // smp::submit_to(), from submission until the result is available
+    // on the calling core
+    windowed_latency_histogram _latency;
 public:
     smp_message_queue(reactor* from, reactor* to);
     template <typename Func>
     futurize_t<std::result_of_t<Func()>> submit(Func&& func) {
-        auto wi = new async_work_item<Func>(std::forward<Func>(func));
+        auto wi = new (_work_item_pool.allocate(sizeof(async_work_item<Func>)))
+                async_work_item<Func>(std::forward<Func>(func));
         auto fut = wi->get_future();
         submit_item(wi);
         return fut;
     }
+    const latency_histogram& latency() const { return _latency.total(); }
     void start(unsigned cpuid);
     template<size_t PrefetchCnt, typename Func>
     size_t process_queue(lf_queue& q, Func process);
@@ -402,6 +476,8 @@ class smp_message_queue {
     void move_pending();
     void flush_request_batch();
     void flush_response_batch();
+    void adjust_batch_size();
+    void free_item(work_item* wi);
 
     friend class smp;
 };
@@ -483,6 +559,7 @@ class reactor_backend_epoll : public reactor_backend {
     virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() override;
     void abort_reader(pollable_fd_state& fd, std::exception_ptr ex);
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex);
+    future<> error_queue_readable(pollable_fd_state& fd);
 };
 
 #ifdef HAVE_OSV
@@ -590,6 +667,9 @@ class reactor {
         // If it returns false, the sleeping idle loop may not be entered.
         virtual bool try_enter_interrupt_mode() { return false; }
         virtual void exit_interrupt_mode() {}
+        // Name under which the poller's statistics are reported.  Pollers
+        // with the same name are accounted together.
+        virtual const char* name() const { return "other"; }
     };
 
     class io_pollfn;
@@ -617,7 +697,17 @@ class reactor {
     public:
         template <typename Func> // signature: bool ()
         static poller simple(Func&& poll) {
-            return poller(make_pollfn(std::forward<Func>(poll)));
+            return poller(make_pollfn("other", std::forward<Func>(poll)));
+        }
+        template <typename Func> // signature: bool ()
+        static poller simple(const char* name, Func&& poll) {
+            return poller(make_pollfn(name, std::forward<Func>(poll)));
+        }
+        // For pollers whose work is only ever queued by tasks, like batched
+        // flushes; unlike simple() ones, they let the reactor sleep.
+        template <typename Func> // signature: bool ()
+        static poller passive(const char* name, Func&& poll) {
+            return poller(make_pollfn(name, std::forward<Func>(poll), true));
         }
         poller(std::unique_ptr<pollfn> fn)
                 : _pollfn(std::move(fn)) {
@@ -643,7 +733,38 @@ class reactor {
     reactor_backend_epoll _backend;
 #endif
     sigset_t _active_sigmask; // holds sigmask while sleeping with sig disabled
-    std::vector<pollfn*> _pollers;
+    // Invocations of all pollers with the same name
+    struct poller_stats {
+        uint64_t polls = 0;
+        // polls that found work
+        uint64_t work = 0;
+        // polls skipped by adaptive polling
+        uint64_t skipped = 0;
+        // Only some iterations of poll_once() are timed; the time spent in
+        // all polls is estimated from those.
+        uint64_t timed_polls = 0;
+        std::chrono::nanoseconds timed = {};
+        std::chrono::nanoseconds estimated_time() const {
+            return timed_polls ? std::chrono::nanoseconds(int64_t(double(timed.count()) * polls / timed_polls)) : timed;
+        }
+    };
+    struct registered_poller {
+        pollfn* fn;
+        poller_stats* stats;
+        // average cost of a poll, from the timed iterations
+        std::chrono::nanoseconds cost = {};
+        // With adaptive polling, an expensive poller that found no work is
+        // skipped until next_poll, and the delay doubles for every poll that
+        // still finds none.
+        std::chrono::nanoseconds delay = {};
+        steady_clock_type::time_point next_poll;
+    };
+    std::vector<registered_poller> _pollers;
+    std::map<sstring, poller_stats> _poller_stats;
+    std::vector<scollectd::registration> _poller_collectd_regs;
+    // zero: poll every poller on every iteration
+    std::chrono::nanoseconds _adaptive_poll_max_delay = {};
+    uint64_t _sleeps = 0;
 
     static constexpr size_t max_aio = 128;
     // Not all reactors have IO queues. If the number of IO queues is less than the number of shards,
@@ -667,13 +788,18 @@ class reactor {
     int _return = 0;
     timer_t _steady_clock_timer = {};
     timer_t _task_quota_timer = {};
+    timer_t _stall_detector_timer = {};
     promise<> _start_promise;
     semaphore _cpu_started;
     uint64_t _tasks_processed = 0;
+    // iterations of the main loop
+    uint64_t _polls = 0;
     seastar::timer_set<timer<>, &timer<>::_link> _timers;
     seastar::timer_set<timer<>, &timer<>::_link>::timer_list_t _expired_timers;
-    seastar::timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link> _lowres_timers;
-    seastar::timer_set<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
+    // There can be millions of lowres timers (a few per TCP connection), most
+    // of which are cancelled or rearmed before they expire.
+    seastar::timer_wheel<timer<lowres_clock>, &timer<lowres_clock>::_link> _lowres_timers;
+    seastar::timer_wheel<timer<lowres_clock>, &timer<lowres_clock>::_link>::timer_list_t _expired_lowres_timers;
     io_context_t _io_context;
     std::vector<struct ::iocb> _pending_aio;
     semaphore _io_context_available;
@@ -682,10 +808,35 @@ class reactor {
     uint64_t _aio_writes = 0;
     uint64_t _aio_write_bytes = 0;
     uint64_t _fsyncs = 0;
-    circular_buffer<std::unique_ptr<task>> _pending_tasks;
-    circular_buffer<std::unique_ptr<task>> _at_destroy_tasks;
+    // Tasks are owned by the queue, but held by plain pointer so that
+    // running one does not pay for moving and resetting a unique_ptr.
+    circular_buffer<task*> _pending_tasks;
+    circular_buffer<task*> _at_destroy_tasks;
     std::chrono::duration<double> _task_quota;
     sig_atomic_t _task_quota_finished;
+    // The task quota signal (every _task_quota of cpu time) and the stall
+    // detector signal (every _stall_detector_period of wall time) both
+    // compare _tasks_processed + _polls with what they saw the last time,
+    // to tell that the reactor has been stuck in a single task or poll
+    // since.  They interrupt the reactor thread itself, so no atomics are
+    // needed.
+    uint64_t _quota_progress = 0;
+    bool _quota_violation_counted = false;
+    uint64_t _task_quota_violations = 0;
+    std::chrono::milliseconds _stall_threshold;
+    std::chrono::milliseconds _stall_detector_period;
+    uint64_t _stall_progress = 0;
+    unsigned _stall_ticks = 0;
+    bool _stall_reported = false;
+    uint64_t _stalls = 0;
+    uint64_t _suppressed_stall_reports = 0;
+    steady_clock_type::time_point _next_stall_report;
+    // Reading the clock around every task would cost about as much as
+    // running a short one, so only one in task_runtime_sample_period
+    // tasks is timed.
+    static constexpr unsigned task_runtime_sample_period = 64;
+    windowed_latency_histogram _task_runtimes;
+    windowed_latency_histogram _poll_cycles;
     std::unique_ptr<network_stack> _network_stack;
     // _lowres_clock will only be created on cpu 0
     std::unique_ptr<lowres_clock> _lowres_clock;
@@ -702,6 +853,11 @@ class reactor {
 private:
     static std::chrono::nanoseconds calculate_poll_time();
     static void clear_task_quota(int);
+    static void stall_detector_tick(int);
+    void check_for_stall();
+    void report_stall(std::chrono::milliseconds stalled);
+    void arm_stall_detector();
+    void disarm_stall_detector();
     void wakeup();
     bool flush_pending_aio();
     bool flush_tcp_batches();
@@ -716,9 +872,15 @@ class reactor {
      * @return FALSE if at least one of the blockers requires a non-blocking
      *         execution.
      */
-    bool poll_once();
+    bool poll_once(steady_clock_type::time_point now, bool skip_idle = true);
+    static constexpr unsigned poll_timing_sample_period = 64;
+    // Pollers that cost less than this are cheap enough to poll on every
+    // iteration, with or without adaptive polling.
+    static constexpr std::chrono::nanoseconds expensive_poll_cost = std::chrono::nanoseconds(500);
+    static constexpr std::chrono::nanoseconds min_adaptive_poll_delay = std::chrono::microseconds(1);
+    void register_poller_metrics(const sstring& name, poller_stats& stats);
     template <typename Func> // signature: bool ()
-    static std::unique_ptr<pollfn> make_pollfn(Func&& func);
+    static std::unique_ptr<pollfn> make_pollfn(const char* name, Func&& func, bool passive = false);
 
     class signals {
     public:
@@ -743,7 +905,7 @@ class reactor {
     thread_pool _thread_pool;
     friend thread_pool;
 
-    void run_tasks(circular_buffer<std::unique_ptr<task>>& tasks);
+    void run_tasks(circular_buffer<task*>& tasks);
     bool posix_reuseport_detect();
 public:
     static boost::program_options::options_description get_options_description();
@@ -812,16 +974,24 @@ class reactor {
 
     template <typename Func>
     void at_destroy(Func&& func) {
-        _at_destroy_tasks.push_back(make_task(std::forward<Func>(func)));
+        auto t = make_task(std::forward<Func>(func));
+        _at_destroy_tasks.push_back(t.get());
+        t.release();
     }
 
-    void add_task(std::unique_ptr<task>&& t) { _pending_tasks.push_back(std::move(t)); }
+    // Released only once queued, so that it is freed if queueing throws
+    void add_task(std::unique_ptr<task>&& t) {
+        _pending_tasks.push_back(t.get());
+        t.release();
+    }
     void force_poll();
 
     void add_high_priority_task(std::unique_ptr<task>&&);
 
     network_stack& net() { return *_network_stack; }
     shard_id cpu_id() const { return _id; }
+    // Number of times a task or poll ran for longer than --stall-threshold-ms
+    uint64_t stalls() const { return _stalls; }
 
     void start_epoll();
     void sleep();
@@ -851,9 +1021,11 @@ class reactor {
     void add_timer(timer<steady_clock_type>*);
     bool queue_timer(timer<steady_clock_type>*);
     void del_timer(timer<steady_clock_type>*);
+    void rearm_timer(timer<steady_clock_type>*, steady_clock_type::time_point old_timeout);
     void add_timer(timer<lowres_clock>*);
     bool queue_timer(timer<lowres_clock>*);
     void del_timer(timer<lowres_clock>*);
+    void rearm_timer(timer<lowres_clock>*, lowres_clock::time_point old_timeout);
 
     future<> run_exit_tasks();
     void stop();
@@ -888,6 +1060,9 @@ class reactor {
     void abort_reader(pollable_fd_state& fd, std::exception_ptr ex) {
         return _backend.abort_reader(fd, std::move(ex));
     }
+    future<> error_queue_readable(pollable_fd_state& fd) {
+        return _backend.error_queue_readable(fd);
+    }
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex) {
         return _backend.abort_writer(fd, std::move(ex));
     }
@@ -912,15 +1087,24 @@ class reactor {
 template <typename Func> // signature: bool ()
 inline
 std::unique_ptr<reactor::pollfn>
-reactor::make_pollfn(Func&& func) {
+reactor::make_pollfn(const char* name, Func&& func, bool passive) {
     struct the_pollfn : pollfn {
-        the_pollfn(Func&& func) : func(std::forward<Func>(func)) {}
+        the_pollfn(const char* name, Func&& func, bool passive) : name_(name), func(std::forward<Func>(func)), passive_(passive) {}
+        const char* name_;
         Func func;
+        bool passive_;
         virtual bool poll() override {
             return func();
         }
+        virtual const char* name() const override {
+            return name_;
+        }
+        virtual bool try_enter_interrupt_mode() override {
+            // A passive poller that was idle has nothing to wake up for
+            return passive_;
+        }
     };
-    return std::make_unique<the_pollfn>(std::forward<Func>(func));
+    return std::make_unique<the_pollfn>(name, std::forward<Func>(func), passive);
 }
 
 extern __thread reactor* local_engine;
@@ -1002,6 +1186,11 @@ class smp {
         }
         return got != 0;
     }
+    /// Returns the round trip latency histogram of calls made from the
+    /// local core to core \c t since startup; one call in 16 is measured.
+    static const latency_histogram& latency(unsigned t) {
+        return _qs[t][engine().cpu_id()].latency();
+    }
     static boost::integer_range<unsigned> all_cpus() {
         return boost::irange(0u, count);
     }
@@ -1146,8 +1335,8 @@ future<> pollable_fd::write_all(const uint8_t* buffer, size_t size) {
 }
 
 inline
-future<size_t> pollable_fd::write_some(net::packet& p) {
-    return engine().writeable(*_s).then([this, &p] () mutable {
+future<size_t> pollable_fd::write_some(net::packet& p, int flags) {
+    return engine().writeable(*_s).then([this, &p, flags] () mutable {
         static_assert(offsetof(iovec, iov_base) == offsetof(net::fragment, base) &&
             sizeof(iovec::iov_base) == sizeof(net::fragment::base) &&
             offsetof(iovec, iov_len) == offsetof(net::fragment, size) &&
@@ -1160,9 +1349,9 @@ future<size_t> pollable_fd::write_some(net::packet& p) {
         msghdr mh = {};
         mh.msg_iov = iov;
         mh.msg_iovlen = p.nr_frags();
-        auto r = get_file_desc().sendmsg(&mh, MSG_NOSIGNAL);
+        auto r = get_file_desc().sendmsg(&mh, MSG_NOSIGNAL | flags);
         if (!r) {
-            return write_some(p);
+            return write_some(p, flags);
         }
         if (size_t(*r) == p.len()) {
             _s->speculate_epoll(EPOLLOUT);
@@ -1192,6 +1381,11 @@ future<> pollable_fd::writeable() {
     return engine().writeable(*_s);
 }
 
+inline
+future<> pollable_fd::error_queue_readable() {
+    return engine().error_queue_readable(*_s);
+}
+
 inline
 void
 pollable_fd::abort_reader(std::exception_ptr ex) {
@@ -1228,6 +1422,23 @@ future<size_t> pollable_fd::recvmsg(struct msghdr *msg) {
     });
 };
 
+// Returns the number of messages received, at least one.
+inline
+future<size_t> pollable_fd::recvmmsg(struct mmsghdr *msgs, size_t vlen) {
+    return engine().readable(*_s).then([this, msgs, vlen] {
+        auto r = get_file_desc().recvmmsg(msgs, vlen, 0);
+        if (!r) {
+            return recvmmsg(msgs, vlen);
+        }
+        // Unlike with recvmsg(), we know whether the queue was drained:
+        // only a full batch means more messages may be waiting.
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLIN);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
 inline
 future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
     return engine().writeable(*_s).then([this, msg] () mutable {
@@ -1300,6 +1511,15 @@ void timer<Clock>::arm(time_point until, std::experimental::optional<duration> p
 template <typename Clock>
 inline
 void timer<Clock>::rearm(time_point until, std::experimental::optional<duration> period) {
+    if (_armed && _queued && !_expired) {
+        // Still in the active set; moving it can be cheaper than removing
+        // and adding it again.
+        auto old_timeout = _expiry;
+        _period = period;
+        _expiry = until;
+        engine().rearm_timer(this, old_timeout);
+        return;
+    }
     if (_armed) {
         cancel();
     }
@@ -22,11 +22,112 @@
 #pragma once
 
 #include <memory>
+#include <new>
+#include <cstddef>
+
+// Per-thread cache of task objects (mostly future continuations), bucketed
+// by size.  A continuation is allocated and freed for almost every
+// non-ready .then(), so recycling them avoids a round trip through the
+// general purpose allocator on the hot path.  A task may be freed on
+// another thread than the one that allocated it (on OSv, the timer thread
+// creates tasks for the reactor); this is safe, since the cache only holds
+// memory obtained from ::operator new.  The cache is freed when its thread
+// exits.
+class task_arena {
+public:
+    static constexpr size_t granularity = 16;
+    static constexpr size_t max_object_size = 512;
+    static constexpr unsigned max_free_objects = 256;
+private:
+    static constexpr size_t nr_buckets = max_object_size / granularity;
+    struct free_object {
+        free_object* next;
+    };
+    free_object* _free[nr_buckets] = {};
+    unsigned _nr_free[nr_buckets] = {};
+private:
+    static size_t bucket_of(size_t size) {
+        return (size - 1) / granularity;
+    }
+    // Set once the thread's arena is destroyed, after which tasks
+    // destroyed by other thread-local destructors bypass it
+    static bool& exited() {
+        static thread_local bool e = false;
+        return e;
+    }
+public:
+    ~task_arena() {
+        for (auto& obj : _free) {
+            while (obj) {
+                auto next = obj->next;
+                ::operator delete(obj);
+                obj = next;
+            }
+        }
+        exited() = true;
+    }
+    void* allocate(size_t size) {
+        if (size > max_object_size) {
+            return ::operator new(size);
+        }
+        auto b = bucket_of(size);
+        auto obj = _free[b];
+        if (obj) {
+            _free[b] = obj->next;
+            --_nr_free[b];
+            return obj;
+        }
+        // round up, so that the object can be reused by anything in its bucket
+        return ::operator new((b + 1) * granularity);
+    }
+    void free(void* ptr, size_t size) noexcept {
+        if (size > max_object_size) {
+            ::operator delete(ptr);
+            return;
+        }
+        auto b = bucket_of(size);
+        if (_nr_free[b] == max_free_objects) {
+            ::operator delete(ptr);
+            return;
+        }
+        auto obj = static_cast<free_object*>(ptr);
+        obj->next = _free[b];
+        _free[b] = obj;
+        ++_nr_free[b];
+    }
+    static void* allocate_local(size_t size) {
+        if (exited()) {
+            return ::operator new(size);
+        }
+        return local().allocate(size);
+    }
+    static void free_local(void* ptr, size_t size) noexcept {
+        if (exited()) {
+            ::operator delete(ptr);
+            return;
+        }
+        local().free(ptr, size);
+    }
+    static task_arena& local() {
+        static thread_local task_arena arena;
+        return arena;
+    }
+};
 
 class task {
 public:
     virtual ~task() noexcept {}
     virtual void run() noexcept = 0;
+#ifndef DEBUG
+    // Tasks are always destroyed through the virtual destructor, so the
+    // size passed to operator delete is that of the most derived type.
+    static void* operator new(size_t size) {
+        return task_arena::allocate_local(size);
+    }
+    static void operator delete(void* ptr, size_t size) noexcept {
+        task_arena::free_local(ptr, size);
+    }
+#endif
 };
 
 void schedule(std::unique_ptr<task> t);
@@ -22,8 +22,11 @@
 
 #include "thread.hh"
 #include "posix.hh"
+#include "align.hh"
 #include <ucontext.h>
 #include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /// \cond internal
 
@@ -32,20 +35,147 @@ namespace seastar {
 thread_local jmp_buf_link g_unthreaded_context;
 thread_local jmp_buf_link* g_current_context;
 
+namespace {
+
+// Thread stacks are mapped directly rather than taken from the seastar
+// allocator: the pages are faulted in only when the thread touches them,
+// and an inaccessible guard page below the stack turns an overflow into a
+// crash instead of silent corruption of a neighbouring allocation.
+//
+// Unmapping a stack and mapping a new one costs a TLB shootdown and fresh
+// page faults, so freed stacks are cached per shard and handed out again
+// as-is (without zeroing).  The cache keeps an intrusive list of free
+// stacks for each of the few distinct sizes in use, linked through the top
+// of each stack, so returning a stack never allocates.
+class stack_cache {
+    static constexpr unsigned max_sizes = 8;
+    static constexpr size_t max_cached_bytes = 16 << 20;
+    struct free_stack {
+        free_stack* next;
+    };
+    struct size_class {
+        size_t size;
+        free_stack* free;
+    };
+    size_class _classes[max_sizes] = {};
+    size_t _cached_bytes = 0;
+private:
+    static size_t page_size() {
+        static const size_t size = ::sysconf(_SC_PAGESIZE);
+        return size;
+    }
+    size_class* find_class(size_t size) {
+        for (auto& c : _classes) {
+            if (c.size == size) {
+                return &c;
+            }
+        }
+        return nullptr;
+    }
+    static free_stack* link_of(char* stack, size_t size) {
+        return reinterpret_cast<free_stack*>(stack + size - sizeof(free_stack));
+    }
+    static char* stack_of(free_stack* link, size_t size) {
+        return reinterpret_cast<char*>(link + 1) - size;
+    }
+    static void unmap(char* stack, size_t size) noexcept {
+        ::munmap(stack - page_size(), size + page_size());
+    }
+    // Set once the thread's cache is destroyed, after which stacks freed
+    // by other thread-local destructors are unmapped directly
+    static bool& exited() {
+        static thread_local bool e = false;
+        return e;
+    }
+public:
+    ~stack_cache() {
+        for (auto& c : _classes) {
+            while (c.free) {
+                auto link = c.free;
+                c.free = link->next;
+                unmap(stack_of(link, c.size), c.size);
+            }
+        }
+        exited() = true;
+    }
+    static size_t round_up(size_t size) {
+        return align_up(size, page_size());
+    }
+    char* get(size_t size) {
+        auto c = find_class(size);
+        if (c && c->free) {
+            auto link = c->free;
+            c->free = link->next;
+            _cached_bytes -= size;
+            return stack_of(link, size);
+        }
+        if (!c) {
+            // claim a slot so that the stack can be cached when it is freed
+            c = find_class(0);
+            if (c) {
+                c->size = size;
+            }
+        }
+        auto guard = page_size();
+        auto area = ::mmap(nullptr, size + guard, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        throw_system_error_on(area == MAP_FAILED, "mmap");
+        auto stack = static_cast<char*>(area) + guard;
+        auto r = ::mprotect(area, guard, PROT_NONE);
+        if (r == -1) {
+            auto err = errno;
+            unmap(stack, size);
+            throw std::system_error(err, std::system_category(), "mprotect");
+        }
+        return stack;
+    }
+    void put(char* stack, size_t size) noexcept {
+        if (exited()) {
+            unmap(stack, size);
+            return;
+        }
+        auto c = find_class(size);
+#ifdef ASAN_ENABLED
+        // A recycled stack carries the previous thread's frames, which
+        // ASAN would report; always start from fresh zeroed pages.
+        c = nullptr;
+#endif
+        if (!c || _cached_bytes + size > max_cached_bytes) {
+            unmap(stack, size);
+            return;
+        }
+        auto link = link_of(stack, size);
+        link->next = c->free;
+        c->free = link;
+        _cached_bytes += size;
+    }
+};
+
+thread_local stack_cache local_stack_cache;
+
+}
+
 thread_context::thread_context(thread_attributes attr, std::function<void ()> func)
         : _attr(std::move(attr))
+        , _stack_size(stack_size_for(_attr))
+        , _stack(make_stack(_stack_size))
         , _func(std::move(func)) {
     setup();
 }
 
-std::unique_ptr<char[]>
-thread_context::make_stack() {
-    auto stack = std::make_unique<char[]>(_stack_size);
-#ifdef ASAN_ENABLED
-    // Avoid ASAN false positive due to garbage on stack
-    std::fill_n(stack.get(), _stack_size, 0);
-#endif
-    return stack;
+size_t
+thread_context::stack_size_for(const thread_attributes& attr) {
+    return stack_cache::round_up(attr.stack_size ? attr.stack_size : default_stack_size);
+}
+
+thread_context::stack_holder
+thread_context::make_stack(size_t size) {
+    return stack_holder(local_stack_cache.get(size), stack_deleter{size});
+}
+
+void
+thread_context::stack_deleter::operator()(char* stack) const noexcept {
+    local_stack_cache.put(stack, size);
 }
 
 void
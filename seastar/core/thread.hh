@@ -85,6 +85,9 @@ class thread_context;
 class thread_attributes {
 public:
     thread_scheduling_group* scheduling_group = nullptr;
+    /// Size of the thread's stack, in bytes, rounded up to a whole number
+    /// of pages.  Zero selects the default (128kB).
+    size_t stack_size = 0;
 };
 
 namespace thread_impl {
@@ -112,9 +115,16 @@ extern thread_local jmp_buf_link g_unthreaded_context;
 // \c thread itself because \c thread is movable, and we want pointers
 // to this state to be captured.
 class thread_context {
+    // Returns a stack to the per-shard stack cache
+    struct stack_deleter {
+        size_t size;
+        void operator()(char* stack) const noexcept;
+    };
+    using stack_holder = std::unique_ptr<char[], stack_deleter>;
+    static constexpr size_t default_stack_size = 128*1024;
     thread_attributes _attr;
-    static constexpr size_t _stack_size = 128*1024;
-    std::unique_ptr<char[]> _stack{make_stack()};
+    size_t _stack_size;
+    stack_holder _stack;
     std::function<void ()> _func;
     jmp_buf_link _context;
     promise<> _done;
@@ -125,7 +135,8 @@ class thread_context {
     static void s_main(unsigned int lo, unsigned int hi);
     void setup();
     void main();
-    static std::unique_ptr<char[]> make_stack();
+    static size_t stack_size_for(const thread_attributes& attr);
+    static stack_holder make_stack(size_t size);
 public:
     thread_context(thread_attributes attr, std::function<void ()> func);
     void switch_in();
@@ -156,6 +156,23 @@ class timer_set {
         }
     }
 
+    /**
+     * Moves a timer in the active set whose timeout was changed from
+     * old_timeout to timer.get_timeout().
+     *
+     * Returns the same as insert() would.
+     */
+    bool update(Timer& timer, time_point old_timeout)
+    {
+        auto index = get_index(get_timestamp(old_timeout));
+        auto& list = _buckets[index];
+        list.erase(list.iterator_to(timer));
+        if (list.empty()) {
+            _non_empty_buckets[index] = false;
+        }
+        return insert(timer);
+    }
+
     /**
      * Expires active timers.
      *
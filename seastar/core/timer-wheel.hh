@@ -0,0 +1,399 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include <chrono>
+#include <limits>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <boost/intrusive/list.hpp>
+#include "bitset-iter.hh"
+
+namespace seastar {
+
+namespace bi = boost::intrusive;
+
+/**
+ * A hierarchical timing wheel with the same interface as timer_set.
+ *
+ * The wheel has one level for every 8 bits of the timestamp, each with
+ * 256 slots.  A timer whose timestamp first differs from the time of the
+ * last expire() call in bit group L lives at level L, in the slot given
+ * by its own bits in that group, so the position of a timer is a function
+ * of its timestamp and is found in constant time on insertion and removal.
+ *
+ * expire() moves whole slots that became due to the expired list, and
+ * only walks the single slot that the new time falls into, moving its
+ * timers to lower levels.  Each timer is moved at most once per level
+ * over its lifetime, and timers that are cancelled or rearmed before they
+ * get close to expiry (TCP retransmit and delayed ack timers, cache item
+ * expiry) are never walked at all.  Unlike timer_set, expiring does not
+ * re-sort large lists, so its cost does not grow with the number of
+ * pending timers.
+ *
+ * The template type "Timer" should have a method named
+ * get_timeout() which returns Timer::time_point which denotes
+ * timer's expiration.
+ */
+template<typename Timer, bi::list_member_hook<> Timer::*link>
+class timer_wheel {
+public:
+    using time_point = typename Timer::time_point;
+    using timer_list_t = bi::list<Timer, bi::member_hook<Timer, bi::list_member_hook<>, link>>;
+private:
+    using duration = typename Timer::duration;
+    using timestamp_t = typename Timer::duration::rep;
+    static_assert(sizeof(timestamp_t) == sizeof(uint64_t), "timer_wheel requires 64-bit timestamps");
+
+    static constexpr timestamp_t max_timestamp = std::numeric_limits<timestamp_t>::max();
+    static constexpr unsigned timestamp_bits = std::numeric_limits<uint64_t>::digits;
+    // With millisecond timestamps, level 1 slots span 256ms and level 2
+    // slots about a minute, so the timers redistributed at once when a
+    // slot is entered are a small fraction of those pending for the next
+    // few seconds.
+    static constexpr unsigned slot_bits = 8;
+    static constexpr unsigned n_slots = 1u << slot_bits;
+    static constexpr unsigned n_levels = (timestamp_bits + slot_bits - 1) / slot_bits;
+    static constexpr unsigned n_words = n_slots / 64;
+
+    struct level {
+        std::array<timer_list_t, n_slots> slots;
+        std::array<uint64_t, n_words> non_empty = {};
+        bool empty() const {
+            for (auto w : non_empty) {
+                if (w) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        bool occupied(unsigned slot) const {
+            return non_empty[slot / 64] & (uint64_t(1) << (slot % 64));
+        }
+        unsigned first_occupied() const {
+            for (unsigned w = 0; w < n_words; ++w) {
+                if (non_empty[w]) {
+                    return w * 64 + bitsets::count_trailing_zeros(non_empty[w]);
+                }
+            }
+            return n_slots;
+        }
+    };
+
+    std::array<level, n_levels> _levels;
+    // timers with timeout <= _last, which are due on the next expire()
+    timer_list_t _overdue;
+    uint32_t _non_empty_levels = 0;
+    timestamp_t _last = 0;
+    timestamp_t _next = max_timestamp;
+    size_t _size = 0;
+private:
+    static timestamp_t get_timestamp(time_point _time_point)
+    {
+        return _time_point.time_since_epoch().count();
+    }
+
+    static timestamp_t get_timestamp(Timer& timer)
+    {
+        return get_timestamp(timer.get_timeout());
+    }
+
+    static unsigned slot_of(timestamp_t timestamp, unsigned lvl)
+    {
+        return (uint64_t(timestamp) >> (lvl * slot_bits)) & (n_slots - 1);
+    }
+
+    // Only valid for timestamp > _last
+    unsigned level_of(timestamp_t timestamp) const
+    {
+        auto diff = uint64_t(timestamp) ^ uint64_t(_last);
+        return (timestamp_bits - 1 - bitsets::count_leading_zeros(diff)) / slot_bits;
+    }
+
+    timer_list_t& list_of(timestamp_t timestamp, unsigned& lvl, unsigned& slot)
+    {
+        if (timestamp <= _last) {
+            lvl = n_levels;
+            return _overdue;
+        }
+        lvl = level_of(timestamp);
+        slot = slot_of(timestamp, lvl);
+        return _levels[lvl].slots[slot];
+    }
+
+    void place(Timer& timer, timestamp_t timestamp)
+    {
+        unsigned lvl, slot;
+        auto& list = list_of(timestamp, lvl, slot);
+        list.push_back(timer);
+        if (lvl < n_levels) {
+            _levels[lvl].non_empty[slot / 64] |= uint64_t(1) << (slot % 64);
+            _non_empty_levels |= 1u << lvl;
+        }
+    }
+
+    void unplace(Timer& timer, timestamp_t timestamp)
+    {
+        unsigned lvl, slot;
+        auto& list = list_of(timestamp, lvl, slot);
+        list.erase(list.iterator_to(timer));
+        if (lvl < n_levels && list.empty()) {
+            mark_empty(lvl, slot);
+        }
+    }
+
+    void mark_empty(unsigned lvl, unsigned slot)
+    {
+        auto& l = _levels[lvl];
+        l.non_empty[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+        if (l.empty()) {
+            _non_empty_levels &= ~(1u << lvl);
+        }
+    }
+
+    // Moves the slots [0, end) of a level to the expired list
+    void expire_slots(unsigned lvl, unsigned end, timer_list_t& exp)
+    {
+        auto& l = _levels[lvl];
+        for (unsigned w = 0; w * 64 < end; ++w) {
+            auto mask = l.non_empty[w];
+            if (end < (w + 1) * 64) {
+                mask &= (uint64_t(1) << (end % 64)) - 1;
+            }
+            while (mask) {
+                auto slot = w * 64 + bitsets::count_trailing_zeros(mask);
+                mask &= mask - 1;
+                exp.splice(exp.end(), l.slots[slot]);
+                l.non_empty[w] &= ~(uint64_t(1) << (slot % 64));
+            }
+        }
+        if (l.empty()) {
+            _non_empty_levels &= ~(1u << lvl);
+        }
+    }
+
+    // Earliest time at which a timer can be due.  Exact for timers at the
+    // lowest level; for higher levels, the start of the earliest occupied
+    // slot, which is where that slot is redistributed to lower levels.
+    timestamp_t first_slot_start() const
+    {
+        if (!_non_empty_levels) {
+            return max_timestamp;
+        }
+        auto lvl = bitsets::count_trailing_zeros((unsigned long)_non_empty_levels);
+        auto slot = _levels[lvl].first_occupied();
+        auto above = (lvl + 1) * slot_bits;
+        uint64_t high = above < timestamp_bits ? (uint64_t(_last) >> above) << above : 0;
+        return timestamp_t(high | (uint64_t(slot) << (lvl * slot_bits)));
+    }
+public:
+    timer_wheel() = default;
+    timer_wheel(const timer_wheel&) = delete;
+
+    ~timer_wheel() {
+        auto cancel_all = [] (timer_list_t& list) {
+            while (!list.empty()) {
+                auto& timer = *list.begin();
+                timer.cancel();
+            }
+        };
+        cancel_all(_overdue);
+        for (auto&& l : _levels) {
+            for (auto&& list : l.slots) {
+                cancel_all(list);
+            }
+        }
+    }
+
+    /**
+     * Adds timer to the active set.
+     *
+     * The value returned by timer.get_timeout() is used as timer's expiry. The result
+     * of timer.get_timeout() must not change while the timer is in the active set,
+     * except through update().
+     *
+     * Preconditions:
+     *  - this timer must not be currently in the active set or in the expired set.
+     *
+     * Returns true if and only if this timer's timeout is less than get_next_timeout().
+     * When this function returns true the caller should reschedule expire() to be
+     * called at timer.get_timeout() to ensure timers are expired in a timely manner.
+     */
+    bool insert(Timer& timer)
+    {
+        auto timestamp = get_timestamp(timer);
+        place(timer, timestamp);
+        ++_size;
+        if (timestamp < _next) {
+            _next = timestamp;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Removes timer from the active set.
+     *
+     * Preconditions:
+     *  - timer must be currently in the active set. Note: it must not be in
+     *    the expired set.
+     */
+    void remove(Timer& timer)
+    {
+        unplace(timer, get_timestamp(timer));
+        --_size;
+    }
+
+    /**
+     * Moves a timer in the active set whose timeout was changed from
+     * old_timeout to timer.get_timeout().  When both timeouts map to the
+     * same slot, the timer is not touched at all.
+     *
+     * Returns the same as insert() would.
+     */
+    bool update(Timer& timer, time_point old_timeout)
+    {
+        auto old_timestamp = get_timestamp(old_timeout);
+        auto timestamp = get_timestamp(timer);
+        unsigned old_lvl, old_slot, lvl, slot;
+        auto& old_list = list_of(old_timestamp, old_lvl, old_slot);
+        auto& list = list_of(timestamp, lvl, slot);
+        if (&old_list != &list) {
+            unplace(timer, old_timestamp);
+            place(timer, timestamp);
+        }
+        if (timestamp < _next) {
+            _next = timestamp;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Expires active timers.
+     *
+     * Preconditions:
+     *  - the time_point passed to this function must not be lesser than
+     *    the previous one passed to this function.
+     *
+     * Postconditons:
+     *  - all timers from the active set with Timer::get_timeout() <= now are moved
+     *    to the expired set.
+     */
+    timer_list_t expire(time_point now)
+    {
+        timer_list_t exp;
+        auto timestamp = get_timestamp(now);
+
+        if (timestamp < _last) {
+            abort();
+        }
+
+        exp.splice(exp.end(), _overdue);
+        if (timestamp != _last) {
+            // Timers at levels below the highest bit group in which now
+            // differs from _last, and in the slots of that level before
+            // now's, are all due.  Timers in higher levels and slots keep
+            // their place.
+            auto top = level_of(timestamp);
+            auto below = (unsigned long)(_non_empty_levels & ((1u << top) - 1));
+            while (below) {
+                auto lvl = bitsets::count_trailing_zeros(below);
+                below &= below - 1;
+                expire_slots(lvl, n_slots, exp);
+            }
+            auto slot = slot_of(timestamp, top);
+            expire_slots(top, slot, exp);
+            _last = timestamp;
+
+            // The slot now falls into holds timers that are due, and timers
+            // that now belong to a lower level.
+            auto& l = _levels[top];
+            if (l.occupied(slot)) {
+                timer_list_t cascade;
+                cascade.splice(cascade.end(), l.slots[slot]);
+                mark_empty(top, slot);
+                while (!cascade.empty()) {
+                    auto& timer = *cascade.begin();
+                    cascade.pop_front();
+                    auto t = get_timestamp(timer);
+                    if (t <= timestamp) {
+                        exp.push_back(timer);
+                    } else {
+                        place(timer, t);
+                    }
+                }
+            }
+        }
+
+        _size -= exp.size();
+        _next = first_slot_start();
+        return exp;
+    }
+
+    /**
+     * Returns a time point at which expire() should be called
+     * in order to ensure timers are expired in a timely manner.
+     *
+     * Returned values are monotonically increasing.
+     */
+    time_point get_next_timeout() const
+    {
+        return time_point(duration(std::max(_last, _next)));
+    }
+
+    /**
+     * Clears both active and expired timer sets.
+     */
+    void clear()
+    {
+        _overdue.clear();
+        for (auto&& l : _levels) {
+            for (auto&& list : l.slots) {
+                list.clear();
+            }
+            l.non_empty = {};
+        }
+        _non_empty_levels = 0;
+        _size = 0;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    /**
+     * Returns true if and only if there are no timers in the active set.
+     */
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    time_point now() {
+        return Timer::clock::now();
+    }
+};
+
+}
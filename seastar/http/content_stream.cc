@@ -0,0 +1,299 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "content_stream.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include "net/packet.hh"
+
+namespace httpd {
+
+using unconsumed_remainder = input_stream<char>::unconsumed_remainder;
+
+// Hands out at most _remaining bytes from the connection stream, leaving
+// anything past the end of the body (a pipelined request) in place.
+class content_length_source_impl : public data_source_impl {
+    input_stream<char>& _in;
+    size_t _remaining;
+    temporary_buffer<char> _out;
+public:
+    content_length_source_impl(input_stream<char>& in, size_t length)
+        : _in(in), _remaining(length) {
+    }
+    future<unconsumed_remainder> operator()(temporary_buffer<char> data) {
+        if (data.empty()) {
+            return make_exception_future<unconsumed_remainder>(
+                    bad_body_exception("connection closed before end of body"));
+        }
+        auto n = std::min(_remaining, data.size());
+        _out = data.share(0, n);
+        data.trim_front(n);
+        _remaining -= n;
+        return make_ready_future<unconsumed_remainder>(std::move(data));
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        if (!_remaining) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        return _in.consume(*this).then([this] {
+            return std::move(_out);
+        });
+    }
+};
+
+// Decodes a chunked body (RFC 7230, section 4.1) one input character at
+// a time, except for chunk data, which is shared with the input buffer.
+class chunked_source_impl : public data_source_impl {
+    enum class state {
+        size,
+        extension,
+        size_lf,
+        data,
+        data_cr,
+        data_lf,
+        trailer_start,
+        trailer,
+        trailer_lf,
+        last_lf,
+        done,
+    };
+    input_stream<char>& _in;
+    state _state = state::size;
+    size_t _chunk_size = 0;
+    bool _have_size = false;
+    temporary_buffer<char> _out;
+private:
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+    static future<unconsumed_remainder> bad_chunk(const char* what) {
+        return make_exception_future<unconsumed_remainder>(bad_body_exception(what));
+    }
+public:
+    explicit chunked_source_impl(input_stream<char>& in) : _in(in) {}
+    future<unconsumed_remainder> operator()(temporary_buffer<char> data) {
+        if (data.empty()) {
+            return bad_chunk("connection closed before end of chunked body");
+        }
+        while (!data.empty()) {
+            if (_state == state::data) {
+                auto n = std::min(_chunk_size, data.size());
+                _out = data.share(0, n);
+                data.trim_front(n);
+                _chunk_size -= n;
+                if (!_chunk_size) {
+                    _state = state::data_cr;
+                }
+                return make_ready_future<unconsumed_remainder>(std::move(data));
+            }
+            char c = data[0];
+            data.trim_front(1);
+            switch (_state) {
+            case state::size: {
+                auto v = hex_value(c);
+                if (v >= 0) {
+                    if (_chunk_size > (std::numeric_limits<size_t>::max() >> 4)) {
+                        return bad_chunk("chunk size too large");
+                    }
+                    _chunk_size = _chunk_size * 16 + v;
+                    _have_size = true;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    _state = state::extension;
+                } else if (c == '\r') {
+                    _state = state::size_lf;
+                } else {
+                    return bad_chunk("bad chunk size");
+                }
+                break;
+            }
+            case state::extension:
+                if (c == '\r') {
+                    _state = state::size_lf;
+                }
+                break;
+            case state::size_lf:
+                if (c != '\n' || !_have_size) {
+                    return bad_chunk("bad chunk header");
+                }
+                _have_size = false;
+                _state = _chunk_size ? state::data : state::trailer_start;
+                break;
+            case state::data_cr:
+                if (c != '\r') {
+                    return bad_chunk("missing CRLF after chunk data");
+                }
+                _state = state::data_lf;
+                break;
+            case state::data_lf:
+                if (c != '\n') {
+                    return bad_chunk("missing CRLF after chunk data");
+                }
+                _state = state::size;
+                break;
+            case state::trailer_start:
+                _state = c == '\r' ? state::last_lf : state::trailer;
+                break;
+            case state::trailer:
+                if (c == '\r') {
+                    _state = state::trailer_lf;
+                }
+                break;
+            case state::trailer_lf:
+                if (c != '\n') {
+                    return bad_chunk("bad chunked body trailer");
+                }
+                _state = state::trailer_start;
+                break;
+            case state::last_lf:
+                if (c != '\n') {
+                    return bad_chunk("bad end of chunked body");
+                }
+                _state = state::done;
+                return make_ready_future<unconsumed_remainder>(std::move(data));
+            case state::data:
+            case state::done:
+                abort();
+            }
+        }
+        return make_ready_future<unconsumed_remainder>();
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        if (_state == state::done) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        return _in.consume(*this).then([this] {
+            // An empty buffer is only returned once the last chunk was seen
+            return std::move(_out);
+        });
+    }
+};
+
+class chunked_sink_impl : public data_sink_impl {
+    output_stream<char>& _out;
+public:
+    explicit chunked_sink_impl(output_stream<char>& out) : _out(out) {}
+    virtual future<> put(net::packet data) override {
+        if (!data.len()) {
+            return make_ready_future<>();
+        }
+        auto header = sprint("%x\r\n", data.len());
+        return _out.write(header).then([this, data = std::move(data)] () mutable {
+            return do_with(std::move(data), [this] (net::packet& data) {
+                return do_for_each(data.fragments().begin(), data.fragments().end(), [this] (net::fragment f) {
+                    return _out.write(f.base, f.size);
+                });
+            });
+        }).then([this] {
+            return _out.write("\r\n", 2);
+        });
+    }
+    virtual future<> flush() override {
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        return _out.write("0\r\n\r\n", 5).then([this] {
+            return _out.flush();
+        });
+    }
+};
+
+class identity_sink_impl : public data_sink_impl {
+    output_stream<char>& _out;
+public:
+    explicit identity_sink_impl(output_stream<char>& out) : _out(out) {}
+    virtual future<> put(net::packet data) override {
+        return do_with(std::move(data), [this] (net::packet& data) {
+            return do_for_each(data.fragments().begin(), data.fragments().end(), [this] (net::fragment f) {
+                return _out.write(f.base, f.size);
+            });
+        });
+    }
+    virtual future<> flush() override {
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        return _out.flush();
+    }
+};
+
+input_stream<char> make_content_length_input_stream(input_stream<char>& in, size_t length) {
+    return input_stream<char>(data_source(std::make_unique<content_length_source_impl>(in, length)));
+}
+
+input_stream<char> make_chunked_input_stream(input_stream<char>& in) {
+    return input_stream<char>(data_source(std::make_unique<chunked_source_impl>(in)));
+}
+
+output_stream<char> make_chunked_output_stream(output_stream<char>& out, size_t buffer_size) {
+    return output_stream<char>(data_sink(std::make_unique<chunked_sink_impl>(out)), buffer_size);
+}
+
+output_stream<char> make_identity_output_stream(output_stream<char>& out, size_t buffer_size) {
+    return output_stream<char>(data_sink(std::make_unique<identity_sink_impl>(out)), buffer_size);
+}
+
+future<> skip_all(input_stream<char>& in) {
+    return repeat([&in] {
+        return in.read().then([] (temporary_buffer<char> buf) {
+            return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+        });
+    });
+}
+
+// The buffers are kept until the end of the stream and copied once, as
+// appending each to the string would copy what was read so far again.
+future<sstring> read_all(input_stream<char>& in, size_t max_size) {
+    struct content {
+        std::vector<temporary_buffer<char>> buffers;
+        size_t size = 0;
+    };
+    return do_with(content(), [&in, max_size] (content& c) {
+        return repeat([&in, &c, max_size] {
+            return in.read().then([&c, max_size] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return stop_iteration::yes;
+                }
+                if (buf.size() > max_size - c.size) {
+                    throw body_too_large_exception();
+                }
+                c.size += buf.size();
+                c.buffers.push_back(std::move(buf));
+                return stop_iteration::no;
+            });
+        }).then([&c] {
+            sstring ret(sstring::initialized_later(), c.size);
+            auto out = ret.begin();
+            for (auto&& buf : c.buffers) {
+                out = std::copy(buf.begin(), buf.end(), out);
+            }
+            return ret;
+        });
+    });
+}
+
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+#include <limits>
+
+namespace httpd {
+
+//
+// Streams used to carry request and reply bodies over an http connection.
+//
+// The body streams do not own the connection's streams; they read from
+// (or write to) them directly, so that backpressure from the handler
+// reaches the TCP connection.  Closing a body stream never closes the
+// underlying connection stream.
+//
+
+/// Thrown when the client sends a malformed chunked body, or the
+/// connection ends before the body is complete.
+class bad_body_exception : public std::exception {
+    sstring _msg;
+public:
+    explicit bad_body_exception(sstring msg) : _msg(std::move(msg)) {}
+    virtual const char* what() const noexcept override {
+        return _msg.c_str();
+    }
+};
+
+/// Thrown by read_all() when the body is longer than it may be.
+class body_too_large_exception : public std::exception {
+public:
+    virtual const char* what() const noexcept override {
+        return "body too large";
+    }
+};
+
+/// Returns a stream that reads exactly \c length bytes from \c in and
+/// then reports end of stream.
+input_stream<char> make_content_length_input_stream(input_stream<char>& in, size_t length);
+
+/// Returns a stream that decodes a "Transfer-Encoding: chunked" body read
+/// from \c in.  Chunk extensions and trailers are consumed and ignored.
+input_stream<char> make_chunked_input_stream(input_stream<char>& in);
+
+/// Returns a stream that writes a "Transfer-Encoding: chunked" body to
+/// \c out.  Every buffer the stream hands down becomes a single chunk;
+/// closing the stream writes the last chunk and flushes \c out, but does
+/// not close it.
+output_stream<char> make_chunked_output_stream(output_stream<char>& out, size_t buffer_size = 8192);
+
+/// Returns a stream that writes its data to \c out unmodified (used for
+/// HTTP/1.0 clients, where the end of the body is the end of the
+/// connection).  Closing it flushes, but does not close, \c out.
+output_stream<char> make_identity_output_stream(output_stream<char>& out, size_t buffer_size = 8192);
+
+/// Reads \c in until end of stream, discarding the data.
+future<> skip_all(input_stream<char>& in);
+
+/// Reads \c in until end of stream and returns the data as an sstring.
+/// Fails with body_too_large_exception once more than \c max_size bytes
+/// were read.
+future<sstring> read_all(input_stream<char>& in, size_t max_size = std::numeric_limits<size_t>::max());
+
+}
@@ -24,6 +24,7 @@
 
 #include "http/request_parser.hh"
 #include "http/request.hh"
+#include "http/content_stream.hh"
 #include "core/reactor.hh"
 #include "core/sstring.hh"
 #include <experimental/string_view>
@@ -68,6 +69,8 @@ class http_server {
     sstring _date = http_date();
     timer<> _date_format_timer { [this] {_date = http_date();} };
     bool _stopping = false;
+    bool _content_streaming = false;
+    size_t _content_length_limit = std::numeric_limits<size_t>::max();
     promise<> _all_connections_stopped;
     future<> _stopped = _all_connections_stopped.get_future();
 private:
@@ -82,6 +85,22 @@ class http_server {
     http_server() {
         _date_format_timer.arm_periodic(1s);
     }
+    /**
+     * When enabled, request bodies are not read into request::content
+     * before the handler is called; handlers read them from
+     * request::content_stream instead.
+     */
+    void set_content_streaming(bool enable) {
+        _content_streaming = enable;
+    }
+    /**
+     * Request bodies longer than this are refused with 413 Payload Too
+     * Large, rather than read into request::content.  Does not apply with
+     * content streaming, where handlers decide how much they read.
+     */
+    void set_content_length_limit(size_t limit) {
+        _content_length_limit = limit;
+    }
     future<> listen(ipv4_addr addr) {
         listen_options lo;
         lo.reuse_address = true;
@@ -137,6 +156,8 @@ class http_server {
         http_request_parser _parser;
         std::unique_ptr<request> _req;
         std::unique_ptr<reply> _resp;
+        // body of the request being handled, reads from _read_buf
+        input_stream<char> _req_body;
         // null element marks eof
         queue<std::unique_ptr<reply>> _replies { 10 };bool _done = false;
     public:
@@ -185,16 +206,102 @@ class http_server {
                 }
                 ++_server._requests_served;
                 std::unique_ptr<httpd::request> req = _parser.get_parsed_request();
+                auto version = req->_version;
+                if (!set_body_stream(*req)) {
+                    return respond_error(version, reply::status_type::bad_request);
+                }
 
-                return _replies.not_full().then([req = std::move(req), this] () mutable {
-                    return generate_reply(std::move(req));
-                }).then([this](bool done) {
-                    _done = done;
+                return read_content(std::move(req)).then_wrapped([this, version] (future<std::unique_ptr<httpd::request>> f) {
+                    std::unique_ptr<httpd::request> req;
+                    try {
+                        req = f.get0();
+                    } catch (body_too_large_exception& e) {
+                        return respond_error(version, reply::status_type::payload_too_large);
+                    }
+                    return _replies.not_full().then([req = std::move(req), this] () mutable {
+                        return generate_reply(std::move(req));
+                    }).then([this](bool done) {
+                        // The next request starts after whatever the handler left unread
+                        return skip_all(_req_body).then([this, done] {
+                            _done = done;
+                        });
+                    });
                 });
             });
         }
+        /**
+         * Parses a Content-Length value: digits only, and no more than
+         * fit a size_t.  The parser already dropped leading whitespace.
+         */
+        static bool parse_content_length(const sstring& value, size_t& length) {
+            auto end = value.size();
+            while (end && (value[end - 1] == ' ' || value[end - 1] == '\t')) {
+                --end;
+            }
+            if (!end) {
+                return false;
+            }
+            size_t v = 0;
+            for (size_t i = 0; i < end; ++i) {
+                auto c = value[i];
+                if (c < '0' || c > '9') {
+                    return false;
+                }
+                size_t digit = c - '0';
+                if (v > (std::numeric_limits<size_t>::max() - digit) / 10) {
+                    return false;
+                }
+                v = v * 10 + digit;
+            }
+            length = v;
+            return true;
+        }
+        // Sets _req_body to the body of req; false if we cannot tell its length
+        bool set_body_stream(request& req) {
+            auto te = req.get_header("Transfer-Encoding");
+            if (te.find("chunked") != sstring::npos) {
+                _req_body = make_chunked_input_stream(_read_buf);
+                return true;
+            }
+            auto length = req.get_header("Content-Length");
+            if (!length.empty() && !parse_content_length(length, req.content_length)) {
+                return false;
+            }
+            _req_body = make_content_length_input_stream(_read_buf, req.content_length);
+            return true;
+        }
+        // Answers a request whose body we do not read.  We cannot tell
+        // where the next request starts, so the connection is closed.
+        future<> respond_error(const sstring& version, reply::status_type status) {
+            _done = true;
+            auto resp = std::make_unique<reply>();
+            resp->set_status(status).set_version(version).done();
+            resp->_headers["Connection"] = "close";
+            return _replies.not_full().then([this, resp = std::move(resp)] () mutable {
+                _replies.push(std::move(resp));
+            });
+        }
+        future<std::unique_ptr<request>> read_content(std::unique_ptr<request> req) {
+            if (_server._content_streaming) {
+                req->content_stream = &_req_body;
+                return make_ready_future<std::unique_ptr<request>>(std::move(req));
+            }
+            if (req->content_length > _server._content_length_limit) {
+                return make_exception_future<std::unique_ptr<request>>(body_too_large_exception());
+            }
+            return read_all(_req_body, _server._content_length_limit).then([req = std::move(req)] (sstring content) mutable {
+                req->content = std::move(content);
+                return std::move(req);
+            });
+        }
         future<> respond() {
-            return do_response_loop().finally([this] {
+            return do_response_loop().then_wrapped([this] (future<> f) {
+                if (f.failed()) {
+                    // A reply was cut short, stop reading requests we cannot answer
+                    _fd.shutdown_input();
+                }
+                return std::move(f);
+            }).finally([this] {
                 return _write_buf.close();
             });
         }
@@ -214,8 +321,12 @@ class http_server {
         future<> start_response() {
             _resp->_headers["Server"] = "Seastar httpd";
             _resp->_headers["Date"] = _server._date;
-            _resp->_headers["Content-Length"] = to_sstring(
-                    _resp->_content.size());
+            if (!_resp->_body_writer) {
+                _resp->_headers["Content-Length"] = to_sstring(
+                        _resp->_content.size());
+            } else if (_resp->_version == "1.1") {
+                _resp->_headers["Transfer-Encoding"] = "chunked";
+            }
             return _write_buf.write(_resp->_response_line.begin(),
                     _resp->_response_line.size()).then([this] {
                 return write_reply_headers(_resp->_headers.begin());
@@ -361,13 +472,27 @@ class http_server {
             sstring version = req->_version;
             return _server._routes.handle(url, std::move(req), std::move(resp)).
             // Caller guarantees enough room
-            then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) {
+            then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) mutable {
+                if (rep->_body_writer && version != "1.1") {
+                    // Without chunked encoding, closing the connection ends the body
+                    rep->_headers.erase("Connection");
+                    should_close = true;
+                }
                 rep->set_version(version).done();
                 this->_replies.push(std::move(rep));
                 return make_ready_future<bool>(should_close);
             });
         }
         future<> write_body() {
+            if (_resp->_body_writer) {
+                auto out = _resp->_version == "1.1" ? make_chunked_output_stream(_write_buf)
+                        : make_identity_output_stream(_write_buf);
+                return do_with(std::move(out), [this] (output_stream<char>& out) {
+                    return _resp->_body_writer(out).then([&out] {
+                        return out.close();
+                    });
+                });
+            }
             return _write_buf.write(_resp->_content.begin(),
                     _resp->_content.size());
         }
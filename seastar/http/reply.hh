@@ -32,7 +32,9 @@
 #pragma once
 
 #include "core/sstring.hh"
+#include "core/iostream.hh"
 #include <unordered_map>
+#include <functional>
 #include "http/mime_types.hh"
 
 namespace httpd {
@@ -40,6 +42,7 @@ namespace httpd {
  * A reply to be sent to a client.
  */
 struct reply {
+    using body_writer_type = std::function<future<>(output_stream<char>& out)>;
     /**
      * The status of the reply.
      */
@@ -56,6 +59,7 @@ struct reply {
         unauthorized = 401, //!< unauthorized
         forbidden = 403, //!< forbidden
         not_found = 404, //!< not_found
+        payload_too_large = 413, //!< payload_too_large
         internal_server_error = 500, //!< internal_server_error
         not_implemented = 501, //!< not_implemented
         bad_gateway = 502, //!< bad_gateway
@@ -73,6 +77,11 @@ struct reply {
      */
     sstring _content;
 
+    /**
+     * When set, the body is produced by this function instead of _content.
+     */
+    body_writer_type _body_writer;
+
     sstring _response_line;
     reply()
             : _status(status_type::ok) {
@@ -115,6 +124,21 @@ struct reply {
         return *this;
     }
 
+    /**
+     * Produce the body with a function instead of holding it in memory.
+     * The body is sent with chunked transfer encoding (HTTP/1.0 clients get
+     * the raw body, followed by the connection being closed), and writes
+     * wait for the connection to drain.  The writer should not close the
+     * stream; the server does that once the returned future resolves.
+     * @param content_type the extension of the content type, e.g. "json"
+     * @param body_writer writes the body to the given stream
+     */
+    reply& write_body(const sstring& content_type, body_writer_type body_writer) {
+        set_content_type(content_type);
+        _body_writer = std::move(body_writer);
+        return *this;
+    }
+
     reply& done(const sstring& content_type) {
         return set_content_type(content_type).done();
     }
@@ -32,6 +32,7 @@
 #define HTTP_REQUEST_HPP
 
 #include "core/sstring.hh"
+#include "core/iostream.hh"
 #include <string>
 #include <vector>
 #include <strings.h>
@@ -61,6 +62,14 @@ struct request {
     connection* connection_ptr;
     parameters param;
     sstring content;
+    /**
+     * When the server streams request bodies (see
+     * http_server::set_content_streaming()), the body is not read into
+     * content; instead it can be read from this stream, which is valid
+     * until the future returned by the handler resolves.  Whatever the
+     * handler leaves unread is discarded.
+     */
+    input_stream<char>* content_stream = nullptr;
     sstring protocol_name;
 
     /**
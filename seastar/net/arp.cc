@@ -20,9 +20,48 @@
  */
 
 #include "arp.hh"
+#include <map>
+#include <cassert>
+#include <mutex>
 
 namespace net {
 
+neighbor_group::neighbor_group(unsigned home)
+    : _home(home)
+    , _members(new std::atomic<arp_for_protocol*>[smp::count]) {
+    for (unsigned i = 0; i < smp::count; ++i) {
+        _members[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+// Only taken when a network stack starts or stops on a shard
+static std::mutex neighbor_groups_lock;
+
+std::shared_ptr<neighbor_group>
+neighbor_group::join(ethernet_address link, uint16_t proto_num, arp_for_protocol* member) {
+    static std::map<std::pair<std::array<uint8_t, 6>, uint16_t>, std::weak_ptr<neighbor_group>> groups;
+    std::lock_guard<std::mutex> g(neighbor_groups_lock);
+    auto& weak = groups[std::make_pair(link.mac, proto_num)];
+    auto group = weak.lock();
+    if (!group) {
+        group = std::make_shared<neighbor_group>(engine().cpu_id());
+        weak = group;
+    }
+    group->_members[engine().cpu_id()].store(member, std::memory_order_release);
+    return group;
+}
+
+void neighbor_group::leave() {
+    auto cpu = engine().cpu_id();
+    if (cpu == _home) {
+        // The others would forward their requests to a shard that drops them
+        for (unsigned i = 0; i < smp::count; ++i) {
+            assert(i == cpu || !member(i));
+        }
+    }
+    _members[cpu].store(nullptr, std::memory_order_release);
+}
+
 arp_for_protocol::arp_for_protocol(arp& a, uint16_t proto_num)
     : _arp(a), _proto_num(proto_num) {
     _arp.add(proto_num, this);
@@ -28,7 +28,11 @@
 #include "byteorder.hh"
 #include "ethernet.hh"
 #include "core/print.hh"
+#include "core/future-util.hh"
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <atomic>
 
 namespace net {
 
@@ -48,6 +52,28 @@ class arp_for_protocol {
     virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) { return false; }
 };
 
+// The arp_for instances of all shards for one protocol on one link, which
+// share a neighbor cache.  The first instance to join is the home shard:
+// it owns the authoritative copy of the cache and resolves addresses for
+// all of them, so that each neighbor is queried once per node rather than
+// once per shard.  Other instances must leave before the home one does,
+// which leave() checks.
+class neighbor_group {
+    unsigned _home;
+    std::unique_ptr<std::atomic<arp_for_protocol*>[]> _members;
+public:
+    explicit neighbor_group(unsigned home);
+    // Called on the member's cpu
+    static std::shared_ptr<neighbor_group> join(ethernet_address link, uint16_t proto_num, arp_for_protocol* member);
+    void leave();
+    unsigned home() const {
+        return _home;
+    }
+    arp_for_protocol* member(unsigned cpu) const {
+        return _members[cpu].load(std::memory_order_acquire);
+    }
+};
+
 class arp {
     interface* _netif;
     l3_protocol _proto;
@@ -81,7 +107,19 @@ class arp_for : public arp_for_protocol {
     using l2addr = ethernet_address;
     using l3addr = typename L3::address_type;
 private:
+    using clock_type = lowres_clock;
     static constexpr auto max_waiters = 512;
+    // How long an entry is used without being confirmed
+    static constexpr std::chrono::seconds reachable_time{60};
+    // Lookups after this ask for the entry to be confirmed, so that
+    // entries in use are refreshed before they expire
+    static constexpr std::chrono::seconds refresh_time{45};
+    static constexpr std::chrono::seconds query_period{1};
+    static constexpr unsigned max_queries = 3;
+    // Waiters give up once the home shard has sent its last query, and
+    // the neighbor has had a query period to answer it
+    static constexpr std::chrono::seconds resolution_timeout{query_period * max_queries};
+    static constexpr std::chrono::milliseconds resolution_check_period{250};
     enum oper {
         op_request = 1,
         op_reply = 2,
@@ -102,31 +140,77 @@ class arp_for : public arp_for_protocol {
             a(htype, ptype, oper, sender_hwaddr, sender_paddr, target_hwaddr, target_paddr);
         }
     };
+    struct neighbor {
+        l2addr l2;
+        clock_type::time_point refresh;
+        clock_type::time_point expiry;
+    };
+    using neighbor_table = std::unordered_map<l3addr, neighbor>;
+    // Entries added or changed, and removed ones, without a value
+    using neighbor_delta = std::vector<std::pair<l3addr, std::experimental::optional<neighbor>>>;
     struct resolution {
         std::vector<promise<l2addr>> _waiters;
-        timer<> _timeout_timer;
+        clock_type::time_point _deadline;
+    };
+    // State of the home shard
+    struct home_state {
+        neighbor_table table;
+        // entries changed since they were last published
+        std::unordered_set<l3addr> changed;
+        // addresses being queried, with the number of queries left
+        std::unordered_map<l3addr, unsigned> queries;
+        // entries being confirmed
+        std::unordered_set<l3addr> probes;
+        timer<lowres_clock> query_timer;
+        bool publish_scheduled = false;
     };
 private:
     l3addr _l3self = L3::broadcast_address();
-    std::unordered_map<l3addr, l2addr> _table;
+    std::shared_ptr<neighbor_group> _group;
+    // This shard's copy of the cache.  Only changed on this shard, by the
+    // updates the home shard sends, so lookups need no synchronization.
+    neighbor_table _table;
     std::unordered_map<l3addr, resolution> _in_progress;
+    timer<lowres_clock> _resolution_timer;
+    // Sent to the home shard since _table was last replaced
+    std::unordered_map<l3addr, l2addr> _learn_sent;
+    std::unordered_set<l3addr> _refresh_sent;
+    std::unique_ptr<home_state> _home;
+    // Cleared on destruction, for the deferred publish()
+    lw_shared_ptr<bool> _alive = make_lw_shared<bool>(true);
 private:
     packet make_query_packet(l3addr paddr);
     virtual future<> received(packet p) override;
     future<> handle_request(arp_hdr* ah);
     l2addr l2self() { return _arp.l2self(); }
     void send(l2addr to, packet p);
+    template <typename Func>
+    void on_home(Func func);
+    home_state& home();
+    void home_learn(l2addr l2, l3addr l3);
+    void home_resolve(l3addr l3, unsigned cpu);
+    void home_refresh(l3addr l3);
+    void home_check_queries();
+    void schedule_publish();
+    void publish();
+    void send_update(unsigned cpu, std::shared_ptr<const neighbor_delta> delta);
+    void update(const neighbor_delta& delta);
+    void check_resolutions();
 public:
     future<> send_query(const l3addr& paddr);
-    explicit arp_for(arp& a) : arp_for_protocol(a, L3::arp_protocol_type()) {
-        _table[L3::broadcast_address()] = ethernet::broadcast_address();
+    explicit arp_for(arp& a)
+        : arp_for_protocol(a, L3::arp_protocol_type())
+        , _resolution_timer([this] { check_resolutions(); }) {
+        _group = neighbor_group::join(l2self(), L3::arp_protocol_type(), this);
+    }
+    ~arp_for() {
+        *_alive = false;
+        _group->leave();
     }
     future<ethernet_address> lookup(const l3addr& addr);
     void learn(l2addr l2, l3addr l3);
     void run();
     void set_self_addr(l3addr addr) {
-        _table.erase(_l3self);
-        _table[addr] = l2self();
         _l3self = addr;
     }
     friend class arp;
@@ -176,28 +260,44 @@ class arp_queue_full_error : public arp_error {
     arp_queue_full_error() : arp_error("ARP waiter's queue is full") {}
 };
 
+template <typename L3>
+constexpr std::chrono::seconds arp_for<L3>::reachable_time;
+template <typename L3>
+constexpr std::chrono::seconds arp_for<L3>::refresh_time;
+template <typename L3>
+constexpr std::chrono::seconds arp_for<L3>::resolution_timeout;
+template <typename L3>
+constexpr std::chrono::milliseconds arp_for<L3>::resolution_check_period;
+template <typename L3>
+constexpr std::chrono::seconds arp_for<L3>::query_period;
+
 template <typename L3>
 future<ethernet_address>
 arp_for<L3>::lookup(const l3addr& paddr) {
+    if (paddr == L3::broadcast_address()) {
+        return make_ready_future<ethernet_address>(ethernet::broadcast_address());
+    }
+    if (paddr == _l3self) {
+        return make_ready_future<ethernet_address>(l2self());
+    }
+    auto now = clock_type::now();
     auto i = _table.find(paddr);
-    if (i != _table.end()) {
-        return make_ready_future<ethernet_address>(i->second);
+    if (i != _table.end() && now < i->second.expiry) {
+        if (now >= i->second.refresh && _refresh_sent.insert(paddr).second) {
+            on_home([paddr] (arp_for& home) { home.home_refresh(paddr); });
+        }
+        return make_ready_future<ethernet_address>(i->second.l2);
     }
     auto j = _in_progress.find(paddr);
-    auto first_request = j == _in_progress.end();
-    auto& res = first_request ? _in_progress[paddr] : j->second;
-
-    if (first_request) {
-        res._timeout_timer.set_callback([paddr, this, &res] {
-            send_query(paddr);
-            for (auto& w : res._waiters) {
-                w.set_exception(arp_timeout_error());
-            }
-            res._waiters.clear();
-        });
-        res._timeout_timer.arm_periodic(std::chrono::seconds(1));
-        send_query(paddr);
+    if (j == _in_progress.end()) {
+        j = _in_progress.emplace(paddr, resolution()).first;
+        j->second._deadline = now + resolution_timeout;
+        if (!_resolution_timer.armed()) {
+            _resolution_timer.arm_periodic(resolution_check_period);
+        }
+        on_home([paddr, cpu = engine().cpu_id()] (arp_for& home) { home.home_resolve(paddr, cpu); });
     }
+    auto& res = j->second;
 
     if (res._waiters.size() >= max_waiters) {
         return make_exception_future<ethernet_address>(arp_queue_full_error());
@@ -210,15 +310,238 @@ arp_for<L3>::lookup(const l3addr& paddr) {
 template <typename L3>
 void
 arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
-    _table[paddr] = hwaddr;
-    auto i = _in_progress.find(paddr);
-    if (i != _in_progress.end()) {
-        auto& res = i->second;
-        res._timeout_timer.cancel();
-        for (auto &&pr : res._waiters) {
-            pr.set_value(hwaddr);
+    if (paddr == _l3self || paddr == L3::broadcast_address()) {
+        return;
+    }
+    // Called for every packet received from a neighbor, so only changes,
+    // and confirmations of entries due for one, go to the home shard
+    auto i = _table.find(paddr);
+    if (i != _table.end() && i->second.l2 == hwaddr && clock_type::now() < i->second.refresh) {
+        return;
+    }
+    auto j = _learn_sent.find(paddr);
+    if (j != _learn_sent.end() && j->second == hwaddr) {
+        return;
+    }
+    _learn_sent[paddr] = hwaddr;
+    on_home([hwaddr, paddr] (arp_for& home) { home.home_learn(hwaddr, paddr); });
+}
+
+template <typename L3>
+template <typename Func>
+void
+arp_for<L3>::on_home(Func func) {
+    auto home = _group->home();
+    if (home == engine().cpu_id()) {
+        func(*this);
+        return;
+    }
+    smp::submit_to(home, [group = _group, func = std::move(func)] () mutable {
+        auto member = group->member(engine().cpu_id());
+        if (member) {
+            func(static_cast<arp_for&>(*member));
         }
-        _in_progress.erase(i);
+    });
+}
+
+template <typename L3>
+typename arp_for<L3>::home_state&
+arp_for<L3>::home() {
+    if (!_home) {
+        _home = std::make_unique<home_state>();
+        _home->query_timer.set_callback([this] { home_check_queries(); });
+    }
+    return *_home;
+}
+
+template <typename L3>
+void
+arp_for<L3>::home_learn(l2addr l2, l3addr l3) {
+    auto& h = home();
+    auto now = clock_type::now();
+    h.table[l3] = neighbor{l2, now + refresh_time, now + reachable_time};
+    h.changed.insert(l3);
+    h.queries.erase(l3);
+    h.probes.erase(l3);
+    if (!h.query_timer.armed()) {
+        h.query_timer.arm_periodic(query_period);
+    }
+    schedule_publish();
+}
+
+template <typename L3>
+void
+arp_for<L3>::home_resolve(l3addr l3, unsigned cpu) {
+    auto& h = home();
+    auto i = h.table.find(l3);
+    if (i != h.table.end() && clock_type::now() < i->second.expiry) {
+        // The shard asking missed it, or will get it with the next
+        // update; send it now
+        send_update(cpu, std::make_shared<const neighbor_delta>(neighbor_delta{{l3, i->second}}));
+        return;
+    }
+    if (!h.queries.emplace(l3, max_queries - 1).second) {
+        return;
+    }
+    send_query(l3);
+    if (!h.query_timer.armed()) {
+        h.query_timer.arm_periodic(query_period);
+    }
+}
+
+template <typename L3>
+void
+arp_for<L3>::home_refresh(l3addr l3) {
+    auto& h = home();
+    auto i = h.table.find(l3);
+    if (i == h.table.end() || !h.probes.insert(l3).second) {
+        return;
+    }
+    // Ask the neighbor directly; its reply refreshes the entry
+    send(i->second.l2, make_query_packet(l3));
+}
+
+// Runs on the home shard while addresses are queried or the cache is not
+// empty: repeats unanswered queries, and drops expired entries.
+template <typename L3>
+void
+arp_for<L3>::home_check_queries() {
+    auto& h = *_home;
+    for (auto i = h.queries.begin(); i != h.queries.end();) {
+        if (i->second) {
+            --i->second;
+            send_query(i->first);
+            ++i;
+        } else {
+            i = h.queries.erase(i);
+        }
+    }
+    auto now = clock_type::now();
+    bool changed = false;
+    for (auto i = h.table.begin(); i != h.table.end();) {
+        if (now >= i->second.expiry) {
+            h.probes.erase(i->first);
+            h.changed.insert(i->first);
+            i = h.table.erase(i);
+            changed = true;
+        } else {
+            ++i;
+        }
+    }
+    if (changed) {
+        schedule_publish();
+    }
+    if (h.queries.empty() && h.table.empty()) {
+        h.query_timer.cancel();
+    }
+}
+
+// Changes made while handling a burst of replies are published together,
+// once the home shard has nothing else to do.  Only the changed entries
+// are sent, so the cost does not grow with the size of the cache.
+template <typename L3>
+void
+arp_for<L3>::schedule_publish() {
+    auto& h = home();
+    if (h.publish_scheduled) {
+        return;
+    }
+    h.publish_scheduled = true;
+    later().then([this, alive = _alive] {
+        if (*alive) {
+            publish();
+        }
+    });
+}
+
+template <typename L3>
+void
+arp_for<L3>::publish() {
+    auto& h = home();
+    h.publish_scheduled = false;
+    if (h.changed.empty()) {
+        return;
+    }
+    neighbor_delta delta;
+    delta.reserve(h.changed.size());
+    for (auto&& l3 : h.changed) {
+        auto i = h.table.find(l3);
+        if (i != h.table.end()) {
+            delta.emplace_back(l3, i->second);
+        } else {
+            delta.emplace_back(l3, std::experimental::nullopt);
+        }
+    }
+    h.changed.clear();
+    auto shared_delta = std::make_shared<const neighbor_delta>(std::move(delta));
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (cpu != engine().cpu_id() && _group->member(cpu)) {
+            send_update(cpu, shared_delta);
+        }
+    }
+    update(*shared_delta);
+}
+
+template <typename L3>
+void
+arp_for<L3>::send_update(unsigned cpu, std::shared_ptr<const neighbor_delta> delta) {
+    if (cpu == engine().cpu_id()) {
+        update(*delta);
+        return;
+    }
+    smp::submit_to(cpu, [group = _group, delta = std::move(delta)] {
+        auto member = group->member(engine().cpu_id());
+        if (member) {
+            static_cast<arp_for&>(*member).update(*delta);
+        }
+    });
+}
+
+// Applies changes to this shard's copy of the cache, and completes the
+// lookups they resolve.
+template <typename L3>
+void
+arp_for<L3>::update(const neighbor_delta& delta) {
+    auto now = clock_type::now();
+    for (auto&& change : delta) {
+        auto& l3 = change.first;
+        _learn_sent.erase(l3);
+        _refresh_sent.erase(l3);
+        if (!change.second) {
+            _table.erase(l3);
+            continue;
+        }
+        auto& n = *change.second;
+        _table[l3] = n;
+        auto i = _in_progress.find(l3);
+        if (i != _in_progress.end() && now < n.expiry) {
+            for (auto&& pr : i->second._waiters) {
+                pr.set_value(n.l2);
+            }
+            _in_progress.erase(i);
+        }
+    }
+    if (_in_progress.empty()) {
+        _resolution_timer.cancel();
+    }
+}
+
+template <typename L3>
+void
+arp_for<L3>::check_resolutions() {
+    auto now = clock_type::now();
+    for (auto i = _in_progress.begin(); i != _in_progress.end();) {
+        if (now >= i->second._deadline) {
+            for (auto&& pr : i->second._waiters) {
+                pr.set_exception(arp_timeout_error());
+            }
+            i = _in_progress.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    if (_in_progress.empty()) {
+        _resolution_timer.cancel();
     }
 }
 
@@ -235,9 +558,15 @@ arp_for<L3>::received(packet p) {
     }
     switch (h.oper) {
     case op_request:
+        // As in RFC 826, the sender of a request for us is learned, and
+        // so is that of any request, gratuitous ones included, if it is
+        // already known.
+        if (h.target_paddr == _l3self || _table.count(h.sender_paddr)) {
+            learn(h.sender_hwaddr, h.sender_paddr);
+        }
         return handle_request(&h);
     case op_reply:
-        arp_learn(h.sender_hwaddr, h.sender_paddr);
+        learn(h.sender_hwaddr, h.sender_paddr);
         return make_ready_future<>();
     default:
         return make_ready_future<>();
@@ -0,0 +1,172 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+namespace net {
+
+/**
+ * An open addressing hash table for finding the connection of a received
+ * segment with as few cache misses as possible.
+ *
+ * Each slot holds the 32-bit hash, the key and the value next to each
+ * other, in a single array probed linearly, so a lookup usually touches
+ * one cache line before the connection itself; std::unordered_map needs
+ * a bucket, a node, and possibly more nodes of the same bucket.  Entries
+ * are removed by shifting the following entries back, without
+ * tombstones, so lookups stay short after many connections came and went.
+ *
+ * The hash is computed by the caller, which can do it once per segment
+ * and prefetch() the slot before doing other work on the segment.
+ *
+ * Key must be equality comparable, and Key and Value default
+ * constructible and movable.  Hash returns a size_t with good low bits.
+ */
+template <typename Key, typename Value, typename Hash>
+class connection_table {
+    struct slot {
+        // zero in empty slots
+        uint32_t hash = 0;
+        Key key;
+        Value value;
+    };
+    std::vector<slot> _slots;
+    size_t _mask;
+    size_t _size = 0;
+    static constexpr size_t min_capacity = 64;
+private:
+    void grow() {
+        std::vector<slot> old(_slots.size() * 2);
+        old.swap(_slots);
+        _mask = _slots.size() - 1;
+        for (auto&& s : old) {
+            if (s.hash) {
+                place(s.hash, std::move(s.key), std::move(s.value));
+            }
+        }
+    }
+    void place(uint32_t h, Key&& key, Value&& value) {
+        auto idx = h & _mask;
+        while (_slots[idx].hash) {
+            idx = (idx + 1) & _mask;
+        }
+        auto& s = _slots[idx];
+        s.hash = h;
+        s.key = std::move(key);
+        s.value = std::move(value);
+    }
+public:
+    explicit connection_table(size_t capacity = min_capacity) {
+        size_t n = min_capacity;
+        while (n < capacity) {
+            n *= 2;
+        }
+        _slots.resize(n);
+        _mask = n - 1;
+    }
+    // Never zero, so that zero can mark empty slots
+    static uint32_t hash(const Key& key) {
+        uint32_t h = Hash()(key);
+        return h ? h : 1;
+    }
+    void prefetch(uint32_t h) const {
+        __builtin_prefetch(&_slots[h & _mask]);
+    }
+    Value* find(const Key& key, uint32_t h) {
+        for (auto idx = h & _mask; _slots[idx].hash; idx = (idx + 1) & _mask) {
+            auto& s = _slots[idx];
+            if (s.hash == h && s.key == key) {
+                return &s.value;
+            }
+        }
+        return nullptr;
+    }
+    Value* find(const Key& key) {
+        return find(key, hash(key));
+    }
+    // Does nothing and returns false if the key is already present
+    bool insert(const Key& key, uint32_t h, Value value) {
+        if (find(key, h)) {
+            return false;
+        }
+        // keep the load factor under 3/4
+        if ((_size + 1) * 4 > _slots.size() * 3) {
+            grow();
+        }
+        place(h, Key(key), std::move(value));
+        ++_size;
+        return true;
+    }
+    bool insert(const Key& key, Value value) {
+        return insert(key, hash(key), std::move(value));
+    }
+    bool erase(const Key& key, uint32_t h) {
+        auto idx = h & _mask;
+        for (;; idx = (idx + 1) & _mask) {
+            auto& s = _slots[idx];
+            if (!s.hash) {
+                return false;
+            }
+            if (s.hash == h && s.key == key) {
+                break;
+            }
+        }
+        // Move entries of the same cluster whose home slot is not after
+        // the hole into it, so that no probe sequence crosses an empty
+        // slot.
+        auto next = idx;
+        for (;;) {
+            next = (next + 1) & _mask;
+            if (!_slots[next].hash) {
+                break;
+            }
+            auto home = _slots[next].hash & _mask;
+            bool stays = idx <= next ? idx < home && home <= next : idx < home || home <= next;
+            if (!stays) {
+                std::swap(_slots[idx], _slots[next]);
+                idx = next;
+            }
+        }
+        --_size;
+        // last, as destroying the value may use the table
+        _slots[idx] = slot();
+        return true;
+    }
+    bool erase(const Key& key) {
+        return erase(key, hash(key));
+    }
+    size_t size() const {
+        return _size;
+    }
+    bool empty() const {
+        return !_size;
+    }
+    size_t capacity() const {
+        return _slots.size();
+    }
+};
+
+}
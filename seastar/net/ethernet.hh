@@ -48,6 +48,14 @@ struct ethernet_address {
 
 std::ostream& operator<<(std::ostream& os, ethernet_address ea);
 
+inline bool operator==(const ethernet_address& a, const ethernet_address& b) {
+    return a.mac == b.mac;
+}
+
+inline bool operator!=(const ethernet_address& a, const ethernet_address& b) {
+    return !(a == b);
+}
+
 struct ethernet {
     using address = ethernet_address;
     static address broadcast_address() {
@@ -38,8 +38,9 @@ std::ostream& operator<<(std::ostream& os, ipv4_address a) {
 }
 
 constexpr std::chrono::seconds ipv4::_frag_timeout;
-constexpr uint32_t ipv4::_frag_low_thresh;
-constexpr uint32_t ipv4::_frag_high_thresh;
+constexpr unsigned ipv4::frag::max_fragments;
+const unsigned ipv4::default_reassembly_datagrams = 1024;
+const size_t ipv4::default_reassembly_memory = 4 * 1024 * 1024;
 
 ipv4::ipv4(interface* netif)
     : _netif(netif)
@@ -59,17 +60,38 @@ ipv4::ipv4(interface* netif)
     , _l4({ { uint8_t(ip_protocol_num::tcp), &_tcp }, { uint8_t(ip_protocol_num::icmp), &_icmp }, { uint8_t(ip_protocol_num::udp), &_udp }})
     , _collectd_regs({
         //
-        // Linearized events: DERIVE:0:u
+        // Reassembled datagrams: DERIVE:0:u
         //
         scollectd::add_polled_metric(scollectd::type_instance_id(
               "ipv4"
             , scollectd::per_cpu_plugin_instance
-            , "total_operations", "linearizations")
-            , scollectd::make_typed(scollectd::data_type::DERIVE
-            , [] { return ipv4_packet_merger::linearizations(); })
+            , "total_operations", "reassembled")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.reassembled)
+        ),
+        //
+        // Datagrams dropped before being reassembled: DERIVE:0:u
+        //
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "reassembly-timeouts")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.timed_out)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "reassembly-evictions")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.evicted)
+        ),
+        scollectd::add_polled_metric(scollectd::type_instance_id(
+              "ipv4"
+            , scollectd::per_cpu_plugin_instance
+            , "total_operations", "reassembly-invalid")
+            , scollectd::make_typed(scollectd::data_type::DERIVE, _frag_stats.invalid)
         ),
     }) {
     _frag_timer.set_callback([this] { frag_timeout(); });
+    set_reassembly_limits(default_reassembly_datagrams, default_reassembly_memory);
 }
 
 bool ipv4::forward(forward_hash& out_hash_data, packet& p, size_t off)
@@ -160,55 +182,8 @@ ipv4::handle_received_packet(packet p, ethernet_address from) {
     }
 
     // Does this IP datagram need reassembly
-    auto mf = h.mf();
-    if (mf == true || offset != 0) {
-        frag_limit_mem();
-        auto frag_id = ipv4_frag_id{h.src_ip, h.dst_ip, h.id, h.ip_proto};
-        auto& frag = _frags[frag_id];
-        if (mf == false) {
-            frag.last_frag_received = true;
-        }
-        // This is a newly created frag_id
-        if (frag.mem_size == 0) {
-            _frags_age.push_back(frag_id);
-            frag.rx_time = clock_type::now();
-        }
-        auto added_size = frag.merge(h, offset, std::move(p));
-        _frag_mem += added_size;
-        if (frag.is_complete()) {
-            // All the fragments are received
-            auto dropped_size = frag.mem_size;
-            auto& ip_data = frag.data.map.begin()->second;
-            // Choose a cpu to forward this packet
-            auto cpu_id = engine().cpu_id();
-            auto l4 = _l4[h.ip_proto];
-            if (l4) {
-                size_t l4_offset = 0;
-                forward_hash hash_data;
-                hash_data.push_back(hton(h.src_ip.ip));
-                hash_data.push_back(hton(h.dst_ip.ip));
-                l4->forward(hash_data, ip_data, l4_offset);
-                cpu_id = _netif->hash2cpu(toeplitz_hash(_netif->rss_key(), hash_data));
-            }
-
-            // No need to forward if the dst cpu is the current cpu
-            if (cpu_id == engine().cpu_id()) {
-                l4->received(std::move(ip_data), h.src_ip, h.dst_ip);
-            } else {
-                auto to = _netif->hw_address();
-                auto pkt = frag.get_assembled_packet(from, to);
-                _netif->forward(cpu_id, std::move(pkt));
-            }
-
-            // Delete this frag from _frags and _frags_age
-            frag_drop(frag_id, dropped_size);
-            _frags_age.remove(frag_id);
-        } else {
-            // Some of the fragments are missing
-            if (!_frag_timer.armed()) {
-                frag_arm();
-            }
-        }
+    if (h.mf() || offset != 0) {
+        reassemble(h, std::move(p), from);
         return make_ready_future<>();
     }
 
@@ -349,89 +324,212 @@ ip_packet_filter * ipv4::packet_filter() const {
     return _packet_filter;
 }
 
-void ipv4::frag_limit_mem() {
-    if (_frag_mem <= _frag_high_thresh) {
+void ipv4::set_reassembly_limits(unsigned max_datagrams, size_t max_memory) {
+    while (!_frags_lru.empty()) {
+        frag_drop(_frags_lru.front());
+    }
+    _frags_free.clear();
+    max_datagrams = std::max(max_datagrams, 1u);
+    _frag_slots = std::vector<frag>(max_datagrams);
+    // room for all of them without growing
+    _frags = decltype(_frags)(max_datagrams * 2);
+    for (auto& f : _frag_slots) {
+        _frags_free.push_back(f);
+    }
+    _frag_high_thresh = std::min(max_memory, size_t(std::numeric_limits<uint32_t>::max()));
+    _frag_low_thresh = _frag_high_thresh / 4 * 3;
+}
+
+void ipv4::reassemble(ip_hdr& h, packet p, ethernet_address from) {
+    frag_limit_mem();
+    auto frag_id = ipv4_frag_id{h.src_ip, h.dst_ip, h.id, h.ip_proto};
+    auto hash = _frags.hash(frag_id);
+    auto fp = _frags.find(frag_id, hash);
+    auto& frag = fp ? **fp : frag_alloc(frag_id, hash);
+    // Move it to the end of the LRU list, keeping its age
+    if (frag.lru_link.is_linked()) {
+        _frags_lru.erase(_frags_lru.iterator_to(frag));
+    }
+    _frags_lru.push_back(frag);
+
+    auto old_size = frag.mem_size;
+    if (!frag.merge(h, h.offset(), std::move(p))) {
+        ++_frag_stats.invalid;
+        frag_drop(frag);
         return;
     }
-    auto drop = _frag_mem - _frag_low_thresh;
-    while (drop) {
-        if (_frags_age.empty()) {
-            return;
+    _frag_mem += frag.mem_size - old_size;
+    if (!frag.is_complete()) {
+        // Some of the fragments are missing
+        if (!_frag_timer.armed()) {
+            frag_arm();
         }
-        // Drop the oldest frag (first element) from _frags_age
-        auto frag_id = _frags_age.front();
-        _frags_age.pop_front();
+        return;
+    }
 
-        // Drop from _frags as well
-        auto& frag = _frags[frag_id];
-        auto dropped_size = frag.mem_size;
-        frag_drop(frag_id, dropped_size);
+    // All the fragments are received
+    ++_frag_stats.reassembled;
+    auto ip_data = frag.assemble();
+    auto l4 = _l4[h.ip_proto];
+    if (!l4) {
+        frag_drop(frag);
+        return;
+    }
+    // Choose a cpu to forward this packet
+    forward_hash hash_data;
+    hash_data.push_back(hton(h.src_ip.ip));
+    hash_data.push_back(hton(h.dst_ip.ip));
+    l4->forward(hash_data, ip_data, 0);
+    auto cpu_id = _netif->hash2cpu(toeplitz_hash(_netif->rss_key(), hash_data));
+
+    // No need to forward if the dst cpu is the current cpu
+    if (cpu_id == engine().cpu_id()) {
+        frag_drop(frag);
+        l4->received(std::move(ip_data), h.src_ip, h.dst_ip);
+    } else {
+        auto to = _netif->hw_address();
+        auto pkt = frag.get_assembled_packet(std::move(ip_data), from, to);
+        frag_drop(frag);
+        _netif->forward(cpu_id, std::move(pkt));
+    }
+}
 
-        drop -= std::min(drop, dropped_size);
+ipv4::frag& ipv4::frag_alloc(const ipv4_frag_id& frag_id, uint32_t hash) {
+    if (_frags_free.empty()) {
+        ++_frag_stats.evicted;
+        frag_drop(_frags_lru.front());
     }
+    auto& frag = _frags_free.front();
+    _frags_free.pop_front();
+    frag.id = frag_id;
+    frag.first_rx_time = clock_type::now();
+    _frags_by_age.push_back(frag);
+    _frags.insert(frag_id, hash, &frag);
+    return frag;
 }
 
-void ipv4::frag_timeout() {
-    if (_frags.empty()) {
+void ipv4::frag_limit_mem() {
+    if (_frag_mem <= _frag_high_thresh) {
         return;
     }
+    // Drop the least recently received datagrams
+    while (_frag_mem > _frag_low_thresh && !_frags_lru.empty()) {
+        ++_frag_stats.evicted;
+        frag_drop(_frags_lru.front());
+    }
+}
+
+void ipv4::frag_timeout() {
     auto now = clock_type::now();
-    for (auto it = _frags_age.begin(); it != _frags_age.end();) {
-        auto frag_id = *it;
-        auto& frag = _frags[frag_id];
-        if (now > frag.rx_time + _frag_timeout) {
-            auto dropped_size = frag.mem_size;
-            // Drop from _frags
-            frag_drop(frag_id, dropped_size);
-            // Drop from _frags_age
-            it = _frags_age.erase(it);
-        } else {
+    while (!_frags_by_age.empty()) {
+        auto& frag = _frags_by_age.front();
+        if (now <= frag.first_rx_time + _frag_timeout) {
             // The further items can only be younger
             break;
         }
+        ++_frag_stats.timed_out;
+        frag_drop(frag);
     }
-    if (_frags.size() != 0) {
-        frag_arm(now);
-    } else {
-        _frag_mem = 0;
+    if (!_frags_by_age.empty()) {
+        frag_arm(_frags_by_age.front().first_rx_time);
     }
 }
 
-void ipv4::frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size) {
-    _frags.erase(frag_id);
-    _frag_mem -= dropped_size;
+void ipv4::frag_drop(frag& f) {
+    _frags.erase(f.id);
+    _frag_mem -= f.mem_size;
+    _frags_lru.erase(_frags_lru.iterator_to(f));
+    _frags_by_age.erase(_frags_by_age.iterator_to(f));
+    f.clear();
+    _frags_free.push_front(f);
 }
 
-int32_t ipv4::frag::merge(ip_hdr &h, uint16_t offset, packet p) {
-    uint32_t old = mem_size;
+// Inserts the payload of a fragment, trimming the parts that were already
+// received.  Returns false if the fragment does not fit with the others.
+bool ipv4::frag::merge(ip_hdr &h, uint16_t offset, packet p) {
     unsigned ip_hdr_len = h.ihl * 4;
     // Store IP header
-    if (offset == 0) {
+    if (offset == 0 && !header.len()) {
         header = p.share(0, ip_hdr_len);
     }
-    // Sotre IP payload
+    // Store IP payload
     p.trim_front(ip_hdr_len);
-    data.merge(offset, std::move(p));
-    // Update mem size
+    uint32_t beg = offset;
+    uint32_t end = beg + p.len();
+    if (!h.mf()) {
+        if (last_frag_received ? end != total
+                : !fragments.empty() && fragments.back().offset + fragments.back().p.len() > end) {
+            return false;
+        }
+        last_frag_received = true;
+        total = end;
+    } else if (last_frag_received && end > total) {
+        return false;
+    }
+    if (beg == end) {
+        return true;
+    }
+    auto it = std::upper_bound(fragments.begin(), fragments.end(), beg, [] (uint32_t off, const fragment& f) {
+        return off < f.offset;
+    });
+    if (it != fragments.begin()) {
+        auto& prev = *(it - 1);
+        auto prev_end = prev.offset + prev.p.len();
+        if (prev_end >= end) {
+            // We already have data in this packet
+            return true;
+        }
+        if (prev_end > beg) {
+            p.trim_front(prev_end - beg);
+            beg = prev_end;
+        }
+    }
+    // Replace the fragments the new one covers, and keep the data of the
+    // one it overlaps the beginning of
+    while (it != fragments.end() && it->offset < end) {
+        auto f_end = it->offset + it->p.len();
+        if (f_end <= end) {
+            received -= it->p.len();
+            it = fragments.erase(it);
+        } else {
+            p.trim_back(end - it->offset);
+            end = it->offset;
+            break;
+        }
+    }
+    if (beg == end) {
+        // Only fills the gap between two fragments that already touch
+        return true;
+    }
+    if (fragments.size() >= max_fragments) {
+        return false;
+    }
+    received += end - beg;
+    fragments.insert(it, fragment{beg, std::move(p)});
     mem_size = header.memory();
-    for (const auto& x : data.map) {
-        mem_size += x.second.memory();
+    for (auto& f : fragments) {
+        mem_size += f.p.memory();
     }
-    auto added_size = mem_size - old;
-    return added_size;
+    return true;
+}
+
+bool ipv4::frag::is_complete() const {
+    // The fragments do not overlap, so they cover the whole payload once
+    // as many bytes were received
+    return last_frag_received && received == total && header.len();
 }
 
-bool ipv4::frag::is_complete() {
-    // If all the fragments are received, ipv4::frag::merge() should merge all
-    // the fragments into a single packet
-    auto offset = data.map.begin()->first;
-    auto nr_packet = data.map.size();
-    return last_frag_received && nr_packet == 1 && offset == 0;
+packet ipv4::frag::assemble() {
+    auto p = std::move(fragments.front().p);
+    for (auto i = fragments.begin() + 1; i != fragments.end(); ++i) {
+        p.append(std::move(i->p));
+    }
+    fragments.clear();
+    return p;
 }
 
-packet ipv4::frag::get_assembled_packet(ethernet_address from, ethernet_address to) {
+packet ipv4::frag::get_assembled_packet(packet ip_data, ethernet_address from, ethernet_address to) {
     auto& ip_header = header;
-    auto& ip_data = data.map.begin()->second;
     // Append a ethernet header, needed for forwarding
     auto eh = ip_header.prepend_header<eth_hdr>();
     eh->src_mac = from;
@@ -454,6 +552,15 @@ packet ipv4::frag::get_assembled_packet(ethernet_address from, ethernet_address
     return pkt;
 }
 
+void ipv4::frag::clear() {
+    header = packet();
+    fragments.clear();
+    received = 0;
+    total = 0;
+    last_frag_received = false;
+    mem_size = 0;
+}
+
 void icmp::received(packet p, ipaddr from, ipaddr to) {
     auto hdr = p.get_header<icmp_hdr>(0);
     if (!hdr || hdr->type != icmp_hdr::msg_type::echo_request) {
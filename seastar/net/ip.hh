@@ -29,8 +29,8 @@
 #include <cstdint>
 #include <array>
 #include <map>
-#include <list>
 #include <chrono>
+#include <boost/intrusive/list.hpp>
 #include "core/array_map.hh"
 #include "byteorder.hh"
 #include "arp.hh"
@@ -40,6 +40,7 @@
 #include "core/shared_ptr.hh"
 #include "toeplitz.hh"
 #include "net/udp.hh"
+#include "connection-table.hh"
 
 namespace net {
 
@@ -94,6 +95,7 @@ namespace net {
 struct ipv4_traits {
     using address_type = ipv4_address;
     using inet_type = ipv4_l4<ip_protocol_num::tcp>;
+    static constexpr eth_protocol_num l3_protocol_num = eth_protocol_num::ipv4;
     struct l4packet {
         ipv4_address to;
         packet p;
@@ -127,6 +129,18 @@ class ip_protocol {
     virtual bool forward(forward_hash& out_hash_data, packet& p, size_t off) { return true; }
 };
 
+// Mixes all bits of h (the murmur3 finalizer), for hashes of several
+// fields to be used by open addressing tables, which use the low bits;
+// std::hash of integers is the identity.
+inline uint64_t mix_hash_bits(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
 template <typename InetTraits>
 struct l4connid {
     using ipaddr = typename InetTraits::address_type;
@@ -145,13 +159,23 @@ struct l4connid {
                 && foreign_port == x.foreign_port;
     }
 
-    uint32_t hash(const rss_key_type& rss_key) {
+    // The hash data of packets received on this connection, as the
+    // forward functions collect it
+    forward_hash hash_data() const {
         forward_hash hash_data;
         hash_data.push_back(hton(foreign_ip.ip));
         hash_data.push_back(hton(local_ip.ip));
         hash_data.push_back(hton(foreign_port));
         hash_data.push_back(hton(local_port));
-        return toeplitz_hash(rss_key, hash_data);
+        return hash_data;
+    }
+
+    uint32_t hash(const rss_key_type& rss_key) const {
+        return toeplitz_hash(rss_key, hash_data());
+    }
+
+    flow_key flow() const {
+        return flow_key(InetTraits::l3_protocol_num, hash_data());
     }
 };
 
@@ -278,20 +302,17 @@ struct ipv4_frag_id {
 
 struct ipv4_frag_id::hash : private std::hash<ipv4_address>,
     private std::hash<uint16_t>, private std::hash<uint8_t> {
+    // Mixed like l4connid::connid_hash, for the reassembly table
     size_t operator()(const ipv4_frag_id& id) const noexcept {
         using h1 = std::hash<ipv4_address>;
         using h2 = std::hash<uint16_t>;
         using h3 = std::hash<uint8_t>;
-        return h1::operator()(id.src_ip) ^
-               h1::operator()(id.dst_ip) ^
-               h2::operator()(id.identification) ^
-               h3::operator()(id.protocol);
+        uint64_t ips = (uint64_t(h1::operator()(id.src_ip)) << 32) ^ h1::operator()(id.dst_ip);
+        uint64_t rest = (uint64_t(h2::operator()(id.identification)) << 8) ^ h3::operator()(id.protocol);
+        return mix_hash_bits(ips ^ mix_hash_bits(rest));
     }
 };
 
-struct ipv4_tag {};
-using ipv4_packet_merger = packet_merger<uint32_t, ipv4_tag>;
-
 class ipv4 {
 public:
     using clock_type = lowres_clock;
@@ -299,6 +320,8 @@ class ipv4 {
     using proto_type = uint16_t;
     static address_type broadcast_address() { return ipv4_address(0xffffffff); }
     static proto_type arp_protocol_type() { return proto_type(eth_protocol_num::ipv4); }
+    static const unsigned default_reassembly_datagrams;
+    static const size_t default_reassembly_memory;
 private:
     interface* _netif;
     std::vector<ipv4_traits::packet_provider_type> _pkt_providers;
@@ -314,25 +337,65 @@ class ipv4 {
     ipv4_udp _udp;
     array_map<ip_protocol*, 256> _l4;
     ip_packet_filter * _packet_filter = nullptr;
+    // A datagram being reassembled.  Allocated once, in a fixed number
+    // of slots, and reused: the fragment vector keeps its capacity.
     struct frag {
+        // A 64KB datagram over a 576 byte MTU path takes 119 fragments
+        static constexpr unsigned max_fragments = 128;
+        struct fragment {
+            uint32_t offset;
+            packet p;
+        };
+        ipv4_frag_id id;
         packet header;
-        ipv4_packet_merger data;
-        clock_type::time_point rx_time;
-        uint32_t mem_size = 0;
-        // fragment with MF == 0 inidates it is the last fragment
+        // Ordered by offset, and not overlapping
+        std::vector<fragment> fragments;
+        // Payload bytes received, and the length of the payload, known
+        // once the last fragment (with MF == 0) is received
+        uint32_t received = 0;
+        uint32_t total = 0;
         bool last_frag_received = false;
-
-        packet get_assembled_packet(ethernet_address from, ethernet_address to);
-        int32_t merge(ip_hdr &h, uint16_t offset, packet p);
-        bool is_complete();
+        uint32_t mem_size = 0;
+        // When the first fragment was received: a datagram times out
+        // however many fragments keep arriving for it
+        clock_type::time_point first_rx_time;
+        boost::intrusive::list_member_hook<> lru_link;
+        boost::intrusive::list_member_hook<> age_link;
+
+        bool merge(ip_hdr& h, uint16_t offset, packet p);
+        bool is_complete() const;
+        // Chains the fragments' data together, without copying it
+        packet assemble();
+        packet get_assembled_packet(packet data, ethernet_address from, ethernet_address to);
+        void clear();
+    };
+    using frag_list = boost::intrusive::list<frag,
+            boost::intrusive::member_hook<frag, boost::intrusive::list_member_hook<>, &frag::lru_link>,
+            boost::intrusive::constant_time_size<false>>;
+    using frag_age_list = boost::intrusive::list<frag,
+            boost::intrusive::member_hook<frag, boost::intrusive::list_member_hook<>, &frag::age_link>,
+            boost::intrusive::constant_time_size<false>>;
+    struct frag_stats {
+        uint64_t reassembled = 0;
+        uint64_t timed_out = 0;
+        // dropped to make room for others
+        uint64_t evicted = 0;
+        // dropped because of inconsistent or too many fragments
+        uint64_t invalid = 0;
     };
-    std::unordered_map<ipv4_frag_id, frag, ipv4_frag_id::hash> _frags;
-    std::list<ipv4_frag_id> _frags_age;
+    std::vector<frag> _frag_slots;
+    connection_table<ipv4_frag_id, frag*, ipv4_frag_id::hash> _frags;
+    // In use, least recently received first
+    frag_list _frags_lru;
+    // In use, oldest first
+    frag_age_list _frags_by_age;
+    frag_list _frags_free;
     static constexpr std::chrono::seconds _frag_timeout{30};
-    static constexpr uint32_t _frag_low_thresh{3 * 1024 * 1024};
-    static constexpr uint32_t _frag_high_thresh{4 * 1024 * 1024};
+    uint32_t _frag_low_thresh;
+    uint32_t _frag_high_thresh;
     uint32_t _frag_mem{0};
     timer<lowres_clock> _frag_timer;
+    frag_stats _frag_stats;
     circular_buffer<l3_protocol::l3packet> _packetq;
     unsigned _pkt_provider_idx = 0;
     scollectd::registrations _collectd_regs;
@@ -341,9 +404,11 @@ class ipv4 {
     bool forward(forward_hash& out_hash_data, packet& p, size_t off);
     std::experimental::optional<l3_protocol::l3packet> get_packet();
     bool in_my_netmask(ipv4_address a) const;
+    void reassemble(ip_hdr& h, packet p, ethernet_address from);
+    frag& frag_alloc(const ipv4_frag_id& frag_id, uint32_t hash);
     void frag_limit_mem();
     void frag_timeout();
-    void frag_drop(ipv4_frag_id frag_id, uint32_t dropped_size);
+    void frag_drop(frag& f);
     void frag_arm(clock_type::time_point now) {
         auto tp = now + _frag_timeout;
         _frag_timer.arm(tp);
@@ -371,6 +436,8 @@ class ipv4 {
     void send(ipv4_address to, ip_protocol_num proto_num, packet p, ethernet_address e_dst);
     tcp<ipv4_traits>& get_tcp() { return *_tcp._tcp; }
     ipv4_udp& get_udp() { return _udp; }
+    // Drops the datagrams being reassembled
+    void set_reassembly_limits(unsigned max_datagrams, size_t max_memory);
     void register_l4(proto_type id, ip_protocol* handler);
     const net::hw_features& hw_features() const { return _netif->hw_features(); }
     static bool needs_frag(packet& p, ip_protocol_num proto_num, net::hw_features hw_features);
@@ -427,18 +494,18 @@ struct ip_hdr {
 
 template <typename InetTraits>
 struct l4connid<InetTraits>::connid_hash : private std::hash<ipaddr>, private std::hash<uint16_t> {
+    // Mixes all bits, so that open addressing tables can use the low
+    // ones; xoring the fields would map all connections between the same
+    // two hosts with swapped ports to the same value.
     size_t operator()(const l4connid<InetTraits>& id) const noexcept {
         using h1 = std::hash<ipaddr>;
         using h2 = std::hash<uint16_t>;
-        return h1::operator()(id.local_ip)
-            ^ h1::operator()(id.foreign_ip)
-            ^ h2::operator()(id.local_port)
-            ^ h2::operator()(id.foreign_port);
+        uint64_t ips = (uint64_t(h1::operator()(id.local_ip)) << 32) ^ h1::operator()(id.foreign_ip);
+        uint64_t ports = (uint64_t(h2::operator()(id.local_port)) << 16) ^ h2::operator()(id.foreign_port);
+        return mix_hash_bits(ips ^ mix_hash_bits(ports));
     }
 };
 
-void arp_learn(ethernet_address l2, ipv4_address l3);
-
 }
 
 #endif /* IP_HH_ */
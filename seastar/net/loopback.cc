@@ -0,0 +1,401 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "loopback.hh"
+#include "proxy.hh"
+#include "ip.hh"
+#include "toeplitz.hh"
+#include "core/reactor.hh"
+#include "core/future-util.hh"
+#include <atomic>
+#include <random>
+#include <experimental/optional>
+#include <boost/range/irange.hpp>
+
+namespace net {
+
+namespace {
+
+// Fixed size ring with one producer and one consumer, which may run on
+// different shards.
+template <typename T>
+class spsc_ring {
+    using slot = std::aligned_storage_t<sizeof(T), alignof(T)>;
+    std::unique_ptr<slot[]> _slots;
+    size_t _mask;
+    // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> _head = { 0 };
+    // next slot to push, written by the producer
+    alignas(64) std::atomic<size_t> _tail = { 0 };
+public:
+    explicit spsc_ring(size_t size) : _slots(new slot[size]), _mask(size - 1) {
+        assert(size && !(size & _mask));
+    }
+    ~spsc_ring() {
+        while (front()) {
+            pop();
+        }
+    }
+    // producer side
+    bool full() const {
+        return _tail.load(std::memory_order_relaxed) - _head.load(std::memory_order_acquire) > _mask;
+    }
+    // producer side; the ring must not be full
+    void push(T&& x) {
+        auto tail = _tail.load(std::memory_order_relaxed);
+        new (&_slots[tail & _mask]) T(std::move(x));
+        _tail.store(tail + 1, std::memory_order_release);
+    }
+    // consumer side; nullptr if empty
+    T* front() {
+        auto head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(&_slots[head & _mask]);
+    }
+    // consumer side; the ring must not be empty
+    void pop() {
+        auto head = _head.load(std::memory_order_relaxed);
+        reinterpret_cast<T*>(&_slots[head & _mask])->~T();
+        _head.store(head + 1, std::memory_order_release);
+    }
+};
+
+struct frame {
+    packet p;
+    // time_point() if the link has no latency or bandwidth limit
+    steady_clock_type::time_point deliver_at;
+};
+
+}
+
+class loopback_link {
+    loopback_config _cfg;
+    net::hw_features _hw_features;
+    // _rings[(to_port * queues + from_queue) * queues + to_queue]
+    std::vector<std::unique_ptr<spsc_ring<frame>>> _rings;
+public:
+    explicit loopback_link(const loopback_config& cfg) : _cfg(cfg) {
+        _cfg.queues = std::max(std::min(_cfg.queues, smp::count), 1u);
+        unsigned ring_size = 2;
+        while (ring_size < _cfg.ring_size) {
+            ring_size <<= 1;
+        }
+        _cfg.ring_size = ring_size;
+        _hw_features.tx_csum_ip_offload = true;
+        _hw_features.tx_csum_l4_offload = true;
+        _hw_features.rx_csum_offload = true;
+        _hw_features.tx_tso = _cfg.tso;
+        _hw_features.mtu = _cfg.mtu;
+        auto nr_rings = 2 * _cfg.queues * _cfg.queues;
+        for (unsigned i = 0; i < nr_rings; ++i) {
+            _rings.push_back(std::make_unique<spsc_ring<frame>>(_cfg.ring_size));
+        }
+    }
+    const loopback_config& config() const {
+        return _cfg;
+    }
+    const net::hw_features& hw_features() const {
+        return _hw_features;
+    }
+    bool shaped() const {
+        return _cfg.latency.count() || _cfg.bandwidth_mbps;
+    }
+    spsc_ring<frame>& ring(unsigned to_port, unsigned from_queue, unsigned to_queue) {
+        return *_rings[(to_port * _cfg.queues + from_queue) * _cfg.queues + to_queue];
+    }
+    // Emulates the receive side scaling of the receiving device: hashes the
+    // fields that ipv4::forward() and tcp::forward() would, and sets the
+    // packet's RSS hash so that the stack does not compute it again.
+    unsigned rss_queue(packet& p) {
+        if (_cfg.queues == 1) {
+            return 0;
+        }
+        auto eh = p.get_header<eth_hdr>();
+        if (!eh || ntoh(eh->eth_proto) != uint16_t(eth_protocol_num::ipv4)) {
+            return 0;
+        }
+        auto iph = p.get_header<ip_hdr>(sizeof(eth_hdr));
+        if (!iph) {
+            return 0;
+        }
+        forward_hash data;
+        data.push_back(iph->src_ip.ip);
+        data.push_back(iph->dst_ip.ip);
+        auto h = ntoh(*iph);
+        if (h.ip_proto == uint8_t(ip_protocol_num::tcp) && h.mf() == false && h.offset() == 0) {
+            auto ports = p.get_header<std::array<uint16_t, 2>>(sizeof(eth_hdr) + sizeof(ip_hdr));
+            if (ports) {
+                data.push_back((*ports)[0]);
+                data.push_back((*ports)[1]);
+            }
+        }
+        auto hash = toeplitz_hash(default_rsskey_40bytes, data);
+        p.set_rss_hash(hash);
+        return hash % _cfg.queues;
+    }
+};
+
+class loopback_device : public device {
+    std::shared_ptr<loopback_link> _link;
+    unsigned _port;
+public:
+    loopback_device(std::shared_ptr<loopback_link> link, unsigned port)
+        : _link(std::move(link)), _port(port) {
+    }
+    virtual ethernet_address hw_address() override {
+        return { 0x02, 0x00, 0x00, 0x00, 0x00, uint8_t(_port + 1) };
+    }
+    virtual net::hw_features hw_features() override {
+        return _link->hw_features();
+    }
+    virtual uint16_t hw_queues_count() override {
+        return _link->config().queues;
+    }
+    virtual std::unique_ptr<qp> init_local_queue(boost::program_options::variables_map opts, uint16_t qid) override;
+};
+
+class loopback_qp : public qp {
+    struct held_frame {
+        unsigned to;
+        frame f;
+    };
+    loopback_device& _dev;
+    std::shared_ptr<loopback_link> _link;
+    unsigned _port;
+    unsigned _qid;
+    reactor::poller _rx_poller;
+    std::default_random_engine _random;
+    std::uniform_real_distribution<double> _uniform{0, 1};
+    // when this queue's share of the link bandwidth is free again
+    steady_clock_type::time_point _link_free;
+    // a packet held back to be sent after the next one
+    std::experimental::optional<held_frame> _held;
+    uint64_t _lost = 0;
+    uint64_t _reordered = 0;
+    uint64_t _ring_full = 0;
+    static constexpr unsigned max_rx_batch = 128;
+private:
+    bool transmit(packet& p);
+    bool flush_held();
+    bool poll_rx();
+public:
+    loopback_qp(loopback_device& dev, std::shared_ptr<loopback_link> link, unsigned port, unsigned qid);
+    virtual future<> send(packet p) override;
+    virtual uint32_t send(circular_buffer<packet>& p) override;
+};
+
+loopback_qp::loopback_qp(loopback_device& dev, std::shared_ptr<loopback_link> link, unsigned port, unsigned qid)
+    : qp(false, "loopback" + std::to_string(port), qid)
+    , _dev(dev)
+    , _link(std::move(link))
+    , _port(port)
+    , _qid(qid)
+    , _rx_poller(reactor::poller::simple("loopback-rx", [this] { return poll_rx(); }))
+    , _random(port * smp::count + qid) {
+    auto add_counter = [this] (const char* name, uint64_t& counter) {
+        // total_operations value:DERIVE:0:U
+        _collectd_regs.push_back(
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", name)
+                    , scollectd::make_typed(scollectd::data_type::DERIVE, counter)
+            ));
+    };
+    add_counter("lost", _lost);
+    add_counter("reordered", _reordered);
+    add_counter("ring-full", _ring_full);
+}
+
+// Returns false, leaving p alone, if the ring to the receiving queue is
+// full; the caller keeps the packet and tries again later.
+bool loopback_qp::transmit(packet& p) {
+    auto& cfg = _link->config();
+    auto to = _link->rss_queue(p);
+    auto& ring = _link->ring(1 - _port, _qid, to);
+    if (ring.full()) {
+        ++_ring_full;
+        return false;
+    }
+    _stats.tx.good.update_frags_stats(p.nr_frags(), p.len());
+    if (cfg.loss && _uniform(_random) < cfg.loss) {
+        ++_lost;
+        p = packet();
+        return true;
+    }
+    steady_clock_type::time_point deliver_at;
+    if (_link->shaped()) {
+        auto now = steady_clock_type::now();
+        _link_free = std::max(_link_free, now);
+        if (cfg.bandwidth_mbps) {
+            // Mbit/s are bits per microsecond
+            _link_free += std::chrono::nanoseconds(uint64_t(p.len()) * 8 * 1000 / cfg.bandwidth_mbps);
+        }
+        deliver_at = _link_free + cfg.latency;
+    }
+    if (cfg.reorder && !_held && _uniform(_random) < cfg.reorder) {
+        ++_reordered;
+        _held = held_frame{to, frame{std::move(p), deliver_at}};
+        return true;
+    }
+    ring.push(frame{std::move(p), deliver_at});
+    flush_held();
+    return true;
+}
+
+bool loopback_qp::flush_held() {
+    if (!_held) {
+        return false;
+    }
+    auto& ring = _link->ring(1 - _port, _qid, _held->to);
+    if (ring.full()) {
+        return false;
+    }
+    ring.push(std::move(_held->f));
+    _held = {};
+    return true;
+}
+
+future<> loopback_qp::send(packet p) {
+    // Like a NIC with a full transmit queue, drop the packet
+    transmit(p);
+    return make_ready_future<>();
+}
+
+uint32_t loopback_qp::send(circular_buffer<packet>& pb) {
+    uint32_t sent = 0;
+    while (!pb.empty() && transmit(pb.front())) {
+        pb.pop_front();
+        ++sent;
+    }
+    return sent;
+}
+
+bool loopback_qp::poll_rx() {
+    // A packet held back for reordering is sent after the next one, or on
+    // the next poll if nothing else was sent.
+    bool work = flush_held();
+    auto now = _link->shaped() ? steady_clock_type::now() : steady_clock_type::time_point();
+    unsigned nr = 0;
+    for (unsigned from = 0; from < _link->config().queues && nr < max_rx_batch; ++from) {
+        auto& ring = _link->ring(_port, from, _qid);
+        while (nr < max_rx_batch) {
+            auto f = ring.front();
+            if (!f || f->deliver_at > now) {
+                break;
+            }
+            auto p = std::move(f->p);
+            ring.pop();
+            if (from != _qid) {
+                // queue "from" runs on shard "from"
+                p = p.free_on_cpu(from);
+            }
+            _stats.rx.good.update_frags_stats(p.nr_frags(), p.len());
+            _dev.l2receive(std::move(p));
+            ++nr;
+        }
+    }
+    if (nr) {
+        _stats.rx.good.update_pkts_bunch(nr);
+    }
+    return work || nr;
+}
+
+std::unique_ptr<qp> loopback_device::init_local_queue(boost::program_options::variables_map opts, uint16_t qid) {
+    return std::make_unique<loopback_qp>(*this, _link, _port, qid);
+}
+
+loopback_config make_loopback_config(const boost::program_options::variables_map& opts) {
+    loopback_config cfg;
+    cfg.queues = opts.count("loopback-queues") ? opts["loopback-queues"].as<unsigned>() : smp::count;
+    cfg.latency = std::chrono::microseconds(opts["loopback-latency-us"].as<unsigned>());
+    cfg.bandwidth_mbps = opts["loopback-bandwidth-mbps"].as<unsigned>();
+    cfg.loss = opts["loopback-loss"].as<double>();
+    cfg.reorder = opts["loopback-reorder"].as<double>();
+    cfg.ring_size = opts["loopback-ring-size"].as<unsigned>();
+    cfg.mtu = opts["loopback-mtu"].as<uint16_t>();
+    cfg.tso = opts["loopback-tso"].as<std::string>() != "off";
+    return cfg;
+}
+
+boost::program_options::options_description
+get_loopback_net_options_description() {
+    boost::program_options::options_description opts(
+            "Loopback net options");
+    opts.add_options()
+        ("loopback-queues",
+                boost::program_options::value<unsigned>(),
+                "number of queues of each loopback device (default: one per shard)")
+        ("loopback-latency-us",
+                boost::program_options::value<unsigned>()->default_value(0),
+                "one-way latency of the loopback link, in microseconds")
+        ("loopback-bandwidth-mbps",
+                boost::program_options::value<unsigned>()->default_value(0),
+                "bandwidth of each loopback queue, in Mbit/s (0: unlimited)")
+        ("loopback-loss",
+                boost::program_options::value<double>()->default_value(0),
+                "probability of dropping a packet")
+        ("loopback-reorder",
+                boost::program_options::value<double>()->default_value(0),
+                "probability of delivering a packet after the next one")
+        ("loopback-ring-size",
+                boost::program_options::value<unsigned>()->default_value(1024),
+                "packets in flight between two loopback queues")
+        ("loopback-mtu",
+                boost::program_options::value<uint16_t>()->default_value(1500),
+                "MTU of the loopback devices")
+        ("loopback-tso",
+                boost::program_options::value<std::string>()->default_value("on"),
+                "Enable TCP segment offload on the loopback devices")
+        ;
+    return opts;
+}
+
+std::pair<std::shared_ptr<device>, std::shared_ptr<device>>
+create_loopback_net_device_pair(const loopback_config& cfg) {
+    auto link = std::make_shared<loopback_link>(cfg);
+    return { std::make_shared<loopback_device>(link, 0), std::make_shared<loopback_device>(link, 1) };
+}
+
+future<> start_loopback_net_device(std::shared_ptr<device> dev) {
+    return parallel_for_each(boost::irange(0u, smp::count), [dev] (unsigned cpu) {
+        return smp::submit_to(cpu, [dev] {
+            uint16_t qid = engine().cpu_id();
+            auto nr_queues = dev->hw_queues_count();
+            if (qid < nr_queues) {
+                auto qp = dev->init_local_queue(boost::program_options::variables_map(), qid);
+                std::map<unsigned, float> cpu_weights;
+                for (unsigned i = nr_queues + qid % nr_queues; i < smp::count; i += nr_queues) {
+                    cpu_weights[i] = 1;
+                }
+                cpu_weights[qid] = 1;
+                qp->configure_proxies(cpu_weights);
+                dev->set_local_queue(std::move(qp));
+            } else {
+                dev->set_local_queue(create_proxy_net_device(qid % nr_queues, dev.get()));
+            }
+        });
+    });
+}
+
+}
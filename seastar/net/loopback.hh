@@ -0,0 +1,72 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#ifndef LOOPBACK_HH_
+#define LOOPBACK_HH_
+
+#include <memory>
+#include <utility>
+#include <chrono>
+#include "net.hh"
+
+namespace net {
+
+// A pair of devices connected back to back, like the two ends of a veth
+// pair, for running two native stacks in the same process without any
+// hardware or kernel device.
+//
+// Each device has queues() queues, queue i running on shard i.  A packet
+// sent on a queue of one device is received on the queue of the other
+// device that the emulated RSS selects: the toeplitz hash of its
+// addresses and ports, as a NIC would compute it, modulo the number of
+// queues.  Every pair of queues is connected by a lock-free single
+// producer, single consumer ring, so traffic that crosses shards does
+// not go through smp::submit_to().
+struct loopback_config {
+    unsigned queues = 1;
+    // one-way delay of every packet
+    std::chrono::microseconds latency = {};
+    // bandwidth of every sending queue, in Mbit/s; zero: unlimited
+    unsigned bandwidth_mbps = 0;
+    // probability of dropping a packet
+    double loss = 0;
+    // probability of delivering a packet after the one sent after it
+    double reorder = 0;
+    // packets in flight between two queues; rounded up to a power of two
+    unsigned ring_size = 1024;
+    uint16_t mtu = 1500;
+    bool tso = true;
+};
+
+loopback_config make_loopback_config(const boost::program_options::variables_map& opts);
+boost::program_options::options_description get_loopback_net_options_description();
+
+std::pair<std::shared_ptr<device>, std::shared_ptr<device>>
+create_loopback_net_device_pair(const loopback_config& cfg);
+
+// Sets up the local queue of dev on every shard, as the native stack does
+// for hardware devices: shards past the last queue get a proxy queue that
+// sends through one of the others.  Must be called on shard 0.
+future<> start_loopback_net_device(std::shared_ptr<device> dev);
+
+}
+
+#endif /* LOOPBACK_HH_ */
@@ -28,6 +28,7 @@
 #include "virtio.hh"
 #include "dpdk.hh"
 #include "xenfront.hh"
+#include "loopback.hh"
 #include "proxy.hh"
 #include "dhcp.hh"
 #include <memory>
@@ -155,9 +156,6 @@ class native_network_stack : public network_stack {
         return ready_promise.get_future();
     }
     virtual bool has_per_core_namespace() override { return true; };
-    void arp_learn(ethernet_address l2, ipv4_address l3) {
-        _inet.learn(l2, l3);
-    }
     friend class native_server_socket_impl<tcp4>;
 };
 
@@ -179,6 +177,7 @@ add_native_net_options_description(boost::program_options::options_description &
     }
 #endif
     opts.add(get_virtio_net_options_description());
+    opts.add(get_loopback_net_options_description());
 #ifdef HAVE_DPDK
     opts.add(get_dpdk_net_options_description());
 #endif
@@ -188,6 +187,8 @@ native_network_stack::native_network_stack(boost::program_options::variables_map
     : _netif(std::move(dev))
     , _inet(&_netif) {
     _inet.get_udp().set_queue_size(opts["udpv4-queue-size"].as<int>());
+    _inet.set_reassembly_limits(opts["ipv4-reassembly-datagrams"].as<unsigned>(),
+            opts["ipv4-reassembly-memory"].as<size_t>());
     _dhcp = opts["host-ipv4-addr"].defaulted()
             && opts["gw-ipv4-addr"].defaulted()
             && opts["netmask-ipv4-addr"].defaulted() && opts["dhcp"].as<bool>();
@@ -286,16 +287,6 @@ future<> native_network_stack::initialize() {
     });
 }
 
-void arp_learn(ethernet_address l2, ipv4_address l3)
-{
-    for (unsigned i = 0; i < smp::count; i++) {
-        smp::submit_to(i, [l2, l3] {
-            auto & ns = static_cast<native_network_stack&>(engine().net());
-            ns.arp_learn(l2, l3);
-        });
-    }
-}
-
 void create_native_stack(boost::program_options::variables_map opts, std::shared_ptr<device> dev) {
     native_network_stack::ready_promise.set_value(std::unique_ptr<network_stack>(std::make_unique<native_network_stack>(opts, std::move(dev))));
 }
@@ -319,6 +310,12 @@ boost::program_options::options_description nns_options() {
         ("udpv4-queue-size",
                 boost::program_options::value<int>()->default_value(ipv4_udp::default_queue_size),
                 "Default size of the UDPv4 per-channel packet queue")
+        ("ipv4-reassembly-datagrams",
+                boost::program_options::value<unsigned>()->default_value(ipv4::default_reassembly_datagrams),
+                "Maximum number of IPv4 datagrams being reassembled, per shard")
+        ("ipv4-reassembly-memory",
+                boost::program_options::value<size_t>()->default_value(ipv4::default_reassembly_memory),
+                "Maximum memory used by IPv4 datagrams being reassembled, in bytes, per shard")
         ("dhcp",
                 boost::program_options::value<bool>()->default_value(true),
                         "Use DHCP discovery")
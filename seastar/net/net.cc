@@ -23,6 +23,7 @@
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/algorithm/string.hpp>
 #include "net.hh"
+#include "proxy.hh"
 #include <utility>
 #include "toeplitz.hh"
 
@@ -75,7 +76,7 @@ bool qp::poll_tx() {
 
 qp::qp(bool register_copy_stats,
        const std::string stats_plugin_name, uint8_t qid)
-        : _tx_poller(reactor::poller::simple([this] { return poll_tx(); }))
+        : _tx_poller(reactor::poller::simple("net-tx", [this] { return poll_tx(); }))
         , _stats_plugin_name(stats_plugin_name)
         , _queue_name(std::string("queue") + std::to_string(qid))
         , _collectd_regs({
@@ -167,6 +168,31 @@ qp::qp(bool register_copy_stats,
                     , scollectd::make_typed(scollectd::data_type::DERIVE
                     , _stats.rx.good.nr_frags)
             ),
+
+            //
+            // Rx load balancing: DERIVE:0:U
+            //
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "rx-local")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.dispatch.local)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "rx-forwarded")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.dispatch.forwarded)
+            ),
+            scollectd::add_polled_metric(scollectd::type_instance_id(
+                    _stats_plugin_name
+                    , scollectd::per_cpu_plugin_instance
+                    , "total_operations", "rx-steered")
+                    , scollectd::make_typed(scollectd::data_type::DERIVE
+                    , _stats.rx.dispatch.steered)
+            ),
     })
 {
     if (register_copy_stats) {
@@ -253,10 +279,40 @@ device::receive(std::function<future<> (packet)> next_packet) {
     return std::move(sub);
 }
 
+future<> device::steer_flow_here(flow_key key) {
+    if (smp::count == 1 || key.empty()) {
+        return make_ready_future<>();
+    }
+    auto cpu = engine().cpu_id();
+    auto hash = key.rss_hash(rss_key());
+    // qid == cpu_id, as in hash2cpu()
+    auto rx_cpu = hash2qid(hash);
+    auto rss_cpu = hash2cpu(hash);
+    return smp::submit_to(rx_cpu, [this, key, hash, cpu, rss_cpu] {
+        if (cpu == rss_cpu) {
+            local_flow_table().erase(key);
+        } else {
+            local_flow_table().set(key, hash, cpu);
+        }
+    });
+}
+
+future<> device::unsteer_flow_here(flow_key key) {
+    if (smp::count == 1 || key.empty()) {
+        return make_ready_future<>();
+    }
+    auto cpu = engine().cpu_id();
+    auto rx_cpu = hash2qid(key.rss_hash(rss_key()));
+    return smp::submit_to(rx_cpu, [this, key, cpu] {
+        local_flow_table().erase(key, cpu);
+    });
+}
+
 void device::set_local_queue(std::unique_ptr<qp> dev) {
     assert(!_queues[engine().cpu_id()]);
     _queues[engine().cpu_id()] = dev.get();
     engine().at_destroy([dev = std::move(dev)] {});
+    start_packet_forwarding();
 }
 
 
@@ -319,18 +375,18 @@ const rss_key_type& interface::rss_key() const {
     return _dev->rss_key();
 }
 
+future<> interface::steer_flow_here(flow_key key) {
+    return _dev->steer_flow_here(key);
+}
+
+future<> interface::unsteer_flow_here(flow_key key) {
+    return _dev->unsteer_flow_here(key);
+}
+
 void interface::forward(unsigned cpuid, packet p) {
-    static __thread unsigned queue_depth;
-
-    if (queue_depth < 1000) {
-        queue_depth++;
-        auto src_cpu = engine().cpu_id();
-        smp::submit_to(cpuid, [this, p = std::move(p), src_cpu]() mutable {
-            _dev->l2receive(p.free_on_cpu(src_cpu));
-        }).then([] {
-            queue_depth--;
-        });
-    }
+    // dropped if the ring to cpuid is full, as a NIC would when its
+    // receive queue is
+    forward_rx(cpuid, *_dev, p);
 }
 
 future<> interface::dispatch_packet(packet p) {
@@ -339,21 +395,44 @@ future<> interface::dispatch_packet(packet p) {
         auto i = _proto_map.find(ntoh(eh->eth_proto));
         if (i != _proto_map.end()) {
             l3_rx_stream& l3 = i->second;
-            auto fw = _dev->forward_dst(engine().cpu_id(), [&p, &l3, this] () {
-                auto hwrss = p.rss_hash();
-                if (hwrss) {
-                    return hwrss.value();
-                } else {
-                    forward_hash data;
-                    if (l3.forward(data, p, sizeof(eth_hdr))) {
-                        return toeplitz_hash(rss_key(), data);
+            auto& stats = _dev->local_queue()._stats.rx.dispatch;
+            auto& flows = _dev->local_flow_table();
+            auto hwrss = p.rss_hash();
+            unsigned fw;
+            if (flows.empty() || (hwrss && !flows.may_contain(hwrss.value()))) {
+                fw = _dev->forward_dst(engine().cpu_id(), [&p, &l3, &hwrss, this] () {
+                    if (hwrss) {
+                        return hwrss.value();
+                    } else {
+                        forward_hash data;
+                        if (l3.forward(data, p, sizeof(eth_hdr))) {
+                            return toeplitz_hash(rss_key(), data);
+                        }
+                        return 0u;
                     }
-                    return 0u;
+                });
+            } else {
+                // The hash data is collected once, for both the exact
+                // match and the RSS fallback
+                forward_hash data;
+                bool has_data = l3.forward(data, p, sizeof(eth_hdr));
+                auto hash = hwrss ? hwrss.value() : has_data ? toeplitz_hash(rss_key(), data) : 0u;
+                std::experimental::optional<unsigned> steered;
+                if (has_data && flows.may_contain(hash)) {
+                    steered = flows.find(flow_key(eth_protocol_num(i->first), data));
+                }
+                if (steered) {
+                    fw = *steered;
+                    ++stats.steered;
+                } else {
+                    fw = _dev->forward_dst(engine().cpu_id(), [hash] { return hash; });
                 }
-            });
+            }
             if (fw != engine().cpu_id()) {
+                ++stats.forwarded;
                 forward(fw, std::move(p));
             } else {
+                ++stats.local;
                 auto h = ntoh(*eh);
                 auto from = h.src_mac;
                 p.trim_front(sizeof(*eh));
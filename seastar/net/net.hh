@@ -32,6 +32,8 @@
 #include "packet.hh"
 #include "const.hh"
 #include <unordered_map>
+#include <array>
+#include <algorithm>
 
 namespace net {
 
@@ -65,6 +67,103 @@ class forward_hash {
     }
 };
 
+// Identifies a flow by the header fields its RSS hash is computed from,
+// as collected by the l3 and l4 forward functions, in wire byte order.
+class flow_key {
+    static constexpr size_t max_size = 16;
+    uint16_t _proto = 0;
+    uint8_t _size = 0;
+    std::array<uint8_t, max_size> _data = {};
+public:
+    flow_key() = default;
+    // Flows with more hash data than max_size cannot be steered, and
+    // get an empty key
+    flow_key(eth_protocol_num proto, const forward_hash& h) {
+        if (h.size() <= max_size) {
+            _proto = uint16_t(proto);
+            _size = h.size();
+            for (size_t i = 0; i < _size; ++i) {
+                _data[i] = h[i];
+            }
+        }
+    }
+    bool empty() const {
+        return !_size;
+    }
+    bool operator==(const flow_key& x) const {
+        return _proto == x._proto && _size == x._size && _data == x._data;
+    }
+    // The RSS hash of the flow's packets, as the hardware computes it
+    uint32_t rss_hash(const rss_key_type& key) const {
+        forward_hash h;
+        for (size_t i = 0; i < _size; ++i) {
+            h.push_back(_data[i]);
+        }
+        return toeplitz_hash(key, h);
+    }
+    struct hash {
+        size_t operator()(const flow_key& k) const {
+            uint64_t w[2];
+            std::copy_n(k._data.begin(), sizeof(w), reinterpret_cast<uint8_t*>(w));
+            return std::hash<uint64_t>()((w[0] * 0x9e3779b97f4a7c15) ^ w[1] ^ k._proto);
+        }
+    };
+};
+
+// Flows steered away from the cpu RSS sends them to.  Entries are only
+// kept on the cpu whose hardware queue receives the flow's packets.
+class flow_table {
+    static constexpr size_t hash_buckets = 1024;
+    struct entry {
+        unsigned cpu;
+        uint32_t rss_hash;
+    };
+    std::unordered_map<flow_key, entry, flow_key::hash> _flows;
+    // Steered flows per low bits of their RSS hash, so that a packet
+    // carrying a hardware RSS hash no steered flow has is not parsed
+    std::array<uint32_t, hash_buckets> _hash_counts = {};
+public:
+    bool empty() const {
+        return _flows.empty();
+    }
+    bool may_contain(uint32_t rss_hash) const {
+        return _hash_counts[rss_hash % hash_buckets];
+    }
+    std::experimental::optional<unsigned> find(const flow_key& key) const {
+        auto i = _flows.find(key);
+        if (i == _flows.end()) {
+            return {};
+        }
+        return i->second.cpu;
+    }
+    void set(const flow_key& key, uint32_t rss_hash, unsigned cpu) {
+        auto r = _flows.emplace(key, entry{cpu, rss_hash});
+        if (r.second) {
+            ++_hash_counts[rss_hash % hash_buckets];
+        } else {
+            r.first->second.cpu = cpu;
+        }
+    }
+    void erase(const flow_key& key) {
+        auto i = _flows.find(key);
+        if (i != _flows.end()) {
+            erase(i);
+        }
+    }
+    // Removes the flow's entry if it sends the flow to cpu
+    void erase(const flow_key& key, unsigned cpu) {
+        auto i = _flows.find(key);
+        if (i != _flows.end() && i->second.cpu == cpu) {
+            erase(i);
+        }
+    }
+private:
+    void erase(std::unordered_map<flow_key, entry, flow_key::hash>::iterator i) {
+        --_hash_counts[i->second.rss_hash % hash_buckets];
+        _flows.erase(i);
+    }
+};
+
 struct hw_features {
     // Enable tx ip header checksum offload
     bool tx_csum_ip_offload = false;
@@ -133,6 +232,14 @@ class interface {
     }
     uint16_t hw_queues_count();
     const rss_key_type& rss_key() const;
+    // Sends packets of the flow to this cpu, whatever their RSS hash is.
+    // Only the cpu that owns the flow's connection may steer it there: a
+    // TCP segment reaching a cpu without its tcb is answered with a reset,
+    // and connections do not move between cpus.
+    future<> steer_flow_here(flow_key key);
+    // Lets RSS choose the flow's cpu again, unless another cpu has
+    // steered it since
+    future<> unsteer_flow_here(flow_key key);
     friend class l3_protocol;
 };
 
@@ -201,6 +308,12 @@ struct qp_stats {
             uint64_t total;        // total number of erroneous packets
             uint64_t csum;         // packets with bad checksum
         } bad;
+
+        struct {
+            uint64_t local;        // packets processed on this cpu
+            uint64_t forwarded;    // packets sent to another cpu
+            uint64_t steered;      // packets that matched the flow steering table
+        } dispatch;
     } rx;
 
     struct {
@@ -251,15 +364,20 @@ class qp {
     }
     bool poll_tx();
     friend class device;
+    friend class interface;
 };
 
 class device {
 protected:
     std::unique_ptr<qp*[]> _queues;
     size_t _rss_table_bits = 0;
+    // Exact match flow -> cpu, consulted before RSS; one table per cpu,
+    // only used by that cpu, holding the flows its queue receives
+    std::unique_ptr<flow_table[]> _flow_tables;
 public:
     device() {
         _queues = std::make_unique<qp*[]>(smp::count);
+        _flow_tables = std::make_unique<flow_table[]>(smp::count);
     }
     virtual ~device() {};
     qp& queue_for_cpu(unsigned cpu) { return *_queues[cpu]; }
@@ -276,6 +394,14 @@ class device {
         return hash % hw_queues_count();
     }
     void set_local_queue(std::unique_ptr<qp> dev);
+    flow_table& local_flow_table() { return _flow_tables[engine().cpu_id()]; }
+    // Steers the flow to the calling cpu, see interface::steer_flow_here(),
+    // replacing an entry a former owner of the flow left.  Only the cpu
+    // receiving the flow's packets from the hardware keeps an entry, and
+    // none is kept if RSS already sends the flow to the calling cpu.
+    // Updates issued from one cpu are applied in order.
+    future<> steer_flow_here(flow_key key);
+    future<> unsteer_flow_here(flow_key key);
     template <typename Func>
     unsigned forward_dst(unsigned src_cpuid, Func&& hashfn) {
         auto& qp = queue_for_cpu(src_cpuid);
@@ -259,6 +259,14 @@ class packet final {
 
     packet free_on_cpu(unsigned cpu, std::function<void()> cb = []{});
 
+    // Replaces the deleter of the packet's data with d, and returns the
+    // previous one; for moving packets between cpus without free_on_cpu().
+    deleter exchange_deleter(deleter d) {
+        auto old = std::move(_impl->_deleter);
+        _impl->_deleter = std::move(d);
+        return old;
+    }
+
     void linearize() { return linearize(0, len()); }
 
     void reset() { _impl.reset(); }
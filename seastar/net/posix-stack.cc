@@ -24,6 +24,29 @@
 #include "packet.hh"
 #include "api.hh"
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <array>
+#include <climits>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 namespace net {
 
@@ -132,13 +155,49 @@ data_source posix_data_source(pollable_fd& fd) {
     return data_source(std::make_unique<posix_data_source_impl>(fd));
 }
 
+thread_local size_t posix_data_source_impl::max_buf_size = 128 * 1024;
+
+void
+posix_data_source_impl::prepare_buffer() {
+    if (_buf && _buf_capacity == _buf_size && _buf_deleter.is_unique()) {
+        return;
+    }
+    _buf_deleter = deleter();
+    _buf = static_cast<char*>(::malloc(_buf_size));
+    if (!_buf) {
+        throw std::bad_alloc();
+    }
+    _buf_capacity = _buf_size;
+    _buf_deleter = make_free_deleter(_buf);
+}
+
+void
+posix_data_source_impl::adapt_buffer_size(size_t read) {
+    if (read == _buf_size) {
+        _buf_size = std::max(std::min(_buf_size * 2, max_buf_size), _buf_size);
+        _small_reads = 0;
+    } else if (read && read <= _buf_size / 4 && _buf_size > min_buf_size) {
+        if (++_small_reads == small_reads_to_shrink) {
+            _buf_size = std::max(_buf_size / 2, size_t(min_buf_size));
+            _small_reads = 0;
+        }
+    } else {
+        _small_reads = 0;
+    }
+}
+
 future<temporary_buffer<char>>
 posix_data_source_impl::get() {
-    return _fd.read_some(_buf.get_write(), _buf_size).then([this] (size_t size) {
-        _buf.trim(size);
-        auto ret = std::move(_buf);
-        _buf = temporary_buffer<char>(_buf_size);
-        return make_ready_future<temporary_buffer<char>>(std::move(ret));
+    prepare_buffer();
+    return _fd.read_some(_buf, _buf_capacity).then([this] (size_t size) {
+        if (!size) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        adapt_buffer_size(size);
+        if (size < _buf_capacity / small_read_copy_fraction) {
+            return make_ready_future<temporary_buffer<char>>(temporary_buffer<char>(_buf, size));
+        }
+        return make_ready_future<temporary_buffer<char>>(temporary_buffer<char>(_buf, size, _buf_deleter.share()));
     });
 }
 
@@ -164,17 +223,307 @@ std::vector<iovec> to_iovec(std::vector<temporary_buffer<char>>& buf_vec) {
     return v;
 }
 
+thread_local size_t posix_data_sink_impl::zerocopy_threshold = 0;
+thread_local lowres_clock::duration posix_data_sink_impl::zerocopy_close_timeout = std::chrono::seconds(10);
+
+posix_data_sink_impl::~posix_data_sink_impl() {
+    if (_zerocopy && !_zerocopy->sends.empty()) {
+        // The reaper keeps the sends; do not let it wait forever
+        _zerocopy->abort_after(zerocopy_close_timeout);
+    }
+}
+
 future<>
 posix_data_sink_impl::put(temporary_buffer<char> buf) {
+    if (_zerocopy_threshold && buf.size() >= _zerocopy_threshold) {
+        return put(packet(fragment{buf.get_write(), buf.size()}, buf.release()));
+    }
     return _fd.write_all(buf.get(), buf.size()).then([d = buf.release()] {});
 }
 
 future<>
 posix_data_sink_impl::put(packet p) {
+    if (_zerocopy) {
+        if (_zerocopy->error) {
+            return make_exception_future<>(_zerocopy->error);
+        }
+        if (_zerocopy->copied) {
+            // The device cannot send from our memory, so the kernel
+            // copied anyway; do it ourselves, it is cheaper.
+            _zerocopy_threshold = 0;
+        }
+    }
     _p = std::move(p);
+    if (_zerocopy_threshold && _p.len() >= _zerocopy_threshold && enable_zerocopy()) {
+        _zerocopy->sends.emplace_back(_zerocopy->next_id, _p.share());
+        return put_zerocopy();
+    }
     return _fd.write_all(_p).then([this] { _p.reset(); });
 }
 
+bool
+posix_data_sink_impl::enable_zerocopy() {
+    if (!_zerocopy) {
+        try {
+            _fd.get_file_desc().setsockopt(SOL_SOCKET, SO_ZEROCOPY, 1);
+            _zerocopy = make_lw_shared<zerocopy_state>(_fd.get_file_desc().dup());
+            _zerocopy_status.enabled = true;
+        } catch (std::system_error& e) {
+            // Before Linux 4.14
+            _zerocopy_threshold = 0;
+        }
+    }
+    return bool(_zerocopy);
+}
+
+// Sends _p, the data of the last of _zerocopy->sends
+future<>
+posix_data_sink_impl::put_zerocopy() {
+    return _fd.write_some(_p, MSG_ZEROCOPY).then_wrapped([this] (future<size_t> f) {
+        if (_zerocopy->aborted) {
+            f.ignore_ready_future();
+            _p.reset();
+            return make_exception_future<>(_zerocopy->error);
+        }
+        try {
+            auto size = f.get0();
+            auto& zs = _zerocopy->sends.back();
+            ++zs.ids;
+            ++zs.outstanding;
+            ++_zerocopy->next_id;
+            if (size < _p.len()) {
+                _p.trim_front(size);
+                return put_zerocopy();
+            }
+        } catch (std::system_error& e) {
+            if (e.code().value() == ENOBUFS) {
+                // Too many sends waiting for completion; copy the rest
+                return _fd.write_all(_p).finally([this] {
+                    finish_zerocopy_send();
+                });
+            }
+            finish_zerocopy_send();
+            throw;
+        }
+        finish_zerocopy_send();
+        return make_ready_future<>();
+    });
+}
+
+void
+posix_data_sink_impl::finish_zerocopy_send() {
+    _p.reset();
+    if (_zerocopy->aborted) {
+        return;
+    }
+    --_zerocopy->sends.back().outstanding;
+    _zerocopy->release();
+    if (!_zerocopy->reaping && !_zerocopy->sends.empty()) {
+        _zerocopy->reaping = true;
+        reap_zerocopy(_zerocopy);
+    }
+}
+
+// Waits for and processes completions until no zero-copy send is left.
+// Holds the state, so it may outlive the sink.
+future<>
+posix_data_sink_impl::reap_zerocopy(lw_shared_ptr<zerocopy_state> zs) {
+    if (zs->sends.empty() || zs->aborted) {
+        zs->sends.clear();
+        zs->reaping = false;
+        zs->abort_timer.cancel();
+        if (zs->drained) {
+            zs->drained->set_value();
+            zs->drained = {};
+        }
+        return make_ready_future<>();
+    }
+    return zs->fd.error_queue_readable().then_wrapped([zs] (future<> f) {
+        try {
+            f.get();
+        } catch (...) {
+            // abort() closed the socket under us
+            return reap_zerocopy(std::move(zs));
+        }
+        try {
+            if (!zs->read_completions()) {
+                // EPOLLERR for a pending socket error, not for the error
+                // queue; take the error, or we would be woken again right
+                // away, and report it to the next put()
+                auto err = zs->fd.get_file_desc().getsockopt<int>(SOL_SOCKET, SO_ERROR);
+                if (err) {
+                    zs->error = std::make_exception_ptr(std::system_error(err, std::system_category()));
+                }
+            }
+        } catch (...) {
+            // Without completions we cannot tell when the sends are free
+            zs->abort();
+            zs->error = std::current_exception();
+        }
+        return reap_zerocopy(std::move(zs));
+    });
+}
+
+posix_data_sink_impl::zerocopy_state::zerocopy_state(file_desc fd)
+        : fd(std::move(fd)), abort_timer([this] { abort(); }) {
+}
+
+void
+posix_data_sink_impl::zerocopy_state::abort_after(lowres_clock::duration timeout) {
+    if (!abort_timer.armed() && !aborted) {
+        abort_timer.arm(timeout);
+    }
+}
+
+// Resets the connection: the kernel drops what it has not sent yet and
+// will not send anything any more, so the remaining sends can be freed
+// without waiting for their completions.
+void
+posix_data_sink_impl::zerocopy_state::abort() {
+    aborted = true;
+    error = std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category()));
+    try {
+        // Make the final close send a reset rather than wait, even if
+        // the socket outlives us
+        ::linger l = { 1, 0 };
+        fd.get_file_desc().setsockopt(SOL_SOCKET, SO_LINGER, l);
+        // and reset the connection now, as the sink may still have the
+        // socket open: connecting to AF_UNSPEC disconnects a TCP socket.
+        ::sockaddr sa = {};
+        sa.sa_family = AF_UNSPEC;
+        fd.get_file_desc().connect(sa, sizeof(sa));
+    } catch (std::system_error& e) {
+        // the connection is already gone
+    }
+    sends.clear();
+    // Wakes the reaper with a broken promise
+    fd.close();
+}
+
+bool
+posix_data_sink_impl::zerocopy_state::read_completions() {
+    bool found = false;
+    for (;;) {
+        union {
+            char buf[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+            cmsghdr align;
+        } control;
+        msghdr mh = {};
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        if (!fd.get_file_desc().recvmsg(&mh, MSG_ERRQUEUE)) {
+            break;
+        }
+        found = true;
+        for (auto cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno) {
+                continue;
+            }
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied = true;
+            }
+            // ids ee_info to ee_data, inclusive
+            for (uint32_t id = ee.ee_info; ; ++id) {
+                completed(id);
+                if (id == ee.ee_data) {
+                    break;
+                }
+            }
+        }
+    }
+    release();
+    return found;
+}
+
+void
+posix_data_sink_impl::zerocopy_state::completed(uint32_t id) {
+    // Completions usually come in order, so the send is usually the first
+    for (auto& zs : sends) {
+        if (uint32_t(id - zs.first_id) < zs.ids) {
+            if (!--zs.outstanding) {
+                zs.p.reset();
+            }
+            return;
+        }
+    }
+}
+
+void
+posix_data_sink_impl::zerocopy_state::release() {
+    while (!sends.empty() && !sends.front().outstanding) {
+        sends.pop_front();
+    }
+}
+
+posix_data_sink_impl::zerocopy_status
+posix_data_sink_impl::get_zerocopy_status() const {
+    auto status = _zerocopy_status;
+    if (_zerocopy) {
+        status.copied |= _zerocopy->copied;
+        status.aborted |= _zerocopy->aborted;
+    }
+    return status;
+}
+
+void
+posix_data_sink_impl::drop_zerocopy() {
+    _zerocopy_status = get_zerocopy_status();
+    _zerocopy = {};
+}
+
+void
+posix_data_sink_impl::abort_zerocopy() {
+    if (_zerocopy && !_zerocopy->aborted) {
+        _zerocopy->abort_timer.cancel();
+        _zerocopy->abort();
+    }
+}
+
+future<>
+posix_data_sink_impl::close() {
+    if (!_zerocopy || _zerocopy->sends.empty()) {
+        drop_zerocopy();
+        _fd.close();
+        return make_ready_future<>();
+    }
+    // The kernel may still send, and resend, data of zero-copy sends
+    // until it reports them complete, so they must not be freed before.
+    // Let the peer know we are done, so it acks everything soon, and
+    // reset the connection if it does not.
+    try {
+        _fd.shutdown(SHUT_WR);
+    } catch (std::system_error& e) {
+        // not connected any more; the reset below frees the sends
+    }
+    _zerocopy->abort_after(zerocopy_close_timeout);
+    _zerocopy->drained = promise<>();
+    return _zerocopy->drained->get_future().then([this] {
+        drop_zerocopy();
+        _fd.close();
+    });
+}
+
+boost::program_options::options_description posix_net_options() {
+    boost::program_options::options_description opts(
+            "Posix networking stack options");
+    opts.add_options()
+        ("posix-receive-buffer-max",
+                boost::program_options::value<size_t>()->default_value(128 * 1024),
+                "largest buffer to read TCP data into; buffers grow towards it while reads fill them")
+        ("posix-zerocopy-threshold",
+                boost::program_options::value<size_t>()->default_value(0),
+                "send TCP writes of at least this many bytes with MSG_ZEROCOPY, "
+                "keeping their buffers until the kernel is done with them (0: disabled)")
+        ;
+    return opts;
+}
+
 server_socket
 posix_network_stack::listen(socket_address sa, listen_options opt) {
     if (_reuseport)
@@ -210,72 +559,218 @@ posix_ap_network_stack::connect(socket_address sa, socket_address local) {
     });
 }
 
-struct cmsg_with_pktinfo {
-    struct cmsghdrcmh;
-    struct in_pktinfo pktinfo;
+// Control messages a datagram may be received with
+union recv_cmsg {
+    char buf[CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(int))];
+    cmsghdr align;
+};
+
+union send_cmsg {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    cmsghdr align;
 };
 
 class posix_udp_channel : public udp_channel_impl {
 private:
     static constexpr int MAX_DATAGRAM_SIZE = 65507;
+    // Datagrams received by one recvmmsg()
+    static constexpr size_t recv_batch = 16;
+    // Datagrams are received into consecutive slices of a shared area, so
+    // small ones cost neither an allocation nor a copy.  What does not fit
+    // a slice goes to an overflow buffer of the message, and is copied out
+    // of it.  An area is freed when all the datagrams received into it are.
+    //
+    // Every message of a batch needs an overflow buffer, so a batch only
+    // grows to recv_batch messages while receives keep filling it.
+    static constexpr size_t recv_slice = 2048;
+    static constexpr size_t recv_area_size = 4 * recv_batch * recv_slice;
+    // Datagrams sent by one sendmmsg()
+    static constexpr size_t send_batch = 64;
+    // With UDP GSO, datagrams of the same size to the same destination are
+    // sent as one message and split by the kernel or the NIC.  Segments
+    // must fit the path MTU, which we do not know, so only datagrams that
+    // fit an ethernet frame are coalesced.
+    static constexpr size_t max_gso_segment = 1472;
+    static constexpr size_t max_gso_segments = 64;
     struct recv_ctx {
-        struct msghdr _hdr;
-        struct iovec _iov;
-        socket_address _src_addr;
-        char* _buffer;
-        cmsg_with_pktinfo _cmsg;
-
-        recv_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_iov = &_iov;
-            _hdr.msg_iovlen = 1;
-            _hdr.msg_name = &_src_addr.u.sa;
-            _hdr.msg_namelen = sizeof(_src_addr.u.sas);
-            memset(&_cmsg, 0, sizeof(_cmsg));
-            _hdr.msg_control = &_cmsg;
-            _hdr.msg_controllen = sizeof(_cmsg);
+        std::array<mmsghdr, recv_batch> _msgs;
+        std::array<std::array<iovec, 2>, recv_batch> _iovecs;
+        std::array<socket_address, recv_batch> _src_addrs;
+        std::array<recv_cmsg, recv_batch> _cmsgs;
+        std::array<std::unique_ptr<char[]>, recv_batch> _overflow;
+        temporary_buffer<char> _area;
+        size_t _batch = 1;
+
+        // Returns the number of messages set up
+        size_t prepare() {
+            if (_area.size() < recv_slice) {
+                _area = temporary_buffer<char>(recv_area_size);
+            }
+            auto n = std::min(_batch, _area.size() / recv_slice);
+            for (size_t i = 0; i < n; ++i) {
+                if (!_overflow[i]) {
+                    _overflow[i].reset(new char[MAX_DATAGRAM_SIZE - recv_slice]);
+                }
+                _iovecs[i][0] = {_area.get_write() + i * recv_slice, recv_slice};
+                _iovecs[i][1] = {_overflow[i].get(), MAX_DATAGRAM_SIZE - recv_slice};
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr.msg_iov = _iovecs[i].data();
+                hdr.msg_iovlen = _iovecs[i].size();
+                hdr.msg_name = &_src_addrs[i].u.sa;
+                hdr.msg_namelen = sizeof(_src_addrs[i].u.sas);
+                hdr.msg_control = _cmsgs[i].buf;
+                hdr.msg_controllen = sizeof(_cmsgs[i].buf);
+                hdr.msg_flags = 0;
+            }
+            return n;
         }
-
-        void prepare() {
-            _buffer = new char[MAX_DATAGRAM_SIZE];
-            _iov.iov_base = _buffer;
-            _iov.iov_len = MAX_DATAGRAM_SIZE;
+        packet take(size_t i) {
+            auto size = _msgs[i].msg_len;
+            auto head = _area.share(i * recv_slice, std::min(size_t(size), size_t(recv_slice)));
+            packet p(fragment{head.get_write(), head.size()}, head.release());
+            if (size > recv_slice) {
+                // a copy, rather than pin the whole buffer
+                p = packet(std::move(p), fragment{_overflow[i].get(), size - recv_slice});
+            }
+            return p;
         }
+        // n of the messages prepared were received
+        void consumed(size_t prepared, size_t n) {
+            _area.trim_front(n * recv_slice);
+            if (n == prepared && _batch < recv_batch) {
+                _batch *= 2;
+            } else if (_batch > 1 && n <= _batch / 4) {
+                _batch /= 2;
+                for (size_t i = _batch; i < recv_batch; ++i) {
+                    _overflow[i].reset();
+                }
+            }
+        }
+    };
+    struct send_request {
+        ipv4_addr dst;
+        packet p;
+        promise<> pr;
+        send_request(ipv4_addr dst, packet p) : dst(dst), p(std::move(p)) {}
     };
     struct send_ctx {
-        struct msghdr _hdr;
-        std::vector<struct iovec> _iovecs;
-        socket_address _dst;
-        packet _p;
-
-        send_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_name = &_dst.u.sa;
-            _hdr.msg_namelen = sizeof(_dst.u.sas);
+        std::array<mmsghdr, send_batch> _msgs;
+        std::array<socket_address, send_batch> _dsts;
+        std::array<send_cmsg, send_batch> _cmsgs;
+        // Number of queued requests each message carries
+        std::array<size_t, send_batch> _requests;
+        std::array<size_t, send_batch> _first_iovec;
+        std::vector<iovec> _iovecs;
+
+        void add_iovecs(const packet& p) {
+            for (auto&& f : p.fragments()) {
+                _iovecs.push_back({f.base, f.size});
+            }
         }
-
-        void prepare(ipv4_addr dst, packet p) {
-            _dst = make_ipv4_address(dst);
-            _p = std::move(p);
-            _iovecs = std::move(to_iovec(_p));
-            _hdr.msg_iov = _iovecs.data();
-            _hdr.msg_iovlen = _iovecs.size();
+        // Returns the number of messages set up; datagrams to destinations
+        // gso_allowed() accepts may be coalesced.
+        template <typename Func>
+        size_t prepare(circular_buffer<send_request>& q, Func&& gso_allowed) {
+            _iovecs.clear();
+            size_t n = 0;
+            size_t i = 0;
+            while (i < q.size() && n < send_batch) {
+                auto& first = q[i++];
+                auto segment = first.p.len();
+                size_t total = segment;
+                _requests[n] = 1;
+                _first_iovec[n] = _iovecs.size();
+                add_iovecs(first.p);
+                auto gso = i < q.size() && segment && segment <= max_gso_segment && gso_allowed(first.dst);
+                while (gso && i < q.size() && _requests[n] < max_gso_segments) {
+                    auto& next = q[i];
+                    auto len = next.p.len();
+                    if (next.dst.ip != first.dst.ip || next.dst.port != first.dst.port
+                            || !len || len > segment || total + len > size_t(MAX_DATAGRAM_SIZE)
+                            || _iovecs.size() - _first_iovec[n] + next.p.nr_frags() > IOV_MAX) {
+                        break;
+                    }
+                    add_iovecs(next.p);
+                    total += len;
+                    ++_requests[n];
+                    ++i;
+                    // only the last segment may be shorter
+                    if (len < segment) {
+                        break;
+                    }
+                }
+                _dsts[n] = make_ipv4_address(first.dst);
+                auto& hdr = _msgs[n].msg_hdr;
+                hdr = {};
+                hdr.msg_name = &_dsts[n].u.sa;
+                hdr.msg_namelen = sizeof(_dsts[n].u.sas);
+                if (_requests[n] > 1) {
+                    hdr.msg_control = _cmsgs[n].buf;
+                    hdr.msg_controllen = sizeof(_cmsgs[n].buf);
+                    auto cmsg = CMSG_FIRSTHDR(&hdr);
+                    cmsg->cmsg_level = SOL_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t gso_size = segment;
+                    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+                }
+                ++n;
+            }
+            // _iovecs may have been reallocated while it grew
+            for (size_t j = 0; j < n; ++j) {
+                auto end = j + 1 < n ? _first_iovec[j + 1] : _iovecs.size();
+                _msgs[j].msg_hdr.msg_iov = _iovecs.data() + _first_iovec[j];
+                _msgs[j].msg_hdr.msg_iovlen = end - _first_iovec[j];
+            }
+            return n;
         }
     };
     std::unique_ptr<pollable_fd> _fd;
     ipv4_addr _address;
     recv_ctx _recv;
+    circular_buffer<udp_datagram> _received;
     send_ctx _send;
+    circular_buffer<send_request> _send_queue;
+    // Sends queued by tasks are flushed once they ran, in one sendmmsg()
+    reactor::poller _send_poller;
+    bool _send_blocked = false;
+    bool _gso = false;
+    // Destinations GSO failed for (by gso_key()), until when we do not
+    // try it again
+    std::unordered_map<uint64_t, lowres_clock::time_point> _no_gso;
+    static constexpr size_t max_no_gso = 256;
+    // Tells continuations whether the channel is still open
+    lw_shared_ptr<bool> _open = make_lw_shared<bool>(true);
     bool _closed;
+private:
+    static uint64_t gso_key(ipv4_addr dst) {
+        return uint64_t(dst.ip) << 16 | dst.port;
+    }
+    bool gso_allowed(ipv4_addr dst);
+    void disable_gso(ipv4_addr dst);
+    void received(size_t i);
+    bool flush_sends();
+    void complete_sends(size_t msgs, std::exception_ptr ex = {});
 public:
     posix_udp_channel(ipv4_addr bind_address)
-            : _closed(false) {
+            : _send_poller(reactor::poller::passive("posix-udp-send", [this] { return flush_sends(); }))
+            , _closed(false) {
         auto sa = make_ipv4_address(bind_address);
         file_desc fd = file_desc::socket(sa.u.sa.sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         fd.setsockopt(SOL_IP, IP_PKTINFO, true);
         if (engine().posix_reuseport_available()) {
             fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
         }
+        // UDP GSO and GRO are only available since Linux 4.18 and 5.0
+        try {
+            fd.getsockopt<int>(SOL_UDP, UDP_SEGMENT);
+            _gso = true;
+        } catch (std::system_error& e) {
+        }
+        try {
+            fd.setsockopt(SOL_UDP, UDP_GRO, 1);
+        } catch (std::system_error& e) {
+        }
         fd.bind(sa.u.sa, sizeof(sa.u.sas));
         _address = ipv4_addr(fd.get_address());
         _fd = std::make_unique<pollable_fd>(std::move(fd));
@@ -286,22 +781,99 @@ class posix_udp_channel : public udp_channel_impl {
     virtual future<> send(ipv4_addr dst, packet p);
     virtual void close() override {
         _closed = true;
+        *_open = false;
+        auto ex = std::make_exception_ptr(std::system_error(ECONNABORTED, std::system_category()));
+        for (auto&& req : _send_queue) {
+            req.pr.set_exception(ex);
+        }
+        _send_queue.clear();
         _fd.reset();
     }
     virtual bool is_closed() const override { return _closed; }
 };
 
 future<> posix_udp_channel::send(ipv4_addr dst, const char *message) {
-    auto len = strlen(message);
-    return _fd->sendto(make_ipv4_address(dst), message, len)
-            .then([len] (size_t size) { assert(size == len); });
+    return send(dst, packet(message, strlen(message)));
 }
 
 future<> posix_udp_channel::send(ipv4_addr dst, packet p) {
-    auto len = p.len();
-    _send.prepare(dst, std::move(p));
-    return _fd->sendmsg(&_send._hdr)
-            .then([len] (size_t size) { assert(size == len); });
+    _send_queue.emplace_back(dst, std::move(p));
+    return _send_queue.back().pr.get_future();
+}
+
+bool posix_udp_channel::flush_sends() {
+    if (_closed || _send_blocked || _send_queue.empty()) {
+        return false;
+    }
+    auto n = _send.prepare(_send_queue, [this] (ipv4_addr dst) { return gso_allowed(dst); });
+    boost::optional<size_t> sent;
+    try {
+        sent = _fd->get_file_desc().sendmmsg(_send._msgs.data(), n, 0);
+    } catch (std::system_error& e) {
+        // sendmmsg() fails only if the first message does
+        auto err = e.code().value();
+        if (_send._requests[0] > 1 && (err == EIO || err == EINVAL)) {
+            // The device or the path to the destination cannot do GSO;
+            // send datagrams to it one by one for a while
+            disable_gso(_send_queue.front().dst);
+        } else {
+            complete_sends(1, std::current_exception());
+        }
+        return true;
+    }
+    if (!sent) {
+        _send_blocked = true;
+        _fd->writeable().then_wrapped([this, open = _open] (future<> f) {
+            f.ignore_ready_future();
+            if (*open) {
+                _send_blocked = false;
+            }
+        });
+        return true;
+    }
+    complete_sends(*sent);
+    return true;
+}
+
+bool posix_udp_channel::gso_allowed(ipv4_addr dst) {
+    if (!_gso) {
+        return false;
+    }
+    if (_no_gso.empty()) {
+        return true;
+    }
+    auto i = _no_gso.find(gso_key(dst));
+    if (i == _no_gso.end()) {
+        return true;
+    }
+    if (lowres_clock::now() < i->second) {
+        return false;
+    }
+    _no_gso.erase(i);
+    return true;
+}
+
+void posix_udp_channel::disable_gso(ipv4_addr dst) {
+    if (_no_gso.size() >= max_no_gso) {
+        // Forget them all rather than track each expiry; they fail again
+        // at most once each.
+        _no_gso.clear();
+    }
+    _no_gso[gso_key(dst)] = lowres_clock::now() + std::chrono::seconds(10);
+}
+
+void posix_udp_channel::complete_sends(size_t msgs, std::exception_ptr ex) {
+    for (size_t i = 0; i < msgs; ++i) {
+        for (size_t j = 0; j < _send._requests[i]; ++j) {
+            auto& req = _send_queue.front();
+            if (ex) {
+                req.pr.set_exception(ex);
+            } else {
+                req.pr.set_value();
+            }
+            _send_queue.pop_front();
+        }
+    }
 }
 
 udp_channel
@@ -322,13 +894,48 @@ class posix_datagram : public udp_datagram_impl {
     virtual packet& get_data() override { return _p; }
 };
 
+void posix_udp_channel::received(size_t i) {
+    auto& hdr = _recv._msgs[i].msg_hdr;
+    auto dst = _address;
+    size_t gro_size = 0;
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            in_pktinfo pktinfo;
+            memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+            dst = ipv4_addr(pktinfo.ipi_addr.s_addr, _address.port);
+        } else if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            gro_size = size;
+        }
+    }
+    ipv4_addr src = _recv._src_addrs[i];
+    auto p = _recv.take(i);
+    if (!gro_size || p.len() <= gro_size) {
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, std::move(p))));
+        return;
+    }
+    // Datagrams coalesced by GRO, all of gro_size bytes but the last
+    for (size_t off = 0; off < p.len(); off += gro_size) {
+        auto len = std::min(gro_size, p.len() - off);
+        _received.push_back(udp_datagram(std::make_unique<posix_datagram>(src, dst, p.share(off, len))));
+    }
+}
+
 future<udp_datagram>
 posix_udp_channel::receive() {
-    _recv.prepare();
-    return _fd->recvmsg(&_recv._hdr).then([this] (size_t size) {
-        auto dst = ipv4_addr(_recv._cmsg.pktinfo.ipi_addr.s_addr, _address.port);
-        return make_ready_future<udp_datagram>(udp_datagram(std::make_unique<posix_datagram>(
-            _recv._src_addr, dst, packet(fragment{_recv._buffer, size}, make_deleter([buf = _recv._buffer] { delete[] buf; })))));
+    if (!_received.empty()) {
+        auto dgram = std::move(_received.front());
+        _received.pop_front();
+        return make_ready_future<udp_datagram>(std::move(dgram));
+    }
+    auto prepared = _recv.prepare();
+    return _fd->recvmmsg(_recv._msgs.data(), prepared).then([this, prepared] (size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            received(i);
+        }
+        _recv.consumed(prepared, n);
+        return receive();
     });
 }
 
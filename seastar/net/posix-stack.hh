@@ -30,28 +30,111 @@ namespace net {
 
 data_source posix_data_source(pollable_fd& fd);
 data_sink posix_data_sink(pollable_fd& fd);
+boost::program_options::options_description posix_net_options();
 
+// Reads into a buffer whose size follows the sizes of the reads: it
+// doubles when a read fills it, since more data is then likely waiting
+// (and read_some() speculates so, skipping epoll for the next read), and
+// halves after a run of reads that used a quarter of it or less.  The
+// buffer is reused for the next read if the consumer already dropped
+// what it got from the previous one; reads of less than an eighth of it
+// are copied out, so that they do not keep all of it alive.
 class posix_data_source_impl final : public data_source_impl {
+    static constexpr size_t min_buf_size = 1024;
+    static constexpr unsigned small_reads_to_shrink = 8;
+    static constexpr unsigned small_read_copy_fraction = 8;
     pollable_fd& _fd;
-    temporary_buffer<char> _buf;
+    char* _buf = nullptr;
+    size_t _buf_capacity = 0;
+    deleter _buf_deleter;
     size_t _buf_size;
+    unsigned _small_reads = 0;
+private:
+    void prepare_buffer();
+    void adapt_buffer_size(size_t read);
 public:
+    // Largest buffer to read into; set from --posix-receive-buffer-max.
+    static thread_local size_t max_buf_size;
     explicit posix_data_source_impl(pollable_fd& fd, size_t buf_size = 8192)
-        : _fd(fd), _buf(buf_size), _buf_size(buf_size) {}
+        : _fd(fd), _buf_size(std::max(std::min(buf_size, max_buf_size), size_t(min_buf_size))) {}
     virtual future<temporary_buffer<char>> get() override;
+    // Size of the buffer the next read allocates
+    size_t buffer_size() const { return _buf_size; }
 };
 
 class posix_data_sink_impl : public data_sink_impl {
+    // A packet sent with MSG_ZEROCOPY, kept until the kernel reports it
+    // no longer needs its data.  Every sendmsg() that sends something
+    // gets the next notification id of the socket.
+    struct zerocopy_send {
+        uint32_t first_id;
+        uint32_t ids = 0;
+        // ids not reported yet, plus one until the last sendmsg()
+        uint32_t outstanding = 1;
+        packet p;
+        zerocopy_send(uint32_t first_id, packet p) : first_id(first_id), p(std::move(p)) {}
+    };
+    // Zero-copy sends the kernel has not reported complete yet.  Shared
+    // with the reaper, which keeps it, and the duplicate of the socket it
+    // reads completions from, until they are, even if the sink is gone.
+    struct zerocopy_state {
+        pollable_fd fd;
+        uint32_t next_id = 0;
+        circular_buffer<zerocopy_send> sends;
+        bool reaping = false;
+        // the kernel copied the data anyway
+        bool copied = false;
+        bool aborted = false;
+        std::exception_ptr error;
+        std::experimental::optional<promise<>> drained;
+        timer<lowres_clock> abort_timer;
+        explicit zerocopy_state(file_desc fd);
+        void abort_after(lowres_clock::duration timeout);
+        void abort();
+        bool read_completions();
+        void completed(uint32_t id);
+        void release();
+    };
+public:
+    // What became of zero-copy sends; kept when close() drops their state
+    struct zerocopy_status {
+        // the socket accepted SO_ZEROCOPY
+        bool enabled = false;
+        // the kernel copied the data anyway
+        bool copied = false;
+        // sends were dropped by resetting the connection
+        bool aborted = false;
+    };
+private:
     pollable_fd& _fd;
     packet _p;
+    size_t _zerocopy_threshold;
+    lw_shared_ptr<zerocopy_state> _zerocopy;
+    zerocopy_status _zerocopy_status;
+private:
+    bool enable_zerocopy();
+    void drop_zerocopy();
+    future<> put_zerocopy();
+    void finish_zerocopy_send();
+    static future<> reap_zerocopy(lw_shared_ptr<zerocopy_state> zs);
 public:
-    explicit posix_data_sink_impl(pollable_fd& fd) : _fd(fd) {}
+    // Packets of at least this many bytes are sent with MSG_ZEROCOPY,
+    // if nonzero; set from --posix-zerocopy-threshold.
+    static thread_local size_t zerocopy_threshold;
+    // How long close(), or a destroyed sink, waits for the kernel to
+    // complete zero-copy sends before resetting the connection
+    static thread_local lowres_clock::duration zerocopy_close_timeout;
+    explicit posix_data_sink_impl(pollable_fd& fd) : _fd(fd), _zerocopy_threshold(zerocopy_threshold) {}
+    ~posix_data_sink_impl();
+    // Whether large packets are still sent with MSG_ZEROCOPY
+    bool zerocopy() const { return _zerocopy_threshold && !get_zerocopy_status().copied; }
+    zerocopy_status get_zerocopy_status() const;
+    // Resets the connection now rather than wait for the kernel to
+    // complete zero-copy sends, as close() does after zerocopy_close_timeout
+    void abort_zerocopy();
     future<> put(packet p) override;
     future<> put(temporary_buffer<char> buf) override;
-    future<> close() override {
-        _fd.close();
-        return make_ready_future<>();
-    }
+    future<> close() override;
 };
 
 class posix_ap_server_socket_impl : public server_socket_impl {
@@ -92,7 +175,14 @@ class posix_network_stack : public network_stack {
 private:
     const bool _reuseport;
 public:
-    explicit posix_network_stack(boost::program_options::variables_map opts) : _reuseport(engine().posix_reuseport_available()) {}
+    explicit posix_network_stack(boost::program_options::variables_map opts) : _reuseport(engine().posix_reuseport_available()) {
+        if (opts.count("posix-zerocopy-threshold")) {
+            posix_data_sink_impl::zerocopy_threshold = opts["posix-zerocopy-threshold"].as<size_t>();
+        }
+        if (opts.count("posix-receive-buffer-max")) {
+            posix_data_source_impl::max_buf_size = opts["posix-receive-buffer-max"].as<size_t>();
+        }
+    }
     virtual server_socket listen(socket_address sa, listen_options opts) override;
     virtual future<connected_socket> connect(socket_address sa, socket_address local) override;
     virtual net::udp_channel make_udp_channel(ipv4_addr addr) override;
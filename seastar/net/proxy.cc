@@ -18,16 +18,320 @@
 #include "core/reactor.hh"
 #include "proxy.hh"
 #include <utility>
+#include <atomic>
+#include <experimental/optional>
+#include <boost/lockfree/spsc_queue.hpp>
 
 namespace net {
 
+namespace {
+
+struct forwarded_packet;
+
+// The deleter of a packet while it is on another shard.  Destroying it
+// gives the forwarded_packet, which holds the packet's original deleter,
+// back to the shard the packet came from.
+struct return_deleter final : deleter::impl {
+    forwarded_packet* _fp;
+    explicit return_deleter(forwarded_packet* fp) : impl(deleter()), _fp(fp) {}
+    virtual ~return_deleter() override;
+    // the storage belongs to the forwarded_packet
+    static void operator delete(void*) {}
+};
+
+// Allocated from a pool on the shard the packet came from, and reused
+// once it is given back.
+struct forwarded_packet {
+    packet p;
+    // the packet is sent by tx_queue if set, or received by rx_device
+    qp* tx_queue;
+    device* rx_device;
+    deleter original;
+    unsigned origin;
+    unsigned target;
+    std::aligned_storage_t<sizeof(return_deleter), alignof(return_deleter)> deleter_storage;
+};
+
+static constexpr size_t ring_length = 256;
+static constexpr size_t poll_batch = 64;
+// Packets a shard may have sent through another shard's queue and not
+// seen freed yet; the rest waits in the proxy, rather than pile up in
+// the other shard's queue when the device is slower than we are.
+static constexpr size_t max_tx_in_flight = 128;
+
+using ring = boost::lockfree::spsc_queue<forwarded_packet*,
+                        boost::lockfree::capacity<ring_length>>;
+
+// Everything one shard sends to another, created when it first does
+struct shard_link {
+    // packets forwarded to the other shard
+    ring packets;
+    // packets that came from the other shard, freed here
+    ring returns;
+};
+
+class shard_link_table {
+    unsigned _nr_cpus;
+    // _links[from * _nr_cpus + to]
+    std::unique_ptr<std::atomic<shard_link*>[]> _links;
+    // changed when a link to a cpu is created
+    std::unique_ptr<std::atomic<unsigned>[]> _generation;
+public:
+    explicit shard_link_table(unsigned nr_cpus)
+        : _nr_cpus(nr_cpus)
+        , _links(new std::atomic<shard_link*>[nr_cpus * nr_cpus])
+        , _generation(new std::atomic<unsigned>[nr_cpus]) {
+        for (unsigned i = 0; i < nr_cpus * nr_cpus; ++i) {
+            _links[i].store(nullptr, std::memory_order_relaxed);
+        }
+        for (unsigned i = 0; i < nr_cpus; ++i) {
+            _generation[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    // Only called by cpu "from", so the link is created once
+    shard_link& get(unsigned from, unsigned to) {
+        auto& l = _links[from * _nr_cpus + to];
+        auto link = l.load(std::memory_order_relaxed);
+        if (!link) {
+            link = new shard_link;
+            l.store(link, std::memory_order_release);
+            _generation[to].fetch_add(1, std::memory_order_release);
+        }
+        return *link;
+    }
+    shard_link* find(unsigned from, unsigned to) const {
+        return _links[from * _nr_cpus + to].load(std::memory_order_acquire);
+    }
+    unsigned generation(unsigned to) const {
+        return _generation[to].load(std::memory_order_acquire);
+    }
+    // Never destroyed: packets may be in flight when the reactors exit
+    static shard_link_table& instance() {
+        static shard_link_table* table = new shard_link_table(smp::count);
+        return *table;
+    }
+};
+
+class packet_forwarder {
+    struct outbound {
+        shard_link* link = nullptr;
+        // not pushed to the link yet
+        std::vector<forwarded_packet*> packets;
+        std::vector<forwarded_packet*> returns;
+        // packets to send, not given back yet
+        size_t tx_in_flight = 0;
+        bool staged = false;
+    };
+    struct inbound {
+        unsigned from;
+        shard_link* link;
+    };
+    unsigned _cpu;
+    std::vector<outbound> _out;
+    // cpus with staged packets or returns
+    std::vector<unsigned> _staged;
+    std::vector<unsigned> _flushing;
+    std::vector<inbound> _in;
+    unsigned _in_generation = 0;
+    std::vector<forwarded_packet*> _pool;
+    std::experimental::optional<reactor::poller> _poller;
+    uint64_t _forwarded = 0;
+    uint64_t _ring_full = 0;
+    uint64_t _tx_limited = 0;
+    scollectd::registrations _collectd_regs;
+private:
+    outbound& out(unsigned cpu) {
+        auto& o = _out[cpu];
+        if (!o.link) {
+            o.link = &shard_link_table::instance().get(_cpu, cpu);
+        }
+        return o;
+    }
+    void stage(unsigned cpu, outbound& o) {
+        if (!o.staged) {
+            o.staged = true;
+            _staged.push_back(cpu);
+        }
+    }
+    // Pushes as much as fits; returns whether anything was pushed
+    static bool push(ring& r, std::vector<forwarded_packet*>& v) {
+        if (v.empty()) {
+            return false;
+        }
+        auto nr = r.push(v.data(), v.size());
+        v.erase(v.begin(), v.begin() + nr);
+        return nr;
+    }
+    bool flush(unsigned cpu) {
+        auto& o = _out[cpu];
+        bool work = push(o.link->packets, o.packets);
+        work |= push(o.link->returns, o.returns);
+        return work;
+    }
+    bool flush() {
+        bool work = false;
+        _flushing.swap(_staged);
+        for (auto cpu : _flushing) {
+            auto& o = _out[cpu];
+            o.staged = false;
+            work |= flush(cpu);
+            if (!o.packets.empty() || !o.returns.empty()) {
+                stage(cpu, o);
+            }
+        }
+        _flushing.clear();
+        return work;
+    }
+    void update_inbound() {
+        auto& table = shard_link_table::instance();
+        auto gen = table.generation(_cpu);
+        if (gen == _in_generation) {
+            return;
+        }
+        _in_generation = gen;
+        _in.clear();
+        for (unsigned from = 0; from < smp::count; ++from) {
+            auto link = table.find(from, _cpu);
+            if (link) {
+                _in.push_back(inbound{from, link});
+            }
+        }
+    }
+    void recycle(forwarded_packet* fp) {
+        if (fp->tx_queue) {
+            --_out[fp->target].tx_in_flight;
+        }
+        // frees the packet's data
+        fp->original = deleter();
+        _pool.push_back(fp);
+    }
+    bool poll() {
+        bool work = flush();
+        update_inbound();
+        forwarded_packet* items[poll_batch];
+        for (auto& in : _in) {
+            auto nr = in.link->packets.pop(items, poll_batch);
+            for (size_t i = 0; i < nr; ++i) {
+                auto fp = items[i];
+                if (fp->tx_queue) {
+                    fp->tx_queue->proxy_send(std::move(fp->p));
+                } else {
+                    fp->rx_device->l2receive(std::move(fp->p));
+                }
+            }
+            auto nr_returns = in.link->returns.pop(items, poll_batch);
+            for (size_t i = 0; i < nr_returns; ++i) {
+                recycle(items[i]);
+            }
+            work |= nr || nr_returns;
+        }
+        return work;
+    }
+public:
+    packet_forwarder()
+        : _cpu(engine().cpu_id())
+        , _out(smp::count) {
+        _poller = reactor::poller::simple("packet-forwarding", [this] { return poll(); });
+        auto add_counter = [this] (const char* name, uint64_t& counter) {
+            _collectd_regs.push_back(
+                scollectd::add_polled_metric(scollectd::type_instance_id("network"
+                        , scollectd::per_cpu_plugin_instance
+                        , "total_operations", name)
+                        , scollectd::make_typed(scollectd::data_type::DERIVE, counter)
+                ));
+        };
+        add_counter("forwarded", _forwarded);
+        add_counter("forward-ring-full", _ring_full);
+        add_counter("forward-tx-limited", _tx_limited);
+        engine().at_destroy([this] {
+            _collectd_regs.clear();
+            _poller = {};
+        });
+    }
+    bool forward(unsigned cpu, packet& p, qp* tx_queue, device* rx_device) {
+        auto& o = out(cpu);
+        if (tx_queue && o.tx_in_flight >= max_tx_in_flight) {
+            ++_tx_limited;
+            return false;
+        }
+        if (o.packets.size() >= ring_length) {
+            flush(cpu);
+            if (o.packets.size() >= ring_length) {
+                ++_ring_full;
+                return false;
+            }
+        }
+        forwarded_packet* fp;
+        if (_pool.empty()) {
+            fp = new forwarded_packet;
+            fp->origin = _cpu;
+        } else {
+            fp = _pool.back();
+            _pool.pop_back();
+        }
+        fp->target = cpu;
+        fp->tx_queue = tx_queue;
+        fp->rx_device = rx_device;
+        if (tx_queue) {
+            ++o.tx_in_flight;
+        }
+        auto d = new (&fp->deleter_storage) return_deleter(fp);
+        fp->original = p.exchange_deleter(deleter(d));
+        fp->p = std::move(p);
+        o.packets.push_back(fp);
+        stage(cpu, o);
+        ++_forwarded;
+        return true;
+    }
+    // Called on the shard where the forwarded packet was freed.  The
+    // returns are pushed by the poller, after the deleter is destroyed.
+    void give_back(forwarded_packet* fp) {
+        if (fp->origin == _cpu) {
+            recycle(fp);
+            return;
+        }
+        auto& o = out(fp->origin);
+        o.returns.push_back(fp);
+        stage(fp->origin, o);
+    }
+    // Pushes what was staged for cpu now, rather than on the next poll
+    void flush_to(unsigned cpu) {
+        flush(cpu);
+    }
+    static packet_forwarder& local();
+};
+
+thread_local std::unique_ptr<packet_forwarder> local_packet_forwarder;
+
+packet_forwarder& packet_forwarder::local() {
+    if (!local_packet_forwarder) {
+        local_packet_forwarder = std::make_unique<packet_forwarder>();
+    }
+    return *local_packet_forwarder;
+}
+
+return_deleter::~return_deleter() {
+    packet_forwarder::local().give_back(_fp);
+}
+
+}
+
+bool forward_tx(unsigned cpu, qp& q, packet& p) {
+    return packet_forwarder::local().forward(cpu, p, &q, nullptr);
+}
+
+bool forward_rx(unsigned cpu, device& dev, packet& p) {
+    return packet_forwarder::local().forward(cpu, p, nullptr, &dev);
+}
+
+void start_packet_forwarding() {
+    packet_forwarder::local();
+}
+
 class proxy_net_device : public qp {
 private:
-    static constexpr size_t _send_queue_length = 128;
-    size_t _send_depth = 0;
     unsigned _cpu;
     device* _dev;
-    std::vector<packet> _moving;
 public:
     explicit proxy_net_device(unsigned cpu, device* dev);
     virtual future<> send(packet p) override {
@@ -40,33 +344,19 @@ proxy_net_device::proxy_net_device(unsigned cpu, device* dev) :
         _cpu(cpu),
         _dev(dev)
 {
-    _moving.reserve(_send_queue_length);
 }
 
 uint32_t proxy_net_device::send(circular_buffer<packet>& p)
 {
-    if (!_moving.empty() || _send_depth  == _send_queue_length) {
-        return 0;
-    }
-
-    for (size_t i = 0; !p.empty() && _send_depth < _send_queue_length; i++, _send_depth++) {
-        _moving.push_back(std::move(p.front()));
+    auto& fw = packet_forwarder::local();
+    qp& dev = _dev->queue_for_cpu(_cpu);
+    uint32_t sent = 0;
+    while (!p.empty() && fw.forward(_cpu, p.front(), &dev, nullptr)) {
         p.pop_front();
+        sent++;
     }
-
-    if (!_moving.empty()) {
-        qp* dev = &_dev->queue_for_cpu(_cpu);
-        auto cpu = engine().cpu_id();
-        smp::submit_to(_cpu, [this, dev, cpu]() mutable {
-            for(size_t i = 0; i < _moving.size(); i++) {
-                dev->proxy_send(_moving[i].free_on_cpu(cpu, [this] { _send_depth--; }));
-            }
-        }).then([this] {
-            _moving.clear();
-        });
-    }
-
-    return _moving.size();
+    fw.flush_to(_cpu);
+    return sent;
 }
 
 std::unique_ptr<qp> create_proxy_net_device(unsigned master_cpu, device* dev) {
@@ -26,5 +26,20 @@ namespace net {
 
 std::unique_ptr<qp> create_proxy_net_device(unsigned master_cpu, device* dev);
 
+// Packets are moved between shards through a ring for each pair of
+// shards, drained by a poller on the receiving shard, without futures or
+// smp::submit_to().  The packet's data is freed on the shard it came
+// from: when the packet is destroyed, its deleter is sent back through
+// the ring in the other direction, in bulk.
+
+// Queues p for sending by q, the queue of a device on cpu.  Returns
+// false, leaving p alone, if the ring to cpu is full.
+bool forward_tx(unsigned cpu, qp& q, packet& p);
+// Queues p for dev's receive path on cpu.  Returns false, leaving p
+// alone, if the ring to cpu is full.
+bool forward_rx(unsigned cpu, device& dev, packet& p);
+// Starts draining the rings to this shard.
+void start_packet_forwarding();
+
 }
 #endif
@@ -25,16 +25,17 @@
 #include "core/shared_ptr.hh"
 #include "core/queue.hh"
 #include "core/semaphore.hh"
+#include "core/circular_buffer.hh"
 #include "core/print.hh"
 #include "net.hh"
 #include "ip_checksum.hh"
 #include "ip.hh"
 #include "const.hh"
 #include "packet-util.hh"
+#include "connection-table.hh"
 #include <unordered_map>
 #include <map>
 #include <functional>
-#include <deque>
 #include <chrono>
 #include <experimental/optional>
 #include <random>
@@ -250,8 +251,8 @@ class tcp {
             tcp_seq wl1;
             tcp_seq wl2;
             tcp_seq initial;
-            std::deque<unacked_segment> data;
-            std::deque<packet> unsent;
+            circular_buffer<unacked_segment> data;
+            circular_buffer<packet> unsent;
             uint32_t unsent_len = 0;
             uint32_t queued_len = 0;
             bool closed = false;
@@ -265,19 +266,15 @@ class tcp {
             // Smoothed round-trip time
             std::chrono::milliseconds srtt;
             bool first_rto_sample = true;
-            clock_type::time_point syn_tx_time;
             // Congestion window
             uint32_t cwnd;
             // Slow start threshold
             uint32_t ssthresh;
             // Duplicated ACKs
             uint16_t dupacks = 0;
-            unsigned syn_retransmit = 0;
-            unsigned fin_retransmit = 0;
             uint32_t limited_transfer = 0;
             uint32_t partial_ack = 0;
             tcp_seq recover;
-            bool window_probe = false;
         } _snd;
         struct receive {
             tcp_seq next;
@@ -286,22 +283,40 @@ class tcp {
             uint16_t mss;
             tcp_seq urgent;
             tcp_seq initial;
-            std::deque<packet> data;
-            tcp_packet_merger out_of_order;
+            circular_buffer<packet> data;
             std::experimental::optional<promise<>> _data_received_promise;
         } _rcv;
+        // State only needed while the handshake or the close is in
+        // progress, segments are unacknowledged or out of order, or the
+        // peer's window is closed.  Allocated on first use by cold(), and
+        // freed by shrink_when_idle() once the connection has been idle for
+        // a while, so that idle connections stay small.
+        struct cold_state {
+            timer<lowres_clock> retransmit;
+            timer<lowres_clock> persist;
+            std::chrono::milliseconds persist_time_out{1000};
+            bool window_probe = false;
+            clock_type::time_point syn_tx_time;
+            unsigned syn_retransmit = 0;
+            unsigned fin_retransmit = 0;
+            tcp_packet_merger out_of_order;
+            explicit cold_state(tcb& t)
+                : retransmit([&t] { t.retransmit(); })
+                , persist([&t] { t.persist(); }) {}
+        };
+        std::unique_ptr<cold_state> _cold;
+        // When the last segment arrived, and whether we are in tcp::_idle_tcbs
+        clock_type::time_point _last_received;
+        bool _idle_queued = false;
         tcp_option _option;
         timer<lowres_clock> _delayed_ack;
         // Retransmission timeout
         std::chrono::milliseconds _rto{1000};
-        std::chrono::milliseconds _persist_time_out{1000};
         static constexpr std::chrono::milliseconds _rto_min{1000};
         static constexpr std::chrono::milliseconds _rto_max{60000};
         // Clock granularity
         static constexpr std::chrono::milliseconds _rto_clk_granularity{1};
         static constexpr uint16_t _max_nr_retransmit{5};
-        timer<lowres_clock> _retransmit;
-        timer<lowres_clock> _persist;
         uint16_t _nr_full_seg_received = 0;
         struct isn_secret {
             // 512 bits secretkey for ISN generating
@@ -332,8 +347,14 @@ class tcp {
         void connect();
         packet read();
         void close();
+        void shrink_when_idle();
+        bool shrinkable() const {
+            return _cold || _snd.data.capacity() || _snd.unsent.capacity() || _rcv.data.capacity();
+        }
         void remove_from_tcbs() {
             auto id = connid{_local_ip, _foreign_ip, _local_port, _foreign_port};
+            // before erase(), which may drop the last reference to us
+            _tcp.unsteer(id);
             _tcp._tcbs.erase(id);
         }
         std::experimental::optional<typename InetTraits::l4packet> get_packet();
@@ -364,6 +385,12 @@ class tcp {
             return _state;
         }
     private:
+        cold_state& cold() {
+            if (!_cold) {
+                _cold = std::make_unique<cold_state>(*this);
+            }
+            return *_cold;
+        }
         void respond_with_reset(tcp_hdr* th);
         bool merge_out_of_order();
         void insert_out_of_order(tcp_seq seq, packet p);
@@ -381,21 +408,26 @@ class tcp {
         };
         void start_retransmit_timer(clock_type::time_point now) {
             auto tp = now + _rto;
-            _retransmit.rearm(tp);
+            cold().retransmit.rearm(tp);
         };
         void stop_retransmit_timer() {
-            _retransmit.cancel();
+            if (_cold) {
+                _cold->retransmit.cancel();
+            }
         };
         void start_persist_timer() {
             auto now = clock_type::now();
             start_persist_timer(now);
         };
         void start_persist_timer(clock_type::time_point now) {
-            auto tp = now + _persist_time_out;
-            _persist.rearm(tp);
+            auto& c = cold();
+            auto tp = now + c.persist_time_out;
+            c.persist.rearm(tp);
         };
         void stop_persist_timer() {
-            _persist.cancel();
+            if (_cold) {
+                _cold->persist.cancel();
+            }
         };
         void persist();
         void retransmit();
@@ -404,7 +436,7 @@ class tcp {
         void update_cwnd(uint32_t acked_bytes);
         void cleanup();
         uint32_t can_send() {
-            if (_snd.window_probe) {
+            if (_cold && _cold->window_probe) {
                 return 1;
             }
             // Can not send more than advertised window allows
@@ -450,19 +482,23 @@ class tcp {
         }
         void do_syn_sent() {
             _state = SYN_SENT;
-            _snd.syn_tx_time = clock_type::now();
+            cold().syn_tx_time = clock_type::now();
             // Send <SYN> to remote
             output();
         }
         void do_syn_received() {
             _state = SYN_RECEIVED;
-            _snd.syn_tx_time = clock_type::now();
+            cold().syn_tx_time = clock_type::now();
             // Send <SYN,ACK> to remote
             output();
         }
         void do_established() {
             _state = ESTABLISHED;
-            update_rto(_snd.syn_tx_time);
+            update_rto(cold().syn_tx_time);
+            // Our SYN is acknowledged; nothing else can be in flight yet
+            if (_snd.data.empty()) {
+                stop_retransmit_timer();
+            }
             _connect_done.set_value();
         }
         void do_reset() {
@@ -523,9 +559,10 @@ class tcp {
         bool segment_acceptable(tcp_seq seg_seq, unsigned seg_len);
         void init_from_options(tcp_hdr* th, uint8_t* opt_start, uint8_t* opt_end);
         friend class connection;
+        friend class tcp;
     };
     inet_type& _inet;
-    std::unordered_map<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
+    connection_table<connid, lw_shared_ptr<tcb>, connid_hash> _tcbs;
     std::unordered_map<uint16_t, listener*> _listening;
     std::random_device _rd;
     std::default_random_engine _e;
@@ -534,6 +571,14 @@ class tcp {
     // queue for packets that do not belong to any tcb
     circular_buffer<ipv4_traits::l4packet> _packetq;
     semaphore _queue_space = {212992};
+    // flow steering updates, applied one after the other
+    future<> _steering = make_ready_future<>();
+    // Connections that may be shrunk once idle, in the order they were
+    // queued, each with the time it was queued.  Each tcb is queued at most
+    // once, and checked again by _shrink_timer idle_shrink_delay later.
+    circular_buffer<std::pair<lw_shared_ptr<tcb>, lowres_clock::time_point>> _idle_tcbs;
+    timer<lowres_clock> _shrink_timer;
+    static constexpr std::chrono::milliseconds idle_shrink_delay{5000};
     scollectd::registrations _collectd_regs;
 public:
     class connection {
@@ -605,6 +650,40 @@ class tcp {
     future<> poll_tcb(ipaddr to, lw_shared_ptr<tcb> tcb);
 private:
     void send_packet_without_tcb(ipaddr from, ipaddr to, packet p);
+    void watch_idle(const lw_shared_ptr<tcb>& tcbp, lowres_clock::time_point now);
+    void shrink_idle_tcbs();
+    // Pins the connection's packets to this cpu in the flow steering
+    // table, so that they reach it whatever RSS does.  Connections are
+    // normally set up on the cpu RSS sends their packets to, and then
+    // there is nothing to do.
+    bool rss_maps_here(const connid& id) {
+        auto netif = _inet._inet.netif();
+        return netif->hash2cpu(id.hash(netif->rss_key())) == engine().cpu_id();
+    }
+    void steer(const connid& id) {
+        if (!rss_maps_here(id)) {
+            update_steering([this, flow = id.flow()] {
+                return _inet._inet.netif()->steer_flow_here(flow);
+            });
+        }
+    }
+    void unsteer(const connid& id) {
+        if (!rss_maps_here(id)) {
+            update_steering([this, flow = id.flow()] {
+                return _inet._inet.netif()->unsteer_flow_here(flow);
+            });
+        }
+    }
+    template <typename Func>
+    void update_steering(Func&& func) {
+        _steering = _steering.then(std::forward<Func>(func)).then_wrapped([] (future<> f) {
+            try {
+                f.get();
+            } catch (std::exception& e) {
+                print("tcp: flow steering update failed: %s\n", e.what());
+            }
+        });
+    }
     void respond_with_reset(tcp_hdr* rth, ipaddr local_ip, ipaddr foreign_ip);
     friend class listener;
 };
@@ -625,6 +704,7 @@ tcp<InetTraits>::tcp(inet_type& inet)
             , [] { return tcp_packet_merger::linearizations(); })
         ),
     }) {
+    _shrink_timer.set_callback([this] { shrink_idle_tcbs(); });
     _inet.register_packet_provider([this, tcb_polled = 0u] () mutable {
         std::experimental::optional<typename InetTraits::l4packet> l4p;
         auto c = _poll_tcbs.size();
@@ -673,12 +753,13 @@ future<typename tcp<InetTraits>::connection> tcp<InetTraits>::connect(socket_add
     do {
         src_port = _port_dist(_e);
         id = connid{src_ip, dst_ip, src_port, dst_port};
-    } while (_inet._inet.netif()->hw_queues_count() > 1 &&
-             (_inet._inet.netif()->hash2cpu(id.hash(_inet._inet.netif()->rss_key())) != engine().cpu_id()
-              || _tcbs.find(id) != _tcbs.end()));
+    } while ((_inet._inet.netif()->hw_queues_count() > 1 &&
+              _inet._inet.netif()->hash2cpu(id.hash(_inet._inet.netif()->rss_key())) != engine().cpu_id())
+             || _tcbs.find(id));
 
     auto tcbp = make_lw_shared<tcb>(*this, id);
-    _tcbs.insert({id, tcbp});
+    _tcbs.insert(id, tcbp);
+    steer(id);
     tcbp->connect();
 
     return tcbp->connect_done().then([tcbp] {
@@ -707,6 +788,12 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
         return;
     }
 
+    auto h = ntoh(*th);
+    auto id = connid{to, from, h.dst_port, h.src_port};
+    // The connection's slot is fetched while the checksum is verified
+    auto hash = _tcbs.hash(id);
+    _tcbs.prefetch(hash);
+
     if (!hw_features().rx_csum_offload) {
         checksummer csum;
         InetTraits::tcp_pseudo_header_checksum(csum, from, to, p.len());
@@ -715,11 +802,9 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     }
-    auto h = ntoh(*th);
-    auto id = connid{to, from, h.dst_port, h.src_port};
-    auto tcbi = _tcbs.find(id);
+    auto tcbi = _tcbs.find(id, hash);
     lw_shared_ptr<tcb> tcbp;
-    if (tcbi == _tcbs.end()) {
+    if (!tcbi) {
         auto listener = _listening.find(id.local_port);
         if (listener == _listening.end() || listener->second->_q.full()) {
             // 1) In CLOSE state
@@ -750,7 +835,8 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
                 // NOTE: Ignored for now
                 tcbp = make_lw_shared<tcb>(*this, id);
                 listener->second->_q.push(connection(tcbp));
-                _tcbs.insert({id, tcbp});
+                _tcbs.insert(id, hash, tcbp);
+                steer(id);
                 return tcbp->input_handle_listen_state(&h, std::move(p));
             }
             // 2.4 fourth other text or control
@@ -759,16 +845,55 @@ void tcp<InetTraits>::received(packet p, ipaddr from, ipaddr to) {
             return;
         }
     } else {
-        tcbp = tcbi->second;
+        tcbp = *tcbi;
         if (tcbp->state() == tcp_state::SYN_SENT) {
             // 3) In SYN_SENT State
-            return tcbp->input_handle_syn_sent_state(&h, std::move(p));
+            tcbp->input_handle_syn_sent_state(&h, std::move(p));
         } else {
             // 4) In other state, can be one of the following:
             // SYN_RECEIVED, ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2
             // CLOSE_WAIT, CLOSING, LAST_ACK, TIME_WAIT
-            return tcbp->input_handle_other_state(&h, std::move(p));
+            tcbp->input_handle_other_state(&h, std::move(p));
         }
+        auto now = lowres_clock::now();
+        tcbp->_last_received = now;
+        if (!tcbp->_idle_queued && tcbp->shrinkable()) {
+            watch_idle(tcbp, now);
+        }
+    }
+}
+
+template <typename InetTraits>
+void tcp<InetTraits>::watch_idle(const lw_shared_ptr<tcb>& tcbp, lowres_clock::time_point now) {
+    tcbp->_idle_queued = true;
+    _idle_tcbs.emplace_back(tcbp, now);
+    if (!_shrink_timer.armed()) {
+        _shrink_timer.arm(_idle_tcbs.front().second + idle_shrink_delay);
+    }
+}
+
+// Shrinks the connections that have received nothing for idle_shrink_delay,
+// so that a busy connection keeps its cold state and queue storage instead
+// of freeing and allocating them again on every round trip.  Connections
+// that were active, or still have something in flight, are checked again
+// later; closed ones are dropped, and queued again by their next segment.
+template <typename InetTraits>
+void tcp<InetTraits>::shrink_idle_tcbs() {
+    auto now = lowres_clock::now();
+    auto nr = _idle_tcbs.size();
+    while (nr-- && _idle_tcbs.front().second + idle_shrink_delay <= now) {
+        auto tcbp = std::move(_idle_tcbs.front().first);
+        _idle_tcbs.pop_front();
+        tcbp->_idle_queued = false;
+        if (tcbp->_last_received + idle_shrink_delay <= now) {
+            tcbp->shrink_when_idle();
+        }
+        if (tcbp->shrinkable() && tcbp->in_state(tcp_state::ESTABLISHED | tcp_state::CLOSE_WAIT | tcp_state::FIN_WAIT_2)) {
+            watch_idle(tcbp, now);
+        }
+    }
+    if (!_idle_tcbs.empty() && !_shrink_timer.armed()) {
+        _shrink_timer.arm(_idle_tcbs.front().second + idle_shrink_delay);
     }
 }
 
@@ -798,9 +923,7 @@ tcp<InetTraits>::tcb::tcb(tcp& t, connid id)
     , _foreign_ip(id.foreign_ip)
     , _local_port(id.local_port)
     , _foreign_port(id.foreign_port)
-    , _delayed_ack([this] { _nr_full_seg_received = 0; output(); })
-    , _retransmit([this] { retransmit(); })
-    , _persist([this] { persist(); }) {
+    , _delayed_ack([this] { _nr_full_seg_received = 0; output(); }) {
 }
 
 template <typename InetTraits>
@@ -1145,7 +1268,7 @@ void tcp<InetTraits>::tcb::input_handle_other_state(tcp_hdr* th, packet p) {
             _snd.wl1 = seg_seq;
             _snd.wl2 = seg_ack;
             if (_snd.window == 0) {
-                _persist_time_out = _rto;
+                cold().persist_time_out = _rto;
                 start_persist_timer();
             } else {
                 stop_persist_timer();
@@ -1535,7 +1658,7 @@ void tcp<InetTraits>::tcb::output_one(bool data_retransmit) {
             _snd.data.emplace_back(unacked_segment{std::move(clone),
                                    len, nr_transmits, now});
         }
-        if (!_retransmit.armed()) {
+        if (!_cold || !_cold->retransmit.armed()) {
             start_retransmit_timer(now);
         }
     }
@@ -1685,10 +1808,11 @@ void tcp<InetTraits>::tcb::clear_delayed_ack() {
 template <typename InetTraits>
 bool tcp<InetTraits>::tcb::merge_out_of_order() {
     bool merged = false;
-    if (_rcv.out_of_order.map.empty()) {
+    if (!_cold || _cold->out_of_order.map.empty()) {
         return merged;
     }
-    for (auto it = _rcv.out_of_order.map.begin(); it != _rcv.out_of_order.map.end();) {
+    auto& out_of_order = _cold->out_of_order;
+    for (auto it = out_of_order.map.begin(); it != out_of_order.map.end();) {
         auto& p = it->second;
         auto seg_beg = it->first;
         auto seg_len = p.len();
@@ -1704,11 +1828,11 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
             _rcv.next += seg_len;
             _rcv.data.push_back(std::move(p));
             // Since c++11, erase() always returns the value of the following element
-            it = _rcv.out_of_order.map.erase(it);
+            it = out_of_order.map.erase(it);
             merged = true;
         } else if (_rcv.next >= seg_end) {
             // This segment has been receive already, drop it
-            it = _rcv.out_of_order.map.erase(it);
+            it = out_of_order.map.erase(it);
         } else {
             // seg_beg > _rcv.need, can not merge. Note, seg_beg can grow only,
             // so we can stop looking here.
@@ -1721,7 +1845,7 @@ bool tcp<InetTraits>::tcb::merge_out_of_order() {
 
 template <typename InetTraits>
 void tcp<InetTraits>::tcb::insert_out_of_order(tcp_seq seg, packet p) {
-    _rcv.out_of_order.merge(seg, std::move(p));
+    cold().out_of_order.merge(seg, std::move(p));
 }
 
 template <typename InetTraits>
@@ -1733,13 +1857,14 @@ template <typename InetTraits>
 void tcp<InetTraits>::tcb::persist() {
     tcp_debug("persist timer fired\n");
     // Send 1 byte packet to probe peer's window size
-    _snd.window_probe = true;
+    auto& c = cold();
+    c.window_probe = true;
     output_one();
-    _snd.window_probe = false;
+    c.window_probe = false;
 
     output();
     // Perform binary exponential back-off per RFC1122
-    _persist_time_out = std::min(_persist_time_out * 2, _rto_max);
+    c.persist_time_out = std::min(c.persist_time_out * 2, _rto_max);
     start_persist_timer();
 }
 
@@ -1754,7 +1879,7 @@ void tcp<InetTraits>::tcb::retransmit() {
 
     // Retransmit SYN
     if (syn_needs_on()) {
-        if (_snd.syn_retransmit++ < _max_nr_retransmit) {
+        if (cold().syn_retransmit++ < _max_nr_retransmit) {
             output_update_rto();
         } else {
             _connect_done.set_exception(tcp_connect_error());
@@ -1765,7 +1890,7 @@ void tcp<InetTraits>::tcb::retransmit() {
 
     // Retransmit FIN
     if (fin_needs_on()) {
-        if (_snd.fin_retransmit++ < _max_nr_retransmit) {
+        if (cold().fin_retransmit++ < _max_nr_retransmit) {
             output_update_rto();
         } else {
             cleanup();
@@ -1859,13 +1984,42 @@ template <typename InetTraits>
 void tcp<InetTraits>::tcb::cleanup() {
     _snd.unsent.clear();
     _snd.data.clear();
-    _rcv.out_of_order.map.clear();
+    if (_cold) {
+        _cold->out_of_order.map.clear();
+    }
     _rcv.data.clear();
     stop_retransmit_timer();
     clear_delayed_ack();
     remove_from_tcbs();
 }
 
+// Called by tcp::shrink_idle_tcbs() once nothing arrived for a while, never
+// from the cold state's own timers, which may be running cleanup().  Frees
+// the cold state once no SYN or FIN can need retransmitting, nothing is in
+// flight or out of order, and no window probe is pending, along with the
+// storage of the queues that are empty.
+template <typename InetTraits>
+void tcp<InetTraits>::tcb::shrink_when_idle() {
+    if (!in_state(ESTABLISHED | CLOSE_WAIT | FIN_WAIT_2) || !_snd.data.empty()) {
+        return;
+    }
+    if (_cold) {
+        if (!_cold->out_of_order.map.empty() || _cold->retransmit.armed() || _cold->persist.armed()) {
+            return;
+        }
+        _cold.reset();
+    }
+    if (_snd.data.capacity()) {
+        _snd.data = {};
+    }
+    if (_snd.unsent.empty() && _snd.unsent.capacity()) {
+        _snd.unsent = {};
+    }
+    if (_rcv.data.empty() && _rcv.data.capacity()) {
+        _rcv.data = {};
+    }
+}
+
 template <typename InetTraits>
 tcp_seq tcp<InetTraits>::tcb::get_isn() {
     // Per RFC6528, TCP SHOULD generate its Initial Sequence Numbers
@@ -1922,6 +2076,9 @@ void tcp<InetTraits>::connection::close_write() {
 template <typename InetTraits>
 constexpr uint16_t tcp<InetTraits>::tcb::_max_nr_retransmit;
 
+template <typename InetTraits>
+constexpr std::chrono::milliseconds tcp<InetTraits>::idle_shrink_delay;
+
 template <typename InetTraits>
 constexpr std::chrono::milliseconds tcp<InetTraits>::tcb::_rto_min;
 
@@ -0,0 +1,85 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "lz4_compressor.hh"
+#include "rpc_types.hh"
+#include "core/bitops.hh"
+#include <lz4.h>
+#include <limits>
+
+namespace rpc {
+
+lz4_compressor::buffer_pool::buffer_pool() : _free(sizeof(size_t) * 8) {
+}
+
+temporary_buffer<char> lz4_compressor::buffer_pool::get(size_t size) {
+    auto alloc_size = std::max(size, min_buffer_size);
+    unsigned idx = std::numeric_limits<size_t>::digits - count_leading_zeros(alloc_size - 1);
+    auto& free = _free[idx];
+    std::unique_ptr<char[]> buf;
+    if (free.empty()) {
+        buf.reset(new char[size_t(1) << idx]);
+    } else {
+        buf = std::move(free.back());
+        free.pop_back();
+    }
+    auto p = buf.get();
+    return temporary_buffer<char>(p, size, make_deleter([pool = shared_from_this(), idx, buf = std::move(buf)] () mutable {
+        pool->put(idx, std::move(buf));
+    }));
+}
+
+void lz4_compressor::buffer_pool::put(unsigned idx, std::unique_ptr<char[]> buf) {
+    auto& free = _free[idx];
+    if (free.size() < max_free_buffers) {
+        free.push_back(std::move(buf));
+    }
+}
+
+lz4_compressor::lz4_compressor() : _pool(make_lw_shared<buffer_pool>()) {
+}
+
+lz4_compressor::~lz4_compressor() {
+}
+
+temporary_buffer<char> lz4_compressor::compress(size_t head_space, const char* data, size_t size) {
+    temporary_buffer<char> dst(head_space + LZ4_compressBound(size));
+    auto len = LZ4_compress_default(data, dst.get_write() + head_space, size, dst.size() - head_space);
+    if (len <= 0 || size_t(len) >= size) {
+        return temporary_buffer<char>();
+    }
+    dst.trim(head_space + len);
+    return dst;
+}
+
+temporary_buffer<char> lz4_compressor::decompress(const char* data, size_t size, size_t raw_size) {
+    if (!plausible(size, raw_size)) {
+        throw rpc_protocol_error();
+    }
+    auto dst = _pool->get(raw_size);
+    auto len = LZ4_decompress_safe(data, dst.get_write(), size, raw_size);
+    if (len < 0 || size_t(len) != raw_size) {
+        throw rpc_protocol_error();
+    }
+    return dst;
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/temporary_buffer.hh"
+#include "core/shared_ptr.hh"
+#include <memory>
+#include <vector>
+
+namespace rpc {
+
+// Compresses rpc frames with LZ4, one frame at a time.
+//
+// Decompressed frames are placed into buffers that are handed back to a
+// small pool when the rpc layer (or the handler holding the arguments)
+// releases them, so that steady traffic does not keep allocating large
+// buffers.
+class lz4_compressor {
+    // Keeps up to max_free_buffers released buffers of each power-of-two size.
+    class buffer_pool : public enable_lw_shared_from_this<buffer_pool> {
+        static constexpr size_t min_buffer_size = 4096;
+        static constexpr size_t max_free_buffers = 4;
+        std::vector<std::vector<std::unique_ptr<char[]>>> _free;
+    public:
+        buffer_pool();
+        temporary_buffer<char> get(size_t size);
+        void put(unsigned idx, std::unique_ptr<char[]> buf);
+    };
+    lw_shared_ptr<buffer_pool> _pool;
+public:
+    lz4_compressor();
+    ~lz4_compressor();
+    // Returns data compressed into a new buffer, with head_space bytes left
+    // free in front of it, or an empty buffer if data did not shrink.
+    temporary_buffer<char> compress(size_t head_space, const char* data, size_t size);
+    // Throws rpc_protocol_error if data does not decompress to exactly
+    // raw_size bytes.
+    temporary_buffer<char> decompress(const char* data, size_t size, size_t raw_size);
+    // Whether size compressed bytes can decompress to raw_size bytes; LZ4
+    // never compresses better than 255:1, so a peer claiming more lies.
+    static bool plausible(size_t size, size_t raw_size) {
+        return raw_size > size && raw_size / 255 <= size;
+    }
+};
+
+}
@@ -23,12 +23,16 @@
 
 #include <unordered_map>
 #include <unordered_set>
+#include <array>
 #include "core/future.hh"
 #include "net/api.hh"
 #include "core/reactor.hh"
 #include "core/iostream.hh"
 #include "core/shared_ptr.hh"
+#include "core/gate.hh"
 #include "rpc/rpc_types.hh"
+#include "rpc/lz4_compressor.hh"
+#include "rpc/rpc_stream.hh"
 
 namespace rpc {
 
@@ -42,6 +46,10 @@ struct SerializerConcept {
     template <typename Input>
     friend T read(const SerializerConcept&, Input& input, type<T> type_tag);  // type_tag used to disambiguate
     // Input and Output expose void read(char*, size_t) and write(const char*, size_t).
+    // Output also has write(temporary_buffer<char>), which adds the buffer to
+    // the frame without copying it, and Input has
+    // std::vector<temporary_buffer<char>> read_buffers(size_t), which returns
+    // the next bytes of the frame in the buffers they were received in.
 };
 
 static constexpr char rpc_magic[] = "SSTARRPC";
@@ -70,6 +78,33 @@ estimate_request_size(const resource_limits& lim, size_t serialized_size) {
     return lim.basic_request_size + serialized_size * lim.bloat_factor;
 }
 
+/// \brief Options for an RPC client
+///
+/// \see client
+struct client_options {
+    bool compress = false;              ///< Offer LZ4 compression of frames to the server
+    size_t compression_threshold = 1024; ///< Frames smaller than this are never compressed
+};
+
+/// \brief Options for an RPC server
+///
+/// \see server
+struct server_options {
+    bool compress = false;              ///< Accept LZ4 compression if a client offers it
+    size_t compression_threshold = 1024; ///< Frames smaller than this are never compressed
+};
+
+// Bits of negotiation_frame::required_features_mask and optional_features_mask
+enum protocol_features : uint32_t {
+    LZ4_COMPRESSION = 1 << 0,
+    STREAMS = 1 << 1,
+};
+
+// Request frames with this verb, and response frames with this message id,
+// carry stream frames instead of calls and replies.
+static constexpr uint64_t stream_verb = std::numeric_limits<uint64_t>::max();
+static constexpr int64_t stream_msg_id = std::numeric_limits<int64_t>::min();
+
 struct negotiation_frame {
     char magic[sizeof(rpc_magic) - 1];
     uint32_t required_features_mask;
@@ -82,7 +117,7 @@ struct negotiation_frame {
 // do not forget to provide hash function for it
 template<typename Serializer, typename MsgType = uint32_t>
 class protocol {
-    class connection {
+    class connection : public stream_registry {
     protected:
         connected_socket _fd;
         input_stream<char> _read_buf;
@@ -91,6 +126,12 @@ class protocol {
         bool _error = false;
         protocol& _proto;
         promise<> _stopped;
+        stats _stats;
+        std::unique_ptr<lz4_compressor> _compressor;
+        size_t _compression_threshold = 0;
+        bool _streams_supported = true;
+    protected:
+        future<> send_frame(net::packet frame);
     public:
         connection(connected_socket&& fd, protocol& proto) : _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _proto(proto) {}
         connection(protocol& proto) : _proto(proto) {}
@@ -102,6 +143,17 @@ class protocol {
         bool error() { return _error; }
         auto& serializer() { return _proto._serializer; }
         auto& get_protocol() { return _proto; }
+        stats& get_stats_internal() {
+            return _stats;
+        }
+        // Once enabled, every frame sent or received on this connection is
+        // wrapped in a compression envelope (see doc/rpc.md).
+        void enable_compression(size_t threshold) {
+            _compressor = std::make_unique<lz4_compressor>();
+            _compression_threshold = threshold;
+        }
+        lz4_compressor* compressor() { return _compressor.get(); }
+        future<> write_frame(net::packet data);
         future<> stop() {
             _fd.shutdown_input();
             _fd.shutdown_output();
@@ -116,25 +168,22 @@ class protocol {
         class connection : public protocol::connection, public enable_lw_shared_from_this<connection> {
             server& _server;
             client_info _info;
-            stats _stats;
         private:
             future<negotiation_frame> negotiate_protocol(input_stream<char>& in);
-            future<MsgType, int64_t, std::experimental::optional<temporary_buffer<char>>>
+            future<uint64_t, int64_t, std::experimental::optional<rcv_buf>>
             read_request_frame(input_stream<char>& in);
 
         public:
             connection(server& s, connected_socket&& fd, socket_address&& addr, protocol& proto);
             future<> process();
-            future<> respond(int64_t msg_id, sstring&& data);
+            future<> respond(int64_t msg_id, net::packet&& data);
+            virtual future<> send_stream_frame(int64_t id, stream_frame_kind kind, temporary_buffer<char> data) override;
             client_info& info() { return _info; }
             const client_info& info() const { return _info; }
             stats get_stats() const {
-                return _stats;
+                return this->_stats;
             }
 
-            stats& get_stats_internal() {
-                return _stats;
-            }
             ipv4_addr peer_address() const {
                 return ipv4_addr(_info.addr);
             }
@@ -147,18 +196,29 @@ class protocol {
             size_t estimate_request_size(size_t serialized_size) {
                 return rpc::estimate_request_size(_server._limits, serialized_size);
             }
+            // Memory for decompressing a frame, whose size the peer chose
+            future<> wait_for_frame_memory(size_t size) {
+                if (size > _server._limits.max_memory) {
+                    return make_exception_future<>(rpc_protocol_error());
+                }
+                return wait_for_resources(size);
+            }
+            void release_frame_memory(size_t size) {
+                release_resources(size);
+            }
         };
     private:
         protocol& _proto;
         server_socket _ss;
         resource_limits _limits;
+        server_options _options;
         semaphore _resources_available;
         std::unordered_set<connection*> _conns;
         bool _stopping = false;
         promise<> _ss_stopped;
     public:
-        server(protocol& proto, ipv4_addr addr, resource_limits memory_limit = resource_limits());
-        server(protocol& proto, server_socket, resource_limits memory_limit = resource_limits());
+        server(protocol& proto, ipv4_addr addr, resource_limits memory_limit = resource_limits(), server_options options = server_options());
+        server(protocol& proto, server_socket, resource_limits memory_limit = resource_limits(), server_options options = server_options());
         void accept();
         future<> stop() {
             _stopping = true; // prevents closed connections to be deleted from _conns
@@ -182,72 +242,130 @@ class protocol {
     class client : public protocol::connection {
         promise<> _connected_promise;
         bool _connected = false;
+        // Holds back requests until the server agreed to compression, since
+        // the frames sent after that point are written differently.
+        promise<> _negotiated;
+        bool _negotiating = false;
         id_type _message_id = 1;
         struct reply_handler_base {
-            timer<> t;
-            virtual void operator()(client&, id_type, temporary_buffer<char> data) = 0;
+            // The reactor's lowres timers are kept in one wheel per shard, so
+            // arming and cancelling this is O(1) and allocates nothing
+            timer<lowres_clock> t;
+            virtual void operator()(client&, id_type, rcv_buf data) = 0;
             virtual void timeout() {}
+            virtual size_t size() const = 0;
             virtual ~reply_handler_base() {};
         };
+        // Every call that waits for a reply needs a handler, so freed
+        // handlers are kept for reuse, by size.
+        class handler_pool {
+            static constexpr size_t granularity = 16;
+            static constexpr size_t max_pooled_size = 512;
+            static constexpr size_t max_free = 128;
+            std::array<std::vector<void*>, max_pooled_size / granularity> _free;
+        public:
+            handler_pool() = default;
+            handler_pool(handler_pool&&) = default;
+            ~handler_pool();
+            void* allocate(size_t size);
+            void deallocate(void* p, size_t size);
+        };
+        struct handler_deleter {
+            handler_pool* pool = nullptr;
+            void operator()(reply_handler_base* h) const {
+                auto size = h->size();
+                h->~reply_handler_base();
+                pool->deallocate(h, size);
+            }
+        };
     public:
+        using handler_ptr = std::unique_ptr<reply_handler_base, handler_deleter>;
         template<typename Reply, typename Func>
         struct reply_handler final : reply_handler_base {
             Func func;
             Reply reply;
             reply_handler(Func&& f) : func(std::move(f)) {}
-            virtual void operator()(client& client, id_type msg_id, temporary_buffer<char> data) override {
+            virtual void operator()(client& client, id_type msg_id, rcv_buf data) override {
                 return func(reply, client, msg_id, std::move(data));
             }
             virtual void timeout() override {
                 reply.done = true;
                 reply.p.set_exception(timeout_error());
             }
+            virtual size_t size() const override {
+                return sizeof(*this);
+            }
             virtual ~reply_handler() {}
         };
     private:
-        std::unordered_map<id_type, std::unique_ptr<reply_handler_base>> _outstanding;
-        stats _stats;
+        struct outstanding_reply {
+            id_type id = 0;
+            handler_ptr handler;
+        };
+        static constexpr size_t initial_ring_size = 256;
+        static constexpr size_t max_ring_size = 65536;
+        handler_pool _handler_pool;
+        // Calls waiting for a reply, indexed by message id modulo the ring
+        // size.  When the ring wraps around to a call that is still waiting,
+        // the ring grows, or once it reached max_ring_size the old call moves
+        // to _outstanding_overflow.
+        std::vector<outstanding_reply> _outstanding;
+        std::unordered_map<id_type, outstanding_reply> _outstanding_overflow;
+        size_t _nr_outstanding = 0;
         ipv4_addr _server_addr;
+    private:
+        outstanding_reply* find_outstanding(id_type id);
+        void grow_outstanding();
+        void timeout(id_type id);
+        void clear_outstanding();
     private:
         future<negotiation_frame> negotiate_protocol(input_stream<char>& in);
-        future<int64_t, std::experimental::optional<temporary_buffer<char>>>
+        future<int64_t, std::experimental::optional<rcv_buf>>
         read_response_frame(input_stream<char>& in);
     public:
-        client(protocol& proto, ipv4_addr addr, ipv4_addr local = ipv4_addr());
+        client(protocol& proto, ipv4_addr addr, ipv4_addr local = ipv4_addr(), client_options options = client_options());
         /**
          * Create client object using the connected_socket result of the
          * provided future.
          *
          * @param addr the remote address identifying this client
          * @param f a future<> resulting in a connected_socket for the connection
+         * @param options client options, such as whether to offer compression
          */
-        client(protocol& proto, ipv4_addr addr, future<connected_socket> f);
+        client(protocol& proto, ipv4_addr addr, future<connected_socket> f, client_options options = client_options());
+        // The connection's loops and the timers of pending calls refer to
+        // the client by address, and its handlers to its pool
+        client(client&&) = delete;
 
         stats get_stats() const {
-            stats res = _stats;
-            res.wait_reply = _outstanding.size();
+            stats res = this->_stats;
+            res.wait_reply = _nr_outstanding;
             return res;
         }
 
-        stats& get_stats_internal() {
-            return _stats;
-        }
         auto next_message_id() { return _message_id++; }
-        void wait_for_reply(id_type id, std::unique_ptr<reply_handler_base>&& h, std::experimental::optional<steady_clock_type::time_point> timeout) {
-            if (timeout) {
-                h->t.set_callback(std::bind(std::mem_fn(&client::wait_timed_out), this, id));
-                h->t.arm(timeout.value());
-            }
-            _outstanding.emplace(id, std::move(h));
+        /// Creates a stream, to be passed to the server as an argument of a
+        /// call whose handler takes an rpc::stream.
+        stream make_stream() {
+            return this->open_stream(next_message_id());
         }
-        void wait_timed_out(id_type id) {
-            struct timeout_handler : reply_handler_base {
-                virtual void operator()(client& client, id_type msg_id, temporary_buffer<char> data) {}
-            };
-            _stats.timeout++;
-            _outstanding[id]->timeout();
-            _outstanding[id] = std::make_unique<timeout_handler>();
+        virtual future<> send_stream_frame(int64_t id, stream_frame_kind kind, temporary_buffer<char> data) override;
+        template <typename Handler, typename... Args>
+        handler_ptr make_reply_handler(Args&&... args) {
+            auto p = _handler_pool.allocate(sizeof(Handler));
+            try {
+                new (p) Handler(std::forward<Args>(args)...);
+            } catch (...) {
+                _handler_pool.deallocate(p, sizeof(Handler));
+                throw;
+            }
+            return handler_ptr(static_cast<Handler*>(p), handler_deleter{&_handler_pool});
         }
+        // Timeouts are rounded up to the lowres clock's 10ms resolution
+        void wait_for_reply(id_type id, handler_ptr&& h, std::experimental::optional<steady_clock_type::time_point> timeout);
+        // Removes and returns the handler of a call, or a null pointer if the
+        // call is not waiting (it timed out, or was never made)
+        handler_ptr take_reply_handler(id_type id);
 
         future<> stop() {
             if (_connected && !this->_error) {
@@ -262,11 +380,50 @@ class protocol {
         ipv4_addr peer_address() const {
             return _server_addr;
         }
+        // Replies are not limited
+        future<> wait_for_frame_memory(size_t size) {
+            return make_ready_future<>();
+        }
+        void release_frame_memory(size_t size) {
+        }
+    };
+
+    /// \brief Several connections to one server, isolating groups of verbs
+    ///
+    /// Each verb belongs to an isolation class, and calls are sent on the
+    /// connection of their class, so that a large or slow reply only delays
+    /// calls of the same class.  A class connects on first use, and
+    /// reconnects on the next call after its connection failed.
+    ///
+    /// Streams are made on the client of the verb they are passed to:
+    /// get_client(verb).make_stream().
+    class multi_client {
+        protocol& _proto;
+        ipv4_addr _server_addr;
+        std::function<unsigned (MsgType)> _isolation_class;
+        std::function<future<connected_socket> ()> _connect;
+        client_options _options;
+        std::vector<std::unique_ptr<client>> _clients;
+        seastar::gate _retired; // clients replaced after an error, until they stop
+        bool _stopped = false;
+    public:
+        /// \param nr_classes number of isolation classes (and connections)
+        /// \param isolation_class returns the class of a verb, less than nr_classes
+        multi_client(protocol& proto, ipv4_addr addr, unsigned nr_classes, std::function<unsigned (MsgType)> isolation_class,
+                ipv4_addr local = ipv4_addr(), client_options options = client_options());
+        /// Like the above, but connections are made by calling \c connect
+        multi_client(protocol& proto, ipv4_addr addr, unsigned nr_classes, std::function<unsigned (MsgType)> isolation_class,
+                std::function<future<connected_socket> ()> connect, client_options options = client_options());
+        client& get_client(MsgType verb);
+        /// Sums the statistics of all connections
+        stats get_stats() const;
+        future<> stop();
+        bool error() const { return _stopped; }
     };
     friend server;
 private:
     using rpc_handler = std::function<future<> (lw_shared_ptr<typename server::connection>, int64_t msgid,
-                                                temporary_buffer<char> data)>;
+                                                rcv_buf data)>;
     std::unordered_map<MsgType, rpc_handler> _handlers;
     Serializer _serializer;
     std::function<void(const sstring&)> _logger;
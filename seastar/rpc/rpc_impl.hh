@@ -150,22 +150,147 @@ inline void marshall_one(Serializer& serializer, Output& out, const T& arg) {
     serialize_helper_type::serialize(serializer, out, arg);
 }
 
+// blobs and streams are encoded by rpc itself, see doc/rpc.md
+template <typename Serializer, typename Output>
+inline void marshall_one(Serializer& serializer, Output& out, const blob& arg) {
+    auto size = cpu_to_le(uint32_t(arg.size()));
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    for (auto&& b : arg.share()) {
+        out.write(std::move(b));
+    }
+}
+
+template <typename Serializer, typename Output>
+inline void marshall_one(Serializer& serializer, Output& out, const stream& arg) {
+    auto id = cpu_to_le(arg.id());
+    out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
 template <typename Serializer, typename Output, typename... T>
 inline void do_marshall(Serializer& serializer, Output& out, const T&... args) {
     // C++ guarantees that brace-initialization expressions are evaluted in order
     (void)std::initializer_list<int>{(marshall_one(serializer, out, args), 1)...};
 }
 
+// Output streams used by marshall().  Besides write(const char*, size_t),
+// which copies, they provide write(temporary_buffer<char>), which splices
+// the buffer into the frame.
+class frame_measuring_stream {
+    size_t _size = 0;
+public:
+    void write(const char* data, size_t size) {
+        _size += size;
+    }
+    void write(temporary_buffer<char> buf) {}
+    size_t size() const {
+        return _size;
+    }
+};
+
+class frame_output_stream {
+    temporary_buffer<char> _buf; // holds all copied data, sized by a measuring pass
+    size_t _start = 0;           // first byte of _buf not yet added to _frame
+    size_t _pos;
+    net::packet _frame;
+private:
+    void cut() {
+        if (_pos != _start) {
+            _frame = net::packet(std::move(_frame), _buf.share(_start, _pos - _start));
+            _start = _pos;
+        }
+    }
+public:
+    frame_output_stream(temporary_buffer<char> buf, size_t head_space) : _buf(std::move(buf)), _pos(head_space) {}
+    void write(const char* data, size_t size) {
+        std::copy_n(data, size, _buf.get_write() + _pos);
+        _pos += size;
+    }
+    void write(temporary_buffer<char> buf) {
+        if (!buf.empty()) {
+            cut();
+            _frame = net::packet(std::move(_frame), std::move(buf));
+        }
+    }
+    net::packet finish() {
+        cut();
+        return std::move(_frame);
+    }
+};
+
+inline net::packet to_packet(temporary_buffer<char> buf) {
+    net::fragment f{buf.get_write(), buf.size()};
+    return net::packet(f, buf.release());
+}
+
+// Serializes args into a frame that is handed to the connection's output
+// stream as is, leaving head_space bytes in front of them, in the first
+// fragment, for the frame header.
 template <typename Serializer, typename... T>
-inline sstring marshall(Serializer& serializer, size_t head_space, const T&... args) {
-    seastar::measuring_output_stream measure;
+inline net::packet marshall(Serializer& serializer, size_t head_space, const T&... args) {
+    frame_measuring_stream measure;
     do_marshall(serializer, measure, args...);
-    sstring ret(sstring::initialized_later(), measure.size() + head_space);
-    seastar::simple_output_stream out(ret, head_space);
+    frame_output_stream out(temporary_buffer<char>(measure.size() + head_space), head_space);
     do_marshall(serializer, out, args...);
-    return ret;
+    return out.finish();
 }
 
+// Input stream used by unmarshall(), reading a frame received in several
+// buffers.  read_buffers() shares data instead of copying it.
+class frame_input_stream {
+    rcv_buf _data;
+    size_t _idx = 0;
+    stream_registry* _streams;
+private:
+    void check(size_t size) const {
+        if (size > _data.size) {
+            throw std::out_of_range("deserialization buffer underflow");
+        }
+    }
+    template <typename Func>
+    void consume(size_t size, Func&& func) {
+        check(size);
+        _data.size -= size;
+        while (size) {
+            auto& b = _data.bufs[_idx];
+            auto now = std::min(size, b.size());
+            func(b, now);
+            b.trim_front(now);
+            size -= now;
+            if (b.empty()) {
+                ++_idx;
+            }
+        }
+    }
+public:
+    frame_input_stream(rcv_buf data, stream_registry* streams) : _data(std::move(data)), _streams(streams) {
+        while (_idx < _data.bufs.size() && _data.bufs[_idx].empty()) {
+            ++_idx;
+        }
+    }
+    void read(char* p, size_t size) {
+        consume(size, [&p] (temporary_buffer<char>& b, size_t now) {
+            p = std::copy_n(b.get(), now, p);
+        });
+    }
+    void skip(size_t size) {
+        consume(size, [] (temporary_buffer<char>& b, size_t now) {});
+    }
+    std::vector<temporary_buffer<char>> read_buffers(size_t size) {
+        std::vector<temporary_buffer<char>> ret;
+        consume(size, [&ret] (temporary_buffer<char>& b, size_t now) {
+            ret.push_back(b.share(0, now));
+        });
+        return ret;
+    }
+    size_t size() const {
+        return _data.size;
+    }
+    // Connection on which stream arguments are opened (may be null)
+    stream_registry* streams() const {
+        return _streams;
+    }
+};
+
 template <typename Serializer, typename Input>
 inline std::tuple<> do_unmarshall(Serializer& serializer, Input& in) {
     return std::make_tuple();
@@ -182,13 +307,34 @@ template<typename Serializer, typename Input, typename T>
 struct unmarshal_one<Serializer, Input, optional<T>> {
     static optional<T> doit(Serializer& serializer, Input& in) {
         if (in.size()) {
-            return optional<T>(read(serializer, in, type<typename remove_optional<T>::type>()));
+            return optional<T>(unmarshal_one<Serializer, Input, typename remove_optional<T>::type>::doit(serializer, in));
         } else {
             return optional<T>();
         }
     }
 };
 
+template<typename Serializer, typename Input>
+struct unmarshal_one<Serializer, Input, blob> {
+    static blob doit(Serializer& serializer, Input& in) {
+        uint32_t size;
+        in.read(reinterpret_cast<char*>(&size), sizeof(size));
+        return blob(in.read_buffers(le_to_cpu(size)));
+    }
+};
+
+template<typename Serializer, typename Input>
+struct unmarshal_one<Serializer, Input, stream> {
+    static stream doit(Serializer& serializer, Input& in) {
+        int64_t id;
+        in.read(reinterpret_cast<char*>(&id), sizeof(id));
+        if (!in.streams()) {
+            throw rpc_protocol_error();
+        }
+        return in.streams()->open_stream(le_to_cpu(id));
+    }
+};
+
 template <typename Serializer, typename Input, typename T0, typename... Trest>
 inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, Input& in) {
     // FIXME: something less recursive
@@ -198,13 +344,14 @@ inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, Input& in)
 }
 
 template <typename Serializer, typename... T>
-inline std::tuple<T...> unmarshall(Serializer& serializer, temporary_buffer<char> input) {
-    seastar::simple_input_stream in(input.get(), input.size());
-    return do_unmarshall<Serializer, seastar::simple_input_stream, T...>(serializer, in);
+inline std::tuple<T...> unmarshall(Serializer& serializer, rcv_buf input, stream_registry* streams) {
+    frame_input_stream in(std::move(input), streams);
+    return do_unmarshall<Serializer, frame_input_stream, T...>(serializer, in);
 }
 
-static std::exception_ptr unmarshal_exception(temporary_buffer<char>& data) {
+static std::exception_ptr unmarshal_exception(rcv_buf& input) {
     std::exception_ptr ex;
+    auto data = linearize(input);
     auto get = [&data] (size_t size) {
         if (data.size() < size) {
             throw rpc_protocol_error();
@@ -248,21 +395,21 @@ struct rcv_reply_base  {
 
 template<typename Serializer, typename MsgType, typename T>
 struct rcv_reply : rcv_reply_base<T, T> {
-    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, temporary_buffer<char> input) {
-        this->set_value(unmarshall<Serializer, T>(dst.serializer(), std::move(input)));
+    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, rcv_buf input) {
+        this->set_value(unmarshall<Serializer, T>(dst.serializer(), std::move(input), &dst));
     }
 };
 
 template<typename Serializer, typename MsgType, typename... T>
 struct rcv_reply<Serializer, MsgType, future<T...>> : rcv_reply_base<std::tuple<T...>, T...> {
-    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, temporary_buffer<char> input) {
-        this->set_value(unmarshall<Serializer, T...>(dst.serializer(), std::move(input)));
+    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, rcv_buf input) {
+        this->set_value(unmarshall<Serializer, T...>(dst.serializer(), std::move(input), &dst));
     }
 };
 
 template<typename Serializer, typename MsgType>
 struct rcv_reply<Serializer, MsgType, void> : rcv_reply_base<void, void> {
-    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, temporary_buffer<char> input) {
+    inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, rcv_buf input) {
         this->set_value();
     }
 };
@@ -274,7 +421,7 @@ template <typename Serializer, typename MsgType, typename Ret, typename... InArg
 inline auto wait_for_reply(wait_type, std::experimental::optional<steady_clock_type::time_point> timeout, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id,
         signature<Ret (InArgs...)> sig) {
     using reply_type = rcv_reply<Serializer, MsgType, Ret>;
-    auto lambda = [] (reply_type& r, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id, temporary_buffer<char> data) mutable {
+    auto lambda = [] (reply_type& r, typename protocol<Serializer, MsgType>::client& dst, id_type msg_id, rcv_buf data) mutable {
         if (msg_id >= 0) {
             dst.get_stats_internal().replied++;
             return r.get_reply(dst, std::move(data));
@@ -285,8 +432,8 @@ inline auto wait_for_reply(wait_type, std::experimental::optional<steady_clock_t
         }
     };
     using handler_type = typename protocol<Serializer, MsgType>::client::template reply_handler<reply_type, decltype(lambda)>;
-    auto r = std::make_unique<handler_type>(std::move(lambda));
-    auto fut = r->reply.p.get_future();
+    auto r = dst.template make_reply_handler<handler_type>(std::move(lambda));
+    auto fut = static_cast<handler_type&>(*r).reply.p.get_future();
     dst.wait_for_reply(msg_id, std::move(r), timeout);
     return fut;
 }
@@ -321,18 +468,20 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
             // send message
             auto msg_id = dst.next_message_id();
             dst.get_stats_internal().pending++;
-            sstring data = marshall(dst.serializer(), 20, args...);
-            auto p = data.begin();
+            auto data = marshall(dst.serializer(), 20, args...);
+            auto p = data.frag(0).base;
             *unaligned_cast<uint64_t*>(p) = cpu_to_le(uint64_t(t));
             *unaligned_cast<int64_t*>(p + 8) = cpu_to_le(msg_id);
-            *unaligned_cast<uint32_t*>(p + 16) = cpu_to_le(data.size() - 20);
+            *unaligned_cast<uint32_t*>(p + 16) = cpu_to_le(data.len() - 20);
             promise<> sentp;
             future<> sent = sentp.get_future();
-            dst.out_ready() = dst.out_ready().then([&dst, data = std::move(data), timeout] () {
+            dst.out_ready() = dst.out_ready().then([&dst, data = std::move(data), timeout] () mutable {
                 if (timeout && steady_clock_type::now() >= timeout.value()) {
                     return make_ready_future<>(); // if message timed outed drop it without sending
                 } else {
-                    return dst.out().write(data).then([&dst] {
+                    // the frame is queued in the stream, and the flush is batched
+                    // with other frames written during this poll cycle
+                    return dst.write_frame(std::move(data)).then([&dst] {
                         return dst.out().flush();
                     });
                 }
@@ -365,6 +514,15 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
         auto operator()(typename protocol<Serializer, MsgType>::client& dst, steady_clock_type::duration timeout, const InArgs&... args) {
             return send(dst, steady_clock_type::now() + timeout, args...);
         }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, const InArgs&... args) {
+            return send(dst.get_client(t), {}, args...);
+        }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, steady_clock_type::time_point timeout, const InArgs&... args) {
+            return send(dst.get_client(t), timeout, args...);
+        }
+        auto operator()(typename protocol<Serializer, MsgType>::multi_client& dst, steady_clock_type::duration timeout, const InArgs&... args) {
+            return send(dst.get_client(t), steady_clock_type::now() + timeout, args...);
+        }
     };
     return shelper{xt, xsig};
 }
@@ -372,11 +530,11 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
 template <typename Serializer, typename MsgType>
 inline
 future<>
-protocol<Serializer, MsgType>::server::connection::respond(int64_t msg_id, sstring&& data) {
-    auto p = data.begin();
+protocol<Serializer, MsgType>::server::connection::respond(int64_t msg_id, net::packet&& data) {
+    auto p = data.frag(0).base;
     *unaligned_cast<int64_t*>(p) = cpu_to_le(msg_id);
-    *unaligned_cast<uint32_t*>(p + 8) = cpu_to_le(data.size() - 12);
-    return this->out().write(data.begin(), data.size()).then([conn = this->shared_from_this()] {
+    *unaligned_cast<uint32_t*>(p + 8) = cpu_to_le(data.len() - 12);
+    return this->write_frame(std::move(data)).then([conn = this->shared_from_this()] {
         return conn->out().flush();
     });
 }
@@ -386,7 +544,7 @@ inline void reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_share
         size_t memory_consumed) {
     if (!client->error()) {
         client->out_ready() = client->out_ready().then([&client = *client, msg_id, ret = std::move(ret)] () mutable {
-            sstring data;
+            net::packet data;
             client.get_stats_internal().pending++;
             client.get_stats_internal().sent_messages++;
             try {
@@ -394,11 +552,12 @@ inline void reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_share
                         std::tuple_cat(std::make_tuple(std::ref(client.serializer()), 12), std::move(ret.get())));
             } catch (std::exception& ex) {
                 uint32_t len = std::strlen(ex.what());
-                data = sstring(sstring::initialized_later(), 20 + len);
-                auto p = data.begin() + 12;
+                temporary_buffer<char> buf(20 + len);
+                auto p = buf.get_write() + 12;
                 *unaligned_cast<uint32_t*>(p) = le_to_cpu(uint32_t(exception_type::USER));
                 *unaligned_cast<uint32_t*>(p + 4) = le_to_cpu(len);
                 std::copy_n(ex.what(), len, p + 8);
+                data = to_packet(std::move(buf));
                 msg_id = -msg_id;
             }
 
@@ -454,9 +613,9 @@ auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci
     using wait_style = wait_signature_t<Ret>;
     return [func = lref_to_cref(std::forward<Func>(func))](lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
                                                            int64_t msg_id,
-                                                           temporary_buffer<char> data) mutable {
-        auto memory_consumed = client->estimate_request_size(data.size());
-        auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data));
+                                                           rcv_buf data) mutable {
+        auto memory_consumed = client->estimate_request_size(data.size);
+        auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data), client.get());
         // note: apply is executed asynchronously with regards to networking so we cannot chain futures here by doing "return apply()"
         return client->wait_for_resources(memory_consumed).then([client, msg_id, memory_consumed, args = std::move(args), &func] () mutable {
           apply(func, client->info(), WantClientInfo(), signature(), std::move(args)).then_wrapped(
@@ -569,13 +728,13 @@ auto protocol<Serializer, MsgType>::register_handler(MsgType t, Func&& func) {
 }
 
 template<typename Serializer, typename MsgType>
-protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, ipv4_addr addr, resource_limits limits)
-    : server(proto, engine().listen(addr, listen_options(true)), limits)
+protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, ipv4_addr addr, resource_limits limits, server_options options)
+    : server(proto, engine().listen(addr, listen_options(true)), limits, options)
 {}
 
 template<typename Serializer, typename MsgType>
-protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_socket ss, resource_limits limits)
-        : _proto(proto), _ss(std::move(ss)), _limits(limits), _resources_available(limits.max_memory)
+protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_socket ss, resource_limits limits, server_options options)
+        : _proto(proto), _ss(std::move(ss)), _limits(limits), _options(options), _resources_available(limits.max_memory)
 {
     accept();
 }
@@ -630,6 +789,191 @@ static bool verify_frame(Connection& c, temporary_buffer<char>& buf, size_t expe
     return true;
 }
 
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::connection::write_frame(net::packet data) {
+    if (!_compressor) {
+        return _write_buf.write(std::move(data));
+    }
+    // Compressed connections prefix each frame with an envelope: the size of
+    // what follows on the wire and its size once decompressed, which is zero
+    // if the frame was sent as is.
+    temporary_buffer<char> compressed;
+    if (data.len() >= _compression_threshold) {
+        auto start = steady_clock_type::now();
+        data.linearize();
+        compressed = _compressor->compress(8, data.frag(0).base, data.len());
+        _stats.compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_type::now() - start).count();
+        _stats.compress_in_bytes += data.len();
+        _stats.compress_out_bytes += compressed.empty() ? data.len() : compressed.size() - 8;
+    }
+    if (compressed.empty()) {
+        temporary_buffer<char> envelope(8);
+        auto p = envelope.get_write();
+        *unaligned_cast<uint32_t*>(p) = cpu_to_le(uint32_t(data.len()));
+        *unaligned_cast<uint32_t*>(p + 4) = cpu_to_le(uint32_t(0));
+        auto frame = to_packet(std::move(envelope));
+        frame.append(std::move(data));
+        return _write_buf.write(std::move(frame));
+    }
+    auto p = compressed.get_write();
+    *unaligned_cast<uint32_t*>(p) = cpu_to_le(uint32_t(compressed.size() - 8));
+    *unaligned_cast<uint32_t*>(p + 4) = cpu_to_le(uint32_t(data.len()));
+    return _write_buf.write(std::move(compressed));
+}
+
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::connection::send_frame(net::packet frame) {
+    if (_error) {
+        return make_exception_future<>(closed_error());
+    }
+    promise<> sent;
+    auto f = sent.get_future();
+    _output_ready = _output_ready.then([this, frame = std::move(frame)] () mutable {
+        return write_frame(std::move(frame)).then([this] {
+            return _write_buf.flush();
+        });
+    }).then_wrapped([sent = std::move(sent)] (future<> f) mutable {
+        if (f.failed()) {
+            auto ex = f.get_exception();
+            sent.set_exception(ex);
+            return make_exception_future<>(std::move(ex));
+        }
+        sent.set_value();
+        return make_ready_future<>();
+    });
+    return f;
+}
+
+// Stream frames: the connection's frame header, followed by the stream id,
+// the frame kind and the data.
+inline net::packet make_stream_frame(size_t header_size, int64_t id, stream_frame_kind kind, temporary_buffer<char> data) {
+    temporary_buffer<char> header(header_size + 12);
+    auto p = header.get_write() + header_size;
+    *unaligned_cast<int64_t*>(p) = cpu_to_le(id);
+    *unaligned_cast<uint32_t*>(p + 8) = cpu_to_le(uint32_t(kind));
+    auto frame = to_packet(std::move(header));
+    if (!data.empty()) {
+        frame = net::packet(std::move(frame), std::move(data));
+    }
+    return frame;
+}
+
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::server::connection::send_stream_frame(int64_t id, stream_frame_kind kind, temporary_buffer<char> data) {
+    auto frame = make_stream_frame(12, id, kind, std::move(data));
+    auto p = frame.frag(0).base;
+    *unaligned_cast<int64_t*>(p) = cpu_to_le(stream_msg_id);
+    *unaligned_cast<uint32_t*>(p + 8) = cpu_to_le(uint32_t(frame.len() - 12));
+    return this->send_frame(std::move(frame));
+}
+
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::client::send_stream_frame(int64_t id, stream_frame_kind kind, temporary_buffer<char> data) {
+    if (!this->_streams_supported) {
+        return make_exception_future<>(error("server does not support streams"));
+    }
+    auto frame = make_stream_frame(20, id, kind, std::move(data));
+    auto p = frame.frag(0).base;
+    *unaligned_cast<uint64_t*>(p) = cpu_to_le(stream_verb);
+    *unaligned_cast<int64_t*>(p + 8) = cpu_to_le(int64_t(0));
+    *unaligned_cast<uint32_t*>(p + 16) = cpu_to_le(uint32_t(frame.len() - 20));
+    return this->send_frame(std::move(frame));
+}
+
+// Reads size bytes, keeping them in the buffers they were received in
+inline future<rcv_buf> read_rcv_buf(input_stream<char>& in, uint32_t size) {
+    if (!size) {
+        return make_ready_future<rcv_buf>();
+    }
+    return in.read_up_to(size).then([&in, size] (temporary_buffer<char> first) {
+        if (first.size() == size || first.empty()) {
+            return make_ready_future<rcv_buf>(rcv_buf(std::move(first)));
+        }
+        return do_with(rcv_buf(std::move(first)), [&in, size] (rcv_buf& data) {
+            return repeat([&in, &data, size] {
+                return in.read_up_to(size - data.size).then([&data, size] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return stop_iteration::yes;
+                    }
+                    data.size += buf.size();
+                    data.bufs.push_back(std::move(buf));
+                    return data.size == size ? stop_iteration::yes : stop_iteration::no;
+                });
+            }).then([&data] {
+                return std::move(data);
+            });
+        });
+    });
+}
+
+// Reads a frame made of a header_size bytes header, with the payload size at
+// size_offset, followed by the payload, undoing the compression envelope if
+// the connection negotiated one.  The payload is disengaged on eof.
+template<typename Connection>
+static
+future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>
+read_frame(Connection& c, input_stream<char>& in, size_t header_size, size_t size_offset) {
+    auto eof = [&c] (bool truncated) {
+        if (truncated) {
+            c.get_protocol().log(c.peer_address(), "unexpected eof");
+        }
+        return make_ready_future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>(temporary_buffer<char>(), std::experimental::optional<rcv_buf>());
+    };
+    if (!c.compressor()) {
+        return in.read_exactly(header_size).then([&c, &in, header_size, size_offset, eof] (temporary_buffer<char> header) {
+            if (header.size() != header_size) {
+                return eof(header.size() != 0);
+            }
+            auto size = le_to_cpu(*unaligned_cast<uint32_t*>(header.get() + size_offset));
+            return read_rcv_buf(in, size).then([size, eof, header = std::move(header)] (rcv_buf data) mutable {
+                if (data.size != size) {
+                    return eof(true);
+                }
+                return make_ready_future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>(std::move(header), std::experimental::optional<rcv_buf>(std::move(data)));
+            });
+        });
+    }
+    return in.read_exactly(8).then([&c, &in, header_size, size_offset, eof] (temporary_buffer<char> envelope) {
+        if (envelope.size() != 8) {
+            return eof(envelope.size() != 0);
+        }
+        auto wire_size = le_to_cpu(*unaligned_cast<uint32_t*>(envelope.get()));
+        auto raw_size = le_to_cpu(*unaligned_cast<uint32_t*>(envelope.get() + 4));
+        if (raw_size && !lz4_compressor::plausible(wire_size, raw_size)) {
+            return make_exception_future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>(rpc_protocol_error());
+        }
+        // Account for the decompressed frame before reading it, and for as
+        // long as decompressing it takes; the request takes over after that.
+        return c.wait_for_frame_memory(raw_size).then([&c, &in, header_size, size_offset, wire_size, raw_size, eof] {
+          return in.read_exactly(wire_size).then_wrapped([&c, header_size, size_offset, wire_size, raw_size, eof] (future<temporary_buffer<char>> f) {
+            auto frame = temporary_buffer<char>();
+            try {
+                frame = f.get0();
+                if (frame.size() == wire_size && raw_size) {
+                    auto start = steady_clock_type::now();
+                    frame = c.compressor()->decompress(frame.get(), frame.size(), raw_size);
+                    c.get_stats_internal().decompress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock_type::now() - start).count();
+                }
+            } catch (...) {
+                c.release_frame_memory(raw_size);
+                throw;
+            }
+            c.release_frame_memory(raw_size);
+            if (frame.size() != (raw_size ? raw_size : wire_size)) {
+                return eof(true);
+            }
+            if (frame.size() < header_size
+                    || le_to_cpu(*unaligned_cast<uint32_t*>(frame.get() + size_offset)) != frame.size() - header_size) {
+                return make_exception_future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>(rpc_protocol_error());
+            }
+            auto header = frame.share(0, header_size);
+            frame.trim_front(header_size);
+            return make_ready_future<temporary_buffer<char>, std::experimental::optional<rcv_buf>>(std::move(header), std::experimental::optional<rcv_buf>(rcv_buf(std::move(frame))));
+          });
+        });
+    });
+}
+
 template<typename Connection>
 static void send_negotiation_frame(Connection& c, const negotiation_frame& nf) {
     sstring reply(sstring::initialized_later(), sizeof(negotiation_frame));
@@ -658,7 +1002,7 @@ future<negotiation_frame> receive_negotiation_frame(Connection& c, input_stream<
             return make_exception_future<negotiation_frame>(closed_error());
         }
         frame->required_features_mask = le_to_cpu(frame->required_features_mask);
-        frame->optional_features_mask = le_to_cpu(frame->required_features_mask);
+        frame->optional_features_mask = le_to_cpu(frame->optional_features_mask);
         frame->len = le_to_cpu(frame->len);
         return make_ready_future<negotiation_frame>(*frame);
     });
@@ -695,33 +1039,29 @@ template<typename Serializer, typename MsgType>
 future<negotiation_frame>
 protocol<Serializer, MsgType>::server::connection::negotiate_protocol(input_stream<char>& in) {
     return receive_negotiation_frame(*this, in).then([this, &in] (negotiation_frame nf) {
-        negotiation_frame mine = {{}, 0, 0, 0};
+        uint32_t supported = STREAMS | (_server._options.compress ? LZ4_COMPRESSION : 0);
+        negotiation_frame mine = {{}, 0, nf.optional_features_mask & supported, 0};
         send_negotiation_frame(*this, mine);
+        this->_streams_supported = mine.optional_features_mask & STREAMS;
+        if (mine.optional_features_mask & LZ4_COMPRESSION) {
+            // the negotiation frame itself is written raw; everything after it is enveloped
+            this->enable_compression(_server._options.compression_threshold);
+        }
         return verify_negotiation_data(*this, in, nf);
     });
 }
 
 template <typename Serializer, typename MsgType>
-future<MsgType, int64_t, std::experimental::optional<temporary_buffer<char>>>
+future<uint64_t, int64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::server::connection::read_request_frame(input_stream<char>& in) {
-    return in.read_exactly(20).then([this, &in] (temporary_buffer<char> header) {
-        if (header.size() != 20) {
-            if (header.size() != 0) {
-                this->_server._proto.log(_info, "unexpected eof");
-            }
-            return make_ready_future<MsgType, int64_t, std::experimental::optional<temporary_buffer<char>>>(MsgType(0), 0, std::experimental::optional<temporary_buffer<char>>());
+    return read_frame(*this, in, 20, 16).then([] (temporary_buffer<char> header, std::experimental::optional<rcv_buf> data) {
+        if (!data) {
+            return make_ready_future<uint64_t, int64_t, std::experimental::optional<rcv_buf>>(0, 0, std::experimental::optional<rcv_buf>());
         }
         auto ptr = header.get();
-        auto type = MsgType(le_to_cpu(*unaligned_cast<uint64_t>(ptr)));
+        auto type = le_to_cpu(*unaligned_cast<uint64_t*>(ptr));
         auto msgid = le_to_cpu(*unaligned_cast<int64_t*>(ptr + 8));
-        auto size = le_to_cpu(*unaligned_cast<uint32_t*>(ptr + 16));
-        return in.read_exactly(size).then([this, type, msgid, size] (temporary_buffer<char> data) {
-            if (data.size() != size) {
-                this->_server._proto.log(_info, "unexpected eof");
-                return make_ready_future<MsgType, int64_t, std::experimental::optional<temporary_buffer<char>>>(MsgType(0), 0, std::experimental::optional<temporary_buffer<char>>());
-            }
-            return make_ready_future<MsgType, int64_t, std::experimental::optional<temporary_buffer<char>>>(type, msgid, std::experimental::optional<temporary_buffer<char>>(std::move(data)));
-        });
+        return make_ready_future<uint64_t, int64_t, std::experimental::optional<rcv_buf>>(type, msgid, std::move(data));
     });
 }
 
@@ -729,23 +1069,30 @@ template<typename Serializer, typename MsgType>
 future<> protocol<Serializer, MsgType>::server::connection::process() {
     return this->negotiate_protocol(this->_read_buf).then([this] (negotiation_frame frame) mutable {
         return do_until([this] { return this->_read_buf.eof() || this->_error; }, [this] () mutable {
-            return this->read_request_frame(this->_read_buf).then([this] (MsgType type, int64_t msg_id, std::experimental::optional<temporary_buffer<char>> data) {
+            return this->read_request_frame(this->_read_buf).then([this] (uint64_t raw_type, int64_t msg_id, std::experimental::optional<rcv_buf> data) {
+                auto type = MsgType(raw_type);
                 if (!data) {
                     this->_error = true;
                     return make_ready_future<>();
+                } else if (raw_type == stream_verb) {
+                    if (!this->_streams_supported) {
+                        return make_exception_future<>(rpc_protocol_error());
+                    }
+                    this->receive_stream_frame(std::move(data.value()));
+                    return make_ready_future<>();
                 } else {
                     auto it = _server._proto._handlers.find(type);
                     if (it != _server._proto._handlers.end()) {
                         return it->second(this->shared_from_this(), msg_id, std::move(data.value()));
                     } else {
                         // send unknown_verb exception back
-                        auto data = sstring(sstring::initialized_later(), 28);
-                        auto p = data.begin() + 12;
+                        auto data = temporary_buffer<char>(28);
+                        auto p = data.get_write() + 12;
                         *unaligned_cast<uint32_t*>(p) = cpu_to_le(uint32_t(exception_type::UNKNOWN_VERB));
                         *unaligned_cast<uint32_t*>(p + 4) = cpu_to_le(uint32_t(8));
                         *unaligned_cast<uint64_t*>(p + 8) = cpu_to_le(uint64_t(type));
                         this->get_stats_internal().pending++;
-                        return this->respond(-msg_id, std::move(data)).finally([this]() {
+                        return this->respond(-msg_id, to_packet(std::move(data))).finally([this]() {
                             this->get_stats_internal().pending--;
                         });
 
@@ -759,6 +1106,7 @@ future<> protocol<Serializer, MsgType>::server::connection::process() {
         }
         f.ignore_ready_future();
         this->_error = true;
+        this->abort_streams(std::make_exception_ptr(closed_error()));
         return this->out_ready().then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             return this->_write_buf.close();
@@ -787,51 +1135,198 @@ protocol<Serializer, MsgType>::client::negotiate_protocol(input_stream<char>& in
 // FIXME: take out-of-line?
 template<typename Serializer, typename MsgType>
 inline
-future<int64_t, std::experimental::optional<temporary_buffer<char>>>
+future<int64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::client::read_response_frame(input_stream<char>& in) {
-    return in.read_exactly(12).then([this, &in] (temporary_buffer<char> header) {
-        if (header.size() != 12) {
-            if (header.size() != 0) {
-                this->_proto.log(this->_server_addr, "unexpected eof");
-            }
-            return make_ready_future<int64_t, std::experimental::optional<temporary_buffer<char>>>(0, std::experimental::optional<temporary_buffer<char>>());
+    return read_frame(*this, in, 12, 8).then([] (temporary_buffer<char> header, std::experimental::optional<rcv_buf> data) {
+        if (!data) {
+            return make_ready_future<int64_t, std::experimental::optional<rcv_buf>>(0, std::experimental::optional<rcv_buf>());
         }
-
-        auto ptr = header.get();
-        auto msgid = le_to_cpu(*unaligned_cast<int64_t*>(ptr));
-        auto size = le_to_cpu(*unaligned_cast<uint32_t*>(ptr + 8));
-        return in.read_exactly(size).then([this, msgid, size] (temporary_buffer<char> data) {
-            if (data.size() != size) {
-                this->_proto.log(this->_server_addr, "unexpected eof");
-                return make_ready_future<int64_t, std::experimental::optional<temporary_buffer<char>>>(0, std::experimental::optional<temporary_buffer<char>>());
-            }
-            return make_ready_future<int64_t, std::experimental::optional<temporary_buffer<char>>>(msgid, std::experimental::optional<temporary_buffer<char>>(std::move(data)));
-        });
+        auto msgid = le_to_cpu(*unaligned_cast<int64_t*>(header.get()));
+        return make_ready_future<int64_t, std::experimental::optional<rcv_buf>>(msgid, std::move(data));
     });
 }
 
 template<typename Serializer, typename MsgType>
-protocol<Serializer, MsgType>::client::client(protocol& proto, ipv4_addr addr, future<connected_socket> f) : protocol<Serializer, MsgType>::connection(proto), _server_addr(addr) {
+protocol<Serializer, MsgType>::client::handler_pool::~handler_pool() {
+    for (auto& free : _free) {
+        for (auto p : free) {
+            ::operator delete(p);
+        }
+    }
+}
+
+template<typename Serializer, typename MsgType>
+void* protocol<Serializer, MsgType>::client::handler_pool::allocate(size_t size) {
+    if (size > max_pooled_size) {
+        return ::operator new(size);
+    }
+    auto idx = (size + granularity - 1) / granularity - 1;
+    auto& free = _free[idx];
+    if (free.empty()) {
+        return ::operator new((idx + 1) * granularity);
+    }
+    auto p = free.back();
+    free.pop_back();
+    return p;
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::handler_pool::deallocate(void* p, size_t size) {
+    if (size > max_pooled_size) {
+        ::operator delete(p);
+        return;
+    }
+    auto& free = _free[(size + granularity - 1) / granularity - 1];
+    if (free.size() < max_free) {
+        free.push_back(p);
+    } else {
+        ::operator delete(p);
+    }
+}
+
+template<typename Serializer, typename MsgType>
+typename protocol<Serializer, MsgType>::client::outstanding_reply*
+protocol<Serializer, MsgType>::client::find_outstanding(id_type id) {
+    auto& slot = _outstanding[id & (_outstanding.size() - 1)];
+    if (slot.handler && slot.id == id) {
+        return &slot;
+    }
+    if (!_outstanding_overflow.empty()) {
+        auto it = _outstanding_overflow.find(id);
+        if (it != _outstanding_overflow.end()) {
+            return &it->second;
+        }
+    }
+    return nullptr;
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::grow_outstanding() {
+    // entries occupy distinct slots modulo the old size, so they also do
+    // modulo twice that size
+    std::vector<outstanding_reply> ring(_outstanding.size() * 2);
+    for (auto& r : _outstanding) {
+        if (r.handler) {
+            ring[r.id & (ring.size() - 1)] = std::move(r);
+        }
+    }
+    _outstanding = std::move(ring);
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::wait_for_reply(id_type id, handler_ptr&& h, std::experimental::optional<steady_clock_type::time_point> timeout) {
+    auto* slot = &_outstanding[id & (_outstanding.size() - 1)];
+    while (slot->handler) {
+        // the ring wrapped around to a call that still waits for its reply
+        if (_outstanding.size() < max_ring_size) {
+            grow_outstanding();
+            slot = &_outstanding[id & (_outstanding.size() - 1)];
+        } else {
+            auto old_id = slot->id;
+            _outstanding_overflow.emplace(old_id, std::move(*slot));
+            slot->handler.reset();
+        }
+    }
+    slot->id = id;
+    slot->handler = std::move(h);
+    ++_nr_outstanding;
+    if (timeout) {
+        auto left = timeout.value() - steady_clock_type::now();
+        auto expires = lowres_clock::now() + std::chrono::duration_cast<lowres_clock::duration>(left);
+        auto& t = slot->handler->t;
+        t.set_callback([this, id] { this->timeout(id); });
+        t.arm(expires);
+    }
+}
+
+template<typename Serializer, typename MsgType>
+typename protocol<Serializer, MsgType>::client::handler_ptr
+protocol<Serializer, MsgType>::client::take_reply_handler(id_type id) {
+    handler_ptr h;
+    auto& slot = _outstanding[id & (_outstanding.size() - 1)];
+    if (slot.handler && slot.id == id) {
+        h = std::move(slot.handler);
+    } else if (!_outstanding_overflow.empty()) {
+        auto it = _outstanding_overflow.find(id);
+        if (it != _outstanding_overflow.end()) {
+            h = std::move(it->second.handler);
+            _outstanding_overflow.erase(it);
+        }
+    }
+    if (h) {
+        --_nr_outstanding;
+    }
+    return h;
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::timeout(id_type id) {
+    // destroys the handler, and so the timer that called us, which is
+    // not touched after its callback returns
+    auto h = take_reply_handler(id);
+    if (h) {
+        this->_stats.timeout++;
+        h->timeout();
+    }
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::clear_outstanding() {
+    for (auto& r : _outstanding) {
+        r.handler.reset();
+    }
+    _outstanding_overflow.clear();
+    _nr_outstanding = 0;
+}
+
+template<typename Serializer, typename MsgType>
+protocol<Serializer, MsgType>::client::client(protocol& proto, ipv4_addr addr, future<connected_socket> f, client_options options)
+        : protocol<Serializer, MsgType>::connection(proto)
+        , _outstanding(initial_ring_size)
+        , _server_addr(addr) {
     this->_output_ready = _connected_promise.get_future();
-    negotiation_frame nf = {{}, 0, 0, 0};
+    negotiation_frame nf = {{}, 0, STREAMS | (options.compress ? LZ4_COMPRESSION : 0), 0};
     send_negotiation_frame(*this, nf);
-    f.then([this] (connected_socket fd) {
+    if (options.compress) {
+        _negotiating = true;
+        this->_output_ready = this->_output_ready.then([this] {
+            return _negotiated.get_future();
+        });
+    }
+    f.then([this, options] (connected_socket fd) {
         fd.set_nodelay(true);
         this->_fd = std::move(fd);
         this->_read_buf = this->_fd.input();
         this->_write_buf = this->_fd.output();
         this->_connected_promise.set_value();
         this->_connected = true;
-        return this->negotiate_protocol(this->_read_buf).then([this] (negotiation_frame frame) {
+        return this->negotiate_protocol(this->_read_buf).then([this, options] (negotiation_frame frame) {
+            if (options.compress && (frame.optional_features_mask & LZ4_COMPRESSION)) {
+                this->enable_compression(options.compression_threshold);
+            }
+            if (!(frame.optional_features_mask & STREAMS)) {
+                this->_streams_supported = false;
+                this->abort_streams(std::make_exception_ptr(error("server does not support streams")));
+            }
+            if (_negotiating) {
+                _negotiating = false;
+                _negotiated.set_value();
+            }
             return do_until([this] { return this->_read_buf.eof() || this->_error; }, [this] () mutable {
-                return this->read_response_frame(this->_read_buf).then([this] (int64_t msg_id, std::experimental::optional<temporary_buffer<char>> data) {
-                    auto it = _outstanding.find(std::abs(msg_id));
+                return this->read_response_frame(this->_read_buf).then([this] (int64_t msg_id, std::experimental::optional<rcv_buf> data) {
                     if (!data) {
                         this->_error = true;
-                    } else if (it != _outstanding.end()) {
-                        auto handler = std::move(it->second);
-                        _outstanding.erase(it);
+                        return;
+                    } else if (msg_id == stream_msg_id) {
+                        this->receive_stream_frame(std::move(data.value()));
+                        return;
+                    }
+                    auto handler = this->take_reply_handler(std::abs(msg_id));
+                    if (handler) {
                         (*handler)(*this, msg_id, std::move(data.value()));
+                    } else if (std::abs(msg_id) >= _message_id) {
+                        // a reply to a call that was never made
+                        this->_error = true;
                     } else if (msg_id < 0) {
                         try {
                             std::rethrow_exception(unmarshal_exception(data.value()));
@@ -842,9 +1337,8 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, ipv4_addr addr, f
                         } catch(...) {
                             this->_error = true;
                         }
-                    } else {
-                        this->_error = true;
                     }
+                    // otherwise it is a late reply to a call that timed out
                 });
             });
         });
@@ -854,10 +1348,15 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, ipv4_addr addr, f
         }
         f.ignore_ready_future();
         this->_error = true;
+        this->abort_streams(std::make_exception_ptr(closed_error()));
         auto need_close = _connected;
         if (!_connected) {
             this->_connected_promise.set_exception(closed_error());
         }
+        if (_negotiating) {
+            _negotiating = false;
+            _negotiated.set_exception(closed_error());
+        }
         _connected = false; // prevent running shutdown() on this
         this->_output_ready.then_wrapped([this, need_close] (future<> f) {
             f.ignore_ready_future();
@@ -865,14 +1364,88 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, ipv4_addr addr, f
         }).then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             this->_stopped.set_value();
-            this->_outstanding.clear();
+            this->clear_outstanding();
         });
     });
 }
 
 template<typename Serializer, typename MsgType>
-protocol<Serializer, MsgType>::client::client(protocol<Serializer, MsgType>& proto, ipv4_addr addr, ipv4_addr local)
-    : client(proto, addr, ::connect(addr, local))
+protocol<Serializer, MsgType>::client::client(protocol<Serializer, MsgType>& proto, ipv4_addr addr, ipv4_addr local, client_options options)
+    : client(proto, addr, ::connect(addr, local), options)
+{}
+
+template<typename Serializer, typename MsgType>
+protocol<Serializer, MsgType>::multi_client::multi_client(protocol& proto, ipv4_addr addr, unsigned nr_classes,
+        std::function<unsigned (MsgType)> isolation_class, ipv4_addr local, client_options options)
+    : multi_client(proto, addr, nr_classes, std::move(isolation_class), [addr, local] { return ::connect(addr, local); }, options)
+{}
+
+template<typename Serializer, typename MsgType>
+protocol<Serializer, MsgType>::multi_client::multi_client(protocol& proto, ipv4_addr addr, unsigned nr_classes,
+        std::function<unsigned (MsgType)> isolation_class, std::function<future<connected_socket> ()> connect, client_options options)
+    : _proto(proto)
+    , _server_addr(addr)
+    , _isolation_class(std::move(isolation_class))
+    , _connect(std::move(connect))
+    , _options(options)
+    , _clients(nr_classes)
 {}
 
+template<typename Serializer, typename MsgType>
+typename protocol<Serializer, MsgType>::client&
+protocol<Serializer, MsgType>::multi_client::get_client(MsgType verb) {
+    auto cls = _isolation_class(verb);
+    assert(cls < _clients.size());
+    auto& c = _clients[cls];
+    if (_stopped) {
+        if (!c) {
+            throw closed_error();
+        }
+        return *c; // fails the call with closed_error
+    }
+    if (c && c->error()) {
+        auto old = std::move(c);
+        auto& o = *old;
+        seastar::with_gate(_retired, [&o] {
+            return o.stop();
+        }).finally([old = std::move(old)] {});
+    }
+    if (!c) {
+        c = std::make_unique<client>(_proto, _server_addr, _connect(), _options);
+    }
+    return *c;
+}
+
+template<typename Serializer, typename MsgType>
+stats protocol<Serializer, MsgType>::multi_client::get_stats() const {
+    stats res;
+    for (auto& c : _clients) {
+        if (!c) {
+            continue;
+        }
+        auto s = c->get_stats();
+        res.replied += s.replied;
+        res.pending += s.pending;
+        res.exception_received += s.exception_received;
+        res.sent_messages += s.sent_messages;
+        res.wait_reply += s.wait_reply;
+        res.timeout += s.timeout;
+        res.compress_in_bytes += s.compress_in_bytes;
+        res.compress_out_bytes += s.compress_out_bytes;
+        res.compress_ns += s.compress_ns;
+        res.decompress_ns += s.decompress_ns;
+    }
+    return res;
+}
+
+template<typename Serializer, typename MsgType>
+future<> protocol<Serializer, MsgType>::multi_client::stop() {
+    _stopped = true;
+    return parallel_for_each(_clients, [] (std::unique_ptr<client>& c) {
+        return c ? c->stop() : make_ready_future<>();
+    }).then([this] {
+        return _retired.close();
+    });
+}
+
 }
@@ -0,0 +1,227 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "rpc_stream.hh"
+#include "core/byteorder.hh"
+#include "core/unaligned.hh"
+
+namespace rpc {
+
+stream_state::stream_state(stream_registry* registry, int64_t id)
+    : _registry(registry), _id(id), _incoming(std::numeric_limits<size_t>::max()) {
+}
+
+future<> stream_state::write(temporary_buffer<char> buf) {
+    if (_error) {
+        return make_exception_future<>(_error);
+    }
+    if (!_registry || _local_closed) {
+        return make_exception_future<>(closed_error());
+    }
+    if (buf.empty()) {
+        return make_ready_future<>();
+    }
+    if (!_credit) {
+        _credit_available = promise<>();
+        return _credit_available->get_future().then([self = shared_from_this(), buf = std::move(buf)] () mutable {
+            return self->write(std::move(buf));
+        });
+    }
+    if (buf.size() <= _credit) {
+        _credit -= buf.size();
+        return _registry->send_stream_frame(_id, stream_frame_kind::DATA, std::move(buf));
+    }
+    // The reader drops the connection if we exceed the window, so send
+    // what fits and wait for credit for the rest
+    auto now = buf.share(0, _credit);
+    buf.trim_front(_credit);
+    _credit = 0;
+    return _registry->send_stream_frame(_id, stream_frame_kind::DATA, std::move(now)).then(
+            [self = shared_from_this(), buf = std::move(buf)] () mutable {
+        return self->write(std::move(buf));
+    });
+}
+
+future<temporary_buffer<char>> stream_state::read() {
+    if (_eof) {
+        return make_ready_future<temporary_buffer<char>>();
+    }
+    if (_error) {
+        return make_exception_future<temporary_buffer<char>>(_error);
+    }
+    return _incoming.pop_eventually().then([self = shared_from_this()] (temporary_buffer<char> buf) {
+        if (buf.empty()) {
+            self->_eof = true;
+            return buf;
+        }
+        self->_unacknowledged += buf.size();
+        if (self->_unacknowledged >= stream_window / 2 && self->_registry) {
+            temporary_buffer<char> credit(8);
+            *unaligned_cast<uint64_t*>(credit.get_write()) = cpu_to_le(uint64_t(self->_unacknowledged));
+            self->_buffered -= self->_unacknowledged;
+            self->_unacknowledged = 0;
+            // a failure to send it also fails the connection, and with it the stream
+            self->_registry->send_stream_frame(self->_id, stream_frame_kind::CREDIT, std::move(credit)).then_wrapped([] (future<> f) {
+                f.ignore_ready_future();
+            });
+        }
+        return buf;
+    });
+}
+
+future<> stream_state::close() {
+    if (!_registry || _local_closed) {
+        return make_ready_future<>();
+    }
+    _local_closed = true;
+    return _registry->send_stream_frame(_id, stream_frame_kind::END, temporary_buffer<char>());
+}
+
+void stream_state::release() {
+    if (!_registry) {
+        return;
+    }
+    close().then_wrapped([] (future<> f) {
+        f.ignore_ready_future();
+    });
+    if (_remote_closed) {
+        _registry->_streams.erase(_id);
+    } else {
+        // Keep it until the other end closes, to drop what it still sends
+        _incoming.abort(std::make_exception_ptr(closed_error()));
+    }
+    _registry = nullptr;
+}
+
+stream_registry::~stream_registry() {
+    abort_streams(std::make_exception_ptr(closed_error()));
+}
+
+stream stream_registry::open_stream(int64_t id) {
+    auto i = _streams.find(id);
+    if (i == _streams.end()) {
+        i = _streams.emplace(id, make_lw_shared<stream_state>(this, id)).first;
+    } else if (!i->second->_registry || i->second->_announced) {
+        // released, or passed to a call, already
+        throw rpc_protocol_error();
+    } else {
+        --_unannounced;
+    }
+    i->second->_announced = true;
+    return stream(i->second);
+}
+
+// Copies the first n bytes of data to dst and drops them from data
+static void consume_front(rcv_buf& data, char* dst, size_t n) {
+    if (data.size < n) {
+        throw rpc_protocol_error();
+    }
+    data.size -= n;
+    auto i = data.bufs.begin();
+    while (n) {
+        auto now = std::min(n, i->size());
+        dst = std::copy_n(i->get(), now, dst);
+        i->trim_front(now);
+        n -= now;
+        if (i->empty()) {
+            ++i;
+        }
+    }
+    data.bufs.erase(data.bufs.begin(), i);
+}
+
+void stream_registry::receive_stream_frame(rcv_buf data) {
+    char header[12];
+    consume_front(data, header, sizeof(header));
+    auto id = le_to_cpu(*unaligned_cast<int64_t*>(header));
+    auto kind = stream_frame_kind(le_to_cpu(*unaligned_cast<uint32_t*>(header + 8)));
+    auto i = _streams.find(id);
+    if (i == _streams.end()) {
+        if (kind == stream_frame_kind::CREDIT) {
+            // both ends are done with it
+            return;
+        }
+        // data may arrive before the call that carries the stream, but
+        // not for many streams
+        if (_unannounced >= max_unannounced_streams) {
+            throw rpc_protocol_error();
+        }
+        i = _streams.emplace(id, make_lw_shared<stream_state>(this, id)).first;
+        ++_unannounced;
+    }
+    auto& st = *i->second;
+    if (!st._registry) {
+        // we released our end; forget it once the other end is done too
+        if (kind == stream_frame_kind::END) {
+            _streams.erase(i);
+        }
+        return;
+    }
+    switch (kind) {
+    case stream_frame_kind::DATA:
+        for (auto&& b : data.bufs) {
+            if (!b.empty()) {
+                st._buffered += b.size();
+                if (st._buffered > stream_window) {
+                    // the writer ignored flow control
+                    throw rpc_protocol_error();
+                }
+                st._incoming.push(std::move(b));
+            }
+        }
+        break;
+    case stream_frame_kind::CREDIT: {
+        char credit[8];
+        consume_front(data, credit, sizeof(credit));
+        st._credit += le_to_cpu(*unaligned_cast<uint64_t*>(credit));
+        if (st._credit > 0 && st._credit_available) {
+            st._credit_available->set_value();
+            st._credit_available = {};
+        }
+        break;
+    }
+    case stream_frame_kind::END:
+        if (!st._remote_closed) {
+            st._remote_closed = true;
+            st._incoming.push(temporary_buffer<char>());
+        }
+        break;
+    default:
+        throw rpc_protocol_error();
+    }
+}
+
+void stream_registry::abort_streams(std::exception_ptr ex) {
+    for (auto&& s : _streams) {
+        auto& st = *s.second;
+        st._registry = nullptr;
+        st._error = ex;
+        st._incoming.abort(ex);
+        if (st._credit_available) {
+            st._credit_available->set_exception(ex);
+            st._credit_available = {};
+        }
+    }
+    _streams.clear();
+    _unannounced = 0;
+}
+
+}
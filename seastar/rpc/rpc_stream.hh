@@ -0,0 +1,131 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/future.hh"
+#include "core/queue.hh"
+#include "core/shared_ptr.hh"
+#include "core/temporary_buffer.hh"
+#include "rpc/rpc_types.hh"
+#include <unordered_map>
+
+namespace rpc {
+
+// Stream frames carry a stream id and one of these kinds, see doc/rpc.md
+enum class stream_frame_kind : uint32_t {
+    DATA = 0,
+    CREDIT = 1,
+    END = 2,
+};
+
+// Bytes a stream writer may send before the reader returns credit for them
+static constexpr size_t stream_window = 256 * 1024;
+
+// Streams whose frames arrived before the call that carries them, that a
+// connection keeps at most
+static constexpr size_t max_unannounced_streams = 16;
+
+class stream_registry;
+
+class stream_state : public enable_lw_shared_from_this<stream_state> {
+    stream_registry* _registry;
+    int64_t _id;
+    queue<temporary_buffer<char>> _incoming;
+    size_t _credit = stream_window;
+    std::experimental::optional<promise<>> _credit_available;
+    size_t _unacknowledged = 0;     // read by us, not yet returned as credit
+    size_t _buffered = 0;           // received, not yet returned as credit
+    bool _announced = false;        // opened by us, or by the call that carries it
+    bool _local_closed = false;
+    bool _remote_closed = false;
+    bool _eof = false;
+    std::exception_ptr _error;
+public:
+    stream_state(stream_registry* registry, int64_t id);
+    int64_t id() const { return _id; }
+    future<> write(temporary_buffer<char> buf);
+    future<temporary_buffer<char>> read();
+    future<> close();
+    void release();
+    friend class stream_registry;
+};
+
+/// \brief A sequence of buffers exchanged over an rpc connection
+///
+/// A client creates a stream with client::make_stream() and passes it as an
+/// argument of an rpc call; the handler gets the other end as an
+/// rpc::stream parameter.  Both ends can write and read, and each direction
+/// is flow controlled: a writer waits once stream_window bytes it sent were
+/// not read by the other end yet.
+///
+/// Only one write() and one read() may be outstanding at a time.  Each end
+/// should close() its direction when it is done writing; destroying a stream
+/// closes it and detaches it from the connection.
+class stream {
+    lw_shared_ptr<stream_state> _state;
+public:
+    explicit stream(lw_shared_ptr<stream_state> state) : _state(std::move(state)) {}
+    stream(stream&&) noexcept = default;
+    stream& operator=(stream&& x) noexcept {
+        if (this != &x) {
+            if (_state) {
+                _state->release();
+            }
+            _state = std::move(x._state);
+        }
+        return *this;
+    }
+    ~stream() {
+        if (_state) {
+            _state->release();
+        }
+    }
+    int64_t id() const { return _state->id(); }
+    future<> write(temporary_buffer<char> buf) { return _state->write(std::move(buf)); }
+    /// Returns the next buffer written by the other end, or an empty buffer
+    /// once it closed the stream.
+    future<temporary_buffer<char>> read() { return _state->read(); }
+    future<> close() { return _state->close(); }
+};
+
+// Streams opened on a connection.  The connection sends the frames the
+// streams produce, and feeds them the stream frames it receives.
+//
+// A stream released by us stays registered, detached, until the other end
+// closes it too, so that its late frames are recognized and dropped.
+class stream_registry {
+    std::unordered_map<int64_t, lw_shared_ptr<stream_state>> _streams;
+    size_t _unannounced = 0;
+public:
+    stream_registry() = default;
+    stream_registry(stream_registry&&) = default;
+    virtual ~stream_registry();
+    virtual future<> send_stream_frame(int64_t id, stream_frame_kind kind, temporary_buffer<char> data) = 0;
+    // Throws rpc_protocol_error if the stream was opened already
+    stream open_stream(int64_t id);
+    // Throws rpc_protocol_error on a malformed frame
+    void receive_stream_frame(rcv_buf data);
+    void abort_streams(std::exception_ptr ex);
+    friend class stream_state;
+};
+
+}
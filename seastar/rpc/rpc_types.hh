@@ -22,7 +22,10 @@
 #pragma once
 
 #include "net/api.hh"
+#include "core/temporary_buffer.hh"
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include <boost/any.hpp>
 #include <boost/type.hpp>
@@ -42,6 +45,13 @@ struct stats {
     counter_type sent_messages = 0;
     counter_type wait_reply = 0;
     counter_type timeout = 0;
+    counter_type compress_in_bytes = 0;   // frame bytes handed to the compressor
+    counter_type compress_out_bytes = 0;  // bytes the compressor put on the wire for them
+    counter_type compress_ns = 0;
+    counter_type decompress_ns = 0;
+    double compression_ratio() const {
+        return compress_out_bytes ? double(compress_in_bytes) / compress_out_bytes : 1.0;
+    }
 };
 
 
@@ -95,6 +105,75 @@ class rpc_protocol_error : public error {
     rpc_protocol_error() : error("rpc protocol exception") {}
 };
 
+// A frame payload, in the buffers it was read into from the connection.
+struct rcv_buf {
+    size_t size = 0;
+    std::vector<temporary_buffer<char>> bufs;
+    rcv_buf() = default;
+    explicit rcv_buf(temporary_buffer<char> buf) : size(buf.size()) {
+        bufs.push_back(std::move(buf));
+    }
+};
+
+// Copies the payload into a single buffer (or steals it, if it is one already).
+inline temporary_buffer<char> linearize(rcv_buf& data) {
+    if (data.bufs.size() == 1) {
+        return std::move(data.bufs.front());
+    }
+    temporary_buffer<char> ret(data.size);
+    auto p = ret.get_write();
+    for (auto&& b : data.bufs) {
+        p = std::copy_n(b.get(), b.size(), p);
+    }
+    return ret;
+}
+
+/// \brief A large payload that rpc passes without copying
+///
+/// Unlike other arguments and return values, a blob is not handed to the
+/// serializer: sending it splices its buffers into the frame, and a
+/// received blob refers to the buffers the frame was read into, so it
+/// need not be contiguous.
+class blob {
+    std::vector<temporary_buffer<char>> _bufs;
+    size_t _size = 0;
+public:
+    blob() = default;
+    explicit blob(temporary_buffer<char> buf) {
+        append(std::move(buf));
+    }
+    explicit blob(std::vector<temporary_buffer<char>> bufs) {
+        for (auto&& b : bufs) {
+            append(std::move(b));
+        }
+    }
+    void append(temporary_buffer<char> buf) {
+        if (!buf.empty()) {
+            _size += buf.size();
+            _bufs.push_back(std::move(buf));
+        }
+    }
+    size_t size() const { return _size; }
+    const std::vector<temporary_buffer<char>>& buffers() const { return _bufs; }
+    // Sharing does not modify the blob's data, only reference counts
+    std::vector<temporary_buffer<char>> share() const {
+        std::vector<temporary_buffer<char>> ret;
+        ret.reserve(_bufs.size());
+        for (auto&& b : _bufs) {
+            ret.push_back(const_cast<temporary_buffer<char>&>(b).share());
+        }
+        return ret;
+    }
+    temporary_buffer<char> linearize() const {
+        temporary_buffer<char> ret(_size);
+        auto p = ret.get_write();
+        for (auto&& b : _bufs) {
+            p = std::copy_n(b.get(), b.size(), p);
+        }
+        return ret;
+    }
+};
+
 struct no_wait_type {};
 
 // return this from a callback if client does not want to waiting for a reply
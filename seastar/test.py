@@ -29,6 +29,7 @@ boost_tests = [
     'thread_test',
     'memcached/test_ascii_parser',
     'sstring_test',
+    'timer_wheel_test',
     'output_stream_test',
     'httpd',
     'fstream_test',
@@ -37,6 +38,11 @@ boost_tests = [
     'shared_ptr_test',
     'fileiotest',
     'packet_test',
+    'posix_zerocopy_test',
+    'posix_data_source_test',
+    'posix_udp_test',
+    'arp_test',
+    'flow_steering_test',
     'tls_test',
     'rpc_test',
 ]
@@ -48,6 +54,7 @@ other_tests = [
     'allocator_test',
     'directory_test',
     'thread_context_switch',
+    'futures_perf',
     'fair_queue_test',
 ]
 
@@ -92,6 +99,12 @@ if __name__ == "__main__":
             test_to_run.append((os.path.join(prefix, test),'boost'))
         test_to_run.append(('tests/memcached/test.py --mode ' + mode + (' --fast' if args.fast else ''),'other'))
         test_to_run.append((os.path.join(prefix, 'distributed_test') + ' -c 2','other'))
+        test_to_run.append((os.path.join(prefix, 'ip_test') + ' --reassembly -c 1','other'))
+        test_to_run.append((os.path.join(prefix, 'tcp_test') + ' --loopback --duration 1 -c 2','other'))
+        test_to_run.append((os.path.join(prefix, 'stall_detector_test') + ' --stall-threshold-ms 50 -c 1','other'))
+        test_to_run.append((os.path.join(prefix, 'timer_set_perf') + ' --max-timers 100000','other'))
+        test_to_run.append((os.path.join(prefix, 'connection_table_perf') + ' --max-connections 100000 --lookups 100000','other'))
+        test_to_run.append((os.path.join(prefix, 'heap_profiler_perf') + ' --operations 100000','other'))
 
 
         allocator_test_path = os.path.join(prefix, 'allocator_test')
@@ -100,8 +113,10 @@ if __name__ == "__main__":
                 test_to_run.append((allocator_test_path + ' --iterations 5','other'))
             else:
                 test_to_run.append((allocator_test_path + ' --time 0.1','other'))
+            test_to_run.append((allocator_test_path + ' --cross-cpu-frees --time 0.1','other'))
         else:
             test_to_run.append((allocator_test_path,'other'))
+            test_to_run.append((allocator_test_path + ' --cross-cpu-frees','other'))
 
     if args.name:
         test_to_run = [t for t in test_to_run if args.name in t[0]]
@@ -29,6 +29,9 @@
 #include <cassert>
 #include <memory>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <array>
 #include <boost/program_options.hpp>
 
 template <size_t N>
@@ -71,6 +74,88 @@ struct allocation {
     }
 };
 
+// Single-producer single-consumer ring for handing objects to another thread
+class object_ring {
+    static constexpr size_t size = 4096;
+    std::array<void*, size> _ring;
+    alignas(64) std::atomic<size_t> _head = { 0 };
+    alignas(64) std::atomic<size_t> _tail = { 0 };
+public:
+    bool push(void* p) {
+        auto t = _tail.load(std::memory_order_relaxed);
+        if (t - _head.load(std::memory_order_acquire) == size) {
+            return false;
+        }
+        _ring[t % size] = p;
+        _tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(void*& p) {
+        auto h = _head.load(std::memory_order_relaxed);
+        if (h == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        p = _ring[h % size];
+        _head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// One thread allocates objects and another frees them, as when buffers are
+// passed between shards.  Both poll the allocator's cross-cpu free lists the
+// way a reactor does.
+void test_cross_cpu_frees(float time) {
+    using clock = steady_clock_type;
+    object_ring ring;
+    std::atomic<bool> done = { false };
+    uint64_t frees = 0;
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::seconds(1) * time);
+    std::thread consumer([&] {
+        void* p;
+        while (true) {
+            if (ring.pop(p)) {
+                if (!p) {
+                    break;
+                }
+                ::free(p);
+                if (++frees % 256 == 0) {
+                    memory::drain_cross_cpu_freelist();
+                }
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        memory::drain_cross_cpu_freelist();
+        done.store(true, std::memory_order_release);
+    });
+    uint64_t allocs = 0;
+    while (clock::now() < end) {
+        for (unsigned i = 0; i < 1000; ++i) {
+            auto p = ::malloc(64);
+            while (!ring.push(p)) {
+                memory::drain_cross_cpu_freelist();
+                std::this_thread::yield();
+            }
+            ++allocs;
+        }
+        memory::drain_cross_cpu_freelist();
+    }
+    while (!ring.push(nullptr)) {
+        std::this_thread::yield();
+    }
+    while (!done.load(std::memory_order_acquire)) {
+        memory::drain_cross_cpu_freelist();
+        std::this_thread::yield();
+    }
+    consumer.join();
+    memory::drain_cross_cpu_freelist();
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    assert(frees == allocs);
+    std::cout << "cross-cpu frees: " << std::fixed << std::setprecision(1)
+              << frees / elapsed / 1e6 << " M/s\n";
+}
+
 int main(int ac, char** av) {
     namespace bpo = boost::program_options;
     bpo::options_description opts("Allowed options");
@@ -78,10 +163,15 @@ int main(int ac, char** av) {
             ("help", "produce this help message")
             ("iterations", bpo::value<unsigned>(), "run s specified number of iterations")
             ("time", bpo::value<float>()->default_value(5.0), "run for a specified amount of time, in seconds")
+            ("cross-cpu-frees", "measure the throughput of freeing memory allocated by another thread")
             ;
     bpo::variables_map vm;
     bpo::store(bpo::parse_command_line(ac, av, opts), vm);
     bpo::notify(vm);
+    if (vm.count("cross-cpu-frees")) {
+        test_cross_cpu_frees(vm["time"].as<float>());
+        return 0;
+    }
     test_aligned_allocator<1>();
     test_aligned_allocator<4>();
     test_aligned_allocator<80>();
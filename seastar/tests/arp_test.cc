@@ -0,0 +1,245 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/ip.hh"
+#include "net/loopback.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+
+using namespace net;
+
+static const ipv4_address host_address("10.0.0.2");
+
+// An ipv4 stack on one shard, on one end of a loopback device pair; the
+// stacks of all shards share a neighbor cache, homed on shard 0.
+struct test_stack {
+    interface netif;
+    ipv4 inet;
+    explicit test_stack(std::shared_ptr<device> dev) : netif(std::move(dev)), inet(&netif) {
+        inet.set_host_address(host_address);
+        inet.set_netmask_address(ipv4_address("255.255.255.0"));
+    }
+};
+
+static thread_local test_stack* stack;
+
+struct arp_packet {
+    packed<uint16_t> htype;
+    packed<uint16_t> ptype;
+    uint8_t hlen;
+    uint8_t plen;
+    packed<uint16_t> oper;
+    ethernet_address sender_hwaddr;
+    ipv4_address sender_paddr;
+    ethernet_address target_hwaddr;
+    ipv4_address target_paddr;
+
+    template <typename Adjuster>
+    void adjust_endianness(Adjuster a) {
+        a(htype, ptype, oper, sender_hwaddr, sender_paddr, target_hwaddr, target_paddr);
+    }
+};
+
+// The other end of the link, on shard 0, where the emulated RSS sends
+// all ARP packets: counts the queries for each address, and answers
+// those it has an address for.
+static std::shared_ptr<device> peer;
+static std::unordered_map<ipv4_address, ethernet_address> peer_answers;
+static std::unordered_map<ipv4_address, unsigned> peer_queries;
+// Queries left unanswered before the peer answers one
+static std::unordered_map<ipv4_address, unsigned> peer_ignored;
+
+static future<> peer_receive(packet p) {
+    auto eh = p.get_header<eth_hdr>();
+    if (!eh || ntoh(eh->eth_proto) != uint16_t(eth_protocol_num::arp)) {
+        return make_ready_future<>();
+    }
+    auto ah = p.get_header<arp_packet>(sizeof(eth_hdr));
+    if (!ah) {
+        return make_ready_future<>();
+    }
+    auto req = ntoh(*ah);
+    if (req.oper != 1) {
+        return make_ready_future<>();
+    }
+    ++peer_queries[req.target_paddr];
+    auto i = peer_answers.find(req.target_paddr);
+    if (i == peer_answers.end() || peer_queries[req.target_paddr] <= peer_ignored[req.target_paddr]) {
+        return make_ready_future<>();
+    }
+    auto rep = req;
+    rep.oper = 2;
+    rep.sender_hwaddr = i->second;
+    rep.sender_paddr = req.target_paddr;
+    rep.target_hwaddr = req.sender_hwaddr;
+    rep.target_paddr = req.sender_paddr;
+    rep = hton(rep);
+    packet reply(reinterpret_cast<char*>(&rep), sizeof(rep));
+    auto reh = reply.prepend_header<eth_hdr>();
+    reh->dst_mac = req.sender_hwaddr;
+    reh->src_mac = peer->hw_address();
+    reh->eth_proto = uint16_t(eth_protocol_num::arp);
+    *reh = hton(*reh);
+    peer->local_queue().send(std::move(reply));
+    return make_ready_future<>();
+}
+
+// Called on shard 0, in a thread
+static void start_stacks() {
+    if (peer) {
+        return;
+    }
+    loopback_config cfg;
+    cfg.queues = smp::count;
+    auto devs = create_loopback_net_device_pair(cfg);
+    start_loopback_net_device(devs.first).get();
+    start_loopback_net_device(devs.second).get();
+    peer = devs.first;
+    new subscription<packet>(peer->receive([] (packet p) { return peer_receive(std::move(p)); }));
+    // Never destroyed, like the devices: shard 0 joins the neighbor group
+    // first, and so is its home shard.
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        smp::submit_to(cpu, [dev = devs.second] {
+            stack = new test_stack(dev);
+        }).get();
+    }
+}
+
+static future<ethernet_address> lookup_on(unsigned cpu, ipv4_address addr) {
+    return smp::submit_to(cpu, [addr] {
+        return stack->inet.get_l2_dst_address(addr);
+    });
+}
+
+// Whether every shard resolves addr from its own copy of the cache
+static bool cached_everywhere(ipv4_address addr, ethernet_address expected) {
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        auto cached = smp::submit_to(cpu, [addr, expected] {
+            auto f = stack->inet.get_l2_dst_address(addr);
+            return f.available() && !f.failed() && f.get0() == expected;
+        }).get0();
+        if (!cached) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Waits for the home shard to publish a change to all shards
+static bool wait_cached_everywhere(ipv4_address addr, ethernet_address expected) {
+    for (unsigned i = 0; i < 1000; ++i) {
+        if (cached_everywhere(addr, expected)) {
+            return true;
+        }
+        sleep(std::chrono::milliseconds(1)).get();
+    }
+    return false;
+}
+
+SEASTAR_TEST_CASE(test_learned_address_is_shared) {
+    return seastar::async([] {
+        start_stacks();
+        ipv4_address addr("10.0.0.10");
+        ethernet_address l2{0x02, 0x00, 0x00, 0x00, 0x00, 0x10};
+        // Learned on the last shard, forwarded to the home shard, which
+        // sends it to all of them
+        auto last = smp::count - 1;
+        smp::submit_to(last, [addr, l2] {
+            stack->inet.learn(l2, addr);
+        }).get();
+        for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+            BOOST_REQUIRE(lookup_on(cpu, addr).get0() == l2);
+        }
+        BOOST_REQUIRE(wait_cached_everywhere(addr, l2));
+    });
+}
+
+SEASTAR_TEST_CASE(test_address_queried_by_home_shard_once) {
+    return seastar::async([] {
+        start_stacks();
+        ipv4_address addr("10.0.0.20");
+        ethernet_address l2{0x02, 0x00, 0x00, 0x00, 0x00, 0x20};
+        peer_answers[addr] = l2;
+        // All shards look it up at once; only the home shard queries it,
+        // and its answer resolves them all
+        auto cpus = boost::irange(0u, smp::count);
+        parallel_for_each(cpus, [addr, l2] (unsigned cpu) {
+            return lookup_on(cpu, addr).then([l2] (ethernet_address resolved) {
+                BOOST_REQUIRE(resolved == l2);
+            });
+        }).get();
+        BOOST_REQUIRE_EQUAL(peer_queries[addr], 1u);
+        BOOST_REQUIRE(cached_everywhere(addr, l2));
+    });
+}
+
+SEASTAR_TEST_CASE(test_changes_are_published) {
+    return seastar::async([] {
+        start_stacks();
+        ipv4_address addr("10.0.0.30");
+        ipv4_address other("10.0.0.31");
+        ethernet_address l2{0x02, 0x00, 0x00, 0x00, 0x00, 0x30};
+        ethernet_address moved{0x02, 0x00, 0x00, 0x00, 0x01, 0x30};
+        ethernet_address other_l2{0x02, 0x00, 0x00, 0x00, 0x00, 0x31};
+        stack->inet.learn(l2, addr);
+        stack->inet.learn(other_l2, other);
+        BOOST_REQUIRE(wait_cached_everywhere(addr, l2));
+        BOOST_REQUIRE(wait_cached_everywhere(other, other_l2));
+        // The neighbor moves: seen on the last shard, published to all,
+        // leaving the other entries alone
+        smp::submit_to(smp::count - 1, [addr, moved] {
+            stack->inet.learn(moved, addr);
+        }).get();
+        BOOST_REQUIRE(wait_cached_everywhere(addr, moved));
+        BOOST_REQUIRE(cached_everywhere(other, other_l2));
+    });
+}
+
+SEASTAR_TEST_CASE(test_lookup_waits_for_retries) {
+    return seastar::async([] {
+        start_stacks();
+        ipv4_address lost("10.0.0.40");
+        ipv4_address absent("10.0.0.41");
+        ethernet_address l2{0x02, 0x00, 0x00, 0x00, 0x00, 0x40};
+        peer_answers[lost] = l2;
+        peer_ignored[lost] = 2;
+        auto last = smp::count - 1;
+        // Answered on the last query: the waiter is still there for it
+        auto resolved = lookup_on(last, lost);
+        // Never answered: fails once all the queries went unanswered
+        auto failed = lookup_on(last, absent).then_wrapped([] (future<ethernet_address> f) {
+            try {
+                f.get();
+                return false;
+            } catch (arp_timeout_error&) {
+                return true;
+            }
+        });
+        BOOST_REQUIRE(resolved.get0() == l2);
+        BOOST_REQUIRE_EQUAL(peer_queries[lost], 3u);
+        BOOST_REQUIRE(failed.get0());
+        BOOST_REQUIRE_EQUAL(peer_queries[absent], 3u);
+    });
+}
@@ -0,0 +1,178 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares the cost of finding the connection of a received segment in
+// std::unordered_map, which tcp used to keep its connections in, and in
+// connection_table, with 10^4 to 10^6 connections.  Lookups are done in
+// random order, like segments of many connections arriving interleaved.
+// Also checks that both tables find exactly the connections in them.
+
+#include "net/ip.hh"
+#include "net/connection-table.hh"
+#include "perf-test-utils.hh"
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+using connid = net::l4connid<net::ipv4_traits>;
+using connid_hash = connid::connid_hash;
+using clock_type = perf_clock;
+
+// stands for the tcb
+struct connection {
+    connid id;
+    uint64_t data[7];
+};
+
+struct std_table {
+    std::unordered_map<connid, connection*, connid_hash> map;
+    void insert(const connid& id, connection* c) {
+        map.emplace(id, c);
+    }
+    connection* find(const connid& id) {
+        auto i = map.find(id);
+        return i == map.end() ? nullptr : i->second;
+    }
+    void erase(const connid& id) {
+        map.erase(id);
+    }
+};
+
+struct flat_table {
+    net::connection_table<connid, connection*, connid_hash> table;
+    void insert(const connid& id, connection* c) {
+        table.insert(id, c);
+    }
+    connection* find(const connid& id) {
+        auto c = table.find(id);
+        return c ? *c : nullptr;
+    }
+    void erase(const connid& id) {
+        table.erase(id);
+    }
+};
+
+// Connections to a server: one local address and port, many clients
+static std::vector<connection> make_connections(size_t n, std::default_random_engine& rnd) {
+    std::uniform_int_distribution<uint32_t> ip(0x0a000000, 0x0affffff);
+    std::uniform_int_distribution<uint16_t> port(1024, 65535);
+    std::vector<connection> conns(n);
+    for (auto& c : conns) {
+        c.id = connid{net::ipv4_address(0xc0a80001), net::ipv4_address(ip(rnd)), 80, port(rnd)};
+    }
+    std::sort(conns.begin(), conns.end(), [] (const connection& a, const connection& b) {
+        return std::make_pair(uint32_t(a.id.foreign_ip.ip), a.id.foreign_port)
+                < std::make_pair(uint32_t(b.id.foreign_ip.ip), b.id.foreign_port);
+    });
+    conns.erase(std::unique(conns.begin(), conns.end(), [] (const connection& a, const connection& b) {
+        return a.id == b.id;
+    }), conns.end());
+    std::shuffle(conns.begin(), conns.end(), rnd);
+    return conns;
+}
+
+template <typename Table>
+static void run(const char* name, std::vector<connection>& conns, size_t lookups) {
+    std::default_random_engine rnd(conns.size());
+    auto n = conns.size();
+    Table table;
+
+    auto t0 = clock_type::now();
+    for (auto& c : conns) {
+        table.insert(c.id, &c);
+    }
+    auto t1 = clock_type::now();
+
+    std::vector<connid> hits(lookups);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    for (auto& id : hits) {
+        id = conns[pick(rnd)].id;
+    }
+    auto t2 = clock_type::now();
+    uint64_t found = 0;
+    for (auto& id : hits) {
+        auto c = table.find(id);
+        found += c->data[0] + 1;
+        check(c->id == id, "lookup found the right connection");
+    }
+    auto t3 = clock_type::now();
+    check(found == lookups, "every lookup hit");
+
+    // segments for connections that do not exist
+    auto misses = hits;
+    for (auto& id : misses) {
+        id.local_port = 81;
+    }
+    auto t4 = clock_type::now();
+    for (auto& id : misses) {
+        check(!table.find(id), "no connection for a missing id");
+    }
+    auto t5 = clock_type::now();
+
+    // churn: half of the connections close, then new ones open
+    for (size_t i = 0; i < n; i += 2) {
+        table.erase(conns[i].id);
+    }
+    auto t6 = clock_type::now();
+    for (size_t i = 0; i < n; ++i) {
+        auto c = table.find(conns[i].id);
+        check(i % 2 ? c == &conns[i] : !c, "lookups after erase");
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        table.insert(conns[i].id, &conns[i]);
+    }
+    for (auto& c : conns) {
+        check(table.find(c.id) == &c, "lookups after reinsertion");
+    }
+
+    std::cout << std::setw(16) << name << std::setw(10) << n << std::fixed << std::setprecision(1)
+              << "  insert " << std::setw(7) << ns_per(t1 - t0, n) << " ns"
+              << "  lookup " << std::setw(7) << ns_per(t3 - t2, lookups) << " ns"
+              << "  miss " << std::setw(7) << ns_per(t5 - t4, lookups) << " ns"
+              << "  erase " << std::setw(7) << ns_per(t6 - t5, (n + 1) / 2) << " ns\n";
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("Allowed options");
+    opts.add_options()
+            ("min-connections", bpo::value<size_t>()->default_value(10000), "smallest number of connections to test with")
+            ("max-connections", bpo::value<size_t>()->default_value(1000000), "largest number of connections to test with")
+            ("lookups", bpo::value<size_t>()->default_value(1000000), "lookups per test")
+            ;
+    bpo::variables_map vm;
+    if (!parse_perf_options(ac, av, opts, vm)) {
+        return 1;
+    }
+    auto lookups = std::max(vm["lookups"].as<size_t>(), size_t(1));
+    for (size_t n = std::max(vm["min-connections"].as<size_t>(), size_t(1)); n <= vm["max-connections"].as<size_t>(); n *= 10) {
+        std::default_random_engine rnd(n);
+        auto conns = make_connections(n, rnd);
+        run<std_table>("unordered_map", conns, lookups);
+        run<flat_table>("connection_table", conns, lookups);
+    }
+    return 0;
+}
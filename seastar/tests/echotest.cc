@@ -22,9 +22,13 @@
 
 #include "net/virtio.hh"
 #include "net/dpdk.hh"
+#include "net/loopback.hh"
 #include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/sleep.hh"
 #include "net/ip.hh"
 #include <iostream>
+#include <cstring>
 #include <utility>
 #include <algorithm>
 
@@ -77,49 +81,183 @@ future<> echo_packet(net::qp& netif, packet p) {
     return netif.send(std::move(p));
 }
 
-#ifdef HAVE_DPDK
-void usage()
-{
-    std::cout<<"Usage: echotest [-virtio|-dpdk]"<<std::endl;
-    std::cout<<"   -virtio - use virtio backend (default)"<<std::endl;
-    std::cout<<"   -dpdk   - use dpdk-pmd backend"<<std::endl;
-}
-#endif
+// Keeps a window of ICMP echo requests in flight from one end of a
+// loopback device pair, answered by echo_packet() at the other end.
+class pinger {
+    net::qp& _qp;
+    ethernet_address _src_mac;
+    ethernet_address _dst_mac;
+    ipv4_address _src_ip = ipv4_address("10.0.0.1");
+    ipv4_address _dst_ip = ipv4_address("10.0.0.2");
+    size_t _payload;
+    unsigned _window;
+    unsigned _in_flight = 0;
+    uint16_t _id = 0;
+    uint64_t _replies = 0;
+    uint64_t _bytes = 0;
+    uint64_t _last_replies = 0;
+    timer<> _refill;
+private:
+    packet make_request() {
+        auto len = sizeof(eth_hdr) + sizeof(ip_hdr) + sizeof(icmp_hdr) + _payload;
+        temporary_buffer<char> buf(len);
+        std::memset(buf.get_write(), 0, len);
+        auto eh = reinterpret_cast<eth_hdr*>(buf.get_write());
+        eh->dst_mac = _dst_mac;
+        eh->src_mac = _src_mac;
+        eh->eth_proto = uint16_t(eth_protocol_num::ipv4);
+        *eh = hton(*eh);
+        auto iph = reinterpret_cast<ip_hdr*>(eh + 1);
+        iph->ihl = sizeof(ip_hdr) / 4;
+        iph->ver = 4;
+        iph->len = len - sizeof(eth_hdr);
+        iph->id = _id++;
+        iph->ttl = 64;
+        iph->ip_proto = uint8_t(ip_protocol_num::icmp);
+        iph->src_ip = _src_ip;
+        iph->dst_ip = _dst_ip;
+        *iph = hton(*iph);
+        iph->csum = ip_checksum(iph, sizeof(*iph));
+        auto icmph = reinterpret_cast<icmp_hdr*>(iph + 1);
+        icmph->type = icmp_hdr::msg_type::echo_request;
+        icmph->csum = ip_checksum(icmph, sizeof(*icmph) + _payload);
+        return packet(fragment{buf.get_write(), len}, buf.release());
+    }
+    void fill() {
+        while (_in_flight < _window) {
+            _qp.send(make_request());
+            ++_in_flight;
+        }
+    }
+public:
+    pinger(net::qp& qp, ethernet_address src, ethernet_address dst, size_t payload, unsigned window)
+            : _qp(qp), _src_mac(src), _dst_mac(dst), _payload(payload), _window(window) {
+        // Requests and replies may be dropped by the link; start over if
+        // nothing came back for a while.
+        _refill.set_callback([this] {
+            if (_replies == _last_replies) {
+                _in_flight = 0;
+                fill();
+            }
+            _last_replies = _replies;
+        });
+    }
+    void start() {
+        fill();
+        _refill.arm_periodic(std::chrono::milliseconds(100));
+    }
+    void stop() {
+        _refill.cancel();
+    }
+    future<> received(packet p) {
+        auto icmph = p.get_header<icmp_hdr>(sizeof(eth_hdr) + sizeof(ip_hdr));
+        if (icmph && icmph->type == icmp_hdr::msg_type::echo_reply) {
+            ++_replies;
+            _bytes += p.len();
+            if (_in_flight) {
+                --_in_flight;
+            }
+            fill();
+        }
+        return make_ready_future<>();
+    }
+    uint64_t replies() const {
+        return _replies;
+    }
+    uint64_t bytes() const {
+        return _bytes;
+    }
+};
 
-int main(int ac, char** av) {
-    std::unique_ptr<net::device> dnet;
-    net::qp* vnet;
+// Measures the echo rate through a loopback device pair, on one shard
+struct loopback_echo {
+    std::shared_ptr<net::device> a;
+    std::shared_ptr<net::device> b;
+    std::unique_ptr<pinger> p;
+    std::experimental::optional<subscription<packet>> a_rx;
+    std::experimental::optional<subscription<packet>> b_rx;
 
-    boost::program_options::variables_map opts;
-    opts.insert(std::make_pair("tap-device", boost::program_options::variable_value(std::string("tap0"), false)));
+    explicit loopback_echo(const boost::program_options::variables_map& opts) {
+        auto cfg = make_loopback_config(opts);
+        cfg.queues = 1;
+        auto devs = create_loopback_net_device_pair(cfg);
+        a = devs.first;
+        b = devs.second;
+        auto qa = a->init_local_queue(opts, 0);
+        auto qb = b->init_local_queue(opts, 0);
+        auto& qpa = *qa;
+        auto& qpb = *qb;
+        a->set_local_queue(std::move(qa));
+        b->set_local_queue(std::move(qb));
+        p = std::make_unique<pinger>(qpa, a->hw_address(), b->hw_address(),
+                opts["payload-size"].as<size_t>(), opts["concurrency"].as<unsigned>());
+        b_rx.emplace(b->receive([&qpb] (packet pkt) {
+            return echo_packet(qpb, std::move(pkt));
+        }));
+        a_rx.emplace(a->receive([this] (packet pkt) {
+            return p->received(std::move(pkt));
+        }));
+    }
 
-#ifdef HAVE_DPDK
-    if (ac > 2) {
-        usage();
-        return -1;
+    future<> run(std::chrono::seconds duration) {
+        auto start = steady_clock_type::now();
+        p->start();
+        return sleep(duration).then([this, start] {
+            p->stop();
+            auto secs = std::chrono::duration<double>(steady_clock_type::now() - start).count();
+            print("echo: %d replies in %.3f s, %.0f requests/s, %.3f Gbps\n",
+                    p->replies(), secs, p->replies() / secs, p->bytes() * 8 * 2 / secs / 1e9);
+        });
     }
+};
 
-    if ((ac == 1) || !std::strcmp(av[1], "-virtio")) {
-        dnet = create_virtio_net_device(opts);
-    } else if (!std::strcmp(av[1], "-dpdk")) {
-        dnet = create_dpdk_net_device();
-    } else {
-        usage();
-        return -1;
-    }
-#else
-    dnet = create_virtio_net_device(opts);
-#endif // HAVE_DPDK
+// Echoes ICMP requests received on a tap device, or a dpdk port
+struct device_echo {
+    std::unique_ptr<net::device> dev;
+    std::experimental::optional<subscription<packet>> rx;
 
-    auto qp = dnet->init_local_queue(opts, 0);
-    vnet = qp.get();
-    dnet->set_local_queue(std::move(qp));
-    subscription<packet> rx =
-        dnet->receive([vnet, &rx] (packet p) {
+    explicit device_echo(std::unique_ptr<net::device> d, const boost::program_options::variables_map& opts)
+            : dev(std::move(d)) {
+        auto qp = dev->init_local_queue(opts, 0);
+        auto vnet = qp.get();
+        dev->set_local_queue(std::move(qp));
+        rx.emplace(dev->receive([vnet] (packet p) {
             return echo_packet(*vnet, std::move(p));
-        });
-    engine().run();
-    return 0;
+        }));
+    }
+};
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+#ifdef HAVE_DPDK
+        ("dpdk", "echo on a dpdk port instead of the tap device")
+#endif
+        ("loopback", "measure the echo rate through a loopback device pair instead")
+        ("payload-size", bpo::value<size_t>()->default_value(56), "ICMP payload size, with --loopback")
+        ("concurrency", bpo::value<unsigned>()->default_value(64), "requests in flight, with --loopback")
+        ("duration", bpo::value<unsigned>()->default_value(5), "duration of the test, in seconds, with --loopback")
+        ;
+    std::unique_ptr<loopback_echo> loopback;
+    std::unique_ptr<device_echo> echo;
+    return app.run_deprecated(ac, av, [&app, &loopback, &echo] {
+        auto& opts = app.configuration();
+        if (opts.count("loopback")) {
+            loopback = std::make_unique<loopback_echo>(opts);
+            loopback->run(std::chrono::seconds(opts["duration"].as<unsigned>())).then([] {
+                engine().exit(0);
+            }).or_terminate();
+            return;
+        }
+#ifdef HAVE_DPDK
+        if (opts.count("dpdk")) {
+            echo = std::make_unique<device_echo>(create_dpdk_net_device(), opts);
+            return;
+        }
+#endif
+        echo = std::make_unique<device_echo>(create_virtio_net_device(opts), opts);
+    });
 }
 
 
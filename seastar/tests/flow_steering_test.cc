@@ -0,0 +1,173 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "net/ip.hh"
+#include "net/loopback.hh"
+#include "test-utils.hh"
+#include <numeric>
+
+using namespace net;
+
+static const ipv4_address src_address("10.0.0.1");
+static const ipv4_address dst_address("10.0.0.2");
+
+// Collects the same fields as ipv4::forward() and tcp::forward(), and so
+// as the loopback device's RSS emulation
+static bool forward_tcp(forward_hash& data, packet& p, size_t off) {
+    auto iph = p.get_header<ip_hdr>(off);
+    data.push_back(iph->src_ip.ip);
+    data.push_back(iph->dst_ip.ip);
+    auto ports = p.get_header<std::array<uint16_t, 2>>(off + sizeof(ip_hdr));
+    data.push_back((*ports)[0]);
+    data.push_back((*ports)[1]);
+    return true;
+}
+
+// The ip header and the ports of a TCP segment from src_port to dst_port
+static packet make_frame(ethernet_address dst_mac, ethernet_address src_mac, uint16_t src_port, uint16_t dst_port) {
+    struct {
+        ip_hdr iph;
+        packed<uint16_t> src_port;
+        packed<uint16_t> dst_port;
+    } __attribute__((packed)) h = {};
+    h.iph.ihl = sizeof(ip_hdr) / 4;
+    h.iph.ver = 4;
+    h.iph.len = sizeof(h);
+    h.iph.ttl = 64;
+    h.iph.ip_proto = uint8_t(ip_protocol_num::tcp);
+    h.iph.src_ip = src_address;
+    h.iph.dst_ip = dst_address;
+    h.iph = hton(h.iph);
+    h.src_port = hton(src_port);
+    h.dst_port = hton(dst_port);
+    packet p(reinterpret_cast<char*>(&h), sizeof(h));
+    auto eh = p.prepend_header<eth_hdr>();
+    eh->dst_mac = dst_mac;
+    eh->src_mac = src_mac;
+    eh->eth_proto = uint16_t(eth_protocol_num::ipv4);
+    *eh = hton(*eh);
+    return p;
+}
+
+static flow_key key_of(packet p) {
+    forward_hash data;
+    forward_tcp(data, p, sizeof(eth_hdr));
+    return flow_key(eth_protocol_num::ipv4, data);
+}
+
+// The receiving end of the link on one shard: counts the packets that
+// reach the shard
+struct flow_host {
+    interface netif;
+    subscription<packet, ethernet_address> rx;
+    unsigned received = 0;
+    explicit flow_host(std::shared_ptr<device> dev)
+        : netif(std::move(dev))
+        , rx(netif.register_l3(eth_protocol_num::ipv4, [this] (packet p, ethernet_address from) {
+            ++received;
+            return make_ready_future<>();
+        }, forward_tcp)) {
+    }
+};
+
+static thread_local std::unique_ptr<flow_host> host;
+
+// Sends nr frames of the flow from the other end of the link, and
+// returns the shard that received them, or -1 if they were spread
+static int receiving_shard(device& peer, ethernet_address dst_mac, uint16_t src_port, uint16_t dst_port, unsigned nr) {
+    smp::invoke_on_all([] {
+        host->received = 0;
+    }).get();
+    for (unsigned i = 0; i < nr; ++i) {
+        peer.local_queue().send(make_frame(dst_mac, peer.hw_address(), src_port, dst_port));
+    }
+    std::vector<unsigned> received(smp::count);
+    for (unsigned i = 0; i < 1000; ++i) {
+        for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+            received[cpu] = smp::submit_to(cpu, [] { return host->received; }).get0();
+        }
+        if (std::accumulate(received.begin(), received.end(), 0u) >= nr) {
+            break;
+        }
+        sleep(std::chrono::milliseconds(1)).get();
+    }
+    for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+        if (received[cpu] == nr) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+SEASTAR_TEST_CASE(test_flow_steered_to_owner) {
+    return seastar::async([] {
+        if (smp::count < 2) {
+            return;
+        }
+        loopback_config cfg;
+        cfg.queues = smp::count;
+        auto devs = create_loopback_net_device_pair(cfg);
+        start_loopback_net_device(devs.first).get();
+        start_loopback_net_device(devs.second).get();
+        auto& peer = *devs.first;
+        auto dev = devs.second;
+        smp::invoke_on_all([dev] {
+            host = std::make_unique<flow_host>(dev);
+        }).get();
+        auto dst_mac = dev->hw_address();
+        uint16_t src_port = 40000, dst_port = 80;
+        auto key = key_of(make_frame(dst_mac, peer.hw_address(), src_port, dst_port));
+        auto nr = 64u;
+
+        // RSS alone sends the flow to one shard
+        auto rss_cpu = receiving_shard(peer, dst_mac, src_port, dst_port, nr);
+        BOOST_REQUIRE(rss_cpu >= 0);
+
+        // Another shard, standing for the one that owns the connection,
+        // steers the flow to itself
+        unsigned owner = (rss_cpu + 1) % smp::count;
+        smp::submit_to(owner, [key] {
+            return host->netif.steer_flow_here(key);
+        }).get();
+        BOOST_REQUIRE_EQUAL(receiving_shard(peer, dst_mac, src_port, dst_port, nr), int(owner));
+
+        // A shard that no longer owns the flow does not remove the entry
+        // of the one that does
+        smp::submit_to(rss_cpu, [key] {
+            return host->netif.unsteer_flow_here(key);
+        }).get();
+        BOOST_REQUIRE_EQUAL(receiving_shard(peer, dst_mac, src_port, dst_port, nr), int(owner));
+
+        // The owner lets RSS choose again
+        smp::submit_to(owner, [key] {
+            return host->netif.unsteer_flow_here(key);
+        }).get();
+        BOOST_REQUIRE_EQUAL(receiving_shard(peer, dst_mac, src_port, dst_port, nr), rss_cpu);
+
+        smp::invoke_on_all([] {
+            host.reset();
+        }).get();
+    });
+}
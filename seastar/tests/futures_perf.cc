@@ -0,0 +1,111 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Measures the cost of scheduling and running continuations attached to
+// futures that are not yet available, which is what every .then() on an
+// I/O result pays.
+
+#include <chrono>
+#include <boost/range/irange.hpp>
+#include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/do_with.hh"
+#include "core/memory.hh"
+#include "core/print.hh"
+
+using namespace std::chrono_literals;
+
+// Attaches chain_length continuations to a future before making it
+// available, so that none of them can be run inline.
+template <typename Attach>
+static future<> run_chain(unsigned chain_length, Attach attach) {
+    return do_with(promise<>(), [chain_length, attach] (promise<>& pr) {
+        auto f = pr.get_future();
+        for (unsigned i = 0; i < chain_length; ++i) {
+            f = attach(std::move(f));
+        }
+        pr.set_value();
+        return f;
+    });
+}
+
+// Runs body() until it has performed at least nr_ops operations, each call
+// accounting for ops_per_call of them, and reports the average cost.
+template <typename Body>
+static future<> measure(const char* name, unsigned nr_ops, unsigned ops_per_call, Body body) {
+    struct state {
+        unsigned done = 0;
+        uint64_t mallocs = memory::stats().mallocs();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    };
+    return do_with(state(), [=] (state& s) {
+        return do_until([&s, nr_ops] { return s.done >= nr_ops; }, [&s, ops_per_call, body] {
+            s.done += ops_per_call;
+            return body();
+        }).then([&s, name] {
+            auto elapsed = std::chrono::steady_clock::now() - s.start;
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            auto mallocs = memory::stats().mallocs() - s.mallocs;
+            print("%-20s %8.1f ns/op %8.3f allocs/op\n", name, double(ns) / s.done, double(mallocs) / s.done);
+        });
+    });
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+
+    app_template app;
+    app.add_options()
+        ("operations", bpo::value<unsigned>()->default_value(1000000), "number of continuations to run per benchmark")
+        ("chain-length", bpo::value<unsigned>()->default_value(1000), "number of continuations attached to a single future")
+        ;
+    return app.run(ac, av, [&app] {
+        auto& opts = app.configuration();
+        auto nr_ops = opts["operations"].as<unsigned>();
+        auto len = std::max(opts["chain-length"].as<unsigned>(), 1u);
+        return measure("then", nr_ops, len, [len] {
+            return run_chain(len, [] (future<> f) {
+                return f.then([] {});
+            });
+        }).then([nr_ops, len] {
+            return measure("then_wrapped", nr_ops, len, [len] {
+                return run_chain(len, [] (future<> f) {
+                    return f.then_wrapped([] (future<> f) {
+                        f.ignore_ready_future();
+                    });
+                });
+            });
+        }).then([nr_ops, len] {
+            return measure("finally", nr_ops, len, [len] {
+                return run_chain(len, [] (future<> f) {
+                    return f.finally([] {});
+                });
+            });
+        }).then([nr_ops, len] {
+            return measure("parallel_for_each", nr_ops, len, [len] {
+                return parallel_for_each(boost::irange(0u, len), [] (unsigned) {
+                    return later();
+                });
+            });
+        });
+    });
+}
@@ -0,0 +1,119 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Measures what the sampling heap profiler adds to the cost of allocating
+// and freeing memory, which should stay under 1% at the suggested 512k
+// sample period.  Also frees objects sampled before the profiler was
+// disabled, and grows and shrinks them while it is enabled.
+
+#include "core/app-template.hh"
+#include "core/thread.hh"
+#include "core/memory.hh"
+#include "core/print.hh"
+#include <array>
+#include <chrono>
+#include <vector>
+#include <cstdlib>
+
+using clock_type = std::chrono::steady_clock;
+
+// Keeps the compiler from eliding an allocation that is freed unused
+static void escape(void* p) {
+    asm volatile("" : : "g"(p) : "memory");
+}
+
+// Allocates and frees objects of the given size in batches, yielding
+// now and then so that a long run does not look like a stall, and
+// returns the cost of an allocation and its free, in nanoseconds
+static double measure(size_t size, unsigned nr_ops) {
+    constexpr unsigned batch = 64;
+    constexpr unsigned batches_per_yield = 1024;
+    std::array<void*, batch> objs;
+    clock_type::duration elapsed = {};
+    unsigned done = 0;
+    while (done < nr_ops) {
+        auto start = clock_type::now();
+        for (unsigned b = 0; b < batches_per_yield && done < nr_ops; ++b, done += batch) {
+            for (auto& p : objs) {
+                p = ::malloc(size);
+                escape(p);
+            }
+            for (auto p : objs) {
+                ::free(p);
+            }
+        }
+        elapsed += clock_type::now() - start;
+        later().get();
+    }
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / done;
+}
+
+// Objects sampled while the profiler runs must stay valid to resize and
+// free after it is turned off
+static void check_sampled_objects_outlive_profiler() {
+    std::vector<void*> objs(256);
+    memory::set_heap_profiling_sample_period(4096);
+    for (auto& p : objs) {
+        p = ::malloc(64 * 1024);
+        escape(p);
+    }
+    for (auto& p : objs) {
+        p = ::realloc(p, 4096);
+    }
+    memory::set_heap_profiling_sample_period(0);
+    for (auto& p : objs) {
+        p = ::realloc(p, 1024);
+        ::free(p);
+    }
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("operations", bpo::value<unsigned>()->default_value(10000000), "allocations per size and mode")
+        ("sample-period", bpo::value<size_t>()->default_value(512 * 1024), "heap profiler sample period to compare against")
+        ("max-overhead", bpo::value<double>()->default_value(0), "fail if the profiler adds more than this many percent (0: report only)")
+        ;
+    return app.run(ac, av, [&app] {
+        return seastar::async([&app] {
+            auto& opts = app.configuration();
+            auto nr_ops = opts["operations"].as<unsigned>();
+            auto period = opts["sample-period"].as<size_t>();
+            auto max_overhead = opts["max-overhead"].as<double>();
+            check_sampled_objects_outlive_profiler();
+            int ret = 0;
+            for (size_t size : { 16, 128, 1024, 16384, 256 * 1024 }) {
+                memory::set_heap_profiling_sample_period(0);
+                auto off = measure(size, nr_ops);
+                memory::set_heap_profiling_sample_period(period);
+                auto on = measure(size, nr_ops);
+                memory::set_heap_profiling_sample_period(0);
+                auto overhead = (on - off) / off * 100;
+                print("%8d bytes: %8.1f ns/op without profiling, %8.1f ns/op with, %+6.2f%%\n", size, off, on, overhead);
+                if (max_overhead && overhead > max_overhead) {
+                    ret = 1;
+                }
+            }
+            return ret;
+        });
+    });
+}
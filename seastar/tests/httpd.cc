@@ -10,7 +10,10 @@
 #include "http/routes.hh"
 #include "http/exception.hh"
 #include "http/transformers.hh"
+#include "http/content_stream.hh"
 #include "core/future-util.hh"
+#include "core/vector-data-sink.hh"
+#include "net/packet-data-source.hh"
 #include "tests/test-utils.hh"
 
 using namespace httpd;
@@ -165,3 +168,85 @@ SEASTAR_TEST_CASE(test_transformer) {
     BOOST_REQUIRE_EQUAL(content, "hello-http-xyz-localhost");
     return make_ready_future<>();
 }
+
+static net::packet make_packet(std::vector<sstring> frags) {
+    net::packet p;
+    for (auto&& f : frags) {
+        p = net::packet(std::move(p), net::fragment{f.begin(), f.size()});
+    }
+    return p;
+}
+
+SEASTAR_TEST_CASE(test_chunked_input_stream) {
+    // chunk header and trailer are split across buffers on purpose
+    auto in = make_lw_shared<input_stream<char>>(net::as_input_stream(make_packet({
+            "4\r\nWi", "ki\r\n5;ext=1\r", "\npedia\r\n0\r\nTrailer: x\r\n\r", "\nNEXT"})));
+    auto body = make_lw_shared<input_stream<char>>(make_chunked_input_stream(*in));
+    return read_all(*body).then([in, body] (sstring content) {
+        BOOST_REQUIRE_EQUAL(content, "Wikipedia");
+        return in->read();
+    }).then([in, body] (temporary_buffer<char> rest) {
+        BOOST_REQUIRE_EQUAL(sstring(rest.get(), rest.size()), "NEXT");
+    });
+}
+
+SEASTAR_TEST_CASE(test_bad_chunked_input_stream) {
+    auto in = make_lw_shared<input_stream<char>>(net::as_input_stream(make_packet({"zz\r\n"})));
+    auto body = make_lw_shared<input_stream<char>>(make_chunked_input_stream(*in));
+    return read_all(*body).then_wrapped([in, body] (future<sstring> f) {
+        BOOST_REQUIRE_THROW(f.get(), bad_body_exception);
+    });
+}
+
+SEASTAR_TEST_CASE(test_content_length_input_stream) {
+    auto in = make_lw_shared<input_stream<char>>(net::as_input_stream(make_packet({"hello", "worldNEXT"})));
+    auto body = make_lw_shared<input_stream<char>>(make_content_length_input_stream(*in, 10));
+    return read_all(*body).then([in, body] (sstring content) {
+        BOOST_REQUIRE_EQUAL(content, "helloworld");
+        return in->read();
+    }).then([in, body] (temporary_buffer<char> rest) {
+        BOOST_REQUIRE_EQUAL(sstring(rest.get(), rest.size()), "NEXT");
+    });
+}
+
+SEASTAR_TEST_CASE(test_read_all_limit) {
+    auto in = make_lw_shared<input_stream<char>>(net::as_input_stream(make_packet({"hello", "world"})));
+    return read_all(*in, 9).then_wrapped([in] (future<sstring> f) {
+        BOOST_REQUIRE_THROW(f.get(), body_too_large_exception);
+    });
+}
+
+SEASTAR_TEST_CASE(test_parse_content_length) {
+    size_t len = 7;
+    BOOST_REQUIRE(http_server::connection::parse_content_length("0", len));
+    BOOST_REQUIRE_EQUAL(len, 0u);
+    BOOST_REQUIRE(http_server::connection::parse_content_length("18446744073709551615", len));
+    BOOST_REQUIRE_EQUAL(len, std::numeric_limits<size_t>::max());
+    BOOST_REQUIRE(http_server::connection::parse_content_length("12 \t", len));
+    BOOST_REQUIRE_EQUAL(len, 12u);
+    len = 7;
+    for (auto bad : {"", " ", "-1", "+1", " 1", "1 2", "12abc", "0x10", "18446744073709551616"}) {
+        BOOST_REQUIRE(!http_server::connection::parse_content_length(bad, len));
+    }
+    BOOST_REQUIRE_EQUAL(len, 7u);
+    return make_ready_future<>();
+}
+
+SEASTAR_TEST_CASE(test_chunked_output_stream) {
+    auto v = make_lw_shared<std::vector<net::packet>>();
+    auto out = make_lw_shared<output_stream<char>>(data_sink(std::make_unique<vector_data_sink>(*v)), 64);
+    auto body = make_lw_shared<output_stream<char>>(make_chunked_output_stream(*out, 4));
+    return body->write("abcdefghij").then([body] {
+        return body->write("xy");
+    }).then([body] {
+        return body->close();
+    }).then([v, out, body] {
+        sstring res;
+        for (auto&& p : *v) {
+            for (auto&& f : p.fragments()) {
+                res += sstring(f.base, f.size);
+            }
+        }
+        BOOST_REQUIRE_EQUAL(res, "a\r\nabcdefghij\r\n2\r\nxy\r\n0\r\n\r\n");
+    });
+}
@@ -22,24 +22,180 @@
 #include "net/arp.hh"
 #include "net/ip.hh"
 #include "net/net.hh"
+#include "net/loopback.hh"
 #include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/thread.hh"
 #include "net/virtio.hh"
+#include <algorithm>
 
 using namespace net;
 
-int main(int ac, char** av) {
-    boost::program_options::variables_map opts;
-    opts.insert(std::make_pair("tap-device", boost::program_options::variable_value(std::string("tap0"), false)));
+// Reserved for experimentation (RFC 3692)
+static constexpr uint8_t test_proto = 253;
+
+static const ipv4_address src_address("192.168.122.1");
+static const ipv4_address dst_address("192.168.122.2");
+
+// Keeps the datagrams of test_proto the stack received
+struct datagram_sink : public ip_protocol {
+    std::vector<packet> datagrams;
+    virtual void received(packet p, ipv4_address from, ipv4_address to) override {
+        datagrams.push_back(std::move(p));
+    }
+};
+
+struct fragment_spec {
+    uint16_t offset;
+    uint16_t len;
+    bool mf;
+};
+
+// Byte at offset of every test datagram, so that overlapping fragments
+// agree, and a misplaced one is detected
+static char payload_byte(unsigned offset) {
+    return char(offset ^ (offset >> 8));
+}
 
-    auto vnet = create_virtio_net_device(opts);
-    vnet->set_local_queue(vnet->init_local_queue(opts, 0));
+static packet make_fragment(ethernet_address to, uint16_t id, const fragment_spec& f) {
+    std::vector<char> data(f.len);
+    for (unsigned i = 0; i < f.len; ++i) {
+        data[i] = payload_byte(f.offset + i);
+    }
+    packet p(data.data(), data.size());
+    auto iph = p.prepend_header<ip_hdr>();
+    iph->ihl = sizeof(*iph) / 4;
+    iph->ver = 4;
+    iph->dscp = 0;
+    iph->ecn = 0;
+    iph->len = sizeof(*iph) + f.len;
+    iph->id = id;
+    iph->frag = (f.mf << uint8_t(ip_hdr::frag_bits::mf)) | (f.offset >> uint8_t(ip_hdr::frag_bits::offset_shift));
+    iph->ttl = 64;
+    iph->ip_proto = test_proto;
+    iph->csum = 0;
+    iph->src_ip = src_address;
+    iph->dst_ip = dst_address;
+    *iph = hton(*iph);
+    checksummer csum;
+    csum.sum(reinterpret_cast<char*>(iph), sizeof(*iph));
+    iph->csum = csum.get();
+    auto eh = p.prepend_header<eth_hdr>();
+    eh->dst_mac = to;
+    eh->src_mac = ethernet_address{0x02, 0x00, 0x00, 0x00, 0x00, 0xff};
+    eh->eth_proto = uint16_t(eth_protocol_num::ipv4);
+    *eh = hton(*eh);
+    return p;
+}
+
+// Feeds fragments to an ipv4 stack on one end of a loopback device pair,
+// as if they were received from the wire
+class reassembly_test {
+    std::shared_ptr<device> _peer;
+    std::shared_ptr<device> _dev;
+    interface _netif;
+    ipv4 _inet;
+    datagram_sink _sink;
+    uint16_t _next_id = 1;
+    unsigned _failures = 0;
+public:
+    explicit reassembly_test(std::pair<std::shared_ptr<device>, std::shared_ptr<device>> devs)
+        : _peer(std::move(devs.first)), _dev(std::move(devs.second)), _netif(_dev), _inet(&_netif) {
+        _inet.set_host_address(dst_address);
+        _inet.register_l4(test_proto, &_sink);
+    }
+    // Returns the datagrams reassembled from the fragments, sent in order
+    std::vector<packet> receive(std::vector<fragment_spec> fragments) {
+        auto id = _next_id++;
+        for (auto& f : fragments) {
+            _dev->l2receive(make_fragment(_netif.hw_address(), id, f));
+        }
+        later().get();
+        return std::exchange(_sink.datagrams, {});
+    }
+    void check(const char* name, std::vector<fragment_spec> fragments, unsigned nr_expected, size_t expected_len = 0) {
+        auto datagrams = receive(std::move(fragments));
+        bool ok = datagrams.size() == nr_expected;
+        for (auto& p : datagrams) {
+            p.linearize();
+            auto data = p.frag(0).base;
+            ok = ok && p.len() == expected_len;
+            for (unsigned i = 0; ok && i < p.len(); ++i) {
+                ok = data[i] == payload_byte(i);
+            }
+        }
+        print("%s: %s\n", name, ok ? "OK" : "FAILED");
+        _failures += !ok;
+    }
+    unsigned failures() const {
+        return _failures;
+    }
+};
 
-    interface netif(std::move(vnet));
-    ipv4 inet(&netif);
-    inet.set_host_address(ipv4_address("192.168.122.2"));
-    engine().run();
-    return 0;
+// Splits a payload of len bytes into fragments of at most frag_len
+// bytes (a multiple of 8), in order
+static std::vector<fragment_spec> split(unsigned len, unsigned frag_len) {
+    std::vector<fragment_spec> fragments;
+    for (unsigned off = 0; off < len; off += frag_len) {
+        auto n = std::min(frag_len, len - off);
+        fragments.push_back(fragment_spec{uint16_t(off), uint16_t(n), off + n < len});
+    }
+    return fragments;
 }
 
+// Called in a thread; t is owned by main(), so that it outlives the
+// reactor's pollers of its devices
+static int run_reassembly(std::unique_ptr<reassembly_test>& t) {
+    loopback_config cfg;
+    cfg.queues = 1;
+    auto devs = create_loopback_net_device_pair(cfg);
+    devs.second->set_local_queue(devs.second->init_local_queue(boost::program_options::variables_map(), 0));
+    t = std::make_unique<reassembly_test>(std::move(devs));
+
+    t->check("in order", split(3000, 1480), 1, 3000);
+    auto fragments = split(3000, 1480);
+    std::reverse(fragments.begin(), fragments.end());
+    t->check("out of order", fragments, 1, 3000);
+    // The third one only fills the gap between the first two, and
+    // is trimmed to nothing
+    t->check("overlapping", {{0, 16, true}, {16, 16, true}, {8, 16, true}, {24, 24, true}, {40, 24, false}}, 1, 64);
+    t->check("duplicate", {{0, 1480, true}, {0, 1480, true}, {1480, 520, false}, {1480, 520, false}}, 1, 2000);
+    // The largest payload, over a 576 byte MTU path: 119 fragments
+    t->check("many fragments", split(65515, 552), 1, 65515);
+    // One byte more than fits in a datagram
+    t->check("oversized", split(65516, 1480), 0);
+    t->check("too many fragments", split(8 * 129, 8), 0);
+    return t->failures() ? 1 : 0;
+}
 
+// The stack on the tap device
+struct tap_host {
+    interface netif;
+    ipv4 inet;
+    explicit tap_host(std::shared_ptr<device> dev) : netif(std::move(dev)), inet(&netif) {
+        inet.set_host_address(dst_address);
+    }
+};
 
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("reassembly", "check IP reassembly on a loopback device, instead of running a stack on the tap device")
+        ;
+    std::unique_ptr<reassembly_test> t;
+    std::unique_ptr<tap_host> tap;
+    return app.run_deprecated(ac, av, [&app, &t, &tap] {
+        auto& opts = app.configuration();
+        if (opts.count("reassembly")) {
+            seastar::async([&t] {
+                return run_reassembly(t);
+            }).then([] (int ret) {
+                engine().exit(ret);
+            }).or_terminate();
+            return;
+        }
+        auto vnet = create_virtio_net_device(opts);
+        vnet->set_local_queue(vnet->init_local_queue(opts, 0));
+        tap = std::make_unique<tap_host>(std::move(vnet));
+    });
+}
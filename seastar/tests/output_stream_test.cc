@@ -128,3 +128,44 @@ SEASTAR_TEST_CASE(test_flush_on_empty_buffer_does_not_push_empty_packet_down_str
         return out->close();
     }).finally([out]{});
 }
+
+static temporary_buffer<char> make_buffer(const char* s) {
+    return temporary_buffer<char>(s, strlen(s));
+}
+
+SEASTAR_TEST_CASE(test_batched_zero_copy_writes_are_coalesced) {
+    auto v = make_shared<std::vector<packet>>();
+    auto out = make_shared<output_stream<char>>(
+        data_sink(std::make_unique<vector_data_sink>(*v)), 16, false, true);
+
+    return out->write("ab").then([out] {
+        return out->write(make_buffer("cd"));
+    }).then([out] {
+        return out->write("ef");
+    }).then([out] {
+        return out->write(make_buffer("gh"));
+    }).then([out, v] {
+        BOOST_REQUIRE(v->empty());
+        return out->close();
+    }).then([out, v] {
+        BOOST_REQUIRE_EQUAL(v->size(), 1u);
+        BOOST_REQUIRE(to_sstring((*v)[0]) == "abcdefgh");
+    });
+}
+
+SEASTAR_TEST_CASE(test_batched_zero_copy_writes_are_put_above_threshold) {
+    auto v = make_shared<std::vector<packet>>();
+    auto out = make_shared<output_stream<char>>(
+        data_sink(std::make_unique<vector_data_sink>(*v)), 4, false, true);
+
+    return out->write(make_buffer("abc")).then([out, v] {
+        BOOST_REQUIRE(v->empty());
+        return out->write(make_buffer("defg"));
+    }).then([out, v] {
+        BOOST_REQUIRE_EQUAL(v->size(), 1u);
+        BOOST_REQUIRE(to_sstring((*v)[0]) == "abcdefg");
+        return out->close();
+    }).then([out, v] {
+        BOOST_REQUIRE_EQUAL(v->size(), 1u);
+    });
+}
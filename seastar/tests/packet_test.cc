@@ -65,3 +65,23 @@ BOOST_AUTO_TEST_CASE(test_headers_are_contiguous_even_with_many_fragments) {
     BOOST_REQUIRE_EQUAL(p.nr_frags(), 9);
 }
 
+
+BOOST_AUTO_TEST_CASE(test_deleter_is_unique) {
+    BOOST_REQUIRE(deleter().is_unique());
+    auto d = make_free_deleter(::malloc(16));
+    BOOST_REQUIRE(d.is_unique());
+    auto shared = d.share();
+    BOOST_REQUIRE(!d.is_unique());
+    BOOST_REQUIRE(!shared.is_unique());
+    shared = deleter();
+    BOOST_REQUIRE(d.is_unique());
+
+    // A buffer trimmed to nothing still refers to the memory
+    temporary_buffer<char> buf(16);
+    auto part = buf.share(8, 8);
+    part.trim_front(8);
+    auto owner = buf.release();
+    BOOST_REQUIRE(!owner.is_unique());
+    part = temporary_buffer<char>();
+    BOOST_REQUIRE(owner.is_unique());
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+// Helpers for the standalone benchmarks of data structures, which run
+// without a reactor and check their results as they go.
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+
+using perf_clock = std::chrono::steady_clock;
+
+inline double ns_per(perf_clock::duration d, size_t n) {
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()) / n;
+}
+
+inline void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        abort();
+    }
+}
+
+// Adds --help to opts and parses the command line into vm; returns false,
+// after printing the options, if the benchmark should not run.
+inline bool parse_perf_options(int ac, char** av, boost::program_options::options_description& opts,
+        boost::program_options::variables_map& vm) {
+    namespace bpo = boost::program_options;
+    opts.add_options()
+            ("help", "produce this help message")
+            ;
+    bpo::store(bpo::parse_command_line(ac, av, opts), vm);
+    bpo::notify(vm);
+    if (vm.count("help")) {
+        std::cout << opts << "\n";
+        return false;
+    }
+    return true;
+}
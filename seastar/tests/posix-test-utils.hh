@@ -0,0 +1,35 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/reactor.hh"
+#include "net/posix-stack.hh"
+
+// Connects a client socket to a server over loopback; returns the
+// client and the server end of the connection.  Called in a thread.
+inline std::pair<pollable_fd, pollable_fd> connect_loopback() {
+    auto listener = engine().posix_listen(make_ipv4_address({0x7f000001, 0}));
+    auto sa = listener.get_file_desc().get_address();
+    auto client = engine().posix_connect(sa, make_ipv4_address({})).get0();
+    auto server = std::get<0>(listener.accept().get());
+    return std::make_pair(std::move(client), std::move(server));
+}
@@ -0,0 +1,99 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/iostream.hh"
+#include "net/posix-stack.hh"
+#include "test-utils.hh"
+#include "posix-test-utils.hh"
+
+using namespace net;
+
+static void send(pollable_fd& fd, size_t size) {
+    std::vector<char> data(size, 'x');
+    fd.write_all(data.data(), data.size()).get();
+}
+
+SEASTAR_TEST_CASE(test_buffer_grows_and_shrinks) {
+    return seastar::async([] {
+        auto fds = connect_loopback();
+        posix_data_source_impl src(fds.first, 8192);
+        // Reads that fill the buffer double it
+        send(fds.second, 8192);
+        BOOST_REQUIRE_EQUAL(src.get().get0().size(), 8192u);
+        BOOST_REQUIRE_EQUAL(src.buffer_size(), 16384u);
+        send(fds.second, 16384);
+        BOOST_REQUIRE_EQUAL(src.get().get0().size(), 16384u);
+        BOOST_REQUIRE_EQUAL(src.buffer_size(), 32768u);
+        // A run of reads using a quarter of it or less halves it
+        for (unsigned i = 0; i < 8; ++i) {
+            send(fds.second, 4096);
+            BOOST_REQUIRE_EQUAL(src.get().get0().size(), 4096u);
+        }
+        BOOST_REQUIRE_EQUAL(src.buffer_size(), 16384u);
+        // which a larger read interrupts
+        for (unsigned i = 0; i < 7; ++i) {
+            send(fds.second, 4096);
+            src.get().get();
+        }
+        send(fds.second, 8192);
+        src.get().get();
+        send(fds.second, 4096);
+        src.get().get();
+        BOOST_REQUIRE_EQUAL(src.buffer_size(), 16384u);
+    });
+}
+
+SEASTAR_TEST_CASE(test_small_reads_are_copied) {
+    return seastar::async([] {
+        auto fds = connect_loopback();
+        posix_data_source_impl src(fds.first, 8192);
+        send(fds.second, 4096);
+        auto base = src.get().get0().get();
+        // Copied out, leaving the buffer free for the next read
+        send(fds.second, 100);
+        auto small = src.get().get0();
+        BOOST_REQUIRE_EQUAL(small.size(), 100u);
+        BOOST_REQUIRE(small.get() != base);
+        send(fds.second, 4096);
+        auto large = src.get().get0();
+        BOOST_REQUIRE(large.get() == base);
+        // Not copied, so the next read needs another buffer
+        send(fds.second, 4096);
+        BOOST_REQUIRE(src.get().get0().get() != base);
+    });
+}
+
+SEASTAR_TEST_CASE(test_read_exactly_releases_buffer) {
+    return seastar::async([] {
+        auto fds = connect_loopback();
+        input_stream<char> in(data_source(std::make_unique<posix_data_source_impl>(fds.first, 8192)));
+        send(fds.second, 4096);
+        auto base = in.read_exactly(3000).get0().get();
+        // Copies the 1096 bytes left, then reads more into the same
+        // buffer, since nothing refers to it any more
+        send(fds.second, 4096);
+        BOOST_REQUIRE_EQUAL(in.read_exactly(2000).get0().size(), 2000u);
+        auto next = in.read_exactly(100).get0();
+        BOOST_REQUIRE(next.get() == base + 904);
+    });
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "net/api.hh"
+#include "net/packet.hh"
+#include "test-utils.hh"
+#include <boost/range/irange.hpp>
+
+using namespace net;
+
+// Datagrams are sent to this address; the channels are of the posix stack,
+// the default one
+static const ipv4_addr server_address(0x7f000001, 10100);
+
+// The contents of the i-th datagram of a test, of the given size
+static sstring datagram(unsigned i, size_t size) {
+    sstring s(sstring::initialized_later(), size);
+    for (size_t j = 0; j < size; ++j) {
+        s[j] = char(i + j);
+    }
+    return s;
+}
+
+static sstring contents(packet& p) {
+    sstring s;
+    for (auto&& f : p.fragments()) {
+        s += sstring(f.base, f.size);
+    }
+    return s;
+}
+
+static future<> expect(udp_channel& chan, unsigned i, size_t size) {
+    return chan.receive().then([i, size] (udp_datagram d) {
+        BOOST_REQUIRE_EQUAL(contents(d.get_data()), datagram(i, size));
+    });
+}
+
+SEASTAR_TEST_CASE(test_small_datagrams_and_a_large_one) {
+    return seastar::async([] {
+        auto server = engine().net().make_udp_channel(server_address);
+        auto client = engine().net().make_udp_channel();
+        // Small datagrams of the same size to the same destination, which
+        // GSO sends and GRO receives as one, and one that does not fit a
+        // receive slice
+        unsigned nr = 10;
+        size_t small = 100, large = 20000;
+        std::vector<future<>> sent;
+        for (unsigned i = 0; i < nr; ++i) {
+            sent.push_back(client.send(server_address, packet(datagram(i, small).c_str(), small)));
+        }
+        sent.push_back(client.send(server_address, packet(datagram(nr, large).c_str(), large)));
+        for (auto&& f : sent) {
+            f.get();
+        }
+        for (unsigned i = 0; i < nr; ++i) {
+            expect(server, i, small).get();
+        }
+        expect(server, nr, large).get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_sends_complete_across_flushes) {
+    return seastar::async([] {
+        auto server = engine().net().make_udp_channel(server_address);
+        auto client = engine().net().make_udp_channel();
+        // Each one longer than the previous one, so none are coalesced,
+        // and more than one sendmmsg() sends
+        unsigned nr = 2 * 64 + 8;
+        auto datagrams = boost::irange(0u, nr);
+        auto received = do_for_each(datagrams, [&server] (unsigned i) {
+            return expect(server, i, i + 1);
+        });
+        std::vector<future<>> sent;
+        for (unsigned i = 0; i < nr; ++i) {
+            sent.push_back(client.send(server_address, packet(datagram(i, i + 1).c_str(), i + 1)));
+        }
+        for (auto&& f : sent) {
+            f.get();
+        }
+        received.get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_close_fails_pending_sends) {
+    return seastar::async([] {
+        auto client = engine().net().make_udp_channel();
+        std::vector<future<>> sent;
+        for (unsigned i = 0; i < 4; ++i) {
+            sent.push_back(client.send(server_address, packet(datagram(i, 10).c_str(), 10)));
+        }
+        // Before the reactor had a chance to flush them
+        client.close();
+        for (auto&& f : sent) {
+            BOOST_REQUIRE_THROW(f.get(), std::system_error);
+        }
+    });
+}
@@ -0,0 +1,118 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/thread.hh"
+#include "core/future-util.hh"
+#include "net/posix-stack.hh"
+#include "net/packet.hh"
+#include "test-utils.hh"
+#include "posix-test-utils.hh"
+#include <boost/range/irange.hpp>
+
+using namespace net;
+
+static constexpr size_t packet_size = 64 * 1024;
+
+static packet make_packet(unsigned i) {
+    temporary_buffer<char> buf(packet_size);
+    std::fill(buf.get_write(), buf.get_write() + buf.size(), char(i));
+    return packet(fragment{buf.get_write(), buf.size()}, buf.release());
+}
+
+// Reads up to size bytes, until the end of the stream, from fd
+static std::vector<char> read_up_to(pollable_fd& fd, size_t size) {
+    std::vector<char> data(size);
+    size_t done = 0;
+    while (done < size) {
+        auto n = fd.read_some(data.data() + done, size - done).get0();
+        if (!n) {
+            break;
+        }
+        done += n;
+    }
+    data.resize(done);
+    return data;
+}
+
+SEASTAR_TEST_CASE(test_zerocopy_sends_complete) {
+    return seastar::async([] {
+        posix_data_sink_impl::zerocopy_threshold = 4096;
+        auto fds = connect_loopback();
+        posix_data_sink_impl sink(fds.first);
+        unsigned nr_packets = 16;
+        auto packets = boost::irange(0u, nr_packets);
+        auto sent = do_for_each(packets, [&sink] (unsigned i) {
+            return sink.put(make_packet(i));
+        });
+        auto data = read_up_to(fds.second, nr_packets * packet_size);
+        sent.get();
+        BOOST_REQUIRE_EQUAL(data.size(), nr_packets * packet_size);
+        for (size_t i = 0; i < data.size(); ++i) {
+            BOOST_REQUIRE_EQUAL(data[i], char(i / packet_size));
+        }
+        // All data was read, so the kernel reports every send complete
+        sink.close().get();
+        auto status = sink.get_zerocopy_status();
+        // Loopback cannot send from our memory: the kernel reports it
+        // copied the data, and the sink stops asking for zero-copy.
+        // Before Linux 4.14 it never enables it in the first place.
+        if (status.enabled) {
+            BOOST_REQUIRE(status.copied);
+        }
+        BOOST_REQUIRE(!status.aborted);
+        BOOST_REQUIRE(!sink.zerocopy());
+    });
+}
+
+SEASTAR_TEST_CASE(test_zerocopy_abort_resets_connection) {
+    return seastar::async([] {
+        posix_data_sink_impl::zerocopy_threshold = 4096;
+        auto fds = connect_loopback();
+        posix_data_sink_impl sink(fds.first);
+        sink.put(make_packet(0)).get();
+        if (!sink.get_zerocopy_status().enabled) {
+            // Before Linux 4.14
+            return;
+        }
+        for (unsigned i = 1; i < 4; ++i) {
+            sink.put(make_packet(i)).get();
+        }
+        // What close() does once zerocopy_close_timeout passes
+        sink.abort_zerocopy();
+        BOOST_REQUIRE(sink.get_zerocopy_status().aborted);
+        try {
+            sink.put(make_packet(4)).get();
+            BOOST_FAIL("put() succeeded after the connection was reset");
+        } catch (std::system_error& e) {
+            BOOST_REQUIRE_EQUAL(e.code().value(), ECONNABORTED);
+        }
+        sink.close().get();
+        BOOST_REQUIRE(sink.get_zerocopy_status().aborted);
+        // The peer gets what arrived before the reset, and then the reset
+        try {
+            read_up_to(fds.second, 5 * packet_size);
+            BOOST_FAIL("the connection was not reset");
+        } catch (std::system_error& e) {
+            BOOST_REQUIRE_EQUAL(e.code().value(), ECONNRESET);
+        }
+    });
+}
@@ -81,11 +81,39 @@ inline sstring read(serializer, Input& in, rpc::type<sstring>) {
 namespace bpo = boost::program_options;
 using namespace std::chrono_literals;
 
+// Keeps `concurrency` calls in flight on a single connection for `duration`
+// and reports the achieved call rate.
+template <typename Call>
+future<> run_benchmark(Call call, rpc::protocol<serializer>::client& client, unsigned concurrency, std::chrono::seconds duration) {
+    auto calls = make_lw_shared<uint64_t>(0);
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + duration;
+    return parallel_for_each(boost::irange(0u, concurrency), [call, &client, calls, end] (unsigned) mutable {
+        return do_until([end] { return std::chrono::steady_clock::now() >= end; }, [call, &client, calls] () mutable {
+            return call(client, 1).then([calls] (int) {
+                ++*calls;
+            });
+        });
+    }).then([&client, calls, start] {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto stats = client.get_stats();
+        print("%d calls in %.2f s: %.0f calls/s, %d messages sent\n", *calls, elapsed, *calls / elapsed, stats.sent_messages);
+        if (stats.compress_in_bytes) {
+            print("compression ratio %.2f, %.0f ns/byte compressing, %.0f ns/byte decompressing\n", stats.compression_ratio(),
+                    double(stats.compress_ns) / stats.compress_in_bytes, double(stats.decompress_ns) / stats.compress_in_bytes);
+        }
+    });
+}
+
 int main(int ac, char** av) {
     app_template app;
     app.add_options()
                     ("port", bpo::value<uint16_t>()->default_value(10000), "RPC server port")
-                    ("server", bpo::value<std::string>(), "Server address");
+                    ("server", bpo::value<std::string>(), "Server address")
+                    ("bench", "Measure the call rate of a single client connection instead of running the tests")
+                    ("concurrency", bpo::value<unsigned>()->default_value(1000), "Calls in flight in benchmark mode")
+                    ("duration", bpo::value<unsigned>()->default_value(10), "Benchmark duration in seconds")
+                    ("compress", "Compress frames with LZ4 (must be given to both client and server)");
     std::cout << "start ";
     rpc::protocol<serializer> myrpc(serializer{});
     static std::unique_ptr<rpc::protocol<serializer>::server> server;
@@ -107,6 +135,7 @@ int main(int ac, char** av) {
         auto test5 = myrpc.register_handler(5, [](){ print("test5 no wait\n"); return rpc::no_wait; });
         auto test6 = myrpc.register_handler(6, [](const rpc::client_info& info, int x){ print("test6 client %s, %d\n", inet_ntoa(info.addr.as_posix_sockaddr_in().sin_addr), x); });
         auto test8 = myrpc.register_handler(8, [](){ print("test8 sleep for 5 sec\n"); return sleep(2s); });
+        auto bench = myrpc.register_handler(13, [](int x) { return x; });
 
         if (config.count("server")) {
             std::cout << "client" << std::endl;
@@ -121,7 +150,20 @@ int main(int ac, char** av) {
             auto test_nohandler = myrpc.make_client<void ()>(100000000); // non existing verb
             auto test_nohandler_nowait = myrpc.make_client<rpc::no_wait_type ()>(100000000); // non existing verb, no_wait call
 
-            client = std::make_unique<rpc::protocol<serializer>::client>(myrpc, ipv4_addr{config["server"].as<std::string>()});
+            rpc::client_options co;
+            co.compress = config.count("compress");
+            client = std::make_unique<rpc::protocol<serializer>::client>(myrpc, ipv4_addr{config["server"].as<std::string>()}, ipv4_addr(), co);
+
+            if (config.count("bench")) {
+                auto concurrency = config["concurrency"].as<unsigned>();
+                auto duration = std::chrono::seconds(config["duration"].as<unsigned>());
+                run_benchmark(bench, *client, concurrency, duration).finally([] {
+                    return client->stop().then([] {
+                        engine().exit(0);
+                    });
+                });
+                return;
+            }
 
             auto f = test8(*client, 1500ms).then_wrapped([](future<> f) {
                 try {
@@ -230,7 +272,9 @@ int main(int ac, char** av) {
             limits.bloat_factor = 1;
             limits.basic_request_size = 0;
             limits.max_memory = 10'000'000;
-            server = std::make_unique<rpc::protocol<serializer>::server>(myrpc, ipv4_addr{port}, limits);
+            rpc::server_options so;
+            so.compress = config.count("compress");
+            server = std::make_unique<rpc::protocol<serializer>::server>(myrpc, ipv4_addr{port}, limits, so);
         }
     });
 
@@ -20,10 +20,12 @@
  */
 
 
+#include <list>
 #include "loopback_socket.hh"
 #include "rpc/rpc.hh"
 #include "test-utils.hh"
 #include "core/thread.hh"
+#include "core/sleep.hh"
 
 struct serializer {
 };
@@ -80,30 +82,39 @@ inline sstring read(serializer, Input& in, rpc::type<sstring>) {
 }
 
 using test_rpc_proto = rpc::protocol<serializer>;
-using connect_fn = std::function<test_rpc_proto::client (ipv4_addr addr, rpc::client_options options)>;
+// Clients are owned by the test environment, since they cannot be moved
+using connect_fn = std::function<test_rpc_proto::client& (ipv4_addr addr, rpc::client_options options)>;
 
 future<>
-with_rpc_env(rpc::resource_limits resource_limits,
+with_rpc_env(rpc::resource_limits resource_limits, rpc::server_options server_options,
         std::function<future<> (test_rpc_proto& proto, test_rpc_proto::server& server, connect_fn connect)> test_fn) {
     struct state {
         test_rpc_proto proto{serializer()};
         loopback_connection_factory lcf;
         std::unique_ptr<test_rpc_proto::server> server;
+        std::list<test_rpc_proto::client> clients;
     };
     return do_with(state(), [=] (state& s) {
-        s.server = std::make_unique<test_rpc_proto::server>(s.proto, s.lcf.get_server_socket(), resource_limits);
-        auto make_client = [&s] (ipv4_addr addr, rpc::client_options options) {
-            return test_rpc_proto::client(s.proto, addr, s.lcf.make_new_connection(), options);
+        s.server = std::make_unique<test_rpc_proto::server>(s.proto, s.lcf.get_server_socket(), resource_limits, server_options);
+        auto make_client = [&s] (ipv4_addr addr, rpc::client_options options) -> test_rpc_proto::client& {
+            s.clients.emplace_back(s.proto, addr, s.lcf.make_new_connection(), options);
+            return s.clients.back();
         };
         return test_fn(s.proto, *s.server, make_client);
     });
 }
 
+future<>
+with_rpc_env(rpc::resource_limits resource_limits,
+        std::function<future<> (test_rpc_proto& proto, test_rpc_proto::server& server, connect_fn connect)> test_fn) {
+    return with_rpc_env(resource_limits, rpc::server_options(), std::move(test_fn));
+}
+
 
 SEASTAR_TEST_CASE(test_rpc_connect) {
     return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
         return seastar::async([&proto, &s, connect] {
-            auto c1 = connect(ipv4_addr(), rpc::client_options());
+            auto& c1 = connect(ipv4_addr(), rpc::client_options());
             auto sum = proto.register_handler(1, [](int a, int b) {
                 return make_ready_future<int>(a+b);
             });
@@ -112,3 +123,281 @@ SEASTAR_TEST_CASE(test_rpc_connect) {
         });
     });
 }
+
+SEASTAR_TEST_CASE(test_rpc_compression) {
+    rpc::server_options so;
+    so.compress = true;
+    return with_rpc_env({}, so, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            rpc::client_options co;
+            co.compress = true;
+            auto& c1 = connect(ipv4_addr(), co);
+            auto echo = proto.register_handler(1, [](sstring x) {
+                return x;
+            });
+            // below the threshold, sent with an uncompressed envelope
+            BOOST_REQUIRE_EQUAL(echo(c1, sstring("small")).get0(), "small");
+            sstring large(sstring::initialized_later(), 100000);
+            for (size_t i = 0; i < large.size(); i++) {
+                large[i] = 'a' + i % 7;
+            }
+            BOOST_REQUIRE(echo(c1, large).get0() == large);
+            auto stats = c1.get_stats();
+            BOOST_REQUIRE(stats.compress_in_bytes > large.size());
+            BOOST_REQUIRE(stats.compression_ratio() > 10);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_compression_not_supported) {
+    return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            rpc::client_options co;
+            co.compress = true;
+            auto& c1 = connect(ipv4_addr(), co);
+            auto echo = proto.register_handler(1, [](sstring x) {
+                return x;
+            });
+            sstring large(100000, 'x');
+            BOOST_REQUIRE(echo(c1, large).get0() == large);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().compress_in_bytes, 0u);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_blob) {
+    return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto& c1 = connect(ipv4_addr(), rpc::client_options());
+            auto echo = proto.register_handler(1, [](int x, rpc::blob b) {
+                return make_ready_future<int, rpc::blob>(x, std::move(b));
+            });
+            rpc::blob b;
+            for (char c = 'a'; c < 'e'; c++) {
+                temporary_buffer<char> buf(1 << 20);
+                std::fill_n(buf.get_write(), buf.size(), c);
+                b.append(std::move(buf));
+            }
+            auto result = echo(c1, 7, b).get();
+            BOOST_REQUIRE_EQUAL(std::get<0>(result), 7);
+            auto& received = std::get<1>(result);
+            BOOST_REQUIRE_EQUAL(received.size(), b.size());
+            auto expected = b.linearize();
+            auto actual = received.linearize();
+            BOOST_REQUIRE(std::equal(expected.begin(), expected.end(), actual.begin()));
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_stream) {
+    return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto& c1 = connect(ipv4_addr(), rpc::client_options());
+            // counts the bytes sent on the stream, and sends them back doubled
+            auto doubler = proto.register_handler(1, [](rpc::stream st) {
+                return do_with(std::move(st), uint64_t(0), [] (rpc::stream& st, uint64_t& total) {
+                    return repeat([&st, &total] {
+                        return st.read().then([&st, &total] (temporary_buffer<char> buf) {
+                            if (buf.empty()) {
+                                return make_ready_future<stop_iteration>(stop_iteration::yes);
+                            }
+                            total += buf.size();
+                            auto copy = temporary_buffer<char>(buf.get(), buf.size());
+                            return st.write(std::move(buf)).then([&st, copy = std::move(copy)] () mutable {
+                                return st.write(std::move(copy));
+                            }).then([] {
+                                return stop_iteration::no;
+                            });
+                        });
+                    }).then([&st] {
+                        return st.close();
+                    }).then([&total] {
+                        return total;
+                    });
+                });
+            });
+            auto st = c1.make_stream();
+            auto reply = doubler(c1, st);
+            // more than the flow control window in both directions
+            size_t sent = 0;
+            size_t received = 0;
+            auto reader = repeat([&st, &received] {
+                return st.read().then([&received] (temporary_buffer<char> buf) {
+                    received += buf.size();
+                    return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+            for (int i = 0; i < 64; i++) {
+                temporary_buffer<char> buf(32 * 1024);
+                std::fill_n(buf.get_write(), buf.size(), 'x');
+                sent += buf.size();
+                st.write(std::move(buf)).get();
+            }
+            st.close().get();
+            BOOST_REQUIRE_EQUAL(reply.get0(), sent);
+            reader.get();
+            BOOST_REQUIRE_EQUAL(received, 2 * sent);
+            c1.stop().get();
+        });
+    });
+}
+
+// A registry that records the frames its streams send
+class test_stream_registry : public rpc::stream_registry {
+public:
+    std::vector<rpc::stream_frame_kind> sent;
+    virtual future<> send_stream_frame(int64_t id, rpc::stream_frame_kind kind, temporary_buffer<char> data) override {
+        sent.push_back(kind);
+        return make_ready_future<>();
+    }
+};
+
+static rpc::rcv_buf make_stream_frame(int64_t id, rpc::stream_frame_kind kind, size_t size = 0) {
+    temporary_buffer<char> buf(12 + size);
+    *unaligned_cast<int64_t*>(buf.get_write()) = cpu_to_le(id);
+    *unaligned_cast<uint32_t*>(buf.get_write() + 8) = cpu_to_le(uint32_t(kind));
+    std::fill_n(buf.get_write() + 12, size, 'x');
+    return rpc::rcv_buf(std::move(buf));
+}
+
+SEASTAR_TEST_CASE(test_rpc_stream_registry) {
+    return seastar::async([] {
+        test_stream_registry reg;
+        // frames may come before the stream is opened
+        reg.receive_stream_frame(make_stream_frame(1, rpc::stream_frame_kind::DATA, 10));
+        auto st = reg.open_stream(1);
+        BOOST_REQUIRE_EQUAL(st.read().get0().size(), 10u);
+        BOOST_REQUIRE_THROW(reg.open_stream(1), rpc::rpc_protocol_error);
+        // a released stream drops late frames, and is gone after END
+        st = reg.open_stream(2);
+        BOOST_REQUIRE(reg.sent.back() == rpc::stream_frame_kind::END);
+        reg.receive_stream_frame(make_stream_frame(1, rpc::stream_frame_kind::DATA, 10));
+        BOOST_REQUIRE_THROW(reg.open_stream(1), rpc::rpc_protocol_error);
+        reg.receive_stream_frame(make_stream_frame(1, rpc::stream_frame_kind::END));
+        reg.open_stream(1);
+        // the other end may not exceed the window
+        reg.receive_stream_frame(make_stream_frame(2, rpc::stream_frame_kind::DATA, rpc::stream_window));
+        BOOST_REQUIRE_THROW(reg.receive_stream_frame(make_stream_frame(2, rpc::stream_frame_kind::DATA, 1)),
+                rpc::rpc_protocol_error);
+        // nor open many streams it does not announce
+        for (size_t i = 0; i < rpc::max_unannounced_streams; i++) {
+            reg.receive_stream_frame(make_stream_frame(100 + i, rpc::stream_frame_kind::DATA, 1));
+        }
+        BOOST_REQUIRE_THROW(reg.receive_stream_frame(make_stream_frame(99, rpc::stream_frame_kind::DATA, 1)),
+                rpc::rpc_protocol_error);
+        reg.open_stream(100);
+        reg.receive_stream_frame(make_stream_frame(99, rpc::stream_frame_kind::DATA, 1));
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_timeout) {
+    return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto& c1 = connect(ipv4_addr(), rpc::client_options());
+            auto slow = proto.register_handler(1, [] (int x) {
+                return sleep(std::chrono::milliseconds(200)).then([x] {
+                    return x;
+                });
+            });
+            auto sum = proto.register_handler(2, [] (int a, int b) {
+                return a + b;
+            });
+            BOOST_REQUIRE_THROW(slow(c1, std::chrono::milliseconds(20), 1).get(), rpc::timeout_error);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().timeout, 1u);
+            // enough calls in flight to grow the reply ring
+            std::vector<future<int>> replies;
+            for (int i = 0; i < 1000; i++) {
+                replies.push_back(sum(c1, std::chrono::seconds(60), i, 1));
+            }
+            for (int i = 0; i < 1000; i++) {
+                BOOST_REQUIRE_EQUAL(replies[i].get0(), i + 1);
+            }
+            // the late reply to the timed out call is dropped
+            sleep(std::chrono::milliseconds(300)).get();
+            BOOST_REQUIRE(!c1.error());
+            BOOST_REQUIRE_EQUAL(slow(c1, 2).get0(), 2);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().wait_reply, 0u);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_timeouts_of_two_clients) {
+    return with_rpc_env({}, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, connect] {
+            auto& c1 = connect(ipv4_addr(), rpc::client_options());
+            auto& c2 = connect(ipv4_addr(), rpc::client_options());
+            auto slow = proto.register_handler(1, [] (int x) {
+                return sleep(std::chrono::milliseconds(200)).then([x] {
+                    return x;
+                });
+            });
+            auto f1 = slow(c1, std::chrono::milliseconds(20), 1);
+            auto f2 = slow(c2, std::chrono::milliseconds(20), 2);
+            BOOST_REQUIRE_THROW(f1.get(), rpc::timeout_error);
+            BOOST_REQUIRE_THROW(f2.get(), rpc::timeout_error);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().timeout, 1u);
+            BOOST_REQUIRE_EQUAL(c2.get_stats().timeout, 1u);
+            // A reply cancels the call's timer
+            auto fast = proto.register_handler(2, [] (int x) {
+                return x;
+            });
+            BOOST_REQUIRE_EQUAL(fast(c1, std::chrono::milliseconds(50), 5).get0(), 5);
+            sleep(std::chrono::milliseconds(100)).get();
+            BOOST_REQUIRE_EQUAL(c1.get_stats().timeout, 1u);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().wait_reply, 0u);
+            // A client that stops drops its calls; the other one's still
+            // time out
+            auto f3 = slow(c1, std::chrono::seconds(60), 3);
+            auto f4 = slow(c2, std::chrono::milliseconds(20), 4);
+            c1.stop().get();
+            BOOST_REQUIRE_THROW(f3.get(), std::exception);
+            BOOST_REQUIRE_THROW(f4.get(), rpc::timeout_error);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().timeout, 1u);
+            BOOST_REQUIRE_EQUAL(c2.get_stats().timeout, 2u);
+            c2.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_multi_client) {
+    struct state {
+        test_rpc_proto proto{serializer()};
+        loopback_connection_factory lcf;
+        std::unique_ptr<test_rpc_proto::server> server;
+        std::unique_ptr<test_rpc_proto::multi_client> client;
+    };
+    return do_with(state(), [] (state& s) {
+        return seastar::async([&s] {
+            s.server = std::make_unique<test_rpc_proto::server>(s.proto, s.lcf.get_server_socket());
+            unsigned connections = 0;
+            // verb 1 is bulk, verbs 2 and 3 share the other connection
+            s.client = std::make_unique<test_rpc_proto::multi_client>(s.proto, ipv4_addr(), 2,
+                    [] (uint32_t verb) { return verb == 1 ? 0u : 1u; },
+                    [&s, &connections] { ++connections; return s.lcf.make_new_connection(); });
+            promise<> release;
+            auto blocked = s.proto.register_handler(1, [&release] {
+                return release.get_future().then([] { return 1; });
+            });
+            auto sum = s.proto.register_handler(2, [] (int a, int b) {
+                return a + b;
+            });
+            auto mul = s.proto.register_handler(3, [] (int a, int b) {
+                return a * b;
+            });
+            auto bulk = blocked(*s.client);
+            BOOST_REQUIRE_EQUAL(sum(*s.client, 2, 3).get0(), 5);
+            BOOST_REQUIRE_EQUAL(mul(*s.client, 2, 3).get0(), 6);
+            BOOST_REQUIRE_EQUAL(connections, 2u);
+            BOOST_REQUIRE(!bulk.available());
+            BOOST_REQUIRE_EQUAL(s.client->get_stats().wait_reply, 1u);
+            release.set_value();
+            BOOST_REQUIRE_EQUAL(bulk.get0(), 1);
+            BOOST_REQUIRE_EQUAL(s.client->get_stats().replied, 3u);
+            s.client->stop().get();
+        });
+    });
+}
@@ -21,6 +21,8 @@
 
 #include "core/reactor.hh"
 #include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/do_with.hh"
 #include "core/print.hh"
 
 future<bool> test_smp_call() {
@@ -66,8 +68,67 @@ report(sstring msg, future<bool>&& result) {
     });
 }
 
+// Makes \c requests empty calls from the local core to core \c to,
+// \c concurrency of them in flight at a time, and describes the
+// resulting throughput and round trip latency.
+future<sstring> benchmark_pair(unsigned to, unsigned requests, unsigned concurrency) {
+    auto before = smp::latency(to);
+    auto start = std::chrono::steady_clock::now();
+    auto per_fiber = std::max(requests / concurrency, 1u);
+    return parallel_for_each(boost::irange(0u, concurrency), [to, per_fiber] (unsigned) {
+        return do_with(0u, [to, per_fiber] (unsigned& done) {
+            return do_until([&done, per_fiber] { return done == per_fiber; }, [&done, to] {
+                ++done;
+                return smp::submit_to(to, [] {});
+            });
+        });
+    }).then([to, before, start, calls = per_fiber * concurrency] {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto h = smp::latency(to) - before;
+        return sstring(sprint("%2u -> %2u: %10.0f calls/s  p50 < %8d ns  p99 < %8d ns  max < %8d ns",
+                engine().cpu_id(), to, calls / elapsed,
+                h.percentile(50).count(), h.percentile(99).count(), h.percentile(100).count()));
+    });
+}
+
+future<> benchmark(unsigned requests, unsigned concurrency) {
+    if (smp::count < 2) {
+        print("benchmark requires at least two cores\n");
+        return make_ready_future<>();
+    }
+    // one pair at a time, so that pairs do not compete for the same cores
+    auto cpus = smp::all_cpus();
+    return do_for_each(cpus.begin(), cpus.end(), [cpus, requests, concurrency] (unsigned from) {
+        return do_for_each(cpus.begin(), cpus.end(), [from, requests, concurrency] (unsigned to) {
+            if (from == to) {
+                return make_ready_future<>();
+            }
+            return smp::submit_to(from, [to, requests, concurrency] {
+                return benchmark_pair(to, requests, concurrency);
+            }).then([] (sstring result) {
+                print("%s\n", result);
+            });
+        });
+    });
+}
+
 int main(int ac, char** av) {
-    return app_template().run_deprecated(ac, av, [] {
+    namespace bpo = boost::program_options;
+
+    app_template app;
+    app.add_options()
+        ("benchmark", "measure cross-core call throughput and latency instead of running the tests")
+        ("requests", bpo::value<unsigned>()->default_value(100000), "number of calls per pair of cores, with --benchmark")
+        ("concurrency", bpo::value<unsigned>()->default_value(1), "number of calls in flight per pair of cores, with --benchmark")
+        ;
+    return app.run_deprecated(ac, av, [&app] {
+       auto& opts = app.configuration();
+       if (opts.count("benchmark")) {
+           auto concurrency = std::max(opts["concurrency"].as<unsigned>(), 1u);
+           return benchmark(opts["requests"].as<unsigned>(), concurrency).then([] {
+               engine().exit(0);
+           });
+       }
        return report("smp call", test_smp_call()).then([] {
            return report("smp exception", test_smp_exception());
        }).then([] {
@@ -0,0 +1,90 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#include "core/reactor.hh"
+#include "core/app-template.hh"
+#include "core/sleep.hh"
+#include "core/print.hh"
+
+int tests, fails;
+
+future<>
+report(sstring msg, future<bool>&& result) {
+    return std::move(result).then([msg] (bool result) {
+        print("%s: %s\n", (result ? "PASS" : "FAIL"), msg);
+        tests += 1;
+        fails += !result;
+    });
+}
+
+// Keeps the reactor in a single task for d
+void spin(std::chrono::milliseconds d) {
+    auto end = std::chrono::steady_clock::now() + d;
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+future<bool> test_long_task_is_a_stall(std::chrono::milliseconds threshold) {
+    return later().then([threshold] {
+        auto before = engine().stalls();
+        spin(threshold * 3);
+        // counted once, however long it lasts
+        return engine().stalls() == before + 1;
+    });
+}
+
+future<bool> test_short_tasks_are_not_stalls(std::chrono::milliseconds threshold) {
+    auto before = engine().stalls();
+    auto end = std::chrono::steady_clock::now() + threshold * 3;
+    return do_until([end] { return std::chrono::steady_clock::now() >= end; }, [threshold] {
+        spin(threshold / 4);
+        return later();
+    }).then([before] {
+        return engine().stalls() == before;
+    });
+}
+
+future<bool> test_sleep_is_not_a_stall(std::chrono::milliseconds threshold) {
+    auto before = engine().stalls();
+    return sleep(threshold * 3).then([before] {
+        return engine().stalls() == before;
+    });
+}
+
+int main(int ac, char** av) {
+    app_template app;
+    return app.run_deprecated(ac, av, [&app] {
+        auto threshold = std::chrono::milliseconds(app.configuration()["stall-threshold-ms"].as<unsigned>());
+        if (!threshold.count()) {
+            print("the stall detector is disabled\n");
+            engine().exit(1);
+            return make_ready_future<>();
+        }
+        return report("long task", test_long_task_is_a_stall(threshold)).then([threshold] {
+            return report("short tasks", test_short_tasks_are_not_stalls(threshold));
+        }).then([threshold] {
+            return report("sleep", test_sleep_is_not_a_stall(threshold));
+        }).then([] {
+            print("\n%d tests / %d failures\n", tests, fails);
+            engine().exit(fails ? 1 : 0);
+        });
+    });
+}
@@ -22,6 +22,14 @@
 #include "net/ip.hh"
 #include "net/virtio.hh"
 #include "net/tcp.hh"
+#include "net/tcp-stack.hh"
+#include "net/loopback.hh"
+#include "core/app-template.hh"
+#include "core/future-util.hh"
+#include "core/sleep.hh"
+#include "core/memory.hh"
+#include <boost/range/irange.hpp>
+#include <cstring>
 
 using namespace net;
 
@@ -54,17 +62,321 @@ struct tcp_test {
     }
 };
 
-int main(int ac, char** av) {
-    boost::program_options::variables_map opts;
-    opts.insert(std::make_pair("tap-device", boost::program_options::variable_value(std::string("tap0"), false)));
-
-    auto vnet = create_virtio_net_device(opts);
-    interface netif(std::move(vnet));
-    ipv4 inet(&netif);
-    inet.set_host_address(ipv4_address("192.168.122.2"));
-    tcp_test tt(inet);
-    engine().when_started().then([&tt] { tt.run(); });
-    engine().run();
+// Loopback benchmark: two native stacks on every shard, connected by a
+// loopback device pair.  The client stack of each shard connects to the
+// server stack, so with several queues, connections and their packets
+// cross shards as they would between two hosts with RSS capable NICs.
+
+namespace bpo = boost::program_options;
+
+static constexpr uint16_t sink_port = 10001;
+static constexpr uint16_t echo_port = 10002;
+
+// One end of the loopback link, on one shard
+struct loopback_host {
+    interface netif;
+    ipv4 inet;
+    loopback_host(std::shared_ptr<device> dev, ipv4_address addr, std::shared_ptr<device> peer, ipv4_address peer_addr)
+            : netif(std::move(dev)), inet(&netif) {
+        inet.set_host_address(addr);
+        inet.set_netmask_address(ipv4_address("255.255.255.0"));
+        inet.learn(peer->hw_address(), peer_addr);
+    }
+};
+
+struct loopback_shard {
+    loopback_host client;
+    loopback_host server;
+    server_socket sink;
+    server_socket echo;
+    loopback_shard(std::shared_ptr<device> a, std::shared_ptr<device> b)
+        : client(a, ipv4_address("10.0.0.1"), b, ipv4_address("10.0.0.2"))
+        , server(b, ipv4_address("10.0.0.2"), a, ipv4_address("10.0.0.1"))
+        , sink(tcpv4_listen(server.inet.get_tcp(), sink_port, listen_options(true)))
+        , echo(tcpv4_listen(server.inet.get_tcp(), echo_port, listen_options(true))) {
+    }
+};
+
+// Never destroyed: the stacks may have timers and connections pending
+// when the benchmark exits.
+static thread_local loopback_shard* the_loopback_shard;
+
+struct server_connection {
+    connected_socket s;
+    input_stream<char> in;
+    output_stream<char> out;
+    explicit server_connection(connected_socket&& s) : s(std::move(s)), in(this->s.input()), out(this->s.output()) {}
+};
+
+static void serve(server_socket& ss, bool echo) {
+    keep_doing([&ss, echo] {
+        return ss.accept().then([echo] (connected_socket s, socket_address) {
+            auto c = make_lw_shared<server_connection>(std::move(s));
+            repeat([c, echo] {
+                return c->in.read().then([c, echo] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    if (!echo) {
+                        return make_ready_future<stop_iteration>(stop_iteration::no);
+                    }
+                    return c->out.write(buf.get(), buf.size()).then([c] {
+                        return c->out.flush();
+                    }).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([c] {
+                return c->out.close();
+            }).handle_exception([c] (auto ep) {});
+        });
+    }).handle_exception([] (auto ep) {});
 }
 
+struct client_connection {
+    connected_socket s;
+    input_stream<char> in;
+    output_stream<char> out;
+    explicit client_connection(connected_socket&& s) : s(std::move(s)), in(this->s.input()), out(this->s.output()) {}
+};
 
+static future<lw_shared_ptr<client_connection>> connect_to(uint16_t port) {
+    auto sa = make_ipv4_address(ipv4_addr(ipv4_address("10.0.0.2").ip, port));
+    return tcpv4_connect(the_loopback_shard->client.inet.get_tcp(), sa).then([] (connected_socket s) {
+        return make_lw_shared<client_connection>(std::move(s));
+    });
+}
+
+// Sends message_size writes until the deadline, and returns the number of
+// bytes the server received.
+static future<uint64_t> run_stream(size_t message_size, steady_clock_type::time_point deadline) {
+    return connect_to(sink_port).then([message_size, deadline] (lw_shared_ptr<client_connection> c) {
+        auto bytes = make_lw_shared<uint64_t>(0);
+        auto msg = make_lw_shared<sstring>(sstring::initialized_later(), message_size);
+        std::fill(msg->begin(), msg->end(), 'x');
+        return do_until([deadline] { return steady_clock_type::now() >= deadline; }, [c, msg, bytes] {
+            *bytes += msg->size();
+            return c->out.write(*msg);
+        }).then([c] {
+            return c->out.close();
+        }).then([c] {
+            // the server closes its side once it has read everything
+            return repeat([c] {
+                return c->in.read().then([] (temporary_buffer<char> buf) {
+                    return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        }).then([bytes] {
+            return *bytes;
+        });
+    });
+}
+
+// Sends request_size requests, each waiting for the echoed response,
+// until the deadline, and returns the number of transactions.
+static future<uint64_t> run_request_response(size_t request_size, steady_clock_type::time_point deadline) {
+    return connect_to(echo_port).then([request_size, deadline] (lw_shared_ptr<client_connection> c) {
+        auto transactions = make_lw_shared<uint64_t>(0);
+        auto msg = make_lw_shared<sstring>(sstring::initialized_later(), request_size);
+        std::fill(msg->begin(), msg->end(), 'x');
+        return do_until([deadline] { return steady_clock_type::now() >= deadline; }, [c, msg, transactions, request_size] {
+            return c->out.write(*msg).then([c] {
+                return c->out.flush();
+            }).then([c, request_size] {
+                return c->in.read_exactly(request_size);
+            }).then([transactions, request_size] (temporary_buffer<char> buf) {
+                if (buf.size() != request_size) {
+                    throw std::runtime_error("short response");
+                }
+                ++*transactions;
+            });
+        }).then([c] {
+            return c->out.close();
+        }).then([transactions] {
+            return *transactions;
+        });
+    });
+}
+
+template <typename Func>
+static future<uint64_t> on_all_shards(Func func) {
+    return map_reduce(boost::irange(0u, smp::count), [func] (unsigned cpu) {
+        return smp::submit_to(cpu, Func(func));
+    }, uint64_t(0), std::plus<uint64_t>());
+}
+
+// Idle connections are opened with the tcp layer directly, so that the
+// memory they take is mostly that of the tcb, and counted at both ends.
+
+static constexpr uint16_t idle_base_port = 20000;
+// Well below the 23584 ephemeral ports of the client, so that connect()
+// quickly finds a free one
+static constexpr unsigned idle_connections_per_port = 8192;
+
+struct idle_connections {
+    using tcp = net::tcp<ipv4_traits>;
+    std::vector<tcp::listener> listeners;
+    std::vector<tcp::connection> accepted;
+    std::vector<tcp::connection> connected;
+};
+
+// Never destroyed, like the_loopback_shard
+static thread_local idle_connections* the_idle_connections;
+
+static void listen_idle(unsigned nr_ports) {
+    the_idle_connections = new idle_connections;
+    auto& listeners = the_idle_connections->listeners;
+    listeners.reserve(nr_ports);
+    for (unsigned i = 0; i < nr_ports; ++i) {
+        listeners.push_back(the_loopback_shard->server.inet.get_tcp().listen(idle_base_port + i, 1024));
+        auto& l = listeners.back();
+        keep_doing([&l] {
+            return l.accept().then([] (idle_connections::tcp::connection c) {
+                the_idle_connections->accepted.push_back(std::move(c));
+            });
+        });
+    }
+}
+
+// Opens nr connections from this shard, up to 256 at a time
+static future<uint64_t> open_idle(unsigned nr, unsigned nr_ports) {
+    auto next = make_lw_shared<unsigned>(0);
+    return parallel_for_each(boost::irange(0u, 256u), [nr, nr_ports, next] (unsigned) {
+        return do_until([nr, next] { return *next >= nr; }, [nr_ports, next] {
+            uint16_t port = idle_base_port + (*next)++ % nr_ports;
+            auto sa = make_ipv4_address(ipv4_addr(ipv4_address("10.0.0.2").ip, port));
+            return the_loopback_shard->client.inet.get_tcp().connect(sa).then([] (idle_connections::tcp::connection c) {
+                the_idle_connections->connected.push_back(std::move(c));
+            });
+        });
+    }).then([] {
+        return uint64_t(the_idle_connections->connected.size());
+    });
+}
+
+static future<uint64_t> allocated_memory() {
+    return on_all_shards([] {
+        return uint64_t(memory::stats().allocated_memory());
+    });
+}
+
+// Opens nr idle connections, and reports the memory each of them takes
+static future<> run_idle(uint64_t nr) {
+    auto nr_ports = unsigned((nr + idle_connections_per_port - 1) / idle_connections_per_port);
+    return smp::invoke_on_all([nr_ports] {
+        listen_idle(nr_ports);
+    }).then([] {
+        return allocated_memory();
+    }).then([nr, nr_ports] (uint64_t before) {
+        auto start = steady_clock_type::now();
+        return on_all_shards([nr, nr_ports] {
+            auto share = nr / smp::count + (engine().cpu_id() < nr % smp::count);
+            return open_idle(share, nr_ports);
+        }).then([nr] (uint64_t) {
+            // wait for the servers to accept them all
+            return repeat([nr] {
+                return on_all_shards([] {
+                    return uint64_t(the_idle_connections->accepted.size());
+                }).then([nr] (uint64_t accepted) {
+                    if (accepted >= nr) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return sleep(std::chrono::milliseconds(10)).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            });
+        }).then([] {
+            // let the connections be shrunk once idle, 5s after their last
+            // segment
+            return sleep(std::chrono::seconds(7));
+        }).then([] {
+            return allocated_memory();
+        }).then([nr, before, start] (uint64_t after) {
+            auto secs = std::chrono::duration<double>(steady_clock_type::now() - start).count();
+            auto bytes = double(after - before) / nr;
+            print("idle: %d connections in %.3f s, %.0f bytes per connection, %.0f bytes per end\n",
+                    nr, secs, bytes, bytes / 2);
+        });
+    });
+}
+
+static future<> run_loopback_benchmark(const bpo::variables_map& opts) {
+    auto message_size = opts["message-size"].as<size_t>();
+    auto request_size = opts["request-size"].as<size_t>();
+    auto duration = std::chrono::seconds(opts["duration"].as<unsigned>());
+    auto nr_idle = opts["idle-connections"].as<uint64_t>();
+    auto cfg = make_loopback_config(opts);
+    auto devs = create_loopback_net_device_pair(cfg);
+    auto a = devs.first;
+    auto b = devs.second;
+    print("loopback: %d queues, %d shards, latency %dus, bandwidth %d Mbps, loss %g, reorder %g\n",
+            a->hw_queues_count(), smp::count, cfg.latency.count(), cfg.bandwidth_mbps, cfg.loss, cfg.reorder);
+    return start_loopback_net_device(a).then([b] {
+        return start_loopback_net_device(b);
+    }).then([a, b] {
+        return smp::invoke_on_all([a, b] {
+            the_loopback_shard = new loopback_shard(a, b);
+            serve(the_loopback_shard->sink, false);
+            serve(the_loopback_shard->echo, true);
+        });
+    }).then([message_size, duration] {
+        auto start = steady_clock_type::now();
+        auto deadline = start + duration;
+        return on_all_shards([message_size, deadline] {
+            return run_stream(message_size, deadline);
+        }).then([start] (uint64_t bytes) {
+            auto secs = std::chrono::duration<double>(steady_clock_type::now() - start).count();
+            print("stream: %d bytes in %.3f s, %.3f Gbps\n", bytes, secs, bytes * 8 / secs / 1e9);
+        });
+    }).then([request_size, duration] {
+        auto start = steady_clock_type::now();
+        auto deadline = start + duration;
+        return on_all_shards([request_size, deadline] {
+            return run_request_response(request_size, deadline);
+        }).then([start] (uint64_t transactions) {
+            auto secs = std::chrono::duration<double>(steady_clock_type::now() - start).count();
+            print("request/response: %d transactions in %.3f s, %.0f transactions/s\n",
+                    transactions, secs, transactions / secs);
+        });
+    }).then([nr_idle] {
+        if (!nr_idle) {
+            return make_ready_future<>();
+        }
+        return run_idle(nr_idle);
+    });
+}
+
+// The stack serving on the tap device
+struct tap_host {
+    interface netif;
+    ipv4 inet;
+    tcp_test test;
+    explicit tap_host(const bpo::variables_map& opts)
+            : netif(create_virtio_net_device(opts)), inet(&netif), test(inet) {
+        inet.set_host_address(ipv4_address("192.168.122.2"));
+    }
+};
+
+int main(int ac, char** av) {
+    app_template app;
+    app.add_options()
+        ("loopback", "benchmark two stacks connected by a loopback device pair, instead of serving on the tap device")
+        ("message-size", bpo::value<size_t>()->default_value(64 * 1024), "size of each write in the streaming test, with --loopback")
+        ("request-size", bpo::value<size_t>()->default_value(64), "size of requests and responses in the request/response test, with --loopback")
+        ("duration", bpo::value<unsigned>()->default_value(5), "duration of each test, in seconds, with --loopback")
+        ("idle-connections", bpo::value<uint64_t>()->default_value(0), "open this many idle connections, e.g. 1000000, and report the memory each takes, with --loopback")
+        ;
+    std::unique_ptr<tap_host> tap;
+    return app.run_deprecated(ac, av, [&app, &tap] {
+        auto& opts = app.configuration();
+        if (opts.count("loopback")) {
+            run_loopback_benchmark(opts).then([] {
+                engine().exit(0);
+            }).or_terminate();
+            return;
+        }
+        tap = std::make_unique<tap_host>(opts);
+        tap->test.run();
+    });
+}
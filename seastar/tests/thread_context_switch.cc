@@ -21,6 +21,7 @@
  */
 
 #include <experimental/optional>
+#include <boost/range/irange.hpp>
 #include "core/thread.hh"
 #include "core/semaphore.hh"
 #include "core/app-template.hh"
@@ -72,8 +73,23 @@ class context_switch_tester {
     }
 };
 
+// Spawns and joins empty threads back to back on the local shard; returns
+// the number of threads that ran.
+future<uint64_t> measure_spawn(std::chrono::steady_clock::duration test_time) {
+    auto end = std::chrono::steady_clock::now() + test_time;
+    return do_with(uint64_t(0), [end] (uint64_t& spawns) {
+        return do_until([end] { return std::chrono::steady_clock::now() >= end; }, [&spawns] {
+            ++spawns;
+            return async([] {});
+        }).then([&spawns] {
+            return spawns;
+        });
+    });
+}
+
 int main(int ac, char** av) {
     static const auto test_time = 5s;
+    static const auto spawn_test_time = 1s;
     return app_template().run_deprecated(ac, av, [] {
         return do_with(distributed<context_switch_tester>(), [] (distributed<context_switch_tester>& dcst) {
             return dcst.start().then([&dcst] {
@@ -86,6 +102,16 @@ int main(int ac, char** av) {
                 switches /= smp::count;
                 print("context switch time: %5.1f ns\n",
                       double(std::chrono::duration_cast<std::chrono::nanoseconds>(test_time).count()) / switches);
+            }).then([] {
+                return map_reduce(boost::irange(0u, smp::count), [] (unsigned cpu) {
+                    return smp::submit_to(cpu, [] {
+                        return measure_spawn(spawn_test_time);
+                    });
+                }, uint64_t(0), std::plus<uint64_t>());
+            }).then([] (uint64_t spawns) {
+                spawns /= smp::count;
+                print("thread spawn/join time: %5.1f ns\n",
+                      double(std::chrono::duration_cast<std::chrono::nanoseconds>(spawn_test_time).count()) / spawns);
             }).then([&dcst] {
                 return dcst.stop();
             }).then([] {
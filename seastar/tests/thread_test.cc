@@ -134,3 +134,32 @@ SEASTAR_TEST_CASE(test_thread_sched_group) {
 #endif
     });
 }
+
+SEASTAR_TEST_CASE(test_thread_stack_size) {
+    return async([] {
+        thread_attributes attr;
+        attr.stack_size = 1 << 20;
+        auto run = [&attr] {
+            uintptr_t where = 0;
+            thread t(attr, [&where] {
+                // use more than the default 128k stack
+                char buf[512 << 10];
+                std::fill_n(buf, sizeof(buf), 1);
+                where = reinterpret_cast<uintptr_t>(&buf[0]);
+                BOOST_REQUIRE(size_t(std::count(buf, buf + sizeof(buf), 1)) == sizeof(buf));
+            });
+            t.join().get();
+            return where;
+        };
+        auto first_stack = run();
+        auto second_stack = run();
+        BOOST_REQUIRE(first_stack != 0);
+#ifndef ASAN_ENABLED
+        // the first thread's stack was returned to the cache when it was
+        // destroyed, and handed out again to the second one
+        BOOST_REQUIRE_EQUAL(first_stack, second_stack);
+#else
+        (void)second_stack;
+#endif
+    });
+}
@@ -0,0 +1,143 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+// Compares timer_set and timer_wheel with many timers, the way the
+// reactor uses them for lowres timers: most timers are cancelled or
+// rearmed, and expire() is called every few milliseconds.  Also checks
+// that both expire every timer exactly once, and never early.
+
+#include "core/timer-set.hh"
+#include "core/timer-wheel.hh"
+#include "perf-test-utils.hh"
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+struct test_timer {
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::milliseconds;
+    using time_point = std::chrono::time_point<clock, duration>;
+    boost::intrusive::list_member_hook<> link;
+    time_point timeout;
+    bool expired = false;
+    time_point get_timeout() const { return timeout; }
+    bool cancel() { abort(); }
+};
+
+using clock_type = perf_clock;
+using time_point = test_timer::time_point;
+
+// Timeouts are spread over [1, range] ms from the start; expire() is
+// called every tick_ms, as the reactor does for lowres timers.
+template <typename Set>
+static void run(const char* name, size_t n, unsigned range, unsigned tick_ms) {
+    std::vector<test_timer> timers(n);
+    std::default_random_engine rnd(n);
+    std::uniform_int_distribution<unsigned> offset(1, range);
+    auto start = time_point(std::chrono::milliseconds(1000000));
+    Set set;
+    set.expire(start);
+
+    // insert and cancel: TCP timers that are stopped when data is acked
+    auto t0 = clock_type::now();
+    for (auto& t : timers) {
+        t.timeout = start + std::chrono::milliseconds(offset(rnd));
+        set.insert(t);
+    }
+    auto t1 = clock_type::now();
+    for (auto& t : timers) {
+        set.remove(t);
+    }
+    auto t2 = clock_type::now();
+    check(set.empty(), "set empty after removing all timers");
+
+    // rearm: each timer is pushed back a few times before it can expire
+    for (auto& t : timers) {
+        t.timeout = start + std::chrono::milliseconds(offset(rnd));
+        set.insert(t);
+    }
+    auto t3 = clock_type::now();
+    for (unsigned round = 0; round < 4; ++round) {
+        for (auto& t : timers) {
+            auto old = t.timeout;
+            t.timeout += std::chrono::milliseconds(range / 8 + 1);
+            set.update(t, old);
+        }
+    }
+    auto t4 = clock_type::now();
+
+    // expire everything, one tick at a time
+    auto end = start + std::chrono::milliseconds(range + 4 * (range / 8 + 1) + tick_ms);
+    size_t expired = 0;
+    clock_type::duration total = {};
+    clock_type::duration worst = {};
+    for (auto now = start; now <= end; now += std::chrono::milliseconds(tick_ms)) {
+        auto e0 = clock_type::now();
+        auto exp = set.expire(now);
+        auto e1 = clock_type::now();
+        total += e1 - e0;
+        worst = std::max(worst, e1 - e0);
+        while (!exp.empty()) {
+            auto& t = *exp.begin();
+            exp.pop_front();
+            check(t.timeout <= now, "timer expired early");
+            check(t.timeout > now - std::chrono::milliseconds(tick_ms), "timer expired late");
+            check(!t.expired, "timer expired twice");
+            t.expired = true;
+            ++expired;
+        }
+    }
+    check(expired == n, "every timer expired");
+    check(set.empty(), "set empty after expiring all timers");
+
+    std::cout << std::setw(12) << name << std::setw(10) << n << std::fixed << std::setprecision(1)
+              << "  insert " << std::setw(7) << ns_per(t1 - t0, n) << " ns"
+              << "  remove " << std::setw(7) << ns_per(t2 - t1, n) << " ns"
+              << "  rearm " << std::setw(7) << ns_per(t4 - t3, 4 * n) << " ns"
+              << "  expire " << std::setw(7) << ns_per(total, n) << " ns/timer"
+              << "  worst tick " << std::setw(9) << std::setprecision(3)
+              << std::chrono::duration<double, std::micro>(worst).count() << " us\n";
+}
+
+int main(int ac, char** av) {
+    namespace bpo = boost::program_options;
+    bpo::options_description opts("Allowed options");
+    opts.add_options()
+            ("min-timers", bpo::value<size_t>()->default_value(1000), "smallest number of timers to test with")
+            ("max-timers", bpo::value<size_t>()->default_value(10000000), "largest number of timers to test with")
+            ("range", bpo::value<unsigned>()->default_value(10000), "timeouts are spread over this many milliseconds")
+            ("tick", bpo::value<unsigned>()->default_value(10), "milliseconds between calls to expire()")
+            ;
+    bpo::variables_map vm;
+    if (!parse_perf_options(ac, av, opts, vm)) {
+        return 1;
+    }
+    auto range = std::max(vm["range"].as<unsigned>(), 1u);
+    auto tick = std::max(vm["tick"].as<unsigned>(), 1u);
+    for (size_t n = vm["min-timers"].as<size_t>(); n <= vm["max-timers"].as<size_t>(); n *= 10) {
+        run<seastar::timer_set<test_timer, &test_timer::link>>("timer_set", n, range, tick);
+        run<seastar::timer_wheel<test_timer, &test_timer::link>>("timer_wheel", n, range, tick);
+    }
+    return 0;
+}
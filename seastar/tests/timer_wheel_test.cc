@@ -0,0 +1,166 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2016 ScyllaDB
+ */
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "core/timer-wheel.hh"
+#include <vector>
+
+using namespace std::chrono_literals;
+
+struct test_timer {
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::milliseconds;
+    using time_point = std::chrono::time_point<clock, duration>;
+    boost::intrusive::list_member_hook<> link;
+    time_point timeout;
+    test_timer() = default;
+    explicit test_timer(time_point t) : timeout(t) {}
+    time_point get_timeout() const { return timeout; }
+    bool cancel() { abort(); }
+};
+
+using wheel = seastar::timer_wheel<test_timer, &test_timer::link>;
+using time_point = test_timer::time_point;
+
+// Not aligned to a slot of any level
+static const time_point start(1000000123ms);
+
+static std::vector<test_timer*> expire(wheel& w, time_point now) {
+    std::vector<test_timer*> ret;
+    auto exp = w.expire(now);
+    while (!exp.empty()) {
+        ret.push_back(&*exp.begin());
+        exp.pop_front();
+    }
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(test_next_timeout_of_empty_wheel) {
+    wheel w;
+    BOOST_REQUIRE(w.get_next_timeout() == time_point::max());
+    expire(w, start);
+    BOOST_REQUIRE(w.get_next_timeout() == time_point::max());
+}
+
+BOOST_AUTO_TEST_CASE(test_next_timeout_follows_inserts) {
+    wheel w;
+    expire(w, start);
+    test_timer t1(start + 5ms), t2(start + 100ms), t3(start + 3ms);
+    BOOST_REQUIRE(w.insert(t1));
+    BOOST_REQUIRE(w.get_next_timeout() == t1.timeout);
+    BOOST_REQUIRE(!w.insert(t2));
+    BOOST_REQUIRE(w.get_next_timeout() == t1.timeout);
+    BOOST_REQUIRE(w.insert(t3));
+    BOOST_REQUIRE(w.get_next_timeout() == t3.timeout);
+    w.clear();
+}
+
+BOOST_AUTO_TEST_CASE(test_next_timeout_reaches_far_timers) {
+    wheel w;
+    expire(w, start);
+    // A timer a few levels up: get_next_timeout() may point at the start
+    // of its slot, where it is moved down, but never past it, and calling
+    // expire() at the times it returns gets to it in a few steps.
+    test_timer t(start + 123456789ms);
+    w.insert(t);
+    auto last = start;
+    unsigned steps = 0;
+    while (true) {
+        auto next = w.get_next_timeout();
+        BOOST_REQUIRE(next >= last);
+        BOOST_REQUIRE(next <= t.timeout);
+        auto exp = expire(w, next);
+        ++steps;
+        if (!exp.empty()) {
+            BOOST_REQUIRE_EQUAL(exp.size(), 1u);
+            BOOST_REQUIRE(next == t.timeout);
+            break;
+        }
+        BOOST_REQUIRE(steps < 8);
+        last = next;
+    }
+    BOOST_REQUIRE(w.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_overdue_insert) {
+    wheel w;
+    expire(w, start);
+    test_timer late(start - 10ms), now(start), later(start + 1ms);
+    BOOST_REQUIRE(w.insert(later));
+    // Timers already due are expired by the next call, even for the same
+    // time as the last one
+    BOOST_REQUIRE(w.insert(late));
+    BOOST_REQUIRE(!w.insert(now));
+    BOOST_REQUIRE(w.get_next_timeout() == start);
+    auto exp = expire(w, start);
+    BOOST_REQUIRE_EQUAL(exp.size(), 2u);
+    BOOST_REQUIRE(exp[0] == &late);
+    BOOST_REQUIRE(exp[1] == &now);
+    BOOST_REQUIRE_EQUAL(w.size(), 1u);
+    BOOST_REQUIRE(w.get_next_timeout() == later.timeout);
+    BOOST_REQUIRE(expire(w, later.timeout) == std::vector<test_timer*>{&later});
+}
+
+BOOST_AUTO_TEST_CASE(test_cascading_expires_on_time) {
+    wheel w;
+    expire(w, start);
+    // On both sides of the slot boundaries of the first three levels
+    std::vector<std::chrono::milliseconds> offsets;
+    for (auto boundary : { 256ms, 65536ms, 16777216ms }) {
+        auto aligned = boundary - (start.time_since_epoch() % boundary);
+        offsets.push_back(aligned - 1ms);
+        offsets.push_back(aligned);
+        offsets.push_back(aligned + 1ms);
+    }
+    std::vector<test_timer> timers;
+    timers.reserve(offsets.size());
+    for (auto offset : offsets) {
+        timers.emplace_back(start + offset);
+        w.insert(timers.back());
+    }
+    // Each one expires on the first call at or past its timeout, and not
+    // on the one just before
+    for (auto& t : timers) {
+        BOOST_REQUIRE(expire(w, t.timeout - 1ms).empty());
+        BOOST_REQUIRE(expire(w, t.timeout) == std::vector<test_timer*>{&t});
+    }
+    BOOST_REQUIRE(w.empty());
+    BOOST_REQUIRE(w.get_next_timeout() == time_point::max());
+}
+
+BOOST_AUTO_TEST_CASE(test_update_moves_timer) {
+    wheel w;
+    expire(w, start);
+    test_timer t(start + 10ms);
+    w.insert(t);
+    auto old = t.timeout;
+    t.timeout = start + 70000ms;
+    BOOST_REQUIRE(!w.update(t, old));
+    BOOST_REQUIRE(expire(w, old).empty());
+    old = t.timeout;
+    t.timeout = start + 20ms;
+    BOOST_REQUIRE(w.update(t, old));
+    BOOST_REQUIRE(w.get_next_timeout() == t.timeout);
+    BOOST_REQUIRE(expire(w, t.timeout) == std::vector<test_timer*>{&t});
+}
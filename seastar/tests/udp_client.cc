@@ -33,34 +33,58 @@ class client {
     uint64_t n_sent {};
     uint64_t n_received {};
     uint64_t n_failed {};
+    uint64_t total_sent {};
+    uint64_t total_received {};
     timer<> _stats_timer;
+    timer<> _stop_timer;
+    std::chrono::steady_clock::time_point _started;
 public:
-    void start(ipv4_addr server_addr) {
+    // Keeps concurrency datagrams of size bytes in flight; with a duration,
+    // prints the average rates and exits when it is over.
+    void start(ipv4_addr server_addr, unsigned concurrency, size_t size, unsigned duration) {
         std::cout << "Sending to " << server_addr << std::endl;
 
         _chan = engine().net().make_udp_channel();
+        _started = std::chrono::steady_clock::now();
 
         _stats_timer.set_callback([this] {
             std::cout << "Out: " << n_sent << " pps, \t";
             std::cout << "Err: " << n_failed << " pps, \t";
             std::cout << "In: " << n_received << " pps" << std::endl;
+            total_sent += n_sent;
+            total_received += n_received;
             n_sent = 0;
             n_received = 0;
             n_failed = 0;
         });
         _stats_timer.arm_periodic(1s);
 
-        keep_doing([this, server_addr] {
-            return _chan.send(server_addr, "hello!\n")
-                .then_wrapped([this] (auto&& f) {
-                    try {
-                        f.get();
-                        n_sent++;
-                    } catch (...) {
-                        n_failed++;
-                    }
-                });
-        });
+        if (duration) {
+            _stop_timer.set_callback([this] {
+                auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - _started).count();
+                total_sent += n_sent;
+                total_received += n_received;
+                std::cout << "Average out: " << uint64_t(total_sent / secs) << " pps, \t";
+                std::cout << "in: " << uint64_t(total_received / secs) << " pps" << std::endl;
+                engine().exit(0);
+            });
+            _stop_timer.arm(std::chrono::seconds(duration));
+        }
+
+        auto data = make_lw_shared<sstring>(size, 'x');
+        for (unsigned i = 0; i < concurrency; ++i) {
+            keep_doing([this, server_addr, data] {
+                return _chan.send(server_addr, packet(data->c_str(), data->size()))
+                    .then_wrapped([this] (auto&& f) {
+                        try {
+                            f.get();
+                            n_sent++;
+                        } catch (...) {
+                            n_failed++;
+                        }
+                    });
+            });
+        }
 
         keep_doing([this] {
             return _chan.receive().then([this] (auto) {
@@ -77,9 +101,13 @@ int main(int ac, char ** av) {
     app_template app;
     app.add_options()
         ("server", bpo::value<std::string>(), "Server address")
+        ("concurrency", bpo::value<unsigned>()->default_value(1), "datagrams in flight")
+        ("size", bpo::value<size_t>()->default_value(7), "datagram size")
+        ("duration", bpo::value<unsigned>()->default_value(0), "seconds to run for, 0 to run until interrupted")
         ;
     return app.run_deprecated(ac, av, [&_client, &app] {
         auto&& config = app.configuration();
-        _client.start(config["server"].as<std::string>());
+        _client.start(config["server"].as<std::string>(), config["concurrency"].as<unsigned>(),
+                config["size"].as<size_t>(), config["duration"].as<unsigned>());
     });
 }
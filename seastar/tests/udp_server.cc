@@ -30,20 +30,28 @@ class udp_server {
 private:
     udp_channel _chan;
     timer<> _stats_timer;
+    uint64_t _n_received {};
     uint64_t _n_sent {};
 public:
-    void start(uint16_t port) {
+    // With sink, datagrams are only counted, to measure the receive path
+    void start(uint16_t port, bool sink) {
         ipv4_addr listen_addr{port};
         _chan = engine().net().make_udp_channel(listen_addr);
 
         _stats_timer.set_callback([this] {
+            std::cout << "In: " << _n_received << " pps, \t";
             std::cout << "Out: " << _n_sent << " pps" << std::endl;
+            _n_received = 0;
             _n_sent = 0;
         });
         _stats_timer.arm_periodic(1s);
 
-        keep_doing([this] {
-            return _chan.receive().then([this] (udp_datagram dgram) {
+        keep_doing([this, sink] {
+            return _chan.receive().then([this, sink] (udp_datagram dgram) {
+                _n_received++;
+                if (sink) {
+                    return make_ready_future<>();
+                }
                 return _chan.send(dgram.get_src(), std::move(dgram.get_data())).then([this] {
                     _n_sent++;
                 });
@@ -61,16 +69,19 @@ namespace bpo = boost::program_options;
 int main(int ac, char ** av) {
     app_template app;
     app.add_options()
-        ("port", bpo::value<uint16_t>()->default_value(10000), "UDP server port") ;
+        ("port", bpo::value<uint16_t>()->default_value(10000), "UDP server port")
+        ("sink", "only count received datagrams, do not echo them")
+        ;
     return app.run_deprecated(ac, av, [&] {
         auto&& config = app.configuration();
         uint16_t port = config["port"].as<uint16_t>();
+        bool sink = config.count("sink");
         auto server = new distributed<udp_server>;
-        server->start().then([server = std::move(server), port] () mutable {
+        server->start().then([server = std::move(server), port, sink] () mutable {
             engine().at_exit([server] {
                 return server->stop();
             });
-            server->invoke_on_all(&udp_server::start, port);
+            server->invoke_on_all(&udp_server::start, port, sink);
         }).then([port] {
             std::cout << "Seastar UDP server listening on port " << port << " ...\n";
         });